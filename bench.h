@@ -1,41 +1,39 @@
 #pragma once
 
-#if !defined(__x86_64__)
-#warning "Not using an amd64 cpu: benchmarking code disabled"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 
-#define BENCH(      name, args... ) name(args)
-#define BENCH_VOID( name, args... ) name(args)
-
-
-#else
-
-
-
-static inline uint64_t rdtscll()
+// Portable timers, in seconds. The wall-clock time is monotonic. The CPU time
+// is for the calling thread only
+static inline double bench_wall_seconds(void)
 {
-    // taken from the wikipedia rdtsc article
-    uint32_t lo, hi;
-    /* We cannot use "=A", since this would use %rax on x86_64 */
-    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
-    return (uint64_t)hi << 32 | lo;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 }
+static inline double bench_cpu_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
 // to time a function call "f(a,b,c)", change it to "BENCH(f,a,b,c)". This uses
 // __auto_type, so gcc-4.9 or higher is required
 #define BENCH( name, args... )                                          \
     ({                                                                  \
-        uint64_t t0 = rdtscll();                                        \
+        double t0 = bench_wall_seconds();                               \
         __auto_type res = name(args);                                   \
-        uint64_t t1 = rdtscll();                                        \
-        fprintf(stderr, #name " took %g cycles\n", (double)(t1-t0));    \
+        double t1 = bench_wall_seconds();                               \
+        fprintf(stderr, #name " took %.3f ms\n", (t1-t0)*1e3);          \
         res;                                                            \
     })
 #define BENCH_VOID( name, args... )                                     \
     ({                                                                  \
-        uint64_t t0 = rdtscll();                                        \
+        double t0 = bench_wall_seconds();                               \
         name(args);                                                     \
-        uint64_t t1 = rdtscll();                                        \
-        fprintf(stderr, #name " took %g cycles\n", (double)(t1-t0));    \
+        double t1 = bench_wall_seconds();                               \
+        fprintf(stderr, #name " took %.3f ms\n", (t1-t0)*1e3);          \
         1;                                                              \
     })
-
-#endif
@@ -8,10 +8,64 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "dem.h"
+#include "dempack.h"
+#include "demgeotiff.h"
 #include "util.h"
 
+// Writes the given directory into path[], with a leading ~/ expanded to the
+// home directory
+static
+bool expand_home_dir(// output
+                     char* path, int bufsize,
+
+                     // input
+                     const char* dir)
+{
+    if(dir[0] == '~' && dir[1] == '/' )
+    {
+        const char* home = getenv("HOME");
+        if(home == NULL)
+        {
+            MSG("User asked for ~, but the 'HOME' env var isn't defined");
+            return false;
+        }
+        return snprintf(path, bufsize, "%s/%s", home, &dir[2]) < bufsize;
+    }
+    return snprintf(path, bufsize, "%s", dir) < bufsize;
+}
+
+// The 64-bit FNV-1a hash of the given bytes, continuing from h
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+static uint64_t fnv1a(uint64_t h, const void* data, size_t Nbytes)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for(size_t k=0; k<Nbytes; k++)
+    {
+        h ^= bytes[k];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Folds the size and mtime of the given file into a source_id. A missing file
+// contributes a marker, so creating it changes the id
+static void source_id_add_file(uint64_t* source_id, const char* filename)
+{
+    struct stat sb;
+    int64_t size_mtime[3] = {-1, -1, -1};
+    if(0 == stat(filename, &sb))
+    {
+        size_mtime[0] = (int64_t)sb.st_size;
+        size_mtime[1] = (int64_t)sb.st_mtim.tv_sec;
+        size_mtime[2] = (int64_t)sb.st_mtim.tv_nsec;
+    }
+    *source_id = fnv1a(*source_id, size_mtime, sizeof(size_mtime));
+}
+
 static
 bool dem_filename(// output
                   char* path, int bufsize,
@@ -44,30 +98,661 @@ bool dem_filename(// output
         demfileE *= -1;
     }
 
-    if(datadir[0] == '~' && datadir[1] == '/' )
+    char dir[1024];
+    if( !expand_home_dir(dir, sizeof(dir), datadir) )
+        return false;
+    if( snprintf(path, bufsize, "%s/%c%.2d%c%.3d.hgt",
+                 dir,
+                 ns, demfileN, we, demfileE) >= bufsize )
+        return false;
+    return true;
+}
+
+// Decodes rows [j0,j1) of columns [i0,i0+w) of a DEM of width W. This is
+// inlined into hgt_decode() for each common grid size
+static inline __attribute__((always_inline))
+void hgt_decode_rows(// output
+                     int16_t* out,
+                     int stride,
+
+                     // input
+                     const unsigned char* dem,
+                     const int W,
+                     int i0, int w,
+                     int j0, int j1)
+{
+    for(int j=j0; j<j1; j++)
     {
-        const char* home = getenv("HOME");
-        if(home == NULL)
+        // DEM starts at NW corner. I flip it around to start my data
+        // at the SW corner
+        const unsigned char* src = &dem[2*( (size_t)(W-1 - j)*(size_t)W + i0 )];
+        int16_t*             dst = &out[(size_t)(j-j0)*(size_t)stride];
+
+        // Each value is big-endian, so I flip the bytes
+        for(int k=0; k<w; k++)
         {
-            MSG("User asked for ~, but the 'HOME' env var isn't defined");
-            return false;
+            int16_t z = (int16_t) ((src[2*k] << 8) | src[2*k + 1]);
+            dst[k] = (z < 0) ? 0 : z;
         }
-        if( snprintf(path, bufsize, "%s/%s/%c%.2d%c%.3d.hgt",
-                     home,
-                     &datadir[2],
-                     ns, demfileN, we, demfileE) >= bufsize )
-            return false;
     }
+}
+
+static void hgt_decode(// output
+                       int16_t* out,
+                       int stride,
+
+                       // input
+                       const unsigned char* dem,
+                       int cells_per_deg,
+                       int i0, int w,
+                       int j0, int j1)
+{
+    // The common sizes get a copy of the loop with W known at compile time, as
+    // it was when only SRTM3 was supported. Other sizes take the generic path
+    switch(cells_per_deg)
+    {
+    case HORIZONATOR_CELLS_PER_DEG_SRTM3:
+        hgt_decode_rows(out, stride, dem, HORIZONATOR_CELLS_PER_DEG_SRTM3+1, i0, w, j0, j1);
+        break;
+    case HORIZONATOR_CELLS_PER_DEG_SRTM1:
+        hgt_decode_rows(out, stride, dem, HORIZONATOR_CELLS_PER_DEG_SRTM1+1, i0, w, j0, j1);
+        break;
+    default:
+        hgt_decode_rows(out, stride, dem, cells_per_deg+1,                   i0, w, j0, j1);
+    }
+}
+
+// The resolution of a DEM file of the given size. 0 if the size isn't that of
+// a square grid of 16-bit samples
+static int hgt_cells_per_deg(off_t size)
+{
+    if(size <= 0 || size % 2 != 0)
+        return 0;
+    int W = (int)round(sqrt((double)(size/2)));
+    if(W < 2 || (off_t)W*(off_t)W*2 != size)
+        return 0;
+    return W-1;
+}
+
+int horizonator_dem_cells_per_deg(const char* datadir)
+{
+    char path[1024];
+    if( !expand_home_dir(path, sizeof(path), datadir) )
+    {
+        MSG("Couldn't expand the DEM path '%s'", datadir);
+        return 0;
+    }
+
+    struct stat sb;
+    if(0 == stat(path, &sb) && S_ISREG(sb.st_mode) &&
+       horizonator_dem_is_geotiff(path))
+    {
+        horizonator_dem_geotiff_t tiff;
+        if(!horizonator_dem_geotiff_open(&tiff, path))
+            return 0;
+        int cells_per_deg = tiff.cells_per_deg;
+        horizonator_dem_geotiff_close(&tiff);
+        return cells_per_deg;
+    }
+    if(0 == stat(path, &sb) && S_ISREG(sb.st_mode))
+    {
+        horizonator_dem_pack_t pack;
+        if(!horizonator_dem_pack_open(&pack, path))
+            return 0;
+        int cells_per_deg = pack.cells_per_deg;
+        horizonator_dem_pack_close(&pack);
+        return cells_per_deg;
+    }
+
+    DIR* dir = opendir(path);
+    if(dir == NULL)
+    {
+        // Like a missing DEM file: everything is assumed to be in the sea
+        MSG("Warning: couldn't open the DEM directory '%s'", path);
+        return HORIZONATOR_CELLS_PER_DEG_SRTM3;
+    }
+
+    int cells_per_deg = HORIZONATOR_CELLS_PER_DEG_SRTM3;
+    struct dirent* entry;
+    while(NULL != (entry = readdir(dir)))
+    {
+        int len = strlen(entry->d_name);
+        if(len < 4 || 0 != strcmp(&entry->d_name[len-4], ".hgt"))
+            continue;
+
+        char filename[2048];
+        if( snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name) >= (int)sizeof(filename) ||
+            0 != stat(filename, &sb) ||
+            sb.st_size == 0 )
+            continue;
+
+        cells_per_deg = hgt_cells_per_deg(sb.st_size);
+        if(cells_per_deg == 0)
+            MSG("The DEM file '%s' has size %lld: not a square grid of 16-bit samples",
+                filename, (long long)sb.st_size);
+        break;
+    }
+    closedir(dir);
+    return cells_per_deg;
+}
+
+// The process-wide cache of decoded DEM tiles. The tiles are in a
+// doubly-linked list, most-recently-used first. There are only ever a few
+// dozen of them, so I look them up by walking the list. A tile being copied
+// out of is referenced (refcount > 0), and the copy happens without holding
+// the lock. If such a tile is evicted, it is unlinked right away, and freed
+// when the last reference is released
+typedef struct dem_cache_tile_t
+{
+    struct dem_cache_tile_t* prev;
+    struct dem_cache_tile_t* next;
+
+    // The key
+    char* filename;
+
+    // The file this was decoded from. If the file changes, the tile is stale
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+
+    // (cells_per_deg+1)^2 samples, stored like the mosaic: row-major, SW
+    // corner first
+    int16_t* data;
+    int      cells_per_deg;
+    size_t   bytes;
+
+    int      refcount;
+    bool     linked;
+} dem_cache_tile_t;
+
+static struct
+{
+    pthread_mutex_t   mutex;
+    dem_cache_tile_t* head;
+    dem_cache_tile_t* tail;
+    horizonator_dem_tile_cache_stats_t stats;
+} dem_cache =
+    {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .stats = {.max_bytes = HORIZONATOR_DEM_TILE_CACHE_MAX_BYTES_DEFAULT}
+    };
+
+static void dem_cache_tile_free(dem_cache_tile_t* tile)
+{
+    free(tile->filename);
+    free(tile->data);
+    free(tile);
+}
+
+// These are called with the lock held
+static void dem_cache_unlink(dem_cache_tile_t* tile)
+{
+    if(tile->prev != NULL) tile->prev->next = tile->next;
+    else                   dem_cache.head   = tile->next;
+    if(tile->next != NULL) tile->next->prev = tile->prev;
+    else                   dem_cache.tail   = tile->prev;
+    tile->prev = tile->next = NULL;
+    tile->linked = false;
+
+    dem_cache.stats.bytes -= tile->bytes;
+    dem_cache.stats.Ntiles--;
+
+    if(tile->refcount == 0)
+        dem_cache_tile_free(tile);
+}
+static void dem_cache_push_front(dem_cache_tile_t* tile)
+{
+    tile->prev = NULL;
+    tile->next = dem_cache.head;
+    if(dem_cache.head != NULL) dem_cache.head->prev = tile;
+    else                       dem_cache.tail       = tile;
+    dem_cache.head = tile;
+}
+static void dem_cache_trim(size_t bytes_needed)
+{
+    while(dem_cache.tail != NULL &&
+          dem_cache.stats.bytes + bytes_needed > dem_cache.stats.max_bytes)
+    {
+        dem_cache_unlink(dem_cache.tail);
+        dem_cache.stats.evictions++;
+    }
+}
+static bool dem_cache_tile_matches(const dem_cache_tile_t* tile,
+                                   const struct stat* sb)
+{
+    return
+        tile->dev           == sb->st_dev          &&
+        tile->ino           == sb->st_ino          &&
+        tile->size          == sb->st_size         &&
+        tile->mtime.tv_sec  == sb->st_mtim.tv_sec  &&
+        tile->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+// Returns the cached tile for this file, referenced, or NULL if there isn't
+// one. The caller releases it with dem_cache_release()
+static dem_cache_tile_t* dem_cache_get(const char* filename,
+                                       const struct stat* sb)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+
+    dem_cache_tile_t* tile;
+    for(tile = dem_cache.head; tile != NULL; tile = tile->next)
+        if(0 == strcmp(tile->filename, filename))
+            break;
+
+    if(tile != NULL && !dem_cache_tile_matches(tile, sb))
+    {
+        dem_cache_unlink(tile);
+        dem_cache.stats.stale++;
+        tile = NULL;
+    }
+
+    if(tile == NULL)
+        dem_cache.stats.misses++;
     else
     {
-        if( snprintf(path, bufsize, "%s/%c%.2d%c%.3d.hgt",
-                     datadir,
-                     ns, demfileN, we, demfileE) >= bufsize )
+        dem_cache.stats.hits++;
+        tile->refcount++;
+        if(tile != dem_cache.head)
+        {
+            // Move to the front
+            if(tile->next != NULL) tile->next->prev = tile->prev;
+            else                   dem_cache.tail   = tile->prev;
+            tile->prev->next = tile->next;
+            dem_cache_push_front(tile);
+        }
+    }
+
+    pthread_mutex_unlock(&dem_cache.mutex);
+    return tile;
+}
+
+// Adds a freshly-decoded tile to the cache, and returns it, referenced. If
+// another thread added this tile in the meantime, I return that one instead,
+// and free the new one. If the tile doesn't fit into the cache at all, it is
+// returned without being cached, and freed when released
+static dem_cache_tile_t* dem_cache_insert(dem_cache_tile_t* tile)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+
+    for(dem_cache_tile_t* t = dem_cache.head; t != NULL; t = t->next)
+        if(0 == strcmp(t->filename, tile->filename) &&
+           t->dev   == tile->dev   &&
+           t->ino   == tile->ino   &&
+           t->size  == tile->size  &&
+           t->mtime.tv_sec  == tile->mtime.tv_sec &&
+           t->mtime.tv_nsec == tile->mtime.tv_nsec)
+        {
+            t->refcount++;
+            pthread_mutex_unlock(&dem_cache.mutex);
+            dem_cache_tile_free(tile);
+            return t;
+        }
+
+    tile->refcount = 1;
+    if(tile->bytes <= dem_cache.stats.max_bytes)
+    {
+        dem_cache_trim(tile->bytes);
+        dem_cache_push_front(tile);
+        tile->linked = true;
+        dem_cache.stats.bytes += tile->bytes;
+        dem_cache.stats.Ntiles++;
+    }
+
+    pthread_mutex_unlock(&dem_cache.mutex);
+    return tile;
+}
+
+static void dem_cache_release(dem_cache_tile_t* tile)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+    tile->refcount--;
+    if(tile->refcount == 0 && !tile->linked)
+        dem_cache_tile_free(tile);
+    pthread_mutex_unlock(&dem_cache.mutex);
+}
+
+void horizonator_dem_tile_cache_set_max_bytes(size_t max_bytes)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+    dem_cache.stats.max_bytes = max_bytes;
+    dem_cache_trim(0);
+    pthread_mutex_unlock(&dem_cache.mutex);
+}
+
+void horizonator_dem_tile_cache_get_stats(horizonator_dem_tile_cache_stats_t* stats)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+    *stats = dem_cache.stats;
+    pthread_mutex_unlock(&dem_cache.mutex);
+}
+
+void horizonator_dem_tile_cache_reset_stats(void)
+{
+    pthread_mutex_lock(&dem_cache.mutex);
+    dem_cache.stats.hits      = 0;
+    dem_cache.stats.misses    = 0;
+    dem_cache.stats.evictions = 0;
+    dem_cache.stats.stale     = 0;
+    pthread_mutex_unlock(&dem_cache.mutex);
+}
+
+bool horizonator_dem_hgt_read(// output
+                              int16_t* out,
+                              int stride,
+
+                              // input
+                              int cells_per_deg,
+                              int demfileN, int demfileE,
+                              int i0, int i1,
+                              int j0, int j1,
+                              const char* datadir)
+{
+    char filename[1024];
+    if( !dem_filename( filename, sizeof(filename),
+                       demfileN, demfileE,
+                       datadir) )
+    {
+        MSG("Couldn't construct DEM filename" );
+        return false;
+    }
+
+    void fill_sea(void)
+    {
+        for(int j=j0; j<j1; j++)
+            memset(&out[(size_t)(j-j0)*(size_t)stride], 0, (i1-i0)*sizeof(int16_t));
+    }
+
+    // Missing or empty DEM files are assumed to be in the sea
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+    {
+        MSG("Warning: couldn't open DEM file '%s'. Assuming elevation=0 (sea surface?)", filename );
+        fill_sea();
+        return true;
+    }
+
+    struct stat sb;
+    int res = fstat(fd, &sb);
+    assert( res == 0 );
+    if(sb.st_size == 0)
+    {
+        // DEM file exists and has size 0: assume it's in the sea. This
+        // does the same thing as if the DEM file didn't exist at all,
+        // except no warning is generated
+        close(fd);
+        fill_sea();
+        return true;
+    }
+
+    if( hgt_cells_per_deg(sb.st_size) != cells_per_deg )
+    {
+        close(fd);
+        MSG("The DEM file '%s' has unexpected size. All the DEMs in a dataset must have the same resolution: %d cells per degree",
+            filename, cells_per_deg );
+        return false;
+    }
+
+    // With the cache on, I decode the whole tile, unless it's already there
+    bool use_cache;
+    {
+        pthread_mutex_lock(&dem_cache.mutex);
+        use_cache = dem_cache.stats.max_bytes > 0;
+        pthread_mutex_unlock(&dem_cache.mutex);
+    }
+    dem_cache_tile_t* tile = NULL;
+    if(use_cache)
+        tile = dem_cache_get(filename, &sb);
+
+    if(tile == NULL)
+    {
+        const unsigned char* dem = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if( dem == MAP_FAILED )
+        {
+            close(fd);
+            MSG("Couldn't mmap the DEM file '%s'", filename );
             return false;
+        }
+
+        const int W = cells_per_deg+1;
+        if(use_cache)
+        {
+            tile = malloc(sizeof(*tile));
+            if(tile != NULL)
+            {
+                *tile = (dem_cache_tile_t){ .filename      = strdup(filename),
+                                            .dev           = sb.st_dev,
+                                            .ino           = sb.st_ino,
+                                            .size          = sb.st_size,
+                                            .mtime         = sb.st_mtim,
+                                            .data          = malloc((size_t)W*(size_t)W*sizeof(int16_t)),
+                                            .cells_per_deg = cells_per_deg,
+                                            .bytes         = (size_t)W*(size_t)W*sizeof(int16_t) };
+                if(tile->filename == NULL || tile->data == NULL)
+                {
+                    dem_cache_tile_free(tile);
+                    tile = NULL;
+                }
+            }
+        }
+
+        if(tile == NULL)
+        {
+            // No cache, or no memory for the whole tile. I decode just the
+            // window
+            close(fd);
+            hgt_decode(out, stride, dem, cells_per_deg, i0, i1-i0, j0, j1);
+            munmap((void*)dem, sb.st_size);
+            return true;
+        }
+
+        hgt_decode(tile->data, W, dem, cells_per_deg, 0, W, 0, W);
+        munmap((void*)dem, sb.st_size);
+        tile = dem_cache_insert(tile);
     }
+    close(fd);
+
+    const int W = tile->cells_per_deg+1;
+    for(int j=j0; j<j1; j++)
+        memcpy(&out[(size_t)(j-j0)*(size_t)stride],
+               &tile->data[(size_t)j*(size_t)W + i0],
+               (i1-i0)*sizeof(int16_t));
+
+    dem_cache_release(tile);
     return true;
 }
 
+const uint16_t horizonator_dem_morton_spread[HORIZONATOR_DEM_TILE_CELLS] =
+{
+    0x000, 0x001, 0x004, 0x005, 0x010, 0x011, 0x014, 0x015,
+    0x040, 0x041, 0x044, 0x045, 0x050, 0x051, 0x054, 0x055,
+    0x100, 0x101, 0x104, 0x105, 0x110, 0x111, 0x114, 0x115,
+    0x140, 0x141, 0x144, 0x145, 0x150, 0x151, 0x154, 0x155,
+    0x400, 0x401, 0x404, 0x405, 0x410, 0x411, 0x414, 0x415,
+    0x440, 0x441, 0x444, 0x445, 0x450, 0x451, 0x454, 0x455,
+    0x500, 0x501, 0x504, 0x505, 0x510, 0x511, 0x514, 0x515,
+    0x540, 0x541, 0x544, 0x545, 0x550, 0x551, 0x554, 0x555,
+};
+
+static struct
+{
+    horizonator_dem_layout_t layout;
+    bool                     huge_pages;
+} mosaic_settings = { .layout = HORIZONATOR_DEM_LAYOUT_TILED };
+
+void horizonator_dem_set_layout(horizonator_dem_layout_t layout,
+                                bool huge_pages)
+{
+    mosaic_settings.layout     = layout;
+    mosaic_settings.huge_pages = huge_pages;
+}
+
+const char* horizonator_dem_layout_name(horizonator_dem_layout_t layout)
+{
+    switch(layout)
+    {
+    case HORIZONATOR_DEM_LAYOUT_TILED:    return "tiled";
+    case HORIZONATOR_DEM_LAYOUT_ROWMAJOR: return "rowmajor";
+    }
+    return "unknown";
+}
+
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+// Allocates the zeroed mosaic of ctx, in the current layout. The last sample
+// is followed by 2 bytes of padding: interp_many_avx2() reads 32 bits at a
+// time
+static bool mosaic_alloc(horizonator_dem_context_t* ctx)
+{
+    const int W = horizonator_dem_mosaic_width(ctx);
+
+    ctx->layout = mosaic_settings.layout;
+
+    size_t Nsamples;
+    if(ctx->layout == HORIZONATOR_DEM_LAYOUT_ROWMAJOR)
+        Nsamples = (size_t)W*(size_t)W;
+    else
+    {
+        ctx->tiles_per_row = (W + HORIZONATOR_DEM_TILE_CELLS-1) / HORIZONATOR_DEM_TILE_CELLS;
+        Nsamples =
+            (size_t)ctx->tiles_per_row * (size_t)ctx->tiles_per_row *
+            HORIZONATOR_DEM_TILE_CELLS * HORIZONATOR_DEM_TILE_CELLS;
+    }
+    size_t Nbytes = Nsamples*sizeof(int16_t) + 2;
+
+    // Tiles start on cache lines. Huge pages must start on a huge-page
+    // boundary, and are only worth it if the mosaic fills one
+    bool   huge      = mosaic_settings.huge_pages && Nbytes >= HUGE_PAGE_BYTES;
+    size_t alignment = huge ? HUGE_PAGE_BYTES : 64;
+    if(huge)
+        Nbytes = (Nbytes + HUGE_PAGE_BYTES-1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+
+    void* mosaic;
+    if(0 != posix_memalign(&mosaic, alignment, Nbytes))
+    {
+        MSG("Couldn't allocate the %dx%d DEM mosaic", W, W);
+        return false;
+    }
+#ifdef MADV_HUGEPAGE
+    // Only a hint: if transparent huge pages are off, we get normal pages
+    if(huge)
+        madvise(mosaic, Nbytes, MADV_HUGEPAGE);
+#endif
+    memset(mosaic, 0, Nbytes);
+    ctx->mosaic = mosaic;
+    return true;
+}
+
+// Writes the w x h window of the mosaic of ctx with its SW corner at
+// (i0,j0). read_rows(cookie) writes rows [jwindow0,jwindow1) of the window
+// row-major into out, with the given stride. It's given zeros to write into.
+// With the row-major layout it writes straight into the mosaic, in one call.
+// With the tiled layout it writes into a temporary buffer, at most Nrows rows
+// at a time, and we scatter that into the tiles. The strips of rows end where
+// (jwindow + phase) is a multiple of Nrows
+typedef bool (mosaic_read_rows_t)(int16_t* out, int stride,
+                                  int jwindow0, int jwindow1,
+                                  void* cookie);
+static bool mosaic_fill(horizonator_dem_context_t* ctx,
+                        int i0, int j0, int w, int h,
+                        int Nrows, int phase,
+                        mosaic_read_rows_t* read_rows, void* cookie)
+{
+    const int W = horizonator_dem_mosaic_width(ctx);
+
+    if(ctx->layout == HORIZONATOR_DEM_LAYOUT_ROWMAJOR)
+        return read_rows(&ctx->mosaic[(size_t)j0*(size_t)W + (size_t)i0], W, 0, h, cookie);
+
+    if(Nrows > h) Nrows = h;
+    int16_t* strip = malloc((size_t)Nrows*(size_t)w*sizeof(int16_t));
+    if(strip == NULL)
+    {
+        MSG("Couldn't allocate the %dx%d DEM strip", w, Nrows);
+        return false;
+    }
+
+    phase %= Nrows;
+    if(phase < 0) phase += Nrows;
+
+    bool result = false;
+    for(int jw0=0; jw0<h; )
+    {
+        int jw1 = (jw0 + phase) / Nrows * Nrows + Nrows - phase;
+        if(jw1 > h) jw1 = h;
+        memset(strip, 0, (size_t)Nrows*(size_t)w*sizeof(int16_t));
+        if(!read_rows(strip, w, jw0, jw1, cookie))
+            goto done;
+
+        for(int jw=jw0; jw<jw1; jw++)
+        {
+            const int16_t* row = &strip[(size_t)(jw-jw0)*(size_t)w];
+            for(int iw=0; iw<w; iw++)
+                ctx->mosaic[horizonator_dem_mosaic_index(ctx, i0+iw, j0+jw)] = row[iw];
+        }
+        jw0 = jw1;
+    }
+    result = true;
+
+ done:
+    free(strip);
+    return result;
+}
+
+// The mosaic_read_rows_t callbacks for each kind of source. These are given
+// the mosaic as a window of the source, starting at (i0,j0), w samples wide
+typedef struct
+{
+    horizonator_dem_pack_t* pack;
+    int i0, j0, w;
+} read_rows_pack_t;
+static bool read_rows_pack(int16_t* out, int stride,
+                           int jmosaic0, int jmosaic1,
+                           void* cookie)
+{
+    const read_rows_pack_t* c = (const read_rows_pack_t*)cookie;
+    return horizonator_dem_pack_read(out, stride, c->pack,
+                                     c->i0, c->j0 + jmosaic0,
+                                     c->w, jmosaic1 - jmosaic0);
+}
+
+typedef struct
+{
+    const horizonator_dem_geotiff_t* tiff;
+    int i0, j0, w;
+} read_rows_geotiff_t;
+static bool read_rows_geotiff(int16_t* out, int stride,
+                              int jmosaic0, int jmosaic1,
+                              void* cookie)
+{
+    const read_rows_geotiff_t* c = (const read_rows_geotiff_t*)cookie;
+    return horizonator_dem_geotiff_read(out, stride, c->tiff,
+                                        c->i0, c->j0 + jmosaic0,
+                                        c->w, jmosaic1 - jmosaic0,
+                                        0);
+}
+
+// One .hgt file: its columns [i0,i1), and its rows starting at j0
+typedef struct
+{
+    const char* datadir;
+    int cells_per_deg;
+    int demfileN, demfileE;
+    int i0, i1, j0;
+} read_rows_hgt_t;
+static bool read_rows_hgt(int16_t* out, int stride,
+                          int jwindow0, int jwindow1,
+                          void* cookie)
+{
+    const read_rows_hgt_t* c = (const read_rows_hgt_t*)cookie;
+    return horizonator_dem_hgt_read(out, stride,
+                                    c->cells_per_deg,
+                                    c->demfileN, c->demfileE,
+                                    c->i0, c->i1,
+                                    c->j0 + jwindow0, c->j0 + jwindow1,
+                                    c->datadir);
+}
+
 bool horizonator_dem_init(// output
               horizonator_dem_context_t* ctx,
 
@@ -83,15 +768,44 @@ bool horizonator_dem_init(// output
 
     const float viewer_lon_lat[] = {viewer_lon, viewer_lat};
 
+    const int cells_per_deg = horizonator_dem_cells_per_deg(datadir);
+    if(cells_per_deg <= 0)
+    {
+        MSG("Couldn't determine the resolution of the DEMs in '%s'", datadir);
+        return false;
+    }
+    ctx->cells_per_deg = cells_per_deg;
+
+    // datadir is either a directory of SRTM DEMs, a DEM pack or a GeoTIFF
+    char        pack_filename[1024];
+    struct stat sb;
+    bool is_pack =
+        expand_home_dir(pack_filename, sizeof(pack_filename), datadir) &&
+        0 == stat(pack_filename, &sb) && S_ISREG(sb.st_mode);
+    bool is_geotiff = is_pack && horizonator_dem_is_geotiff(pack_filename);
+    if(is_geotiff)
+        is_pack = false;
+
+    // The dataset is identified by its path, and the size and mtime of its
+    // files. For a directory, the .hgt files are added as they're read, below
+    {
+        char path[1024];
+        if(!expand_home_dir(path, sizeof(path), datadir))
+            snprintf(path, sizeof(path), "%s", datadir);
+        ctx->source_id = fnv1a(FNV_OFFSET_BASIS, path, strlen(path));
+        if(is_pack || is_geotiff)
+            source_id_add_file(&ctx->source_id, pack_filename);
+    }
+
     for(int i=0; i<2; i++)
     {
         // If radius == 1 -> N = 2 and center = 1.5 -> I have cells 1,2. Same
         // with center = 1.anything
         //
-        //   icell_origin  = floor(latlon_view * CELLS_PER_DEG) - (radius-1)
-        //   latlon_origin = floor(icell_origin / CELLS_PER_DEG)
-        int   icell_origin   = floor(viewer_lon_lat[i] * CELLS_PER_DEG) - (radius_cells-1);
-        float origin_lon_lat = (float)icell_origin / (float)CELLS_PER_DEG;
+        //   icell_origin  = floor(latlon_view * cells_per_deg) - (radius-1)
+        //   latlon_origin = floor(icell_origin / cells_per_deg)
+        int   icell_origin   = floor(viewer_lon_lat[i] * cells_per_deg) - (radius_cells-1);
+        float origin_lon_lat = (float)icell_origin / (float)cells_per_deg;
 
         // Which DEM contains the SW corner of the render data
         ctx->origin_dem_lon_lat[i] = (int)floor(origin_lon_lat);
@@ -99,20 +813,20 @@ bool horizonator_dem_init(// output
         // Which cell in the origin DEM contains the SW corner of the render data
         //
         // This round() is here only for floating-point fuzz. It SHOULD be an integer already
-        ctx->origin_dem_cellij [i] = (int)round( (origin_lon_lat - ctx->origin_dem_lon_lat[i]) * CELLS_PER_DEG );
+        ctx->origin_dem_cellij [i] = (int)round( (origin_lon_lat - ctx->origin_dem_lon_lat[i]) * cells_per_deg );
 
         // Let's confirm I did the right thing....
         // I'm disabling these asserts because floating-point fuzz may make them
         // fail. I left them enabled long-enough to be confident that this stuff
         // works
-        // assert( radius_cells-1 < (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)CELLS_PER_DEG - (float)ctx->origin_dem_cellij [i]);
-        // assert( radius_cells   > (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)CELLS_PER_DEG - (float)ctx->origin_dem_cellij [i]);
+        // assert( radius_cells-1 < (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)cells_per_deg - (float)ctx->origin_dem_cellij [i]);
+        // assert( radius_cells   > (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)cells_per_deg - (float)ctx->origin_dem_cellij [i]);
 
         // I will have 2*radius_cells
         int cellij_last = ctx->origin_dem_cellij[i] + radius_cells*2-1;
-        int idem_last   = cellij_last / CELLS_PER_DEG;
+        int idem_last   = cellij_last / cells_per_deg;
         ctx->Ndems_ij[i] = idem_last + 1;
-        if( cellij_last == idem_last*CELLS_PER_DEG )
+        if( cellij_last == idem_last*cells_per_deg )
         {
             // The last cell in my render is the first cell in the DEM. But
             // adjacent DEMs have one row/col of overlap, so I can use the last
@@ -120,7 +834,7 @@ bool horizonator_dem_init(// output
             ctx->Ndems_ij[i]--;
         }
 
-        if( ctx->Ndems_ij[i] > max_Ndems_ij )
+        if( !is_pack && !is_geotiff && ctx->Ndems_ij[i] > max_Ndems_ij )
         {
             horizonator_dem_deinit(ctx);
             MSG("Requested radius too large. Increase the compile-time-constant max_Ndems_ij from the current value of %d", max_Ndems_ij);
@@ -128,65 +842,139 @@ bool horizonator_dem_init(// output
         }
     }
 
-    // I now load my DEMs. Each dems[] is a pointer to an mmap-ed source file.
-    // The ordering of dems[] is increasing latlon, with lon varying faster
-    for( int j = 0; j < ctx->Ndems_ij[1]; j++ )
-        for( int i = 0; i < ctx->Ndems_ij[0]; i++ )
+    const int W = 2*radius_cells;
+
+    if(is_pack)
+    {
+        horizonator_dem_pack_t pack;
+        if(!horizonator_dem_pack_open(&pack, pack_filename))
+            return false;
+        if(!mosaic_alloc(ctx))
         {
-            char filename[1024];
-            if( !dem_filename( filename, sizeof(filename),
-                               j + ctx->origin_dem_lon_lat[1],
-                               i + ctx->origin_dem_lon_lat[0],
-                               datadir) )
-            {
-                horizonator_dem_deinit(ctx);
-                MSG("Couldn't construct DEM filename" );
-                return false;
-            }
+            horizonator_dem_pack_close(&pack);
+            return false;
+        }
 
-            struct stat sb;
-            ctx->mmap_fd[i][j] = open( filename, O_RDONLY );
-            if( ctx->mmap_fd[i][j] <= 0 )
-            {
-                horizonator_dem_deinit(ctx);
-                MSG("Warning: couldn't open DEM file '%s'. Assuming elevation=0 (sea surface?)", filename );
-                ctx->dems      [i][j] = NULL;
-                ctx->mmap_sizes[i][j] = 0;
-                ctx->mmap_fd   [i][j] = 0;
-                continue;
-            }
+        // The SW corner of the mosaic, in the full-resolution samples of the
+        // pack
+        int i0 = (ctx->origin_dem_lon_lat[0] - pack.lon0)*cells_per_deg + ctx->origin_dem_cellij[0];
+        int j0 = (ctx->origin_dem_lon_lat[1] - pack.lat0)*cells_per_deg + ctx->origin_dem_cellij[1];
+        if(i0 < 0 || j0 < 0 ||
+           i0 + W > pack.W || j0 + W > pack.H)
+            MSG("Warning: the render area extends past the DEM pack '%s'. Assuming elevation=0 (sea surface?) there",
+                pack_filename);
 
-            int res = fstat(ctx->mmap_fd[i][j], &sb);
-            assert( res == 0 );
-            if(sb.st_size == 0)
-            {
-                // DEM file exists and has size 0: assume it's in the sea. This
-                // does the same thing as if the DEM file didn't exist at all,
-                // except no warning is generated
-                close(ctx->mmap_fd[i][j]);
+        // The pack is read one row of its blocks at a time. The strips line
+        // up with the rows of blocks, and each read decodes each of its
+        // blocks once, so nothing is decoded twice, however wide the mosaic
+        bool result = mosaic_fill(ctx, 0, 0, W, W, pack.block_cells, j0,
+                                  read_rows_pack,
+                                  &(read_rows_pack_t){ .pack = &pack,
+                                                       .i0 = i0, .j0 = j0, .w = W });
+        if(!result)
+        {
+            horizonator_dem_pack_close(&pack);
+            MSG("Couldn't read the DEM pack '%s'", pack_filename);
+            horizonator_dem_deinit(ctx);
+            return false;
+        }
 
-                horizonator_dem_deinit(ctx);
-                ctx->dems      [i][j] = NULL;
-                ctx->mmap_sizes[i][j] = 0;
-                ctx->mmap_fd   [i][j] = 0;
-                continue;
+        // I keep the pack for its bounds and levels. The samples are in the
+        // mosaic now, so the decompressed blocks aren't needed
+        horizonator_dem_pack_cache_free(&pack);
+        ctx->pack           = pack;
+        ctx->pack_origin[0] = i0;
+        ctx->pack_origin[1] = j0;
+        return true;
+    }
 
-            }
+    if(is_geotiff)
+    {
+        horizonator_dem_geotiff_t tiff;
+        if(!horizonator_dem_geotiff_open(&tiff, pack_filename))
+            return false;
+        if(!mosaic_alloc(ctx))
+        {
+            horizonator_dem_geotiff_close(&tiff);
+            return false;
+        }
 
-            ctx->dems      [i][j] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ctx->mmap_fd[i][j], 0);
-            ctx->mmap_sizes[i][j] = sb.st_size;
+        // The SW corner of the mosaic, in the samples of the file
+        int i0 = ctx->origin_dem_lon_lat[0]*cells_per_deg + ctx->origin_dem_cellij[0] - tiff.lon0_cells;
+        int j0 = ctx->origin_dem_lon_lat[1]*cells_per_deg + ctx->origin_dem_cellij[1] - tiff.lat0_cells;
+        if(i0 < 0 || j0 < 0 ||
+           i0 + W > tiff.W || j0 + W > tiff.H)
+            MSG("Warning: the render area extends past the GeoTIFF '%s'. Assuming elevation=0 (sea surface?) there",
+                pack_filename);
 
-            if( ctx->dems[i][j] == MAP_FAILED )
-            {
-                horizonator_dem_deinit(ctx);
-                MSG("Couldn't mmap the DEM file '%s'", filename );
-                return false;
-            }
+        // The file is read in one call: the internal tiles are large, and not
+        // cached, so reading in strips would decode them repeatedly
+        bool result = mosaic_fill(ctx, 0, 0, W, W, W, 0,
+                                  read_rows_geotiff,
+                                  &(read_rows_geotiff_t){ .tiff = &tiff,
+                                                          .i0 = i0, .j0 = j0, .w = W });
+        horizonator_dem_geotiff_close(&tiff);
+        if(!result)
+        {
+            MSG("Couldn't read the GeoTIFF '%s'", pack_filename);
+            horizonator_dem_deinit(ctx);
+        }
+        return result;
+    }
+
+    // The column/row of each DEM in the mosaic. Adjacent DEMs have one row/col
+    // of overlap, so DEM t covers cells (t*cells_per_deg, (t+1)*cells_per_deg]
+    // of the render area (counting from the start of the origin DEM). DEM 0
+    // additionally covers cell 0. Each DEM thus covers a contiguous run of
+    // mosaic cells, which starts at cell "cell0" inside that DEM
+    int mosaic_begin[2][max_Ndems_ij];
+    int mosaic_end  [2][max_Ndems_ij];
+    int cell0       [2][max_Ndems_ij];
+    for(int i=0; i<2; i++)
+        for(int t=0; t<ctx->Ndems_ij[i]; t++)
+        {
+            int c0 = (t == 0) ? 0 : t*cells_per_deg + 1;
+            int c1 = (t+1)*cells_per_deg + 1;
 
-            if( WDEM*WDEM*2 != sb.st_size )
+            mosaic_begin[i][t] = c0 - ctx->origin_dem_cellij[i];
+            mosaic_end  [i][t] = c1 - ctx->origin_dem_cellij[i];
+            if(mosaic_begin[i][t] < 0) mosaic_begin[i][t] = 0;
+            if(mosaic_end  [i][t] > W) mosaic_end  [i][t] = W;
+            cell0[i][t] = mosaic_begin[i][t] + ctx->origin_dem_cellij[i] - t*cells_per_deg;
+        }
+
+    if(!mosaic_alloc(ctx))
+        return false;
+
+    // I now load my DEMs, each into its part of the mosaic. The ordering of
+    // the DEMs is increasing latlon, with lon varying faster. Each DEM is read
+    // with one call, so it's decoded (and warned about, if missing) once
+    for( int j = 0; j < ctx->Ndems_ij[1]; j++ )
+        for( int i = 0; i < ctx->Ndems_ij[0]; i++ )
+        {
+            read_rows_hgt_t cookie =
+                { .datadir       = datadir,
+                  .cells_per_deg = cells_per_deg,
+                  .demfileN      = j + ctx->origin_dem_lon_lat[1],
+                  .demfileE      = i + ctx->origin_dem_lon_lat[0],
+                  .i0            = cell0[0][i],
+                  .i1            = cell0[0][i] + mosaic_end[0][i] - mosaic_begin[0][i],
+                  .j0            = cell0[1][j] };
+
+            char filename[1024];
+            if( dem_filename(filename, sizeof(filename),
+                             cookie.demfileN, cookie.demfileE,
+                             datadir) )
+                source_id_add_file(&ctx->source_id, filename);
+
+            const int h = mosaic_end[1][j] - mosaic_begin[1][j];
+            if( !mosaic_fill(ctx,
+                             mosaic_begin[0][i], mosaic_begin[1][j],
+                             mosaic_end[0][i] - mosaic_begin[0][i], h,
+                             h, 0,
+                             read_rows_hgt, &cookie) )
             {
                 horizonator_dem_deinit(ctx);
-                MSG("The DEM file '%s' has unexpected size. Is this a 3-arc-sec SRTM DEM?", filename );
                 return false;
             }
         }
@@ -196,20 +984,15 @@ bool horizonator_dem_init(// output
 
 void horizonator_dem_deinit( horizonator_dem_context_t* ctx )
 {
-    for( int i=0; i<max_Ndems_ij; i++)
-        for( int j=0; j<max_Ndems_ij; j++)
-        {
-            if( ctx->dems[i][j] != NULL && ctx->dems[i][j] != MAP_FAILED )
-            {
-                munmap( ctx->dems[i][j], ctx->mmap_sizes[i][j] );
-                ctx->dems[i][j] = NULL;
-            }
-            if( ctx->mmap_fd[i][j] > 0 )
-            {
-                close( ctx->mmap_fd[i][j] );
-                ctx->mmap_fd[i][j] = 0;
-            }
-        }
+    free(ctx->mosaic);
+    ctx->mosaic = NULL;
+    // An empty mosaic: horizonator_dem_sample() and friends see nothing
+    ctx->radius_cells = 0;
+
+    free(ctx->pyramid.data);
+    ctx->pyramid = (horizonator_dem_pyramid_t){};
+
+    horizonator_dem_pack_close(&ctx->pack);
 }
 
 // Given coordinates index cells, in respect to the origin cell
@@ -219,47 +1002,564 @@ int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
                    // Positive = towards North
                    int j)
 {
-    if(i < 0 || j < 0) return -1;
+    const int W = 2*ctx->radius_cells;
+    if(i < 0 || j < 0 || i >= W || j >= W) return -1;
+    return horizonator_dem_mosaic_at(ctx, i, j);
+}
 
-    // Cell coordinates inside my whole render area. Across multiple DEMs
-    int cell_ij[2] = {
-        i + ctx->origin_dem_cellij[0],
-        j + ctx->origin_dem_cellij[1] };
 
-    int dem_ij[2];
-    for(int i=0; i<2; i++)
+// The bilinearly-interpolated elevation at (x,y), in mosaic cells. NAN
+// outside the mosaic
+static inline float interp_cells_scalar(const horizonator_dem_context_t* ctx,
+                                        float x, float y)
+{
+    const int W = horizonator_dem_mosaic_width(ctx);
+    if( !(x >= 0.0f && x <= (float)(W-1) &&
+          y >= 0.0f && y <= (float)(W-1)) )
+        return NAN;
+
+    int i = (int)x < W-2 ? (int)x : W-2;
+    int j = (int)y < W-2 ? (int)y : W-2;
+    float fx = x - (float)i;
+    float fy = y - (float)j;
+
+    float z00 = horizonator_dem_mosaic_at(ctx, i,   j  );
+    float z10 = horizonator_dem_mosaic_at(ctx, i+1, j  );
+    float z01 = horizonator_dem_mosaic_at(ctx, i,   j+1);
+    float z11 = horizonator_dem_mosaic_at(ctx, i+1, j+1);
+    float z0  = z00 + fx*(z10 - z00);
+    float z1  = z01 + fx*(z11 - z01);
+    return z0 + fy*(z1 - z0);
+}
+
+// Interpolates points k0..N-1, one at a time. If lat,lon are NULL, the
+// points are given in mosaic cells, in x,y
+static void interp_many_scalar(// output
+                               float* z,
+
+                               // input
+                               const horizonator_dem_context_t* ctx,
+                               const float* lat, const float* lon,
+                               const float* x,   const float* y,
+                               int k0, int N)
+{
+    const float lon_origin = (float)ctx->origin_dem_lon_lat[0];
+    const float lat_origin = (float)ctx->origin_dem_lon_lat[1];
+    const float i_origin   = (float)ctx->origin_dem_cellij[0];
+    const float j_origin   = (float)ctx->origin_dem_cellij[1];
+
+    for(int k=k0; k<N; k++)
+        z[k] = lat == NULL ?
+            interp_cells_scalar(ctx, x[k], y[k]) :
+            interp_cells_scalar(ctx,
+                                (lon[k] - lon_origin) * (float)ctx->cells_per_deg - i_origin,
+                                (lat[k] - lat_origin) * (float)ctx->cells_per_deg - j_origin);
+}
+
+#if defined __x86_64__ || defined __i386__
+// interp_cells_scalar() for 8 points at a time, with the gathers of
+// horizonator_dem_cell_corners_avx2()
+__attribute__((target("avx2"), always_inline))
+static inline __m256 interp_cells_avx2(const horizonator_dem_context_t* ctx,
+                                       __m256 x, __m256 y)
+{
+    const int W = horizonator_dem_mosaic_width(ctx);
+
+    const __m256  zero       = _mm256_setzero_ps();
+    const __m256  xy_max     = _mm256_set1_ps((float)(W-1));
+    const __m256i ij_max     = _mm256_set1_epi32(W-2);
+    const __m256  nan        = _mm256_set1_ps(NAN);
+
+    // Ordered comparisons: NAN inputs are outside
+    __m256 inside =
+        _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(x, zero,   _CMP_GE_OQ),
+                                    _mm256_cmp_ps(x, xy_max, _CMP_LE_OQ)),
+                      _mm256_and_ps(_mm256_cmp_ps(y, zero,   _CMP_GE_OQ),
+                                    _mm256_cmp_ps(y, xy_max, _CMP_LE_OQ)));
+
+    // The points outside read cell (0,0), and are overwritten with NAN at
+    // the end
+    x = _mm256_and_ps(x, inside);
+    y = _mm256_and_ps(y, inside);
+
+    __m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(x), ij_max);
+    __m256i j = _mm256_min_epi32(_mm256_cvttps_epi32(y), ij_max);
+    __m256  fx = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+    __m256  fy = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j));
+
+    __m256 z00, z10, z01, z11;
+    horizonator_dem_cell_corners_avx2(&z00, &z10, &z01, &z11, ctx, i, j);
+
+    __m256 z0 = _mm256_add_ps(z00, _mm256_mul_ps(fx, _mm256_sub_ps(z10, z00)));
+    __m256 z1 = _mm256_add_ps(z01, _mm256_mul_ps(fx, _mm256_sub_ps(z11, z01)));
+    __m256 zi = _mm256_add_ps(z0,  _mm256_mul_ps(fy, _mm256_sub_ps(z1,  z0 )));
+    return _mm256_blendv_ps(nan, zi, inside);
+}
+
+// Interpolates the points 8 at a time, for as long as there are 8 left.
+// Returns how many points were done. The points are given as in
+// interp_many_scalar()
+__attribute__((target("avx2")))
+static int interp_many_avx2(// output
+                            float* z,
+
+                            // input
+                            const horizonator_dem_context_t* ctx,
+                            const float* lat, const float* lon,
+                            const float* x,   const float* y,
+                            int N)
+{
+    const __m256 lon_origin = _mm256_set1_ps((float)ctx->origin_dem_lon_lat[0]);
+    const __m256 lat_origin = _mm256_set1_ps((float)ctx->origin_dem_lon_lat[1]);
+    const __m256 i_origin   = _mm256_set1_ps((float)ctx->origin_dem_cellij[0]);
+    const __m256 j_origin   = _mm256_set1_ps((float)ctx->origin_dem_cellij[1]);
+    const __m256 cells      = _mm256_set1_ps((float)ctx->cells_per_deg);
+
+    int k = 0;
+    if(lat == NULL)
+        for(; k+8 <= N; k += 8)
+            _mm256_storeu_ps(&z[k],
+                             interp_cells_avx2(ctx,
+                                               _mm256_loadu_ps(&x[k]),
+                                               _mm256_loadu_ps(&y[k])));
+    else
+        for(; k+8 <= N; k += 8)
+        {
+            __m256 xk = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&lon[k]), lon_origin),
+                                                    cells),
+                                      i_origin);
+            __m256 yk = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&lat[k]), lat_origin),
+                                                    cells),
+                                      j_origin);
+            _mm256_storeu_ps(&z[k], interp_cells_avx2(ctx, xk, yk));
+        }
+    return k;
+}
+#endif
+
+static void interp_many(// output
+                        float* z,
+
+                        // input
+                        const horizonator_dem_context_t* ctx,
+                        const float* lat, const float* lon,
+                        const float* x,   const float* y,
+                        int N)
+{
+    int k = 0;
+
+#if defined __x86_64__ || defined __i386__
+    if(__builtin_cpu_supports("avx2"))
+        k = interp_many_avx2(z, ctx, lat, lon, x, y, N);
+#endif
+
+    interp_many_scalar(z, ctx, lat, lon, x, y, k, N);
+}
+
+void horizonator_dem_interp_many(// output
+                                 float* z,
+
+                                 // input
+                                 const horizonator_dem_context_t* ctx,
+                                 const float* lat, const float* lon,
+                                 int N)
+{
+    interp_many(z, ctx, lat, lon, NULL, NULL, N);
+}
+
+void horizonator_dem_interp_cells_many(// output
+                                       float* z,
+
+                                       // input
+                                       const horizonator_dem_context_t* ctx,
+                                       const float* x, const float* y,
+                                       int N)
+{
+    interp_many(z, ctx, NULL, NULL, x, y, N);
+}
+
+// The header of the pyramid cache files. The levels follow it, finest first, in
+// the native byte order
+typedef struct
+{
+    char     magic[8];
+    int32_t  origin_dem_lon_lat[2];
+    int32_t  origin_dem_cellij [2];
+    int32_t  W;
+    int32_t  Nlevels;
+} pyramid_file_header_t;
+
+#define PYRAMID_FILE_MAGIC "hzpyr02"
+
+// Sets up the sizes of the pyramid levels for a mosaic of width W. Returns the
+// total number of nodes, or 0 if we'd need too many levels
+static size_t pyramid_layout(horizonator_dem_pyramid_t* p, int W)
+{
+    size_t N = 0;
+    int    w = W-1;
+
+    p->Nlevels = 0;
+    while(true)
     {
-        dem_ij[i]  = cell_ij[i] / CELLS_PER_DEG;
+        if(p->Nlevels == HORIZONATOR_DEM_PYRAMID_MAX_LEVELS)
+            return 0;
+        p->widths[p->Nlevels++] = w;
+        N += (size_t)w*(size_t)w;
+        if(w <= 1)
+            return N;
+        w = (w+1) / 2;
+    }
+}
+
+static void pyramid_set_levels(horizonator_dem_pyramid_t* p)
+{
+    int16_t* level = p->data;
+    for(int l=0; l<p->Nlevels; l++)
+    {
+        p->levels[l] = level;
+        level = &level[(size_t)p->widths[l]*(size_t)p->widths[l]];
+    }
+}
 
-        // cell coordinates inside the one DEM containing the cell
-        cell_ij[i] -= dem_ij[i] * CELLS_PER_DEG;
+// The nodes [i0,i1) x [j0,j1) of level l of the pyramid that can be copied
+// from the max levels of the pack. Node i of the level covers the samples
+// [i,i+1]*2^l of the mosaic, and the node of the pack must cover the same
+// samples: the two must line up, and the node must not be clipped by the N or
+// E edge of the mosaic or the pack. Returns false if there are none
+static bool pyramid_seed_nodes(// output
+                               int* i0, int* j0, int* i1, int* j1,
+                               // input
+                               const horizonator_dem_context_t* ctx,
+                               int l)
+{
+    const horizonator_dem_pack_t* pack = &ctx->pack;
+    if(pack->map == NULL || l == 0 || l >= pack->Nlevels)
+        return false;
+
+    const int s = 1 << l;
+    const int W = horizonator_dem_mosaic_width(ctx);
+    const int o[2] = {ctx->pack_origin[0], ctx->pack_origin[1]};
+    if( (o[0] & (s-1)) != 0 || (o[1] & (s-1)) != 0 )
+        return false;
+
+    const int Wpack[2] = {pack->W, pack->H};
+    int n0[2], n1[2];
+    for(int d=0; d<2; d++)
+    {
+        // The samples under node i are [o + i*s, o + (i+1)*s] in the pack.
+        // These must be inside [0,Wpack-1] and, relative to the mosaic,
+        // inside [0,W-1]
+        n0[d] = o[d] < 0 ? -o[d] / s : 0;
+        n1[d] = (W-1) / s;
+        int n1_pack = (Wpack[d]-1 - o[d]) / s;
+        if(Wpack[d]-1 - o[d] < 0) n1_pack = 0;
+        if(n1[d] > n1_pack) n1[d] = n1_pack;
+    }
+    *i0 = n0[0]; *i1 = n1[0];
+    *j0 = n0[1]; *j1 = n1[1];
+    return *i0 < *i1 && *j0 < *j1;
+}
 
-        // Adjacent DEMs have one row/col of overlap, so I can use the last row
-        // of the previous DEM
-        if(cell_ij[i] == 0)
+static void pyramid_build(horizonator_dem_pyramid_t* p,
+                          const horizonator_dem_context_t* ctx)
+{
+    int w = p->widths[0];
+    for(int j=0; j<w; j++)
+        for(int i=0; i<w; i++)
         {
-            dem_ij [i]--;
-            cell_ij[i] = CELLS_PER_DEG;
+            int16_t z00 = horizonator_dem_mosaic_at(ctx, i,   j  );
+            int16_t z10 = horizonator_dem_mosaic_at(ctx, i+1, j  );
+            int16_t z01 = horizonator_dem_mosaic_at(ctx, i,   j+1);
+            int16_t z11 = horizonator_dem_mosaic_at(ctx, i+1, j+1);
+            int16_t z0  = z00 > z10 ? z00 : z10;
+            int16_t z1  = z01 > z11 ? z01 : z11;
+            p->levels[0][(size_t)j*(size_t)w + (size_t)i] = z0 > z1 ? z0 : z1;
         }
 
-        if( dem_ij[i] >= ctx->Ndems_ij[i] ) return -1;
+    for(int l=1; l<p->Nlevels; l++)
+    {
+        const int16_t* child   = p->levels[l-1];
+        int16_t*       parent  = p->levels[l];
+        int            wchild  = p->widths[l-1];
+        int            wparent = p->widths[l];
+
+        // The nodes that the pack has are copied. The rest are built from the
+        // level below
+        int si0, sj0, si1, sj1;
+        if(!pyramid_seed_nodes(&si0, &sj0, &si1, &sj1, ctx, l))
+            si0 = sj0 = si1 = sj1 = 0;
+        const int16_t* seed       = ctx->pack.levels[l];
+        const int      wseed      = ctx->pack.level_widths[l];
+        const int      seed_i0    = ctx->pack_origin[0] >> l;
+        const int      seed_j0    = ctx->pack_origin[1] >> l;
+        for(int j=sj0; j<sj1; j++)
+            memcpy(&parent[(size_t)j*(size_t)wparent + (size_t)si0],
+                   &seed[(size_t)(seed_j0 + j)*(size_t)wseed + (size_t)(seed_i0 + si0)],
+                   (size_t)(si1 - si0)*sizeof(int16_t));
+
+        for(int j=0; j<wparent; j++)
+            for(int i=0; i<wparent; i++)
+            {
+                if(j >= sj0 && j < sj1 && i >= si0 && i < si1)
+                {
+                    i = si1-1;
+                    continue;
+                }
+
+                // At the N and E edges, the parent may have only one child in
+                // each direction
+                int i0 = 2*i;
+                int j0 = 2*j;
+                int i1 = i0+1 < wchild ? i0+1 : i0;
+                int j1 = j0+1 < wchild ? j0+1 : j0;
+
+                int16_t z00 = child[(size_t)j0*(size_t)wchild + (size_t)i0];
+                int16_t z10 = child[(size_t)j0*(size_t)wchild + (size_t)i1];
+                int16_t z01 = child[(size_t)j1*(size_t)wchild + (size_t)i0];
+                int16_t z11 = child[(size_t)j1*(size_t)wchild + (size_t)i1];
+                int16_t z0  = z00 > z10 ? z00 : z10;
+                int16_t z1  = z01 > z11 ? z01 : z11;
+                parent[(size_t)j*(size_t)wparent + (size_t)i] = z0 > z1 ? z0 : z1;
+            }
     }
+}
 
-    const unsigned char* dem = ctx->dems[dem_ij[0]][dem_ij[1]];
-    if(dem == NULL)
-        return 0;
+// Like "mkdir -p"
+static bool mkdir_parents(const char* dir)
+{
+    char path[1024];
+    if( snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path) )
+        return false;
+
+    for(char* p = &path[1]; ; p++)
+    {
+        if(*p != '/' && *p != '\0')
+            continue;
 
-    uint32_t p =
-        cell_ij[0] +
-        // DEM starts at NW corner. I flip it around to start my data at the SW
-        // corner
-        (WDEM-1 - cell_ij[1])*WDEM;
+        char c = *p;
+        *p = '\0';
+        if(0 != mkdir(path, 0755))
+        {
+            struct stat sb;
+            if(0 != stat(path, &sb) || !S_ISDIR(sb.st_mode))
+                return false;
+        }
+        *p = c;
+        if(c == '\0')
+            return true;
+    }
+}
+
+bool horizonator_dem_cache_filename(// output
+                                    char* path, int bufsize,
 
-    // Each value is big-endian, so I flip the bytes
-    int16_t  z = (int16_t) ((dem[2*p] << 8) | dem[2*p + 1]);
-    return (z < 0) ? 0 : z;
+                                    // input
+                                    const horizonator_dem_context_t* ctx,
+                                    const char* cachedir,
+                                    const char* kind)
+{
+    char dir[1024];
+    if( !expand_home_dir(dir, sizeof(dir), cachedir) )
+        return false;
+    return
+        snprintf(path, bufsize, "%s/%s_%016llx_%d_%d_%d_%d_%d_%d.dat",
+                 dir, kind,
+                 (unsigned long long)ctx->source_id,
+                 ctx->origin_dem_lon_lat[0], ctx->origin_dem_lon_lat[1],
+                 ctx->origin_dem_cellij [0], ctx->origin_dem_cellij [1],
+                 horizonator_dem_mosaic_width(ctx),
+                 ctx->cells_per_deg) < bufsize;
+}
+
+static void pyramid_header(// output
+                           pyramid_file_header_t* header,
+
+                           // input
+                           const horizonator_dem_context_t* ctx)
+{
+    *header = (pyramid_file_header_t)
+        { .magic              = PYRAMID_FILE_MAGIC,
+          .origin_dem_lon_lat = {ctx->origin_dem_lon_lat[0], ctx->origin_dem_lon_lat[1]},
+          .origin_dem_cellij  = {ctx->origin_dem_cellij [0], ctx->origin_dem_cellij [1]},
+          .W                  = horizonator_dem_mosaic_width(ctx),
+          .Nlevels            = ctx->pyramid.Nlevels };
 }
 
+// Reads the levels from the cache file, if it exists and matches this mosaic
+static bool pyramid_read_cache(horizonator_dem_pyramid_t* p,
+                               size_t Nbytes,
+                               const pyramid_file_header_t* header,
+                               const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    bool result = false;
+
+    struct stat sb;
+    if(0 != fstat(fd, &sb) ||
+       sb.st_size != (off_t)(sizeof(*header) + Nbytes))
+        goto done;
+
+    pyramid_file_header_t header_file;
+    if(sizeof(header_file) != read(fd, &header_file, sizeof(header_file)) ||
+       0 != memcmp(&header_file, header, sizeof(header_file)))
+        goto done;
+
+    for(size_t Nread = 0; Nread < Nbytes; )
+    {
+        ssize_t n = read(fd, &((char*)p->data)[Nread], Nbytes - Nread);
+        if(n <= 0)
+            goto done;
+        Nread += n;
+    }
+    result = true;
+
+ done:
+    close(fd);
+    return result;
+}
+
+// I write to a temporary file, and then rename it, so a concurrent reader never
+// sees a partial file
+bool horizonator_dem_cache_write(const char* filename,
+                                 const char* cachedir,
+                                 const void* header, size_t header_size,
+                                 const void* data,   size_t Nbytes)
+{
+    char dir[1024];
+    char filename_tmp[1024];
+    if( !expand_home_dir(dir, sizeof(dir), cachedir) ||
+        !mkdir_parents(dir) ||
+        snprintf(filename_tmp, sizeof(filename_tmp), "%s.%d.tmp",
+                 filename, (int)getpid()) >= (int)sizeof(filename_tmp) )
+        return false;
+
+    int fd = open(filename_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return false;
+
+    bool result = (ssize_t)header_size == write(fd, header, header_size);
+    for(size_t Nwritten = 0; result && Nwritten < Nbytes; )
+    {
+        ssize_t n = write(fd, &((const char*)data)[Nwritten], Nbytes - Nwritten);
+        if(n <= 0)
+            result = false;
+        else
+            Nwritten += n;
+    }
+
+    if(0 != close(fd))
+        result = false;
+    if(result && 0 != rename(filename_tmp, filename))
+        result = false;
+    if(!result)
+        unlink(filename_tmp);
+    return result;
+}
+
+bool horizonator_dem_pyramid_init( horizonator_dem_context_t* ctx,
+                                   const char* cachedir )
+{
+    horizonator_dem_pyramid_t* p = &ctx->pyramid;
+    if(p->data != NULL)
+        return true;
+
+    const int W = horizonator_dem_mosaic_width(ctx);
+    if(W < 2)
+    {
+        MSG("The DEM mosaic is too small to build a pyramid");
+        return false;
+    }
+
+    size_t N = pyramid_layout(p, W);
+    if(N == 0)
+    {
+        MSG("The DEM mosaic is too large. Increase the compile-time-constant HORIZONATOR_DEM_PYRAMID_MAX_LEVELS from the current value of %d",
+            HORIZONATOR_DEM_PYRAMID_MAX_LEVELS);
+        *p = (horizonator_dem_pyramid_t){};
+        return false;
+    }
+    const size_t Nbytes = N*sizeof(int16_t);
+
+    p->data = malloc(Nbytes);
+    if(p->data == NULL)
+    {
+        MSG("Couldn't allocate the %zu-byte DEM pyramid", Nbytes);
+        *p = (horizonator_dem_pyramid_t){};
+        return false;
+    }
+    pyramid_set_levels(p);
+
+    if(cachedir == NULL)
+    {
+        pyramid_build(p, ctx);
+        return true;
+    }
+
+    char filename[1024];
+    if( !horizonator_dem_cache_filename(filename, sizeof(filename), ctx, cachedir, "pyramid") )
+    {
+        MSG("Warning: couldn't construct the pyramid cache filename. Not caching");
+        pyramid_build(p, ctx);
+        return true;
+    }
+
+    pyramid_file_header_t header;
+    pyramid_header(&header, ctx);
+
+    if( pyramid_read_cache(p, Nbytes, &header, filename) )
+        return true;
+
+    pyramid_build(p, ctx);
+    if( !horizonator_dem_cache_write(filename, cachedir,
+                                     &header, sizeof(header),
+                                     p->data, Nbytes) )
+        MSG("Warning: couldn't write the pyramid cache file '%s'", filename);
+    return true;
+}
+
+
+void horizonator_dem_bounds(// output
+                            int16_t* zmin, int16_t* zmax,
+
+                            // input
+                            const horizonator_dem_context_t* ctx,
+                            int i0, int j0,
+                            int i1, int j1)
+{
+    int16_t lo = INT16_MAX, hi = INT16_MIN;
+
+    // The bounds of the blocks of the pack contain the window. If they're
+    // equal, the whole window is flat (the sea, for instance), and I don't need
+    // to read it. Otherwise they're usually too loose to use: the occlusion
+    // culling of the render needs the exact bounds
+    if(ctx->pack.map != NULL)
+    {
+        horizonator_dem_pack_bounds(&lo, &hi, &ctx->pack,
+                                    ctx->pack_origin[0] + i0, ctx->pack_origin[1] + j0,
+                                    ctx->pack_origin[0] + i1, ctx->pack_origin[1] + j1);
+        if(lo == hi)
+        {
+            *zmin = lo;
+            *zmax = hi;
+            return;
+        }
+        lo = INT16_MAX;
+        hi = INT16_MIN;
+    }
+
+    for(int j=j0; j<=j1; j++)
+        for(int i=i0; i<=i1; i++)
+        {
+            int16_t z = horizonator_dem_mosaic_at(ctx, i, j);
+            if(lo > z) lo = z;
+            if(hi < z) hi = z;
+        }
+    *zmin = lo;
+    *zmax = hi;
+}
 
 // Reports the lat/lon of the first and last cells. These are INCLUSIVE
 void horizonator_dem_bounds_latlon_deg(const horizonator_dem_context_t* ctx,
@@ -268,15 +1568,15 @@ void horizonator_dem_bounds_latlon_deg(const horizonator_dem_context_t* ctx,
 {
     *lon0 =
         (float)ctx->origin_dem_lon_lat[0] +
-        (float)ctx->origin_dem_cellij[0] / (float)CELLS_PER_DEG;
+        (float)ctx->origin_dem_cellij[0] / (float)ctx->cells_per_deg;
     *lat0 =
         (float)ctx->origin_dem_lon_lat[1] +
-        (float)ctx->origin_dem_cellij[1] / (float)CELLS_PER_DEG;
+        (float)ctx->origin_dem_cellij[1] / (float)ctx->cells_per_deg;
 
     *lon1 =
         (float)ctx->origin_dem_lon_lat[0] +
-        ((float)ctx->origin_dem_cellij[0] + 2*ctx->radius_cells-1) / (float)CELLS_PER_DEG;
+        ((float)ctx->origin_dem_cellij[0] + 2*ctx->radius_cells-1) / (float)ctx->cells_per_deg;
     *lat1 =
         (float)ctx->origin_dem_lon_lat[1] +
-        ((float)ctx->origin_dem_cellij[1] + 2*ctx->radius_cells-1) / (float)CELLS_PER_DEG;
+        ((float)ctx->origin_dem_cellij[1] + 2*ctx->radius_cells-1) / (float)ctx->cells_per_deg;
 }
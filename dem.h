@@ -2,21 +2,91 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 
-// Each SRTM file is a grid of 1201x1201 samples; last row/col overlap in neighboring DEMs
-#define WDEM          1201
-#define CELLS_PER_DEG (WDEM - 1) /* -1 because of the overlapping DEM edges */
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#endif
+
+#include "dempack.h"
+
+// Each SRTM file covers one degree: a grid of (cells_per_deg+1)^2 samples. The
+// last row/col overlap in neighboring DEMs. The resolution is a property of the
+// dataset: all the DEMs in one directory (or pack) have the same one. These are
+// the common ones
+#define HORIZONATOR_CELLS_PER_DEG_SRTM3 1200 /* 3 arc-seconds: 1201x1201 samples */
+#define HORIZONATOR_CELLS_PER_DEG_SRTM1 3600 /* 1 arc-second:  3601x3601 samples */
 
 
 // at most I allow a grid of this many DEMs. I can malloc the exact number, but
 // this is easier
 #define max_Ndems_ij 4
 
+// The pyramid can have at most this many levels. Level L has
+// ceil((2*radius_cells-1) / 2^L) nodes per side, so this is plenty
+#define HORIZONATOR_DEM_PYRAMID_MAX_LEVELS 20
+
+// Where the pyramids are cached by default
+#define HORIZONATOR_DEM_PYRAMID_CACHEDIR "~/.horizonator/pyramids"
+
+// A max-elevation pyramid over the mosaic. Node (i,j) of level 0 is the
+// highest of the 4 samples at the corners of the mosaic cell (i,j)-(i+1,j+1),
+// so nothing in that cell is higher. Each node of level L+1 is the highest of
+// the 2x2 nodes of level L under it. The top level is a single node: the
+// highest point of the whole mosaic. Each level is stored row-major, SW corner
+// first
 typedef struct
 {
-    unsigned char* dems      [max_Ndems_ij][max_Ndems_ij];
-    size_t         mmap_sizes[max_Ndems_ij][max_Ndems_ij];
-    int            mmap_fd   [max_Ndems_ij][max_Ndems_ij];
+    // All the levels, in one allocation, finest first. NULL if the pyramid
+    // hasn't been built
+    int16_t* data;
+
+    int16_t* levels[HORIZONATOR_DEM_PYRAMID_MAX_LEVELS];
+    int      widths[HORIZONATOR_DEM_PYRAMID_MAX_LEVELS];
+    int      Nlevels;
+} horizonator_dem_pyramid_t;
+
+// How the samples of the mosaic are laid out in memory. The CPU consumers of
+// the mosaic (viewshed, raycast, LOS, ...) walk it radially, in every
+// direction. Row-major storage is good only for walks along the rows: a walk
+// along a column touches a new cache line, and a new page, at every step.
+//
+// HORIZONATOR_DEM_LAYOUT_TILED splits the mosaic into square tiles of
+// HORIZONATOR_DEM_TILE_CELLS x HORIZONATOR_DEM_TILE_CELLS samples (8kB),
+// stored one after another, row-major. The samples in each tile are in Morton
+// (Z) order: every aligned 8x4 block of samples is one 64-byte cache line, and
+// nearby samples in any direction are nearby in memory. The mosaic is padded
+// to whole tiles. This is the default.
+//
+// HORIZONATOR_DEM_LAYOUT_ROWMAJOR is the plain row-major grid
+typedef enum { HORIZONATOR_DEM_LAYOUT_TILED,
+               HORIZONATOR_DEM_LAYOUT_ROWMAJOR } horizonator_dem_layout_t;
+
+#define HORIZONATOR_DEM_TILE_BITS  6
+#define HORIZONATOR_DEM_TILE_CELLS (1 << HORIZONATOR_DEM_TILE_BITS)
+
+// The layout of the mosaics made by later calls to horizonator_dem_init(). If
+// huge_pages, large mosaics are allocated on 2MB boundaries, and the kernel is
+// asked to back them with transparent huge pages: a radial walk then needs far
+// fewer TLB entries. This is a process-wide setting, meant to be set once, at
+// startup
+void horizonator_dem_set_layout(horizonator_dem_layout_t layout,
+                                bool huge_pages);
+const char* horizonator_dem_layout_name(horizonator_dem_layout_t layout);
+
+typedef struct
+{
+    // The decoded elevations of the whole render area, in meters. This is a
+    // dense (2*radius_cells) x (2*radius_cells) grid, with the SW corner at
+    // (0,0): i (the column) increases towards the East, and j (the row)
+    // increases towards the North. It is stored in the given layout, so it
+    // should be read with horizonator_dem_mosaic_at() only. The source DEMs
+    // are decoded into this once, in horizonator_dem_init(), and are not kept
+    // around. Voids (negative values) and missing DEMs read as 0
+    int16_t*       mosaic;
+    horizonator_dem_layout_t layout;
+    // With HORIZONATOR_DEM_LAYOUT_TILED: how many tiles in each row
+    int            tiles_per_row;
 
     // Which DEM contains the SW corner of the render data
     int            origin_dem_lon_lat[2];
@@ -27,8 +97,28 @@ typedef struct
     // How many DEMs, in each direction
     int            Ndems_ij          [2];
 
+    // The resolution of the dataset. A mosaic cell is 1/cells_per_deg degrees
+    // on each side
+    int            cells_per_deg;
+
     // Copy of RENDER_RADIUS
     int radius_cells;
+
+    // Identifies the dataset the mosaic came from: a hash of the (expanded)
+    // datadir path, and of the size and mtime of the pack, the GeoTIFF or each
+    // .hgt file that was read. Part of the key of the on-disk caches
+    uint64_t source_id;
+
+    // Built on request, by horizonator_dem_pyramid_init()
+    horizonator_dem_pyramid_t pyramid;
+
+    // If the mosaic came from a DEM pack: the pack, still mapped, for the
+    // bounds of its blocks and its max levels, and the sample of the pack at
+    // the SW corner of the mosaic. pack.map is NULL otherwise. Nothing reads
+    // the samples of the pack after horizonator_dem_init(), so this may be
+    // used from several threads at once
+    horizonator_dem_pack_t pack;
+    int                    pack_origin[2];
 } horizonator_dem_context_t;
 
 
@@ -43,6 +133,14 @@ typedef struct
 // The grid starts at the SW corner. DEM tiles are named from the SW point
 //
 // The viewer sits between cell radius_cells-1 and radius_cells
+//
+// datadir is a directory of SRTM .hgt files, a DEM pack file made by
+// horizonator_dem_pack_write(), or a GeoTIFF (see demgeotiff.h). From a pack
+// or a GeoTIFF we read only the blocks under the render area, and the limit of
+// max_Ndems_ij doesn't apply. The resolution of the data comes from
+// horizonator_dem_cells_per_deg(). radius_cells is in the cells of that
+// resolution: a 1-arc-second dataset needs 3 times the radius to cover the
+// same area as a 3-arc-second one
 bool horizonator_dem_init(// output
               horizonator_dem_context_t* ctx,
 
@@ -56,13 +154,260 @@ bool horizonator_dem_init(// output
 
 void horizonator_dem_deinit( horizonator_dem_context_t* ctx );
 
-// Given coordinates index cells, in respect to the origin cell
+// The resolution of the DEMs in datadir: a directory of .hgt files, a DEM
+// pack or a GeoTIFF. For a directory, this comes from the size of the first
+// non-empty .hgt file in it. If there are none (everything is in the sea),
+// this is HORIZONATOR_CELLS_PER_DEG_SRTM3. Returns 0 on error
+int horizonator_dem_cells_per_deg(const char* datadir);
+
+// Decodes a window of one SRTM DEM file: columns [i0,i1) and rows [j0,j1),
+// counted from the SW corner of the DEM. The DEM whose SW corner is at
+// demfileN,demfileE is read from datadir. It must have the given resolution.
+// Row j is written to out[(j-j0)*stride]. Voids (negative values) read as 0. A
+// missing or empty DEM file is assumed to be in the sea: the window reads as
+// 0. The decoded DEM goes through the tile cache described below. Returns
+// false on error
+bool horizonator_dem_hgt_read(// output
+                              int16_t* out,
+                              int stride,
+
+                              // input
+                              int cells_per_deg,
+                              int demfileN, int demfileE,
+                              int i0, int i1,
+                              int j0, int j1,
+                              const char* datadir);
+
+// The .hgt files are decoded in full, and the decoded tiles are kept in a
+// cache, shared by all the contexts in the process: a long-running process that
+// creates many contexts over the same area decodes each tile once. The cache is
+// thread-safe, and is bounded by size: the least-recently-used tiles are
+// evicted first. The tiles are keyed by their file: the dataset directory and
+// the tile's lat,lon. A tile whose file has changed since it was decoded is
+// thrown out, and decoded again. DEM packs don't go through this cache: they
+// are mmap-ed, and shared through the page cache
+#define HORIZONATOR_DEM_TILE_CACHE_MAX_BYTES_DEFAULT ((size_t)256 << 20)
+
+typedef struct
+{
+    // Lookups that found the tile, and that didn't
+    uint64_t hits, misses;
+    // Tiles thrown out to make room, and tiles thrown out because their file
+    // changed
+    uint64_t evictions, stale;
+
+    // The current size of the cache, and its limit
+    size_t   bytes, max_bytes;
+    int      Ntiles;
+} horizonator_dem_tile_cache_stats_t;
+
+// Sets the limit on the memory used by the cache. Tiles are evicted right away,
+// if needed, to stay under the new limit. 0 turns off the cache: each
+// horizonator_dem_hgt_read() then decodes only the window it needs, straight
+// from the file
+void horizonator_dem_tile_cache_set_max_bytes(size_t max_bytes);
+
+// Reports the statistics of the cache. The counters accumulate since the
+// start of the process, or the last reset
+void horizonator_dem_tile_cache_get_stats(horizonator_dem_tile_cache_stats_t* stats);
+void horizonator_dem_tile_cache_reset_stats(void);
+
+// Given coordinates index cells, in respect to the origin cell. Returns -1 for
+// cells outside the mosaic
 int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
                    // Positive = towards East
                    int i,
                    // Positive = towards North
                    int j);
 
+// Width (and height) of the mosaic, in cells
+static inline int horizonator_dem_mosaic_width(const horizonator_dem_context_t* ctx)
+{
+    return 2*ctx->radius_cells;
+}
+
+// Bits 0..5 of x, moved to the even bits 0,2,..10. Interleaving the bits of
+// i and j like this produces the Morton order
+extern const uint16_t horizonator_dem_morton_spread[HORIZONATOR_DEM_TILE_CELLS];
+
+// Where sample (i,j) lives in ctx->mosaic
+static inline size_t horizonator_dem_mosaic_index(const horizonator_dem_context_t* ctx,
+                                                  int i, int j)
+{
+    if(ctx->layout == HORIZONATOR_DEM_LAYOUT_ROWMAJOR)
+        return (size_t)j*(size_t)(2*ctx->radius_cells) + (size_t)i;
+
+    const int    mask = HORIZONATOR_DEM_TILE_CELLS-1;
+    const size_t tile =
+        (size_t)(j >> HORIZONATOR_DEM_TILE_BITS) * (size_t)ctx->tiles_per_row +
+        (size_t)(i >> HORIZONATOR_DEM_TILE_BITS);
+    return
+        (tile << (2*HORIZONATOR_DEM_TILE_BITS)) |
+        (size_t)horizonator_dem_morton_spread[i & mask] |
+        ((size_t)horizonator_dem_morton_spread[j & mask] << 1);
+}
+
+// Unchecked horizonator_dem_sample(), for inner loops. The caller makes sure
+// that 0 <= i,j < horizonator_dem_mosaic_width()
+static inline int16_t horizonator_dem_mosaic_at(const horizonator_dem_context_t* ctx,
+                                                int i, int j)
+{
+    return ctx->mosaic[horizonator_dem_mosaic_index(ctx, i, j)];
+}
+
+#if defined __x86_64__ || defined __i386__
+// horizonator_dem_morton_spread[], for 8 values at a time: with shifts and
+// masks instead of the table
+__attribute__((target("avx2")))
+static inline __m256i horizonator_dem_morton_spread_avx2(__m256i x)
+{
+    x = _mm256_and_si256(x, _mm256_set1_epi32(HORIZONATOR_DEM_TILE_CELLS-1));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0F0F));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x3333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x5555));
+    return x;
+}
+
+// horizonator_dem_mosaic_index() of the tiled layout, for 8 points at a time
+__attribute__((target("avx2")))
+static inline __m256i horizonator_dem_mosaic_index_tiled_avx2(__m256i i, __m256i j,
+                                                              __m256i tiles_per_row)
+{
+    __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(j, HORIZONATOR_DEM_TILE_BITS),
+                                                       tiles_per_row),
+                                    _mm256_srli_epi32(i, HORIZONATOR_DEM_TILE_BITS));
+    return _mm256_or_si256(_mm256_slli_epi32(tile, 2*HORIZONATOR_DEM_TILE_BITS),
+                           _mm256_or_si256(horizonator_dem_morton_spread_avx2(i),
+                                           _mm256_slli_epi32(horizonator_dem_morton_spread_avx2(j), 1)));
+}
+
+// The samples at the 4 corners of the cells (i,j)-(i+1,j+1), for 8 cells at a
+// time, for inner loops in AVX2 code. The caller makes sure that
+// 0 <= i,j <= horizonator_dem_mosaic_width()-2.
+//
+// There is no 16-bit gather, so I gather 32 bits at a time. In the row-major
+// layout, each gather reads the samples at i and i+1 together. That's 2
+// gathers per cell instead of 4, and since i <= W-2, it never reads past the
+// end of a row. In the tiled layout, i and i+1 aren't always adjacent, so each
+// sample is gathered separately, and the high half is thrown away. The mosaic
+// is padded, so this doesn't read past its end
+__attribute__((target("avx2"), always_inline))
+static inline void horizonator_dem_cell_corners_avx2(// output
+                                                     __m256* z00, __m256* z10,
+                                                     __m256* z01, __m256* z11,
+
+                                                     // input
+                                                     const horizonator_dem_context_t* ctx,
+                                                     __m256i i, __m256i j)
+{
+    const int* mosaic = (const int*)ctx->mosaic;
+
+    // The index of the int16 sample. With scale=2, the gathers read 32 bits
+    // starting at that sample. Little-endian: the sample at the index is in
+    // the low half
+    if(ctx->layout == HORIZONATOR_DEM_LAYOUT_TILED)
+    {
+        const __m256i tiles_per_row = _mm256_set1_epi32(ctx->tiles_per_row);
+        const __m256i one           = _mm256_set1_epi32(1);
+
+        __m256i i1  = _mm256_add_epi32(i, one);
+        __m256i j1  = _mm256_add_epi32(j, one);
+        __m256i g00 = _mm256_i32gather_epi32(mosaic, horizonator_dem_mosaic_index_tiled_avx2(i,  j,  tiles_per_row), 2);
+        __m256i g10 = _mm256_i32gather_epi32(mosaic, horizonator_dem_mosaic_index_tiled_avx2(i1, j,  tiles_per_row), 2);
+        __m256i g01 = _mm256_i32gather_epi32(mosaic, horizonator_dem_mosaic_index_tiled_avx2(i,  j1, tiles_per_row), 2);
+        __m256i g11 = _mm256_i32gather_epi32(mosaic, horizonator_dem_mosaic_index_tiled_avx2(i1, j1, tiles_per_row), 2);
+        *z00 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g00, 16), 16));
+        *z10 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g10, 16), 16));
+        *z01 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g01, 16), 16));
+        *z11 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g11, 16), 16));
+    }
+    else
+    {
+        const __m256i stride = _mm256_set1_epi32(horizonator_dem_mosaic_width(ctx));
+
+        // The high half is the sample at i+1
+        __m256i idx0 = _mm256_add_epi32(_mm256_mullo_epi32(j, stride), i);
+        __m256i idx1 = _mm256_add_epi32(idx0, stride);
+        __m256i g0   = _mm256_i32gather_epi32(mosaic, idx0, 2);
+        __m256i g1   = _mm256_i32gather_epi32(mosaic, idx1, 2);
+        *z00 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g0, 16), 16));
+        *z10 = _mm256_cvtepi32_ps(_mm256_srai_epi32(g0, 16));
+        *z01 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g1, 16), 16));
+        *z11 = _mm256_cvtepi32_ps(_mm256_srai_epi32(g1, 16));
+    }
+}
+#endif
+
+// Bilinearly-interpolated elevation at each of N points, given in degrees.
+// Points outside the mosaic get NAN. On CPUs that support AVX2, 8 points are
+// done at a time, with gathers from the mosaic
+void horizonator_dem_interp_many(// output
+                                 float* z,
+
+                                 // input
+                                 const horizonator_dem_context_t* ctx,
+                                 const float* lat, const float* lon,
+                                 int N);
+
+// horizonator_dem_interp_many(), with the points given in the cells of the
+// mosaic instead: x increasing to the East, y to the North, with (0,0) at the
+// SW sample. For callers that walk the mosaic in its own coordinates
+void horizonator_dem_interp_cells_many(// output
+                                       float* z,
+
+                                       // input
+                                       const horizonator_dem_context_t* ctx,
+                                       const float* x, const float* y,
+                                       int N);
+
+// Builds the max-elevation pyramid of the mosaic, for horizonator_raycast().
+// Does nothing if it has already been built.
+//
+// If the mosaic came from a DEM pack, the levels whose nodes line up with the
+// max levels of the pack are copied from the pack, except at the N and E edges
+// of the mosaic and the pack. Level L lines up if the SW corner of the mosaic
+// is at a multiple of 2^L samples in the pack. The other levels are built from
+// the mosaic.
+//
+// If cachedir is not NULL, the pyramid is cached in a file in that directory
+// (HORIZONATOR_DEM_PYRAMID_CACHEDIR is a good choice). A pyramid of the same
+// region, cached earlier, is read instead of being rebuilt. The cache files
+// are keyed on the dataset (including the size and mtime of its files), and
+// the location and size of the mosaic, so a file built from different DEMs is
+// never used. A failure to read or write the cache is not an error: we just
+// build the pyramid in memory
+bool horizonator_dem_pyramid_init( horizonator_dem_context_t* ctx,
+                                   const char* cachedir );
+
+// The lowest and highest samples in [i0,i1] x [j0,j1] of the mosaic. If the
+// mosaic came from a DEM pack, and the bounds of the blocks of the pack that
+// overlap the window say it's flat, the mosaic isn't read. The window must be
+// inside the mosaic
+void horizonator_dem_bounds(// output
+                            int16_t* zmin, int16_t* zmax,
+
+                            // input
+                            const horizonator_dem_context_t* ctx,
+                            int i0, int j0,
+                            int i1, int j1);
+
+// Helpers for the files that cache data derived from the mosaic, such as the
+// pyramid. These are keyed on the dataset (source_id), and the location and
+// size of the mosaic: the cache file for the given kind of data is written
+// into path[]. horizonator_dem_cache_write() writes a file: a header and the
+// data, creating cachedir if needed. The write is atomic
+bool horizonator_dem_cache_filename(// output
+                                    char* path, int bufsize,
+
+                                    // input
+                                    const horizonator_dem_context_t* ctx,
+                                    const char* cachedir,
+                                    const char* kind);
+bool horizonator_dem_cache_write(const char* filename,
+                                 const char* cachedir,
+                                 const void* header, size_t header_size,
+                                 const void* data,   size_t Nbytes);
+
 void horizonator_dem_bounds_latlon_deg(const horizonator_dem_context_t* ctx,
                                        float* lat0, float* lon0,
                                        float* lat1, float* lon1);
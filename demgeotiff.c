@@ -0,0 +1,874 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "demgeotiff.h"
+#include "util.h"
+
+// The TIFF tags and GeoTIFF keys I look at
+#define TAG_IMAGE_WIDTH        256
+#define TAG_IMAGE_LENGTH       257
+#define TAG_BITS_PER_SAMPLE    258
+#define TAG_COMPRESSION        259
+#define TAG_STRIP_OFFSETS      273
+#define TAG_SAMPLES_PER_PIXEL  277
+#define TAG_ROWS_PER_STRIP     278
+#define TAG_STRIP_BYTE_COUNTS  279
+#define TAG_PREDICTOR          317
+#define TAG_TILE_WIDTH         322
+#define TAG_TILE_LENGTH        323
+#define TAG_TILE_OFFSETS       324
+#define TAG_TILE_BYTE_COUNTS   325
+#define TAG_SAMPLE_FORMAT      339
+#define TAG_MODEL_PIXEL_SCALE  33550
+#define TAG_MODEL_TIEPOINT     33922
+#define TAG_MODEL_TRANSFORM    34264
+#define TAG_GEO_KEY_DIRECTORY  34735
+#define TAG_GDAL_NODATA        42113
+
+#define KEY_MODEL_TYPE         1024
+#define KEY_RASTER_TYPE        1025
+#define MODEL_TYPE_GEOGRAPHIC  2
+#define RASTER_PIXEL_IS_POINT  2
+
+#define COMPRESSION_NONE         1
+#define COMPRESSION_LZW          5
+#define COMPRESSION_DEFLATE      8
+#define COMPRESSION_DEFLATE_OLD  32946
+
+#define PREDICTOR_NONE           1
+#define PREDICTOR_HORIZONTAL     2
+#define PREDICTOR_FLOATING_POINT 3
+
+#define SAMPLE_FORMAT_UINT  1
+#define SAMPLE_FORMAT_INT   2
+#define SAMPLE_FORMAT_FLOAT 3
+
+// One IFD entry, with its values located in the file
+typedef struct
+{
+    int            type;
+    uint64_t       count;
+    const uint8_t* values;
+} entry_t;
+
+static uint64_t get_uint(const uint8_t* p, int Nbytes, bool big_endian)
+{
+    uint64_t x = 0;
+    for(int i=0; i<Nbytes; i++)
+        x |= (uint64_t)p[big_endian ? i : Nbytes-1-i] << (8*(Nbytes-1-i));
+    return x;
+}
+
+static int type_size(int type)
+{
+    switch(type)
+    {
+    case 1: case 2: case 6: case 7: return 1; // BYTE, ASCII, SBYTE, UNDEFINED
+    case 3: case 8:                 return 2; // SHORT, SSHORT
+    case 4: case 9: case 11:        return 4; // LONG, SLONG, FLOAT
+    case 5: case 10: case 12:       return 8; // RATIONAL, SRATIONAL, DOUBLE
+    case 16: case 17: case 18:      return 8; // LONG8, SLONG8, IFD8
+    }
+    return 0;
+}
+
+// The k-th value of an integer entry. Returns false if the entry isn't an
+// unsigned integer, or doesn't have that many values
+static bool entry_uint(uint64_t* x,
+                       const entry_t* e, uint64_t k,
+                       const horizonator_dem_geotiff_t* tiff)
+{
+    if(e->values == NULL || k >= e->count)
+        return false;
+    int size;
+    switch(e->type)
+    {
+    case 1:  size = 1; break;
+    case 3:  size = 2; break;
+    case 4:  size = 4; break;
+    case 16: size = 8; break;
+    default: return false;
+    }
+    *x = get_uint(&e->values[k*size], size, tiff->big_endian);
+    return true;
+}
+
+static bool entry_double(double* x,
+                         const entry_t* e, uint64_t k,
+                         const horizonator_dem_geotiff_t* tiff)
+{
+    if(e->values == NULL || k >= e->count || e->type != 12)
+        return false;
+    uint64_t bits = get_uint(&e->values[k*8], 8, tiff->big_endian);
+    memcpy(x, &bits, sizeof(*x));
+    return true;
+}
+
+bool horizonator_dem_is_geotiff(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(fp == NULL)
+        return false;
+    uint8_t magic[4];
+    bool result = 4 == fread(magic, 1, 4, fp) &&
+        ((magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) && magic[3] == 0) ||
+         (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43)));
+    fclose(fp);
+    return result;
+}
+
+// Reads the first IFD: the tags we care about go into entries[]. Returns false
+// if the file is malformed
+static bool read_ifd(// output
+                     entry_t* entries, const int* tags, int Ntags,
+
+                     // input
+                     const horizonator_dem_geotiff_t* tiff)
+{
+    const uint8_t* map  = (const uint8_t*)tiff->map;
+    const size_t   size = tiff->map_size;
+    const bool     be   = tiff->big_endian;
+
+    if(size < 8)
+        return false;
+    const bool bigtiff = get_uint(&map[2], 2, be) == 43;
+
+    // The sizes of the fields of the header, the IFD and its entries
+    const int size_offset = bigtiff ? 8 : 4;
+    const int size_count  = bigtiff ? 8 : 2;
+    const int size_entry  = bigtiff ? 20 : 12;
+
+    if(bigtiff && size < 16)
+        return false;
+    uint64_t ifd = get_uint(&map[bigtiff ? 8 : 4], size_offset, be);
+    if(ifd > size || (uint64_t)size_count > size - ifd)
+        return false;
+
+    uint64_t Nentries = get_uint(&map[ifd], size_count, be);
+    if(Nentries > (size - ifd - size_count) / size_entry)
+        return false;
+
+    for(uint64_t k=0; k<Nentries; k++)
+    {
+        const uint8_t* e = &map[ifd + size_count + k*size_entry];
+
+        int tag = (int)get_uint(&e[0], 2, be);
+        int t;
+        for(t=0; t<Ntags; t++)
+            if(tags[t] == tag)
+                break;
+        if(t == Ntags)
+            continue;
+
+        entries[t].type  = (int)get_uint(&e[2], 2, be);
+        entries[t].count = get_uint(&e[4], size_offset, be);
+
+        // The values are inline if they fit, or somewhere else in the file
+        const uint8_t* value = &e[4 + size_offset];
+        uint64_t Nbytes = (uint64_t)type_size(entries[t].type) * entries[t].count;
+        if(Nbytes == 0 || entries[t].count > size)
+            return false;
+        if(Nbytes <= (uint64_t)size_offset)
+            entries[t].values = value;
+        else
+        {
+            uint64_t offset = get_uint(value, size_offset, be);
+            if(offset > size || Nbytes > size - offset)
+                return false;
+            entries[t].values = &map[offset];
+        }
+    }
+    return true;
+}
+
+// Reads the georeferencing, and fills in cells_per_deg, lat0_cells and
+// lon0_cells. Returns false if it's missing, or something we can't use
+static bool read_georeferencing(horizonator_dem_geotiff_t* tiff,
+                                const entry_t* scale,
+                                const entry_t* tiepoint,
+                                const entry_t* transform,
+                                const entry_t* geokeys,
+                                const char*    filename)
+{
+    if(transform->values != NULL && (scale->values == NULL || tiepoint->values == NULL))
+    {
+        MSG("GeoTIFF '%s' is georeferenced with a ModelTransformation. Only ModelPixelScale + ModelTiepoint are supported",
+            filename);
+        return false;
+    }
+
+    double sx, sy, tie_i, tie_j, tie_lon, tie_lat;
+    if(!(entry_double(&sx,      scale,    0, tiff) &&
+         entry_double(&sy,      scale,    1, tiff) &&
+         entry_double(&tie_i,   tiepoint, 0, tiff) &&
+         entry_double(&tie_j,   tiepoint, 1, tiff) &&
+         entry_double(&tie_lon, tiepoint, 3, tiff) &&
+         entry_double(&tie_lat, tiepoint, 4, tiff)))
+    {
+        MSG("GeoTIFF '%s' has no usable ModelPixelScale and ModelTiepoint tags", filename);
+        return false;
+    }
+
+    // The GeoKeys, if any: a header of 4 shorts, and then 4 shorts per key:
+    // the id, the location, the count and the value. The keys I need have
+    // their value inline (location = 0)
+    int model_type  = MODEL_TYPE_GEOGRAPHIC;
+    int raster_type = 0;
+    uint64_t Nkeys;
+    if(entry_uint(&Nkeys, geokeys, 3, tiff))
+        for(uint64_t k=0; k<Nkeys; k++)
+        {
+            uint64_t id, location, value;
+            if(!(entry_uint(&id,       geokeys, 4 + 4*k + 0, tiff) &&
+                 entry_uint(&location, geokeys, 4 + 4*k + 1, tiff) &&
+                 entry_uint(&value,    geokeys, 4 + 4*k + 3, tiff)))
+                break;
+            if(location != 0)
+                continue;
+            if(id == KEY_MODEL_TYPE)  model_type  = (int)value;
+            if(id == KEY_RASTER_TYPE) raster_type = (int)value;
+        }
+    if(model_type != MODEL_TYPE_GEOGRAPHIC)
+    {
+        MSG("GeoTIFF '%s' is in a projected coordinate system. Only geographic (lat/lon) GeoTIFFs are supported",
+            filename);
+        return false;
+    }
+
+    // The resolution must be a whole number of cells per degree, the same in
+    // both directions
+    double cells_per_deg = 1.0 / sx;
+    tiff->cells_per_deg  = (int)round(cells_per_deg);
+    if(tiff->cells_per_deg <= 0 ||
+       fabs(cells_per_deg - (double)tiff->cells_per_deg) > 1e-6*cells_per_deg ||
+       fabs(sy - sx) > 1e-6*sx)
+    {
+        MSG("GeoTIFF '%s' has pixels of %g x %g degrees. These must be square, with a whole number of pixels per degree",
+            filename, sx, sy);
+        return false;
+    }
+
+    // The position of the center of the NW sample. With PixelIsArea (the
+    // default), the raster coordinates of that center are (0.5,0.5). With
+    // PixelIsPoint they're (0,0)
+    double center = raster_type == RASTER_PIXEL_IS_POINT ? 0.0 : 0.5;
+    double lon_cells = (tie_lon + (center - tie_i)*sx) * (double)tiff->cells_per_deg;
+    double lat_cells = (tie_lat - (center - tie_j)*sy) * (double)tiff->cells_per_deg;
+    if(fabs(lon_cells - round(lon_cells)) > 0.01 ||
+       fabs(lat_cells - round(lat_cells)) > 0.01)
+    {
+        MSG("GeoTIFF '%s' has samples that aren't on the grid of %d cells per degree",
+            filename, tiff->cells_per_deg);
+        return false;
+    }
+    tiff->lon0_cells = (int)round(lon_cells);
+    tiff->lat0_cells = (int)round(lat_cells) - (tiff->H-1);
+    return true;
+}
+
+bool horizonator_dem_geotiff_open(// output
+                                  horizonator_dem_geotiff_t* tiff,
+
+                                  // input
+                                  const char* filename)
+{
+    *tiff = (horizonator_dem_geotiff_t){};
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open GeoTIFF '%s'", filename);
+        return false;
+    }
+
+    struct stat sb;
+    if(0 != fstat(fd, &sb) || sb.st_size < 8)
+    {
+        close(fd);
+        MSG("GeoTIFF '%s' is too small", filename);
+        return false;
+    }
+
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        MSG("Couldn't mmap GeoTIFF '%s'", filename);
+        return false;
+    }
+    tiff->map        = map;
+    tiff->map_size   = sb.st_size;
+    tiff->big_endian = ((const uint8_t*)map)[0] == 'M';
+
+    const int tags[] = { TAG_IMAGE_WIDTH, TAG_IMAGE_LENGTH,
+                         TAG_BITS_PER_SAMPLE, TAG_SAMPLE_FORMAT, TAG_SAMPLES_PER_PIXEL,
+                         TAG_COMPRESSION, TAG_PREDICTOR,
+                         TAG_TILE_WIDTH, TAG_TILE_LENGTH, TAG_TILE_OFFSETS, TAG_TILE_BYTE_COUNTS,
+                         TAG_ROWS_PER_STRIP, TAG_STRIP_OFFSETS, TAG_STRIP_BYTE_COUNTS,
+                         TAG_MODEL_PIXEL_SCALE, TAG_MODEL_TIEPOINT, TAG_MODEL_TRANSFORM,
+                         TAG_GEO_KEY_DIRECTORY, TAG_GDAL_NODATA };
+    enum { E_WIDTH, E_LENGTH,
+           E_BITS, E_FORMAT, E_SAMPLES,
+           E_COMPRESSION, E_PREDICTOR,
+           E_TILE_W, E_TILE_H, E_TILE_OFFSETS, E_TILE_BYTES,
+           E_ROWS_PER_STRIP, E_STRIP_OFFSETS, E_STRIP_BYTES,
+           E_SCALE, E_TIEPOINT, E_TRANSFORM,
+           E_GEOKEYS, E_NODATA,
+           E_COUNT };
+    entry_t e[E_COUNT] = {};
+
+    if(!read_ifd(e, tags, E_COUNT, tiff))
+    {
+        MSG("'%s' is not a valid TIFF", filename);
+        goto fail;
+    }
+
+    // Optional tags have the default values of the spec
+    uint64_t W, H, bits, format = SAMPLE_FORMAT_UINT, samples = 1;
+    uint64_t compression = COMPRESSION_NONE, predictor = PREDICTOR_NONE;
+    if(!entry_uint(&W,    &e[E_WIDTH],  0, tiff) ||
+       !entry_uint(&H,    &e[E_LENGTH], 0, tiff) ||
+       !entry_uint(&bits, &e[E_BITS],   0, tiff) ||
+       (e[E_FORMAT     ].values != NULL && !entry_uint(&format,      &e[E_FORMAT],      0, tiff)) ||
+       (e[E_SAMPLES    ].values != NULL && !entry_uint(&samples,     &e[E_SAMPLES],     0, tiff)) ||
+       (e[E_COMPRESSION].values != NULL && !entry_uint(&compression, &e[E_COMPRESSION], 0, tiff)) ||
+       (e[E_PREDICTOR  ].values != NULL && !entry_uint(&predictor,   &e[E_PREDICTOR],   0, tiff)) ||
+       W == 0 || H == 0 || W > INT32_MAX || H > INT32_MAX)
+    {
+        MSG("GeoTIFF '%s' is missing its dimensions or sample description", filename);
+        goto fail;
+    }
+    tiff->W                = (int)W;
+    tiff->H                = (int)H;
+    tiff->sample_format    = (int)format;
+    tiff->bytes_per_sample = (int)bits / 8;
+    tiff->compression      = (int)compression;
+    tiff->predictor        = (int)predictor;
+
+    if(samples != 1 ||
+       !((format == SAMPLE_FORMAT_INT   && bits == 16) ||
+         (format == SAMPLE_FORMAT_UINT  && bits == 16) ||
+         (format == SAMPLE_FORMAT_FLOAT && bits == 32)))
+    {
+        MSG("GeoTIFF '%s' has %d samples of %d bits, in format %d. Only single-sample Int16, UInt16 and Float32 are supported",
+            filename, (int)samples, (int)bits, (int)format);
+        goto fail;
+    }
+    if(!(compression == COMPRESSION_NONE    ||
+         compression == COMPRESSION_LZW     ||
+         compression == COMPRESSION_DEFLATE ||
+         compression == COMPRESSION_DEFLATE_OLD) ||
+       !(predictor == PREDICTOR_NONE       ||
+         predictor == PREDICTOR_HORIZONTAL ||
+         (predictor == PREDICTOR_FLOATING_POINT && format == SAMPLE_FORMAT_FLOAT)))
+    {
+        MSG("GeoTIFF '%s' has compression %d with predictor %d. Only uncompressed, LZW and deflate data are supported",
+            filename, (int)compression, (int)predictor);
+        goto fail;
+    }
+
+    // Tiled or stripped
+    const entry_t* offsets;
+    const entry_t* bytecounts;
+    if(e[E_TILE_OFFSETS].values != NULL)
+    {
+        uint64_t tile_w, tile_h;
+        if(!entry_uint(&tile_w, &e[E_TILE_W], 0, tiff) ||
+           !entry_uint(&tile_h, &e[E_TILE_H], 0, tiff) ||
+           tile_w == 0 || tile_h == 0 || tile_w > 65536 || tile_h > 65536)
+        {
+            MSG("GeoTIFF '%s' has an invalid tile size", filename);
+            goto fail;
+        }
+        tiff->tile_w = (int)tile_w;
+        tiff->tile_h = (int)tile_h;
+        offsets      = &e[E_TILE_OFFSETS];
+        bytecounts   = &e[E_TILE_BYTES];
+    }
+    else
+    {
+        uint64_t rows = H;
+        if(e[E_ROWS_PER_STRIP].values != NULL &&
+           !entry_uint(&rows, &e[E_ROWS_PER_STRIP], 0, tiff))
+            goto fail;
+        if(rows > H) rows = H;
+        tiff->tile_w = (int)W;
+        tiff->tile_h = (int)rows;
+        offsets      = &e[E_STRIP_OFFSETS];
+        bytecounts   = &e[E_STRIP_BYTES];
+    }
+    tiff->Ntiles_i = (tiff->W + tiff->tile_w-1) / tiff->tile_w;
+    tiff->Ntiles_j = (tiff->H + tiff->tile_h-1) / tiff->tile_h;
+
+    const uint64_t Ntiles = (uint64_t)tiff->Ntiles_i * (uint64_t)tiff->Ntiles_j;
+    tiff->tile_offsets = malloc(Ntiles*sizeof(uint64_t));
+    tiff->tile_bytes   = malloc(Ntiles*sizeof(uint64_t));
+    if(tiff->tile_offsets == NULL || tiff->tile_bytes == NULL)
+    {
+        MSG("Couldn't allocate the tile tables of GeoTIFF '%s'", filename);
+        goto fail;
+    }
+    for(uint64_t k=0; k<Ntiles; k++)
+        if(!entry_uint(&tiff->tile_offsets[k], offsets,    k, tiff) ||
+           !entry_uint(&tiff->tile_bytes  [k], bytecounts, k, tiff) ||
+           tiff->tile_offsets[k] > tiff->map_size ||
+           tiff->tile_bytes  [k] > tiff->map_size - tiff->tile_offsets[k])
+        {
+            MSG("GeoTIFF '%s' has an invalid tile table", filename);
+            goto fail;
+        }
+
+    // GDAL writes the nodata value as a string
+    if(e[E_NODATA].values != NULL && e[E_NODATA].type == 2)
+    {
+        char str[64] = {};
+        memcpy(str, e[E_NODATA].values,
+               e[E_NODATA].count < sizeof(str)-1 ? e[E_NODATA].count : sizeof(str)-1);
+        char* end;
+        tiff->nodata     = strtod(str, &end);
+        tiff->has_nodata = end != str;
+    }
+
+    if(!read_georeferencing(tiff,
+                            &e[E_SCALE], &e[E_TIEPOINT], &e[E_TRANSFORM], &e[E_GEOKEYS],
+                            filename))
+        goto fail;
+
+    return true;
+
+ fail:
+    horizonator_dem_geotiff_close(tiff);
+    return false;
+}
+
+void horizonator_dem_geotiff_close(horizonator_dem_geotiff_t* tiff)
+{
+    if(tiff->map != NULL)
+        munmap(tiff->map, tiff->map_size);
+    free(tiff->tile_offsets);
+    free(tiff->tile_bytes);
+    *tiff = (horizonator_dem_geotiff_t){};
+}
+
+// TIFF LZW: codes of 9 to 12 bits, MSB-first, with the code width growing one
+// code early. Code 256 clears the table, and 257 ends the data. Returns false
+// unless exactly Nout bytes were decoded
+static bool lzw_decode(// output
+                       uint8_t* out, size_t Nout,
+
+                       // input
+                       const uint8_t* in, size_t Nin)
+{
+    enum { CLEAR = 256, EOI = 257, MAX_CODES = 4096 };
+
+    // Each code is an earlier code + one byte
+    uint16_t prefix[MAX_CODES];
+    uint8_t  suffix[MAX_CODES];
+    uint8_t  first [MAX_CODES];
+    uint16_t length[MAX_CODES];
+    for(int c=0; c<256; c++)
+    {
+        suffix[c] = first[c] = (uint8_t)c;
+        length[c] = 1;
+    }
+
+    size_t   o     = 0;
+    size_t   ip    = 0;
+    uint32_t bits  = 0;
+    int      Nbits = 0;
+    int      width = 9;
+    int      next  = EOI+1;
+    int      old   = -1;
+
+    // Writes out the string of the given code, truncated to fit
+    void emit(int code)
+    {
+        size_t len = length[code];
+        size_t end = o + len;
+        for(size_t p = end; p-- > o; code = prefix[code])
+            if(p < Nout)
+                out[p] = suffix[code];
+        o = end < Nout ? end : Nout;
+    }
+
+    while(o < Nout)
+    {
+        while(Nbits < width && ip < Nin)
+        {
+            bits   = (bits << 8) | in[ip++];
+            Nbits += 8;
+        }
+        if(Nbits < width)
+            break;
+        int code = (int)(bits >> (Nbits - width)) & ((1 << width) - 1);
+        Nbits -= width;
+
+        if(code == EOI)
+            break;
+        if(code == CLEAR)
+        {
+            width = 9;
+            next  = EOI+1;
+            old   = -1;
+            continue;
+        }
+
+        if(old < 0)
+        {
+            if(code >= 256)
+                return false;
+            emit(code);
+            old = code;
+            continue;
+        }
+
+        uint8_t c;
+        if(code < next)
+        {
+            c = first[code];
+            emit(code);
+        }
+        else if(code == next)
+        {
+            // The string being defined right now: old + its first byte
+            c = first[old];
+            emit(old);
+            if(o < Nout) out[o++] = c;
+        }
+        else
+            return false;
+
+        if(next < MAX_CODES)
+        {
+            prefix[next] = (uint16_t)old;
+            suffix[next] = c;
+            first [next] = first[old];
+            length[next] = length[old] + 1;
+            next++;
+            if(next == (1 << width) - 1 && width < 12)
+                width++;
+        }
+        old = code;
+    }
+    return o == Nout;
+}
+
+static bool inflate_decode(// output
+                           uint8_t* out, size_t Nout,
+
+                           // input
+                           const uint8_t* in, size_t Nin)
+{
+    z_stream z = { .next_in   = (Bytef*)in,
+                   .avail_in  = (uInt)Nin,
+                   .next_out  = out,
+                   .avail_out = (uInt)Nout };
+    if(Z_OK != inflateInit(&z))
+        return false;
+    int status = inflate(&z, Z_FINISH);
+    bool result =
+        (status == Z_STREAM_END || status == Z_OK || status == Z_BUF_ERROR) &&
+        z.avail_out == 0;
+    inflateEnd(&z);
+    return result;
+}
+
+// Converts one decoded sample (in the native byte order) to an elevation
+static int16_t elevation(const horizonator_dem_geotiff_t* tiff, const uint8_t* p)
+{
+    double z;
+    switch(tiff->sample_format)
+    {
+    case SAMPLE_FORMAT_INT:  { int16_t  x; memcpy(&x, p, 2); z = x; break; }
+    case SAMPLE_FORMAT_UINT: { uint16_t x; memcpy(&x, p, 2); z = x; break; }
+    default:                 { float    x; memcpy(&x, p, 4); z = x; break; }
+    }
+    if(!(z > 0.0) || (tiff->has_nodata && z == tiff->nodata))
+        return 0;
+    return z >= 32767. ? 32767 : (int16_t)lround(z);
+}
+
+// Per-thread buffers
+typedef struct
+{
+    uint8_t* tile;
+    uint8_t* row;
+} worker_scratch_t;
+
+// Decodes the first Nrows rows of tile k into scratch->tile, as rows of tile_w
+// samples in the native byte order
+static bool decode_tile(const horizonator_dem_geotiff_t* tiff,
+                        worker_scratch_t* scratch,
+                        uint64_t k, int Nrows)
+{
+    const int     bps    = tiff->bytes_per_sample;
+    const size_t  Nrow   = (size_t)tiff->tile_w * (size_t)bps;
+    const size_t  Nout   = Nrow * (size_t)Nrows;
+    const uint8_t* in    = &((const uint8_t*)tiff->map)[tiff->tile_offsets[k]];
+    const size_t  Nin    = tiff->tile_bytes[k];
+    uint8_t*      tile   = scratch->tile;
+
+    switch(tiff->compression)
+    {
+    case COMPRESSION_NONE:
+        if(Nin < Nout)
+            return false;
+        memcpy(tile, in, Nout);
+        break;
+    case COMPRESSION_LZW:
+        if(!lzw_decode(tile, Nout, in, Nin))
+            return false;
+        break;
+    default:
+        if(!inflate_decode(tile, Nout, in, Nin))
+            return false;
+        break;
+    }
+
+    const bool swap =
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        !tiff->big_endian;
+#else
+        tiff->big_endian;
+#endif
+
+    if(tiff->predictor == PREDICTOR_FLOATING_POINT)
+    {
+        // Each row is stored as bps planes of bytes, most significant first,
+        // and these are differenced as one sequence of bytes. This doesn't
+        // depend on the byte order of the file
+        for(int r=0; r<Nrows; r++)
+        {
+            uint8_t* row = &tile[r*Nrow];
+            for(size_t b=1; b<Nrow; b++)
+                row[b] += row[b-1];
+
+            for(int i=0; i<tiff->tile_w; i++)
+                for(int b=0; b<bps; b++)
+                {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    scratch->row[i*bps + b]         = row[b*tiff->tile_w + i];
+#else
+                    scratch->row[i*bps + bps-1 - b] = row[b*tiff->tile_w + i];
+#endif
+                }
+            memcpy(row, scratch->row, Nrow);
+        }
+        return true;
+    }
+
+    if(swap)
+        for(size_t p=0; p<Nout; p+=bps)
+            for(int b=0; b<bps/2; b++)
+            {
+                uint8_t t          = tile[p+b];
+                tile[p+b]          = tile[p+bps-1-b];
+                tile[p+bps-1-b]    = t;
+            }
+
+    if(tiff->predictor == PREDICTOR_HORIZONTAL)
+        for(int r=0; r<Nrows; r++)
+        {
+            uint8_t* row = &tile[r*Nrow];
+            if(bps == 2)
+            {
+                uint16_t* x = (uint16_t*)row;
+                for(int i=1; i<tiff->tile_w; i++)
+                    x[i] = (uint16_t)(x[i] + x[i-1]);
+            }
+            else
+            {
+                uint32_t* x = (uint32_t*)row;
+                for(int i=1; i<tiff->tile_w; i++)
+                    x[i] += x[i-1];
+            }
+        }
+    return true;
+}
+
+// The state shared by the workers of horizonator_dem_geotiff_read()
+typedef struct
+{
+    const horizonator_dem_geotiff_t* tiff;
+    int16_t* out;
+    int      stride;
+    int      i0, j0;
+
+    // The window, in the columns and rows of the file, and the tiles it
+    // touches
+    int      c0, c1, r0, r1;
+    int      ti0, tj0, Ntasks_i, Ntasks;
+
+    int      next_task;
+    bool     failed;
+} read_shared_t;
+
+typedef struct
+{
+    read_shared_t*   shared;
+    worker_scratch_t scratch;
+} read_worker_t;
+
+// Each worker takes the next tile that isn't taken yet, until they're all
+// done. Each tile covers its own part of out[], so the workers don't interfere
+static void* read_worker(void* cookie)
+{
+    read_worker_t*    worker  = (read_worker_t*)cookie;
+    read_shared_t*    s       = worker->shared;
+    worker_scratch_t* scratch = &worker->scratch;
+
+    while(!__atomic_load_n(&s->failed, __ATOMIC_RELAXED))
+    {
+        int task = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED);
+        if(task >= s->Ntasks)
+            break;
+
+        int      ti = s->ti0 + task % s->Ntasks_i;
+        int      tj = s->tj0 + task / s->Ntasks_i;
+        uint64_t k  = (uint64_t)tj * (uint64_t)s->tiff->Ntiles_i + (uint64_t)ti;
+
+        // The last row of tiles may extend past the S edge. I don't
+        // decode the rest: that part of a tile is padding, and the last
+        // strip of a stripped file doesn't have it at all
+        int Nrows = s->tiff->tile_h;
+        if((tj+1)*s->tiff->tile_h > s->tiff->H)
+            Nrows = s->tiff->H - tj*s->tiff->tile_h;
+
+        // The part of the window in this tile
+        int tc0 = ti*s->tiff->tile_w, tc1 = tc0 + s->tiff->tile_w;
+        int tr0 = tj*s->tiff->tile_h, tr1 = tr0 + Nrows;
+        if(tc0 < s->c0) tc0 = s->c0;
+        if(tr0 < s->r0) tr0 = s->r0;
+        if(tc1 > s->c1) tc1 = s->c1;
+        if(tr1 > s->r1) tr1 = s->r1;
+
+        // A tile with no data (a sparse file) reads as 0, like everything
+        // else with no data
+        if(s->tiff->tile_bytes[k] == 0)
+            continue;
+
+        if(!decode_tile(s->tiff, scratch, k, Nrows))
+        {
+            MSG("GeoTIFF tile %d,%d is corrupt", ti, tj);
+            __atomic_store_n(&s->failed, true, __ATOMIC_RELAXED);
+            break;
+        }
+
+        for(int r=tr0; r<tr1; r++)
+        {
+            const uint8_t* src =
+                &scratch->tile[((size_t)(r - tj*s->tiff->tile_h)*(size_t)s->tiff->tile_w +
+                                (size_t)(tc0 - ti*s->tiff->tile_w)) * (size_t)s->tiff->bytes_per_sample];
+            int16_t* dst = &s->out[(size_t)(s->tiff->H-1 - r - s->j0)*(size_t)s->stride + (size_t)(tc0 - s->i0)];
+            for(int c=tc0; c<tc1; c++, src += s->tiff->bytes_per_sample)
+                *(dst++) = elevation(s->tiff, src);
+        }
+    }
+    return NULL;
+}
+
+bool horizonator_dem_geotiff_read(// output
+                                  int16_t* out,
+                                  int stride,
+
+                                  // input
+                                  const horizonator_dem_geotiff_t* tiff,
+                                  int i0, int j0,
+                                  int w,  int h,
+                                  int Nthreads)
+{
+    for(int j=0; j<h; j++)
+        memset(&out[(size_t)j*(size_t)stride], 0, (size_t)w*sizeof(int16_t));
+
+    // The window, in the columns and rows of the file: rows count from the
+    // N edge. Clipped to the file
+    int c0 = i0;
+    int c1 = i0 + w;
+    int r0 = tiff->H - (j0 + h);
+    int r1 = tiff->H - j0;
+    if(c0 < 0)        c0 = 0;
+    if(r0 < 0)        r0 = 0;
+    if(c1 > tiff->W)  c1 = tiff->W;
+    if(r1 > tiff->H)  r1 = tiff->H;
+    if(c0 >= c1 || r0 >= r1)
+        return true;
+
+    const int ti0 = c0 / tiff->tile_w, ti1 = (c1-1) / tiff->tile_w;
+    const int tj0 = r0 / tiff->tile_h, tj1 = (r1-1) / tiff->tile_h;
+    const int Ntasks_i = ti1 - ti0 + 1;
+    const int Ntasks   = Ntasks_i * (tj1 - tj0 + 1);
+
+    if(Nthreads <= 0)
+    {
+        long Ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Nthreads = Ncpus > 0 ? (int)Ncpus : 1;
+    }
+    if(Nthreads > Ntasks)
+        Nthreads = Ntasks;
+
+    bool result = false;
+
+    read_shared_t shared =
+        { .tiff   = tiff,
+          .out    = out,
+          .stride = stride,
+          .i0     = i0,  .j0  = j0,
+          .c0     = c0,  .c1  = c1,
+          .r0     = r0,  .r1  = r1,
+          .ti0    = ti0, .tj0 = tj0,
+          .Ntasks_i = Ntasks_i,
+          .Ntasks   = Ntasks };
+
+    const size_t Ntile = (size_t)tiff->tile_w * (size_t)tiff->tile_h * (size_t)tiff->bytes_per_sample;
+    read_worker_t* workers        = calloc(Nthreads, sizeof(workers[0]));
+    pthread_t*     threads        = calloc(Nthreads, sizeof(threads[0]));
+    bool*          thread_started = calloc(Nthreads, sizeof(thread_started[0]));
+    if(workers == NULL || threads == NULL || thread_started == NULL)
+    {
+        MSG("calloc() failed");
+        goto done;
+    }
+    for(int i=0; i<Nthreads; i++)
+    {
+        workers[i].shared       = &shared;
+        workers[i].scratch.tile = malloc(Ntile);
+        workers[i].scratch.row  = malloc((size_t)tiff->tile_w * (size_t)tiff->bytes_per_sample);
+        if(workers[i].scratch.tile == NULL || workers[i].scratch.row == NULL)
+        {
+            MSG("Couldn't allocate the buffers for worker %d", i);
+            goto done;
+        }
+    }
+
+    // Worker 0 is this thread. If any other worker can't be started, the
+    // others simply do its share
+    for(int i=1; i<Nthreads; i++)
+        if(0 == pthread_create(&threads[i], NULL, read_worker, &workers[i]))
+            thread_started[i] = true;
+    read_worker(&workers[0]);
+    for(int i=1; i<Nthreads; i++)
+        if(thread_started[i])
+            pthread_join(threads[i], NULL);
+
+    result = !shared.failed;
+
+ done:
+    if(workers != NULL)
+        for(int i=0; i<Nthreads; i++)
+        {
+            free(workers[i].scratch.tile);
+            free(workers[i].scratch.row);
+        }
+    free(workers);
+    free(threads);
+    free(thread_started);
+    return result;
+}
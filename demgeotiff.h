@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Much of the newer elevation data comes as large GeoTIFF files, not as 1x1
+// degree .hgt files. These can be read directly: a GeoTIFF file can be given
+// anywhere a DEM directory is expected, without converting it first.
+//
+// The file is read with mmap(). It is split internally into tiles (or strips),
+// each compressed separately, and reading a window decodes only the tiles that
+// intersect it, in parallel. So a render area reads a small part of a large
+// file. We support
+//
+// - classic TIFF and BigTIFF, in either byte order
+// - tiled or stripped files, with one sample per pixel
+// - Int16, UInt16 and Float32 samples. Floats are rounded to the nearest meter
+// - no compression, LZW or deflate, with no predictor, the horizontal
+//   predictor or the floating-point predictor
+// - geographic (lat/lon) georeferencing, from the ModelPixelScale and
+//   ModelTiepoint tags, with the samples on the grid of some integer number of
+//   cells per degree, the same in both directions. This is how SRTM (and most
+//   other global DEMs) are delivered as GeoTIFF
+//
+// The samples are indexed like in a DEM pack: (i,j) from the SW corner, with i
+// increasing to the East and j to the North. Voids (the GDAL nodata value, NaN
+// or negative values) read as 0, like in the mosaic of horizonator_dem_init()
+
+typedef struct
+{
+    // The whole file, mmap-ed. NULL if not open
+    void*  map;
+    size_t map_size;
+
+    // The number of samples in each direction
+    int W, H;
+
+    int cells_per_deg;
+
+    // The SW sample is at lat,lon = (lat0_cells,lon0_cells) / cells_per_deg
+    int lat0_cells, lon0_cells;
+
+    // The file is split into Ntiles_i x Ntiles_j tiles of tile_w x tile_h
+    // samples each, stored row-major, NW tile first. A stripped file has
+    // strips of the full width instead: Ntiles_i = 1. Tile k is in
+    // [tile_offsets[k], tile_offsets[k] + tile_bytes[k]) in the file
+    int       tile_w, tile_h;
+    int       Ntiles_i, Ntiles_j;
+    uint64_t* tile_offsets;
+    uint64_t* tile_bytes;
+
+    bool   big_endian;
+    int    compression;
+    int    predictor;
+    int    sample_format;
+    int    bytes_per_sample;
+    bool   has_nodata;
+    double nodata;
+} horizonator_dem_geotiff_t;
+
+// Whether the given file is a TIFF. Just looks at the magic number
+bool horizonator_dem_is_geotiff(const char* filename);
+
+bool horizonator_dem_geotiff_open(// output
+                                  horizonator_dem_geotiff_t* tiff,
+
+                                  // input
+                                  const char* filename);
+
+void horizonator_dem_geotiff_close(horizonator_dem_geotiff_t* tiff);
+
+// Reads the w x h window of samples starting at (i0,j0) into out. Row j of the
+// window is written to out[j*stride]. Only the tiles that overlap the window
+// are decoded, by Nthreads threads. If Nthreads <= 0, we use one per CPU.
+// Samples outside the file read as 0. Returns false if a tile is corrupt
+bool horizonator_dem_geotiff_read(// output
+                                  int16_t* out,
+                                  int stride,
+
+                                  // input
+                                  const horizonator_dem_geotiff_t* tiff,
+                                  int i0, int j0,
+                                  int w,  int h,
+                                  int Nthreads);
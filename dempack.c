@@ -0,0 +1,981 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dempack.h"
+#include "dem.h"
+#include "util.h"
+
+// The header at the start of the file. The zmin and zmax arrays of the blocks
+// follow, then the max levels, finest first. Then the blocks, at a page-aligned
+// offset.
+//
+// In a compressed pack, the blocks are instead a table of Nblocks+1 file
+// offsets, followed by the compressed blocks: block k is in
+// [offsets[k], offsets[k+1])
+typedef struct
+{
+    char    magic[8];
+    int32_t lat0, lon0;
+    int32_t Nlat, Nlon;
+    int32_t cells_per_deg;
+    int32_t block_cells;
+    int32_t compression;
+
+    int32_t W, H;
+    int32_t Nblocks_i, Nblocks_j;
+} pack_file_header_t;
+
+#define PACK_FILE_MAGIC "hzpak03"
+#define PACK_ALIGN      4096
+
+static uint64_t align_up(uint64_t x)
+{
+    return (x + PACK_ALIGN-1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+// The sizes of the max levels, and where everything is in the file
+typedef struct
+{
+    int      Nlevels;
+    int      widths [HORIZONATOR_DEM_PACK_MAX_LEVELS];
+    int      heights[HORIZONATOR_DEM_PACK_MAX_LEVELS];
+    uint64_t offset_levels[HORIZONATOR_DEM_PACK_MAX_LEVELS];
+    uint64_t offset_bounds;
+    // Where the blocks (or the offsets table of a compressed pack) start
+    uint64_t offset_blocks;
+} pack_layout_t;
+
+// Fills in the size of the pack, in samples and in blocks, and the layout of the
+// file. Returns the size of the file, if uncompressed, or 0 if the pack would
+// need too many levels
+static uint64_t pack_layout(pack_file_header_t* header,
+                            pack_layout_t* layout)
+{
+    const int B = header->block_cells;
+
+    header->W         = header->Nlon*header->cells_per_deg + 1;
+    header->H         = header->Nlat*header->cells_per_deg + 1;
+    header->Nblocks_i = (header->W + B-1) / B;
+    header->Nblocks_j = (header->H + B-1) / B;
+
+    uint64_t Nblocks = (uint64_t)header->Nblocks_i*(uint64_t)header->Nblocks_j;
+    uint64_t offset  = sizeof(pack_file_header_t);
+    layout->offset_bounds = offset;
+    offset += 2*Nblocks*sizeof(int16_t);
+
+    // The levels are laid out like the pyramid: level 0 has a node per cell
+    int w = header->W - 1;
+    int h = header->H - 1;
+    layout->Nlevels = 0;
+    while(true)
+    {
+        if(layout->Nlevels == HORIZONATOR_DEM_PACK_MAX_LEVELS)
+            return 0;
+        layout->widths [layout->Nlevels] = w;
+        layout->heights[layout->Nlevels] = h;
+        layout->offset_levels[layout->Nlevels] = offset;
+        if(layout->Nlevels > 0)
+            offset += (uint64_t)w*(uint64_t)h*sizeof(int16_t);
+        layout->Nlevels++;
+        if(w <= 1 && h <= 1)
+            break;
+        w = (w+1) / 2;
+        h = (h+1) / 2;
+    }
+
+    layout->offset_blocks = align_up(offset);
+    return align_up(layout->offset_blocks + Nblocks*(uint64_t)B*(uint64_t)B*sizeof(int16_t));
+}
+
+// Points the pack into the mapped file
+static void pack_set_blocks(horizonator_dem_pack_t* pack,
+                            const pack_file_header_t* header,
+                            const pack_layout_t* layout)
+{
+    pack->lat0          = header->lat0;
+    pack->lon0          = header->lon0;
+    pack->Nlat          = header->Nlat;
+    pack->Nlon          = header->Nlon;
+    pack->cells_per_deg = header->cells_per_deg;
+    pack->block_cells   = header->block_cells;
+    pack->compression   = header->compression;
+    pack->W             = header->W;
+    pack->H             = header->H;
+    pack->Nblocks_i     = header->Nblocks_i;
+    pack->Nblocks_j     = header->Nblocks_j;
+
+    const char* map    = (const char*)pack->map;
+    const char* blocks = &map[layout->offset_blocks];
+    pack->blocks        = pack->compression == 0 ? (const int16_t*) blocks : NULL;
+    pack->block_offsets = pack->compression != 0 ? (const uint64_t*)blocks : NULL;
+
+    pack->block_zmin = (const int16_t*)&map[layout->offset_bounds];
+    pack->block_zmax = &pack->block_zmin[(size_t)pack->Nblocks_i*(size_t)pack->Nblocks_j];
+
+    pack->Nlevels = layout->Nlevels;
+    for(int l=0; l<layout->Nlevels; l++)
+    {
+        pack->level_widths [l] = layout->widths [l];
+        pack->level_heights[l] = layout->heights[l];
+        pack->levels       [l] = l == 0 ? NULL : (const int16_t*)&map[layout->offset_levels[l]];
+    }
+}
+
+// Block (bi,bj) of an uncompressed pack
+static int16_t* pack_block_raw(const horizonator_dem_pack_t* pack,
+                               int bi, int bj)
+{
+    return (int16_t*)&pack->blocks[((size_t)bj*(size_t)pack->Nblocks_i + (size_t)bi) *
+                                   (size_t)pack->block_cells * (size_t)pack->block_cells];
+}
+
+// Where sample (i,j) of an uncompressed pack lives
+static int16_t* pack_sample(const horizonator_dem_pack_t* pack,
+                            int i, int j)
+{
+    const int B = pack->block_cells;
+    return &pack_block_raw(pack, i/B, j/B)[(j%B)*B + (i%B)];
+}
+
+
+
+// Fills in the bounds of the blocks, and the max levels, from the samples of an
+// uncompressed pack being written
+static void pack_fill_bounds_levels(horizonator_dem_pack_t* pack)
+{
+    const int B = pack->block_cells;
+
+    int16_t* zmin = (int16_t*)pack->block_zmin;
+    int16_t* zmax = (int16_t*)pack->block_zmax;
+    for(int bj=0; bj<pack->Nblocks_j; bj++)
+        for(int bi=0; bi<pack->Nblocks_i; bi++)
+        {
+            // The samples at the corners of the cells of this block. The
+            // padding past the N and E edges isn't included
+            const int i1 = (bi+1)*B < pack->W-1 ? (bi+1)*B : pack->W-1;
+            const int j1 = (bj+1)*B < pack->H-1 ? (bj+1)*B : pack->H-1;
+
+            int16_t lo = INT16_MAX, hi = INT16_MIN;
+            for(int j=bj*B; j<=j1; j++)
+                for(int i=bi*B; i<=i1; i++)
+                {
+                    int16_t z = *pack_sample(pack, i, j);
+                    if(lo > z) lo = z;
+                    if(hi < z) hi = z;
+                }
+            zmin[(size_t)bj*(size_t)pack->Nblocks_i + (size_t)bi] = lo;
+            zmax[(size_t)bj*(size_t)pack->Nblocks_i + (size_t)bi] = hi;
+        }
+
+    // Level 1 comes from the samples: node (i,j) is the highest of the samples
+    // [2i,2i+2] x [2j,2j+2]. Each coarser level from the one below it. At the
+    // N and E edges, a node may have only one child in each direction
+    for(int l=1; l<pack->Nlevels; l++)
+    {
+        int16_t*       parent  = (int16_t*)pack->levels[l];
+        const int16_t* child   = pack->levels[l-1];
+        const int      wparent = pack->level_widths [l];
+        const int      hparent = pack->level_heights[l];
+        const int      wchild  = pack->level_widths [l-1];
+        const int      hchild  = pack->level_heights[l-1];
+
+        for(int j=0; j<hparent; j++)
+            for(int i=0; i<wparent; i++)
+            {
+                int16_t hi = INT16_MIN;
+                if(l == 1)
+                {
+                    const int i1 = 2*i+2 < pack->W-1 ? 2*i+2 : pack->W-1;
+                    const int j1 = 2*j+2 < pack->H-1 ? 2*j+2 : pack->H-1;
+                    for(int jj=2*j; jj<=j1; jj++)
+                        for(int ii=2*i; ii<=i1; ii++)
+                        {
+                            int16_t z = *pack_sample(pack, ii, jj);
+                            if(hi < z) hi = z;
+                        }
+                }
+                else
+                {
+                    const int i1 = 2*i+1 < wchild ? 2*i+1 : 2*i;
+                    const int j1 = 2*j+1 < hchild ? 2*j+1 : 2*j;
+                    for(int jj=2*j; jj<=j1; jj++)
+                        for(int ii=2*i; ii<=i1; ii++)
+                        {
+                            int16_t z = child[(size_t)jj*(size_t)wchild + (size_t)ii];
+                            if(hi < z) hi = z;
+                        }
+                }
+                parent[(size_t)j*(size_t)wparent + (size_t)i] = hi;
+            }
+    }
+}
+
+
+
+// The block codec. Each sample is predicted from its neighbors to the W, S and
+// SW with the median edge detector of LOCO-I. The residuals are mapped to
+// unsigned integers (0,-1,1,-2,2,...), and Rice-coded, with one Rice parameter
+// k per row of the block, chosen from the mean residual of that row. The bits
+// are packed LSB-first. Large residuals are escaped: RICE_QMAX 1 bits, followed
+// by the raw 17-bit value
+#define RICE_QMAX      24
+#define RICE_KBITS     5
+#define RICE_RAWBITS   17
+
+static int16_t predict(const int16_t* z, int B, int i, int j)
+{
+    if(j == 0) return i == 0 ? 0 : z[i-1];
+    if(i == 0) return z[(j-1)*B];
+
+    int a = z[ j   *B + i-1];
+    int b = z[(j-1)*B + i  ];
+    int c = z[(j-1)*B + i-1];
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    if(c >= hi) return (int16_t)lo;
+    if(c <= lo) return (int16_t)hi;
+    return (int16_t)(a + b - c);
+}
+
+static uint32_t zigzag(int32_t x)
+{
+    return x >= 0 ? (uint32_t)x*2u : (uint32_t)(-x)*2u - 1u;
+}
+static int32_t unzigzag(uint32_t u)
+{
+    return (u & 1u) ? -(int32_t)((u+1u)/2u) : (int32_t)(u/2u);
+}
+
+// An upper bound on the size of one compressed block
+static size_t block_compressed_max(int B)
+{
+    return (size_t)B*(size_t)B*(RICE_QMAX + RICE_RAWBITS)/8 + (size_t)B*RICE_KBITS/8 + 16;
+}
+
+// Compresses the B*B samples in z into out. Returns the number of bytes
+static size_t block_compress(uint8_t* out, const int16_t* z, int B)
+{
+    size_t   n     = 0;
+    uint64_t acc   = 0;
+    int      nbits = 0;
+
+    void put(uint32_t value, int bits)
+    {
+        acc   |= (uint64_t)value << nbits;
+        nbits += bits;
+        while(nbits >= 8)
+        {
+            out[n++] = (uint8_t)acc;
+            acc    >>= 8;
+            nbits   -= 8;
+        }
+    }
+
+    uint32_t u[B];
+    for(int j=0; j<B; j++)
+    {
+        uint64_t sum = 0;
+        for(int i=0; i<B; i++)
+        {
+            u[i] = zigzag((int32_t)z[j*B + i] - (int32_t)predict(z, B, i, j));
+            sum += u[i];
+        }
+
+        int k = 0;
+        while(k < RICE_RAWBITS && ((uint64_t)B << k) < sum)
+            k++;
+        put(k, RICE_KBITS);
+
+        for(int i=0; i<B; i++)
+        {
+            uint32_t q = u[i] >> k;
+            if(q < RICE_QMAX)
+            {
+                // q 1 bits and a 0, then the low bits
+                put((1u << q) - 1u, q+1);
+                if(k > 0)
+                    put(u[i] & ((1u << k) - 1u), k);
+            }
+            else
+            {
+                put((1u << RICE_QMAX) - 1u, RICE_QMAX);
+                put(u[i], RICE_RAWBITS);
+            }
+        }
+    }
+    if(nbits > 0)
+        out[n++] = (uint8_t)acc;
+    return n;
+}
+
+// The bit reader of the decompressor. Reading past the end of the data produces
+// 0s, and is counted in overrun
+typedef struct
+{
+    const uint8_t* in;
+    size_t         size, n;
+    uint64_t       acc;
+    int            nbits;
+    int            overrun;
+} bitreader_t;
+
+// Makes sure acc has at least 57 bits
+static inline void bitreader_refill(bitreader_t* r)
+{
+    if(r->n + 8 <= r->size)
+    {
+        uint64_t x;
+        memcpy(&x, &r->in[r->n], sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        r->acc   |= x << r->nbits;
+        r->n     += (63 - r->nbits) / 8;
+        r->nbits |= 56;
+        return;
+    }
+    while(r->nbits <= 56)
+    {
+        if(r->n < r->size) r->acc |= (uint64_t)r->in[r->n++] << r->nbits;
+        else               r->overrun += 8;
+        r->nbits += 8;
+    }
+}
+
+static inline uint32_t bitreader_get(bitreader_t* r, int bits)
+{
+    uint32_t v = (uint32_t)r->acc & (uint32_t)((1ull << bits) - 1u);
+    r->acc   >>= bits;
+    r->nbits  -= bits;
+    return v;
+}
+
+// One Rice-coded value. acc must have at least RICE_QMAX+RICE_RAWBITS bits
+static inline uint32_t bitreader_rice(bitreader_t* r, int k)
+{
+    // The count of leading 1 bits
+    uint32_t q = (uint32_t)__builtin_ctzll(~r->acc);
+    if(q >= RICE_QMAX)
+    {
+        bitreader_get(r, RICE_QMAX);
+        return bitreader_get(r, RICE_RAWBITS);
+    }
+    r->acc   >>= q+1;
+    r->nbits  -= q+1;
+    return (q << k) | bitreader_get(r, k);
+}
+
+// Decompresses a block of B*B samples from in[0..size). Returns false if the
+// data is corrupt
+static bool block_decompress(int16_t* z, const uint8_t* in, size_t size, int B)
+{
+    bitreader_t r = {.in = in, .size = size};
+
+    for(int j=0; j<B; j++)
+    {
+        bitreader_refill(&r);
+        int k = (int)bitreader_get(&r, RICE_KBITS);
+        if(k > RICE_RAWBITS)
+            return false;
+
+        // The row below. There isn't one at j == 0
+        int16_t*       row  = &z[j*B];
+        const int16_t* prev = j > 0 ? &z[(j-1)*B] : NULL;
+
+        // The first sample of the row is predicted from the one below it. The
+        // others like in predict()
+        bitreader_refill(&r);
+        int32_t x = unzigzag(bitreader_rice(&r, k)) + (j == 0 ? 0 : prev[0]);
+        if(x < INT16_MIN || x > INT16_MAX)
+            return false;
+        row[0] = (int16_t)x;
+
+        for(int i=1; i<B; i++)
+        {
+            bitreader_refill(&r);
+            int32_t p;
+            if(j == 0)
+                p = row[i-1];
+            else
+            {
+                int a  = row [i-1];
+                int b  = prev[i  ];
+                int c  = prev[i-1];
+                int lo = a < b ? a : b;
+                int hi = a < b ? b : a;
+                p = c >= hi ? lo : c <= lo ? hi : a + b - c;
+            }
+            x = unzigzag(bitreader_rice(&r, k)) + p;
+            if(x < INT16_MIN || x > INT16_MAX)
+                return false;
+            row[i] = (int16_t)x;
+        }
+    }
+
+    // The bits left in acc that weren't real data must not have been consumed
+    return r.overrun <= r.nbits;
+}
+
+
+
+// The cache of decompressed blocks: a hash table of the blocks, and a
+// doubly-linked list of them, most recently used first
+typedef struct
+{
+    uint64_t key;
+    int      prev, next;    // in the LRU list
+    int      hash_next;     // in the hash bucket
+} cache_slot_t;
+
+struct horizonator_dem_pack_cache_t
+{
+    int           Nslots, Nused;
+    int           Nbuckets;
+    int           head, tail;
+    int*          buckets;
+    cache_slot_t* slots;
+    int16_t*      data;
+};
+
+static uint64_t cache_key(int bi, int bj)
+{
+    return ((uint64_t)(uint32_t)bj << 32) | (uint64_t)(uint32_t)bi;
+}
+
+static int cache_bucket(const struct horizonator_dem_pack_cache_t* c, uint64_t key)
+{
+    return (int)((key * 0x9E3779B97F4A7C15ull) >> 40) & (c->Nbuckets-1);
+}
+
+static void cache_unlink(struct horizonator_dem_pack_cache_t* c, int s)
+{
+    if(c->slots[s].prev >= 0) c->slots[c->slots[s].prev].next = c->slots[s].next;
+    else                      c->head                         = c->slots[s].next;
+    if(c->slots[s].next >= 0) c->slots[c->slots[s].next].prev = c->slots[s].prev;
+    else                      c->tail                         = c->slots[s].prev;
+}
+
+static void cache_push_front(struct horizonator_dem_pack_cache_t* c, int s)
+{
+    c->slots[s].prev = -1;
+    c->slots[s].next = c->head;
+    if(c->head >= 0) c->slots[c->head].prev = s;
+    c->head = s;
+    if(c->tail < 0) c->tail = s;
+}
+
+static struct horizonator_dem_pack_cache_t* cache_new(int Nslots, int B)
+{
+    struct horizonator_dem_pack_cache_t* c = calloc(1, sizeof(*c));
+    if(c == NULL)
+        return NULL;
+
+    c->Nslots   = Nslots;
+    c->Nbuckets = 1;
+    while(c->Nbuckets < 2*Nslots)
+        c->Nbuckets *= 2;
+    c->head     = -1;
+    c->tail     = -1;
+    c->buckets  = malloc(c->Nbuckets * sizeof(c->buckets[0]));
+    c->slots    = malloc(Nslots * sizeof(c->slots[0]));
+    c->data     = malloc((size_t)Nslots*(size_t)B*(size_t)B*sizeof(int16_t));
+    if(c->buckets == NULL || c->slots == NULL || c->data == NULL)
+    {
+        free(c->buckets);
+        free(c->slots);
+        free(c->data);
+        free(c);
+        return NULL;
+    }
+    for(int b=0; b<c->Nbuckets; b++)
+        c->buckets[b] = -1;
+    return c;
+}
+
+static void cache_free(struct horizonator_dem_pack_cache_t* c)
+{
+    if(c == NULL)
+        return;
+    free(c->buckets);
+    free(c->slots);
+    free(c->data);
+    free(c);
+}
+
+const int16_t* horizonator_dem_pack_block(horizonator_dem_pack_t* pack,
+                                          int bi, int bj)
+{
+    if(pack->compression == 0)
+        return pack_block_raw(pack, bi, bj);
+
+    const int B = pack->block_cells;
+
+    if(pack->cache == NULL)
+    {
+        pack->cache = cache_new(HORIZONATOR_DEM_PACK_CACHE_BLOCKS, B);
+        if(pack->cache == NULL)
+        {
+            MSG("Couldn't allocate the DEM pack block cache");
+            return NULL;
+        }
+    }
+    struct horizonator_dem_pack_cache_t* c = pack->cache;
+
+    const uint64_t key    = cache_key(bi, bj);
+    const int      bucket = cache_bucket(c, key);
+    for(int s = c->buckets[bucket]; s >= 0; s = c->slots[s].hash_next)
+        if(c->slots[s].key == key)
+        {
+            pack->cache_hits++;
+            if(c->head != s)
+            {
+                cache_unlink(c, s);
+                cache_push_front(c, s);
+            }
+            return &c->data[(size_t)s*(size_t)B*(size_t)B];
+        }
+    pack->cache_misses++;
+
+    // Not cached. I take an unused slot, or evict the least-recently-used one
+    int s;
+    if(c->Nused < c->Nslots)
+        s = c->Nused++;
+    else
+    {
+        s = c->tail;
+        cache_unlink(c, s);
+        if(c->slots[s].key != UINT64_MAX)
+        {
+            int* p = &c->buckets[cache_bucket(c, c->slots[s].key)];
+            while(*p != s)
+                p = &c->slots[*p].hash_next;
+            *p = c->slots[s].hash_next;
+        }
+    }
+
+    const size_t   k    = (size_t)bj*(size_t)pack->Nblocks_i + (size_t)bi;
+    const uint64_t off0 = pack->block_offsets[k];
+    const uint64_t off1 = pack->block_offsets[k+1];
+    int16_t*       z    = &c->data[(size_t)s*(size_t)B*(size_t)B];
+    if(off0 > off1 || off1 > pack->map_size ||
+       !block_decompress(z, &((const uint8_t*)pack->map)[off0], off1 - off0, B))
+    {
+        MSG("Block (%d,%d) of the DEM pack is corrupt", bi, bj);
+        // The slot is now unused. It isn't in any hash bucket. I put it at the
+        // back of the list, so it's reused first
+        c->slots[s].key  = UINT64_MAX;
+        c->slots[s].prev = c->tail;
+        c->slots[s].next = -1;
+        if(c->tail >= 0) c->slots[c->tail].next = s;
+        else             c->head                = s;
+        c->tail = s;
+        return NULL;
+    }
+
+    c->slots[s].key       = key;
+    c->slots[s].hash_next = c->buckets[bucket];
+    c->buckets[bucket]    = s;
+    cache_push_front(c, s);
+    return z;
+}
+
+// Writes the compressed version of the uncompressed pack in raw to fd. The
+// bounds and the levels are copied as they are. Returns false on error
+static bool pack_compress(int fd,
+                          const horizonator_dem_pack_t* raw,
+                          const pack_file_header_t* header_raw,
+                          const pack_layout_t* layout)
+{
+    bool result = false;
+
+    pack_file_header_t header = *header_raw;
+    header.compression = HORIZONATOR_DEM_PACK_COMPRESSION_RICE;
+
+    const int B   = raw->block_cells;
+    uint8_t*  buf = malloc(block_compressed_max(B));
+    uint64_t* offsets = NULL;
+    if(buf == NULL)
+        goto done;
+
+    bool pwrite_all(const void* data, size_t n, uint64_t offset)
+    {
+        for(size_t Nwritten = 0; Nwritten < n; )
+        {
+            ssize_t m = pwrite(fd, &((const char*)data)[Nwritten], n - Nwritten,
+                               (off_t)(offset + Nwritten));
+            if(m <= 0)
+                return false;
+            Nwritten += m;
+        }
+        return true;
+    }
+
+    const uint64_t offset  = layout->offset_blocks;
+    const size_t   Nblocks = (size_t)raw->Nblocks_i*(size_t)raw->Nblocks_j;
+
+    offsets = malloc((Nblocks+1)*sizeof(offsets[0]));
+    if(offsets == NULL)
+        goto done;
+
+    offsets[0] = offset + (Nblocks+1)*sizeof(offsets[0]);
+    for(int bj=0; bj<raw->Nblocks_j; bj++)
+        for(int bi=0; bi<raw->Nblocks_i; bi++)
+        {
+            size_t k = (size_t)bj*(size_t)raw->Nblocks_i + (size_t)bi;
+            size_t n = block_compress(buf, pack_block_raw(raw, bi, bj), B);
+            if(!pwrite_all(buf, n, offsets[k]))
+                goto done;
+            offsets[k+1] = offsets[k] + n;
+        }
+
+    if(!pwrite_all(offsets, (Nblocks+1)*sizeof(offsets[0]), offset) ||
+       !pwrite_all(&((const char*)raw->map)[sizeof(header)],
+                   offset - sizeof(header), sizeof(header)) ||
+       !pwrite_all(&header, sizeof(header), 0) ||
+       0 != ftruncate(fd, (off_t)offsets[Nblocks]))
+        goto done;
+    result = true;
+
+ done:
+    free(buf);
+    free(offsets);
+    return result;
+}
+
+bool horizonator_dem_pack_write(const char* filename,
+                                int lat0, int lon0,
+                                int Nlat, int Nlon,
+                                int block_cells,
+                                bool compress,
+                                const char* datadir)
+{
+    if(Nlat <= 0 || Nlon <= 0 || block_cells <= 0)
+    {
+        MSG("The pack must have a positive size, and blocks");
+        return false;
+    }
+
+    // The pack has the resolution of its DEMs
+    const int cells_per_deg = horizonator_dem_cells_per_deg(datadir);
+    if(cells_per_deg <= 0)
+        return false;
+    const int Wdem = cells_per_deg + 1;
+
+    pack_file_header_t header = { .magic         = PACK_FILE_MAGIC,
+                                  .lat0          = lat0,
+                                  .lon0          = lon0,
+                                  .Nlat          = Nlat,
+                                  .Nlon          = Nlon,
+                                  .cells_per_deg = cells_per_deg,
+                                  .block_cells   = block_cells };
+    pack_layout_t  layout;
+    const uint64_t size = pack_layout(&header, &layout);
+    if(size == 0)
+    {
+        MSG("The pack is too large. Increase the compile-time-constant HORIZONATOR_DEM_PACK_MAX_LEVELS from the current value of %d",
+            HORIZONATOR_DEM_PACK_MAX_LEVELS);
+        return false;
+    }
+
+    // The uncompressed pack is built in filename_tmp. If compressing, the
+    // compressed pack is then written to filename_tmp_compressed
+    char filename_tmp           [1024];
+    char filename_tmp_compressed[1024];
+    if( snprintf(filename_tmp, sizeof(filename_tmp), "%s.%d.tmp",
+                 filename, (int)getpid()) >= (int)sizeof(filename_tmp) ||
+        snprintf(filename_tmp_compressed, sizeof(filename_tmp_compressed), "%s.%d.tmp.z",
+                 filename, (int)getpid()) >= (int)sizeof(filename_tmp_compressed))
+    {
+        MSG("Filename too long: '%s'", filename);
+        return false;
+    }
+
+    bool                   result = false;
+    horizonator_dem_pack_t pack   = {.map = MAP_FAILED, .map_size = size};
+    int16_t*               dem    = NULL;
+    int                    fd_compressed = -1;
+
+    // I write the file through a shared mapping, so the pack doesn't need to
+    // fit in memory. The file starts out as all 0: the sea, and the padding
+    int fd = open(filename_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        MSG("Couldn't create '%s'", filename_tmp);
+        return false;
+    }
+    if(0 != ftruncate(fd, (off_t)size))
+    {
+        MSG("Couldn't size '%s' to %llu bytes", filename_tmp, (unsigned long long)size);
+        goto done;
+    }
+    pack.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(pack.map == MAP_FAILED)
+    {
+        MSG("Couldn't mmap '%s'", filename_tmp);
+        goto done;
+    }
+    memcpy(pack.map, &header, sizeof(header));
+    pack_set_blocks(&pack, &header, &layout);
+
+    // One DEM at a time. Adjacent DEMs share their edges. Like
+    // horizonator_dem_init(), I take these from the DEM to the S or W
+    dem = malloc((size_t)Wdem*(size_t)Wdem*sizeof(int16_t));
+    if(dem == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+    for(int dj=0; dj<Nlat; dj++)
+        for(int di=0; di<Nlon; di++)
+        {
+            if( !horizonator_dem_hgt_read(dem, Wdem,
+                                          cells_per_deg,
+                                          lat0 + dj, lon0 + di,
+                                          0, Wdem, 0, Wdem,
+                                          datadir) )
+                goto done;
+
+            for(int j = dj==0 ? 0 : 1; j<Wdem; j++)
+                for(int i = di==0 ? 0 : 1; i<Wdem; i++)
+                    *pack_sample(&pack,
+                                 di*cells_per_deg + i,
+                                 dj*cells_per_deg + j) = dem[(size_t)j*(size_t)Wdem + i];
+        }
+    pack_fill_bounds_levels(&pack);
+
+    if(compress)
+    {
+        fd_compressed = open(filename_tmp_compressed, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd_compressed < 0)
+        {
+            MSG("Couldn't create '%s'", filename_tmp_compressed);
+            goto done;
+        }
+        if(!pack_compress(fd_compressed, &pack, &header, &layout))
+        {
+            MSG("Couldn't write the compressed pack to '%s'", filename_tmp_compressed);
+            goto done;
+        }
+    }
+
+    if(0 != munmap(pack.map, size))
+    {
+        pack.map = MAP_FAILED;
+        goto done;
+    }
+    pack.map = MAP_FAILED;
+
+    if(0 != close(fd))
+    {
+        fd = -1;
+        goto done;
+    }
+    fd = -1;
+    if(fd_compressed >= 0)
+    {
+        int res = close(fd_compressed);
+        fd_compressed = -1;
+        if(res != 0)
+            goto done;
+    }
+
+    if(0 != rename(compress ? filename_tmp_compressed : filename_tmp, filename))
+    {
+        MSG("Couldn't rename '%s' to '%s'",
+            compress ? filename_tmp_compressed : filename_tmp, filename);
+        goto done;
+    }
+    result = true;
+
+ done:
+    free(dem);
+    if(pack.map != MAP_FAILED)
+        munmap(pack.map, size);
+    if(fd >= 0)
+        close(fd);
+    if(fd_compressed >= 0)
+        close(fd_compressed);
+    unlink(filename_tmp);
+    if(compress)
+        unlink(filename_tmp_compressed);
+    return result;
+}
+
+bool horizonator_dem_pack_open(// output
+                               horizonator_dem_pack_t* pack,
+
+                               // input
+                               const char* filename)
+{
+    *pack = (horizonator_dem_pack_t){};
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open DEM pack '%s'", filename);
+        return false;
+    }
+
+    struct stat sb;
+    if(0 != fstat(fd, &sb) || sb.st_size < (off_t)sizeof(pack_file_header_t))
+    {
+        close(fd);
+        MSG("DEM pack '%s' is too small", filename);
+        return false;
+    }
+
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        MSG("Couldn't mmap DEM pack '%s'", filename);
+        return false;
+    }
+
+    // The header must describe the layout I would have written. A compressed
+    // pack has the same blocks, but I can't know the size of the file without
+    // reading the data. So I check that the offsets table lies inside the file.
+    // The offsets of each block are checked when it's decompressed
+    const pack_file_header_t* header_file = (const pack_file_header_t*)map;
+    pack_file_header_t header = { .magic         = PACK_FILE_MAGIC,
+                                  .lat0          = header_file->lat0,
+                                  .lon0          = header_file->lon0,
+                                  .Nlat          = header_file->Nlat,
+                                  .Nlon          = header_file->Nlon,
+                                  .cells_per_deg = header_file->cells_per_deg,
+                                  .block_cells   = header_file->block_cells,
+                                  .compression   = header_file->compression };
+    pack_layout_t layout;
+    bool valid =
+        0 == memcmp(header.magic, header_file->magic, sizeof(header.magic)) &&
+        header.Nlat > 0 && header.Nlon > 0 &&
+        header.cells_per_deg > 0 && header.block_cells > 0;
+    if(valid)
+    {
+        uint64_t size    = pack_layout(&header, &layout);
+        uint64_t Nblocks = (uint64_t)header.Nblocks_i * (uint64_t)header.Nblocks_j;
+        if(size == 0)
+            valid = false;
+        else if(header.compression == 0)
+            valid = size == (uint64_t)sb.st_size;
+        else if(header.compression == HORIZONATOR_DEM_PACK_COMPRESSION_RICE)
+            valid = layout.offset_blocks + (Nblocks+1)*sizeof(uint64_t) <= (uint64_t)sb.st_size;
+        else
+            valid = false;
+        valid = valid && 0 == memcmp(&header, header_file, sizeof(header));
+    }
+    if(!valid)
+    {
+        munmap(map, sb.st_size);
+        MSG("'%s' is not a valid DEM pack", filename);
+        return false;
+    }
+
+    pack->map      = map;
+    pack->map_size = sb.st_size;
+    pack_set_blocks(pack, &header, &layout);
+    return true;
+}
+
+void horizonator_dem_pack_cache_free(horizonator_dem_pack_t* pack)
+{
+    cache_free(pack->cache);
+    pack->cache = NULL;
+}
+
+void horizonator_dem_pack_close(horizonator_dem_pack_t* pack)
+{
+    if(pack->map != NULL)
+        munmap(pack->map, pack->map_size);
+    cache_free(pack->cache);
+    *pack = (horizonator_dem_pack_t){};
+}
+
+bool horizonator_dem_pack_read(// output
+                               int16_t* out,
+                               int stride,
+
+                               // input
+                               horizonator_dem_pack_t* pack,
+                               int i0, int j0,
+                               int w,  int h)
+{
+    const int B = pack->block_cells;
+
+    // The part of the window that is inside the pack
+    const int i_begin = i0 < 0         ? 0       : i0;
+    const int i_end   = i0+w > pack->W ? pack->W : i0+w;
+    const int j_begin = j0 < 0         ? 0       : j0;
+    const int j_end   = j0+h > pack->H ? pack->H : j0+h;
+
+    for(int j=0; j<h; j++)
+    {
+        int16_t* row = &out[(size_t)j*(size_t)stride];
+        const int jp = j0 + j;
+        if(jp < j_begin || jp >= j_end || i_begin >= i_end)
+        {
+            memset(row, 0, w*sizeof(int16_t));
+            continue;
+        }
+        if(i_begin > i0)
+            memset(row, 0, (i_begin - i0)*sizeof(int16_t));
+        if(i_end < i0+w)
+            memset(&row[i_end - i0], 0, (i0+w - i_end)*sizeof(int16_t));
+    }
+    if(i_begin >= i_end || j_begin >= j_end)
+        return true;
+
+    // I go block by block, so each block is fetched (and decompressed) once
+    for(int bj = j_begin/B; bj <= (j_end-1)/B; bj++)
+        for(int bi = i_begin/B; bi <= (i_end-1)/B; bi++)
+        {
+            const int16_t* block = horizonator_dem_pack_block(pack, bi, bj);
+            if(block == NULL)
+                return false;
+
+            int ib0 = bi*B     > i_begin ? bi*B     : i_begin;
+            int ib1 = (bi+1)*B < i_end   ? (bi+1)*B : i_end;
+            int jb0 = bj*B     > j_begin ? bj*B     : j_begin;
+            int jb1 = (bj+1)*B < j_end   ? (bj+1)*B : j_end;
+            for(int jp=jb0; jp<jb1; jp++)
+                memcpy(&out[(size_t)(jp-j0)*(size_t)stride + (ib0-i0)],
+                       &block[(jp%B)*B + (ib0%B)],
+                       (ib1-ib0)*sizeof(int16_t));
+        }
+    return true;
+}
+
+void horizonator_dem_pack_bounds(// output
+                                 int16_t* zmin, int16_t* zmax,
+
+                                 // input
+                                 const horizonator_dem_pack_t* pack,
+                                 int i0, int j0,
+                                 int i1, int j1)
+{
+    const int B = pack->block_cells;
+
+    int16_t lo = INT16_MAX, hi = INT16_MIN;
+    if(i0 < 0 || j0 < 0 || i1 > pack->W-1 || j1 > pack->H-1)
+        lo = hi = 0;
+
+    // Each sample is in the bounds of the block it's in
+    const int bi0 = (i0 < 0         ? 0         : i0) / B;
+    const int bi1 = (i1 > pack->W-1 ? pack->W-1 : i1) / B;
+    const int bj0 = (j0 < 0         ? 0         : j0) / B;
+    const int bj1 = (j1 > pack->H-1 ? pack->H-1 : j1) / B;
+    for(int bj=bj0; bj<=bj1; bj++)
+        for(int bi=bi0; bi<=bi1; bi++)
+        {
+            const size_t k = (size_t)bj*(size_t)pack->Nblocks_i + (size_t)bi;
+            if(lo > pack->block_zmin[k]) lo = pack->block_zmin[k];
+            if(hi < pack->block_zmax[k]) hi = pack->block_zmax[k];
+        }
+    *zmin = lo;
+    *zmax = hi;
+}
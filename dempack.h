@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// A DEM pack is one file holding the elevations of a whole region, made from
+// the SRTM DEMs by horizonator_dem_pack_write() (or the horizonator-pack tool).
+// The file is read with mmap(), so only the parts of it that are used are ever
+// read from disk, and these are shared between processes in the page cache.
+//
+// The region is a rectangle of whole degrees. The pack has every sample of the
+// DEMs: Nlon*cells_per_deg+1 columns and Nlat*cells_per_deg+1 rows, starting at
+// the SW corner. These are split into square blocks of block_cells x
+// block_cells samples, stored one after another, row-major, SW block first.
+// Inside each block the samples are row-major, SW first, in the native byte
+// order. Blocks at the N and E edges are padded with 0.
+//
+// Voids, and the areas with no DEM file (the sea), read as 0, like in the
+// mosaic of horizonator_dem_init()
+//
+// For each block we also store the lowest and highest sample at the corners of
+// its cells: block (bi,bj) covers the samples [bi,bi+1]*block_cells in each
+// direction, including the ones it shares with the blocks to the N and E. And
+// we store the max levels: node (i,j) of level L is the highest of the samples
+// [i,i+1]*2^L in each direction, clipped to the pack. So nothing in the cells
+// under that node is higher. Level L+1 is the max of the 2x2 nodes of level L
+// under each of its nodes, like the levels of the pyramid of
+// horizonator_dem_pyramid_init(), and level 0 (one node per cell) isn't
+// stored. Each level is row-major, SW node first. These aren't compressed, and
+// add about a third to the size of an uncompressed pack
+//
+// The blocks may be compressed losslessly (compression ==
+// HORIZONATOR_DEM_PACK_COMPRESSION_RICE): each sample is predicted from its
+// neighbors, and the residuals are Rice-coded. SRTM terrain compresses to
+// roughly a third of its size this way. The blocks are then decompressed when
+// they are first used, and the most recently used ones are kept in a cache in
+// the open pack, so reading a window touches only the blocks under it, once.
+
+// The default block size. A block is then 8KB: 2 pages
+#define HORIZONATOR_DEM_PACK_BLOCK_CELLS 64
+
+// The max levels go up to a single node, so this allows packs of up to 2^24
+// samples on each side
+#define HORIZONATOR_DEM_PACK_MAX_LEVELS 24
+
+#define HORIZONATOR_DEM_PACK_COMPRESSION_NONE 0
+#define HORIZONATOR_DEM_PACK_COMPRESSION_RICE 1
+
+// How many decompressed blocks an open pack keeps. With the default block size
+// this is 4MB, enough for the mosaic of a render radius of ~60km
+#define HORIZONATOR_DEM_PACK_CACHE_BLOCKS 512
+
+struct horizonator_dem_pack_cache_t;
+
+typedef struct
+{
+    // The whole file, mmap-ed. NULL if not open
+    void*  map;
+    size_t map_size;
+
+    // The SW corner of the region, and its size, in degrees
+    int lat0, lon0;
+    int Nlat, Nlon;
+
+    int cells_per_deg;
+    int block_cells;
+    int compression;
+
+    // The number of samples in each direction
+    int W, H;
+
+    int Nblocks_i, Nblocks_j;
+
+    // Nblocks_j*Nblocks_i blocks of block_cells*block_cells samples each. NULL
+    // if the pack is compressed
+    const int16_t* blocks;
+
+    // If the pack is compressed: where each block is in the file. Block k is
+    // in [block_offsets[k], block_offsets[k+1]). NULL otherwise
+    const uint64_t* block_offsets;
+
+    // The lowest and highest sample of each block. Nblocks_j*Nblocks_i each
+    const int16_t* block_zmin;
+    const int16_t* block_zmax;
+
+    // The max levels. levels[0] is NULL: level 0 isn't stored
+    int            Nlevels;
+    int            level_widths [HORIZONATOR_DEM_PACK_MAX_LEVELS];
+    int            level_heights[HORIZONATOR_DEM_PACK_MAX_LEVELS];
+    const int16_t* levels       [HORIZONATOR_DEM_PACK_MAX_LEVELS];
+
+    // The decompressed blocks, allocated when the first one is needed. NULL
+    // until then, and always for uncompressed packs
+    struct horizonator_dem_pack_cache_t* cache;
+    // How many blocks were found in the cache, and how many were decompressed
+    uint64_t cache_hits, cache_misses;
+} horizonator_dem_pack_t;
+
+// Makes a pack of the region with SW corner at lat0,lon0, Nlat x Nlon degrees
+// in size, from the SRTM DEMs in datadir. The pack has the resolution of the
+// DEMs (horizonator_dem_cells_per_deg()). If compress, the blocks are
+// compressed. The file is written atomically
+bool horizonator_dem_pack_write(const char* filename,
+                                int lat0, int lon0,
+                                int Nlat, int Nlon,
+                                int block_cells,
+                                bool compress,
+                                const char* datadir);
+
+bool horizonator_dem_pack_open(// output
+                               horizonator_dem_pack_t* pack,
+
+                               // input
+                               const char* filename);
+
+void horizonator_dem_pack_close(horizonator_dem_pack_t* pack);
+
+// Reads the w x h window of samples starting at (i0,j0) into out. Row j of the
+// window is written to out[j*stride]. Only the blocks that overlap the window
+// are touched. Samples outside the pack read as 0. Returns false if a block is
+// corrupt
+bool horizonator_dem_pack_read(// output
+                               int16_t* out,
+                               int stride,
+
+                               // input
+                               horizonator_dem_pack_t* pack,
+                               int i0, int j0,
+                               int w,  int h);
+
+// The samples of block (bi,bj). If the pack is compressed, these are in the
+// cache of the pack, and remain valid until HORIZONATOR_DEM_PACK_CACHE_BLOCKS
+// other blocks are requested. Returns NULL if the block is corrupt.
+//
+// The cache isn't locked: a pack must not be read from several threads at once
+const int16_t* horizonator_dem_pack_block(horizonator_dem_pack_t* pack,
+                                          int bi, int bj);
+
+// Frees the cache of decompressed blocks. It is allocated again if more blocks
+// are read. For packs that are kept open after the samples are read, for their
+// bounds and levels
+void horizonator_dem_pack_cache_free(horizonator_dem_pack_t* pack);
+
+// Bounds on the samples [i0,i1] x [j0,j1] of the pack: none of them is lower
+// than *zmin or higher than *zmax. These come from the bounds of the blocks
+// that overlap the window, without reading any samples, so they may be loose.
+// Samples outside the pack read as 0
+void horizonator_dem_pack_bounds(// output
+                                 int16_t* zmin, int16_t* zmax,
+
+                                 // input
+                                 const horizonator_dem_pack_t* pack,
+                                 int i0, int j0,
+                                 int i1, int j1);
@@ -3,12 +3,77 @@
 #version 420
 
 layout(location = 0) out vec4 frag_color;
+
+// The DEM cell seen at this pixel, the offset inside that cell, and the
+// elevation there. Written only if the offscreen framebuffer has the cell-ID
+// attachment enabled (horizonator_render_offscreen() asked for geolocation).
+// The offsets are scaled to [0,65535], and packed into z: x in the low 16 bits,
+// y in the high 16 bits. w has the bits of the float elevation, in meters
+layout(location = 1) out ivec4 frag_cellid;
+
+// The view parameters. These change at runtime, and live in a uniform buffer
+// that the CPU code uploads. The layout must match horizonator_context_t.view
+layout(std140, binding = 0) uniform view_t
+{
+    float aspect;
+    float az_deg0, az_deg1;
+    float viewer_cell_i, viewer_cell_j;
+    float viewer_z;
+    float viewer_lat;
+    float cos_viewer_lat;
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    float znear, zfar;
+    float znear_color, zfar_color;
+    float viewport_width, viewport_height;
+};
+
 in vec3 rgb_fragment;
 in vec2 tex_fragment;
+flat in ivec2  cell_fragment;
+flat in mat3x2 triangle_offset;
+flat in mat3   triangle_enz;
 uniform sampler2D tex;
 
 uniform int NtilesX, NtilesY;
 
+const float pi = 3.14159265358979;
+
+// Unwraps an angle x to lie within pi of an angle near. All angles in radians
+float unwrap_near_rad(float x, float near)
+{
+    float d = (x - near) / (2.*pi);
+    return (d - round(d)) * 2.*pi + near;
+}
+
+// The line of sight through the center of this pixel: (east, north, up), with
+// a horizontal length of 1. This inverts the projection in vertex.glsl
+vec3 pixel_ray()
+{
+    float az_rad0 = radians(az_deg0);
+    float az_rad1 = unwrap_near_rad(radians(az_deg1)-az_rad0, pi) + az_rad0;
+    float az_ndc_per_rad = 2.0 / (az_rad1 - az_rad0);
+
+    float az_ndc = gl_FragCoord.x / viewport_width  * 2. - 1.;
+    float el_ndc = gl_FragCoord.y / viewport_height * 2. - 1.;
+    float az     = az_ndc / az_ndc_per_rad + (az_rad0 + az_rad1)/2.;
+    float el     = el_ndc / (aspect * az_ndc_per_rad);
+    return vec3(sin(az), cos(az), tan(el));
+}
+
+// The barycentric coordinates of the point of the edge a-b of the triangle
+// that is closest to the line of sight ray (a unit vector), and the squared
+// distance of that point from the line. Each component of ia,ib selects a
+// vertex of the edge
+vec4 nearest_on_edge(vec3 a, vec3 b, vec3 ia, vec3 ib, vec3 ray)
+{
+    vec3  pa = a     - dot(a,     ray)*ray;
+    vec3  pd = (b-a) - dot(b - a, ray)*ray;
+    float dd = dot(pd, pd);
+    float s  = dd > 0. ? clamp(-dot(pa, pd) / dd, 0., 1.) : 0.;
+    vec3  p  = pa + s*pd;
+    return vec4(ia*(1.-s) + ib*s, dot(p, p));
+}
 
 void main(void)
 {
@@ -20,4 +85,47 @@ void main(void)
         vec4 shadingcolor = vec4(rgb_fragment, 0.0);
         frag_color = 0.7*texcolor + 0.3*shadingcolor;
     }
+
+    // The barycentric coordinates of the point where the line of sight meets
+    // the plane of the triangle (Moller-Trumbore). The triangle is drawn with
+    // straight edges in azimuth,elevation, so near its edges the line of sight
+    // can pass outside it in 3D: mostly for large triangles close to the
+    // viewer. I then take the point of the triangle closest to the line of
+    // sight, which is on one of its edges
+    vec3  ray = normalize(pixel_ray());
+    vec3  e1  = triangle_enz[1] - triangle_enz[0];
+    vec3  e2  = triangle_enz[2] - triangle_enz[0];
+    vec3  p   = cross(ray, e2);
+    vec3  v   = -triangle_enz[0];
+    vec3  q   = cross(v, e1);
+    float det = dot(e1, p);
+    vec3  b   = vec3(0., dot(v, p), dot(ray, q)) / det;
+    b.x = 1. - b.y - b.z;
+    if(!(all(greaterThanEqual(b, vec3(0.))) && all(lessThanEqual(b, vec3(1.)))))
+    {
+        vec4 b01 = nearest_on_edge(triangle_enz[0], triangle_enz[1],
+                                   vec3(1.,0.,0.), vec3(0.,1.,0.), ray);
+        vec4 b12 = nearest_on_edge(triangle_enz[1], triangle_enz[2],
+                                   vec3(0.,1.,0.), vec3(0.,0.,1.), ray);
+        vec4 b20 = nearest_on_edge(triangle_enz[2], triangle_enz[0],
+                                   vec3(0.,0.,1.), vec3(1.,0.,0.), ray);
+        vec4 bn  = b01;
+        if(b12.w < bn.w) bn = b12;
+        if(b20.w < bn.w) bn = b20;
+        b = bn.xyz;
+    }
+
+    vec2  offset    = triangle_offset * b;
+    float elevation = viewer_z + dot(b, vec3(triangle_enz[0].z,
+                                             triangle_enz[1].z,
+                                             triangle_enz[2].z));
+
+    // The offset may span several cells, if the triangle is larger than a
+    // cell. An offset on a cell boundary is reported as the far edge of the
+    // cell before it, so the reported cell is always one the triangle covers
+    vec2  cell = max(ceil(offset) - 1., 0.);
+    uvec2 f    = uvec2(round(clamp(offset - cell, 0., 1.) * 65535.));
+    frag_cellid = ivec4(cell_fragment + ivec2(cell),
+                        int(f.x | (f.y << 16)),
+                        floatBitsToInt(elevation));
 }
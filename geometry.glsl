@@ -9,28 +9,79 @@ in  vec3 rgb[];
 out vec3 rgb_fragment;
 in  vec2 tex[];
 out vec2 tex_fragment;
+in  vec2 cellij[];
+in  float az[];
+in  vec3 enz[];
+
+// The SW corner of the triangle's bounding box, and the position of each
+// vertex relative to that corner, and to the viewer. In the dense mesh each
+// triangle is half of a cell, and the offsets are 0 or 1. The triangles of a
+// simplified mesh are larger. The fragment shader finds the point of the
+// triangle seen at each pixel, and its cell
+flat out ivec2  cell_fragment;
+flat out mat3x2 triangle_offset;
+flat out mat3   triangle_enz;
+
+// Set if the terrain is the dense grid, not a simplified mesh
+uniform bool dense_mesh;
+
+const float pi = 3.14159265358979;
+
+// The angle x wrapped to [-pi,pi]
+float wrap_rad(float x)
+{
+    return x - 2.*pi*round(x / (2.*pi));
+}
 
 void main()
 {
     // The azimuth is gl_Position.x. Any triangles on the seam (some vertices
     // off on the left, and some off on the right) need to be thrown out. Those
-    // triangle will have max-az > 1 and min-az < -1 for max-min > 2. But I can
-    // be even more general. Any triangles that have max-min > 0.5 span more
-    // that 1/4 of the width of the viewport. This is never what we want, so I
-    // throw those out too.
-    if( max(max(gl_in[0].gl_Position.x,
-                gl_in[1].gl_Position.x),
-            gl_in[2].gl_Position.x) -
-        min(min(gl_in[0].gl_Position.x,
-                gl_in[1].gl_Position.x),
-            gl_in[2].gl_Position.x) > 0.5 )
+    // triangle will have max-az > 1 and min-az < -1 for max-min > 2. In the
+    // dense grid I can be even more general. Any triangles that have max-min >
+    // 0.5 span more that 1/4 of the width of the viewport. This is never what
+    // we want, so I throw those out too. The triangles of a simplified mesh
+    // can legitimately be this wide, and are handled below
+    if( dense_mesh )
+    {
+        if( max(max(gl_in[0].gl_Position.x,
+                    gl_in[1].gl_Position.x),
+                gl_in[2].gl_Position.x) -
+            min(min(gl_in[0].gl_Position.x,
+                    gl_in[1].gl_Position.x),
+                gl_in[2].gl_Position.x) > 0.5 )
+            return;
+    }
+
+    // The vertex azimuths are unwrapped around the center of the view. A
+    // triangle that straddles the seam behind the viewer has vertices on both
+    // ends of that range, and would be drawn across the whole view, so I throw
+    // it out. The true azimuth differences between the vertices are the wrapped
+    // ones: each is less than pi. If the triangle surrounds the viewer, these
+    // go all the way around, and I can't draw it at all. Otherwise the true
+    // span of the triangle is the extent of the vertices placed relative to
+    // vertex 0. If the unwrapped span is larger, the triangle is on the seam
+    float d01 = wrap_rad(az[1] - az[0]);
+    float d12 = wrap_rad(az[2] - az[1]);
+    float d20 = wrap_rad(az[0] - az[2]);
+    if( abs(d01 + d12 + d20) > pi )
         return;
 
+    float span_true = max(max(0., d01), -d20) - min(min(0., d01), -d20);
+    float span      = max(max(az[0], az[1]), az[2]) - min(min(az[0], az[1]), az[2]);
+    if( span > span_true + 1e-3 )
+        return;
+
+    vec2 cell = min(min(cellij[0], cellij[1]), cellij[2]);
+
     for(int i=0; i<3; i++)
     {
-        rgb_fragment = rgb[i];
-        tex_fragment = tex[i];
-        gl_Position  = gl_in[i].gl_Position;
+        rgb_fragment    = rgb[i];
+        tex_fragment    = tex[i];
+        cell_fragment   = ivec2(cell);
+        triangle_offset = mat3x2(cellij[0] - cell, cellij[1] - cell, cellij[2] - cell);
+        triangle_enz    = mat3(enz[0], enz[1], enz[2]);
+        gl_Position     = gl_in[i].gl_Position;
         EmitVertex();
     }
     EndPrimitive();
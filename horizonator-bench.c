@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+
+#include "horizonator.h"
+#include "viewshed.h"
+#include "bench.h"
+#include "util.h"
+
+// Stage-level benchmark. For each configuration in the sweep (render radius x
+// image size x texturing x mosaic layout) we create the context several times,
+// and render from it several times, collecting the time taken by each stage of
+// horizonator_init() and horizonator_render_offscreen(). The results are
+// written to stdout as JSON: one object per configuration, with the median and
+// the percentiles of each stage, so that results from different releases can
+// be compared mechanically
+
+#define MAX_LIST 16
+
+typedef struct
+{
+    double* x;
+    int     N, Nalloc;
+} samples_t;
+
+static bool samples_push(samples_t* s, double x)
+{
+    if(s->N == s->Nalloc)
+    {
+        int     Nalloc = s->Nalloc > 0 ? s->Nalloc*2 : 64;
+        double* p      = realloc(s->x, Nalloc*sizeof(double));
+        if(p == NULL)
+        {
+            MSG("realloc() failed");
+            return false;
+        }
+        s->x      = p;
+        s->Nalloc = Nalloc;
+    }
+    s->x[s->N++] = x;
+    return true;
+}
+
+static int compare_double(const void* _a, const void* _b)
+{
+    double a = *(const double*)_a;
+    double b = *(const double*)_b;
+    return (a > b) - (a < b);
+}
+
+// Nearest-rank percentile. The samples must be sorted already
+static double percentile(const samples_t* s, double p)
+{
+    int i = (int)ceil(p/100. * (double)s->N) - 1;
+    if(i < 0)     i = 0;
+    if(i >= s->N) i = s->N-1;
+    return s->x[i];
+}
+
+// Accumulates the timings of one horizonator_init() or
+// horizonator_render_offscreen() call. Some stages run more than once per call,
+// so I sum them
+typedef struct
+{
+    double seconds [HORIZONATOR_STAGE_COUNT];
+    bool   reported[HORIZONATOR_STAGE_COUNT];
+} call_timings_t;
+
+static void stage_callback(horizonator_stage_t stage, double seconds, void* cookie)
+{
+    call_timings_t* t = (call_timings_t*)cookie;
+    t->seconds [stage] += seconds;
+    t->reported[stage]  = true;
+}
+
+// Parses a comma-separated list of integers. Returns the number of elements
+// or <0 on error
+static int parse_int_list(int* out, const char* str)
+{
+    int N = 0;
+    while(*str)
+    {
+        if(N == MAX_LIST)
+            return -1;
+        char* end;
+        long x = strtol(str, &end, 10);
+        if(end == str || x <= 0)
+            return -1;
+        out[N++] = (int)x;
+        if(*end == ',')      end++;
+        else if(*end != '\0') return -1;
+        str = end;
+    }
+    return N;
+}
+
+// Parses a comma-separated list of WIDTHxHEIGHT. Returns the number of
+// elements or <0 on error
+static int parse_size_list(int* widths, int* heights, const char* str)
+{
+    int N = 0;
+    while(*str)
+    {
+        if(N == MAX_LIST)
+            return -1;
+        int len;
+        if(2 != sscanf(str, "%dx%d%n", &widths[N], &heights[N], &len) ||
+           widths[N] <= 0 || heights[N] <= 0)
+            return -1;
+        N++;
+        str += len;
+        if(*str == ',')       str++;
+        else if(*str != '\0') return -1;
+    }
+    return N;
+}
+
+// Parses a comma-separated list of mosaic layout names. Returns the number of
+// elements or <0 on error
+static int parse_layout_list(horizonator_dem_layout_t* out, const char* str)
+{
+    const horizonator_dem_layout_t all[] = {HORIZONATOR_DEM_LAYOUT_TILED,
+                                            HORIZONATOR_DEM_LAYOUT_ROWMAJOR};
+    int N = 0;
+    while(*str)
+    {
+        if(N == MAX_LIST)
+            return -1;
+        int len = (int)strcspn(str, ",");
+        int k;
+        for(k=0; k<(int)(sizeof(all)/sizeof(all[0])); k++)
+        {
+            const char* name = horizonator_dem_layout_name(all[k]);
+            if((int)strlen(name) == len && 0 == strncmp(str, name, len))
+                break;
+        }
+        if(k == (int)(sizeof(all)/sizeof(all[0])))
+            return -1;
+        out[N++] = all[k];
+        str += len;
+        if(*str == ',')       str++;
+    }
+    return N;
+}
+
+// Reads every cell along rays from the center of the mosaic out to its edge,
+// in every direction, one ray at a time: the access pattern of the CPU
+// queries (viewshed, LOS, raycast). There are enough rays to reach every cell
+// on the edge. Returns the sum of the elevations, so that the reads can't be
+// optimized away
+static double radial_walk(const horizonator_dem_context_t* dems)
+{
+    const int W     = horizonator_dem_mosaic_width(dems);
+    const int Nrays = 4*W;
+
+    double sum = 0.0;
+    for(int iray=0; iray<Nrays; iray++)
+    {
+        double az = 2.*M_PI * (double)iray / (double)Nrays;
+        double dx = cos(az);
+        double dy = sin(az);
+        for(int k=0; ; k++)
+        {
+            int i = W/2 + (int)floor(dx*(double)k);
+            int j = W/2 + (int)floor(dy*(double)k);
+            if(i < 0 || j < 0 || i >= W || j >= W)
+                break;
+            sum += horizonator_dem_mosaic_at(dems, i, j);
+        }
+    }
+    return sum;
+}
+
+static void print_stats_json(const char* name, samples_t* s, bool last)
+{
+    qsort(s->x, s->N, sizeof(double), compare_double);
+
+    double sum = 0.0;
+    for(int i=0; i<s->N; i++) sum += s->x[i];
+
+    printf("        \"%s\": {\"n\": %d, \"mean_s\": %.9g, \"min_s\": %.9g, \"median_s\": %.9g, "
+           "\"p90_s\": %.9g, \"p99_s\": %.9g, \"max_s\": %.9g}%s\n",
+           name, s->N,
+           sum / (double)s->N,
+           s->x[0],
+           percentile(s, 50.),
+           percentile(s, 90.),
+           percentile(s, 99.),
+           s->x[s->N-1],
+           last ? "" : ",");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "%s [--radius R0,R1,...]\n"
+        "   [--size W0xH0,W1xH1,...]\n"
+        "   [--texture | --texture-sweep]\n"
+        "   [--mesh-tolerance METERS]\n"
+        "   [--max-range METERS]\n"
+        "   [--layout L0,L1,...] [--huge-pages]\n"
+        "   [--radial]\n"
+        "   [--inits N]\n"
+        "   [--renders N]\n"
+        "   [--allow-tile-downloads]\n"
+        "   [--dirdems DIRECTORY]\n"
+        "   [--dirdems-near DIRECTORY [--radius-near NEAR_RADIUS_CELLS]]\n"
+        "   [--dirtiles DIRECTORY]\n"
+        "   LAT LON\n"
+        "\n"
+        "Benchmarks the stages of horizonator_init() and\n"
+        "horizonator_render_offscreen(), centered at LAT,LON. We sweep over\n"
+        "the given render radii (in cells; default 1000) and image sizes\n"
+        "(default 1600x400). By default we render without texturing. With\n"
+        "--texture we texture. With --texture-sweep we do both.\n"
+        "\n"
+        "By default we draw the full DEM grid. With --mesh-tolerance we draw a\n"
+        "mesh simplified to within this many meters of vertical error instead.\n"
+        "With --dirdems-near we draw the terrain within NEAR_RADIUS_CELLS\n"
+        "(default 1000) of the viewer from those higher-resolution DEMs. The\n"
+        "far field comes from --dirdems, as usual.\n"
+        "\n"
+        "By default we load and mesh the whole square of the render radius.\n"
+        "With --max-range we load and mesh only the terrain within this many\n"
+        "meters of the viewer, and render out to that range.\n"
+        "\n"
+        "--layout sweeps over the in-memory layouts of the DEM mosaic: 'tiled'\n"
+        "(the default: Morton-ordered tiles) and 'rowmajor'. With --huge-pages\n"
+        "large mosaics are put on transparent huge pages. With --radial we\n"
+        "also time the CPU consumers of the mosaic after each init: a walk\n"
+        "along rays from the center to the edge in every direction\n"
+        "(radial_walk), and a viewshed from the center (viewshed). These\n"
+        "show the effect of the layout.\n"
+        "\n"
+        "For each configuration we call horizonator_init() --inits times\n"
+        "(default 3), and horizonator_render_offscreen() --renders times\n"
+        "(default 20) after each init. The renders sweep the heading around\n"
+        "the full circle, with a 90deg field of view.\n"
+        "\n"
+        "The results are written to stdout as JSON. For each stage we report\n"
+        "the number of samples, and the mean, min, median, 90th, 99th\n"
+        "percentiles and the max, in seconds. The init_total and render_total\n"
+        "entries time the whole horizonator_init() and\n"
+        "horizonator_render_offscreen() calls.\n";
+
+    struct option opts[] = {
+        { "radius",            required_argument, NULL, 'R' },
+        { "size",              required_argument, NULL, 's' },
+        { "texture",           no_argument,       NULL, 'T' },
+        { "texture-sweep",     no_argument,       NULL, 'S' },
+        { "mesh-tolerance",    required_argument, NULL, 'm' },
+        { "max-range",         required_argument, NULL, 'M' },
+        { "layout",            required_argument, NULL, 'L' },
+        { "huge-pages",        no_argument,       NULL, 'H' },
+        { "radial",            no_argument,       NULL, 'W' },
+        { "inits",             required_argument, NULL, 'i' },
+        { "renders",           required_argument, NULL, 'r' },
+        { "dirdems",           required_argument, NULL, 'd' },
+        { "dirdems-near",      required_argument, NULL, 'D' },
+        { "radius-near",       required_argument, NULL, 'N' },
+        { "dirtiles",          required_argument, NULL, 't' },
+        { "allow-tile-downloads",no_argument,     NULL, 'a' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int         radii  [MAX_LIST] = {1000};
+    int         widths [MAX_LIST] = {1600};
+    int         heights[MAX_LIST] = {400};
+    int         Nradii            = 1;
+    int         Nsizes            = 1;
+    bool        textures[2]       = {false, true};
+    int         Ntextures         = 1;
+    float       mesh_tolerance    = 0.0f;
+    float       max_range         = 0.0f;
+    horizonator_dem_layout_t layouts[MAX_LIST] = {HORIZONATOR_DEM_LAYOUT_TILED};
+    int         Nlayouts          = 1;
+    bool        huge_pages        = false;
+    bool        radial            = false;
+    int         Ninits            = 3;
+    int         Nrenders          = 20;
+    const char* dir_dems          = NULL;
+    const char* dir_dems_near     = NULL;
+    int         near_radius_cells = 1000;
+    const char* dir_tiles         = NULL;
+    bool        allow_downloads   = false;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "+h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'R':
+            Nradii = parse_int_list(radii, optarg);
+            if(Nradii <= 0)
+            {
+                fprintf(stderr, "--radius must be a comma-separated list of integers > 0, with at most %d elements\n", MAX_LIST);
+                return 1;
+            }
+            break;
+
+        case 's':
+            Nsizes = parse_size_list(widths, heights, optarg);
+            if(Nsizes <= 0)
+            {
+                fprintf(stderr, "--size must be a comma-separated list of WIDTHxHEIGHT, with at most %d elements\n", MAX_LIST);
+                return 1;
+            }
+            break;
+
+        case 'T':
+            textures[0] = true;
+            Ntextures   = 1;
+            break;
+
+        case 'S':
+            textures[0] = false;
+            textures[1] = true;
+            Ntextures   = 2;
+            break;
+
+        case 'm':
+            mesh_tolerance = (float)atof(optarg);
+            if(mesh_tolerance <= 0.0f)
+            {
+                fprintf(stderr, "--mesh-tolerance must have an float argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'M':
+            max_range = (float)atof(optarg);
+            if(max_range <= 0.0f)
+            {
+                fprintf(stderr, "--max-range must have an float argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'L':
+            Nlayouts = parse_layout_list(layouts, optarg);
+            if(Nlayouts <= 0)
+            {
+                fprintf(stderr, "--layout must be a comma-separated list of 'tiled' or 'rowmajor', with at most %d elements\n", MAX_LIST);
+                return 1;
+            }
+            break;
+
+        case 'H':
+            huge_pages = true;
+            break;
+
+        case 'W':
+            radial = true;
+            break;
+
+        case 'i':
+            Ninits = atoi(optarg);
+            if(Ninits <= 0)
+            {
+                fprintf(stderr, "--inits must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'r':
+            Nrenders = atoi(optarg);
+            if(Nrenders <= 0)
+            {
+                fprintf(stderr, "--renders must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'd':
+            dir_dems = optarg;
+            break;
+
+        case 'D':
+            dir_dems_near = optarg;
+            break;
+
+        case 'N':
+            near_radius_cells = atoi(optarg);
+            if(near_radius_cells <= 0)
+            {
+                fprintf(stderr, "--radius-near must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 't':
+            dir_tiles = optarg;
+            break;
+
+        case 'a':
+            allow_downloads = true;
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    int Nargs_remaining = argc-optind;
+    if( Nargs_remaining != 2 )
+    {
+        fprintf(stderr, "Need exactly 2 non-option arguments. Got %d\n\n",Nargs_remaining);
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    float lat = (float)atof(argv[optind+0]);
+    float lon = (float)atof(argv[optind+1]);
+
+    call_timings_t timings;
+
+    printf("{\n  \"lat\": %f,\n  \"lon\": %f,\n  \"results\": [\n", lat, lon);
+
+    bool first_result = true;
+    for(int iradius = 0; iradius < Nradii;    iradius++)
+    for(int isize   = 0; isize   < Nsizes;    isize++)
+    for(int itex    = 0; itex    < Ntextures; itex++)
+    for(int ilayout = 0; ilayout < Nlayouts;  ilayout++)
+    {
+        const int  radius         = radii  [iradius];
+        const int  width          = widths [isize];
+        const int  height         = heights[isize];
+        const bool render_texture = textures[itex];
+
+        horizonator_dem_set_layout(layouts[ilayout], huge_pages);
+
+        samples_t stages[HORIZONATOR_STAGE_COUNT] = {};
+        samples_t init_total   = {};
+        samples_t render_total = {};
+        samples_t radial_total   = {};
+        samples_t viewshed_total = {};
+
+        char*  image  = malloc((size_t)width*(size_t)height*3);
+        float* ranges = malloc((size_t)width*(size_t)height*sizeof(float));
+        if(image == NULL || ranges == NULL)
+        {
+            MSG("malloc() failed");
+            return 1;
+        }
+
+        bool push_timings(samples_t* total, double seconds)
+        {
+            if(!samples_push(total, seconds))
+                return false;
+            for(int i=0; i<HORIZONATOR_STAGE_COUNT; i++)
+                if(timings.reported[i] &&
+                   !samples_push(&stages[i], timings.seconds[i]))
+                    return false;
+            return true;
+        }
+
+        for(int iinit = 0; iinit < Ninits; iinit++)
+        {
+            horizonator_context_t ctx = {};
+
+            timings = (call_timings_t){};
+            double t0 = bench_wall_seconds();
+            if( !horizonator_init( &ctx,
+                                   lat, lon,
+                                   width, height,
+                                   radius,
+                                   max_range,
+                                   mesh_tolerance,
+                                   true,
+                                   render_texture,
+                                   dir_dems,
+                                   dir_dems_near, near_radius_cells,
+                                   dir_tiles,
+                                   allow_downloads) )
+            {
+                fprintf(stderr, "horizonator_init() failed\n");
+                return 1;
+            }
+            double t_init = bench_wall_seconds() - t0;
+
+            // The stats were reset by horizonator_init(), so they hold just
+            // its stages. The callback picks up the renders
+            for(int i=0; i<HORIZONATOR_STAGE_COUNT; i++)
+                if(ctx.stats.stages[i].count > 0)
+                    stage_callback(i, ctx.stats.stages[i].wall_s, &timings);
+            if(!push_timings(&init_total, t_init))
+                return 1;
+            horizonator_set_stage_callback(&ctx, stage_callback, &timings);
+
+            if(radial)
+            {
+                const int W = horizonator_dem_mosaic_width(&ctx.dems);
+                uint8_t* visible = malloc((size_t)W*(size_t)W);
+                if(visible == NULL)
+                {
+                    MSG("malloc() failed");
+                    return 1;
+                }
+
+                t0 = bench_wall_seconds();
+                volatile double sum = radial_walk(&ctx.dems);
+                (void)sum;
+                if(!samples_push(&radial_total, bench_wall_seconds() - t0))
+                    return 1;
+
+                t0 = bench_wall_seconds();
+                if(!horizonator_viewshed(visible, NULL, &ctx.dems,
+                                         lat, lon, 2.0f, 0.0f, 0.13f))
+                {
+                    fprintf(stderr, "horizonator_viewshed() failed\n");
+                    return 1;
+                }
+                if(!samples_push(&viewshed_total, bench_wall_seconds() - t0))
+                    return 1;
+                free(visible);
+            }
+
+            for(int irender = 0; irender < Nrenders; irender++)
+            {
+                float az_center = 360.f * (float)irender / (float)Nrenders;
+                if(!horizonator_pan_zoom(&ctx, az_center - 45.f, az_center + 45.f))
+                {
+                    fprintf(stderr, "horizonator_pan_zoom() failed\n");
+                    return 1;
+                }
+
+                timings = (call_timings_t){};
+                t0 = bench_wall_seconds();
+                if(!horizonator_render_offscreen(&ctx, image, ranges, NULL))
+                {
+                    fprintf(stderr, "horizonator_render_offscreen() failed\n");
+                    return 1;
+                }
+                if(!push_timings(&render_total, bench_wall_seconds() - t0))
+                    return 1;
+            }
+
+            horizonator_deinit(&ctx);
+        }
+
+        printf("%s    {\n"
+               "      \"radius_cells\": %d,\n"
+               "      \"width\": %d,\n"
+               "      \"height\": %d,\n"
+               "      \"render_texture\": %s,\n"
+               "      \"mesh_tolerance\": %f,\n"
+               "      \"max_range\": %f,\n"
+               "      \"near_radius_cells\": %d,\n"
+               "      \"dem_layout\": \"%s\",\n"
+               "      \"huge_pages\": %s,\n"
+               "      \"stages\": {\n",
+               first_result ? "" : ",\n",
+               radius, width, height,
+               render_texture ? "true" : "false",
+               (double)mesh_tolerance,
+               (double)max_range,
+               dir_dems_near != NULL ? near_radius_cells : 0,
+               horizonator_dem_layout_name(layouts[ilayout]),
+               huge_pages ? "true" : "false");
+        first_result = false;
+
+        for(int i=0; i<HORIZONATOR_STAGE_COUNT; i++)
+            if(stages[i].N > 0)
+                print_stats_json(horizonator_stage_name(i), &stages[i], false);
+        if(radial)
+        {
+            print_stats_json("radial_walk", &radial_total,   false);
+            print_stats_json("viewshed",    &viewshed_total, false);
+        }
+        print_stats_json("init_total",   &init_total,   false);
+        print_stats_json("render_total", &render_total, true);
+        printf("      }\n    }");
+        fflush(stdout);
+
+        for(int i=0; i<HORIZONATOR_STAGE_COUNT; i++)
+            free(stages[i].x);
+        free(init_total.x);
+        free(render_total.x);
+        free(radial_total.x);
+        free(viewshed_total.x);
+        free(image);
+        free(ranges);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
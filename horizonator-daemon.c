@@ -0,0 +1,781 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+#include <FreeImage.h>
+
+#include "horizonator.h"
+#include "util.h"
+
+// A long-running render server. Render requests come in on stdin, one per
+// line. Initializing a horizonator context (loading the DEMs, filling the
+// VBO, loading the texture) is far slower than rendering from it, so we keep an
+// LRU of initialized contexts, keyed by region. Any request whose viewer lies
+// in a region we already have loaded re-uses that context.
+//
+// The regions are squares on a grid of --region-cells cells. Each context is
+// loaded centered on its region, so a viewer anywhere in the region sees at
+// least RENDER_RADIUS_CELLS - REGION_CELLS/2 cells of data in each direction.
+//
+// Requests are read in batches: whatever is available on stdin without
+// blocking, up to --batch requests. Each batch is reordered to group requests
+// by region, with the already-resident regions first. So consecutive requests
+// that alternate between regions don't thrash the cache
+
+#define MAX_BATCH_DEFAULT        64
+#define MAX_CONTEXTS_DEFAULT      8
+#define MAX_MEMORY_MB_DEFAULT  2048
+
+typedef struct
+{
+    horizonator_context_t ctx;
+
+    // The key: region indices, towards E and N
+    int      region_ij[2];
+    uint64_t last_used;
+    size_t   bytes;
+    bool     resident;
+} region_t;
+
+typedef struct
+{
+    float lat, lon;
+    float az_deg0, az_deg1;
+    char  filename_image [512];
+    char  filename_ranges[512];
+
+    int   region_ij[2];
+
+    // for the reordering
+    int   sort_class;
+    int64_t sort_key;
+
+    // sequence number of this request, in the order they came in. Reported
+    // back in the responses
+    long  seq;
+} request_t;
+
+static struct
+{
+    long requests;
+    long failures;
+    long hits;
+    long misses;
+    long evictions;
+    // requests that were served from the context used by the previous request
+    long reused_consecutively;
+    // requests that were moved from their arrival position by the reordering
+    long reordered;
+} stats;
+
+static void print_stats(FILE* fp, int Nresident, size_t bytes_resident)
+{
+    // The DEM tiles decoded for the contexts are cached separately, in the
+    // library
+    horizonator_dem_tile_cache_stats_t dem_cache;
+    horizonator_dem_tile_cache_get_stats(&dem_cache);
+
+    fprintf(fp,
+            "requests: %ld failures: %ld hits: %ld misses: %ld hit_rate: %.3f evictions: %ld "
+            "reused_consecutively: %ld reordered: %ld resident: %d resident_MB: %.1f "
+            "dem_cache_hits: %llu dem_cache_misses: %llu dem_cache_evictions: %llu "
+            "dem_cache_tiles: %d dem_cache_MB: %.1f\n",
+            stats.requests, stats.failures,
+            stats.hits, stats.misses,
+            stats.hits + stats.misses > 0 ?
+              (double)stats.hits / (double)(stats.hits + stats.misses) : 0.0,
+            stats.evictions,
+            stats.reused_consecutively,
+            stats.reordered,
+            Nresident,
+            (double)bytes_resident / (1024.*1024.),
+            (unsigned long long)dem_cache.hits,
+            (unsigned long long)dem_cache.misses,
+            (unsigned long long)(dem_cache.evictions + dem_cache.stale),
+            dem_cache.Ntiles,
+            (double)dem_cache.bytes / (1024.*1024.));
+    fflush(fp);
+}
+
+// Rough estimate of the memory used by one context. Each context decodes the
+// DEMs into its own mosaic, so that is counted here. The shared cache of
+// decoded .hgt tiles isn't: it has its own limit, --dem-cache-mb.
+//
+// With max_range > 0, the context at this latitude loads only what's in that
+// range. This follows what terrain_init() does in horizonator-lib.c: the
+// mosaic is a square just large enough to contain the disk, and only the
+// chunks touching the disk get vertices and triangles
+static size_t context_bytes(int radius_cells, float max_range, float lat,
+                            int cells_per_deg,
+                            int width, int height,
+                            bool render_texture)
+{
+    const float C  = (float)HORIZONATOR_CHUNK_CELLS;
+    const float dn = 6371000.0f * (float)M_PI / 180.0f / (float)cells_per_deg;
+    const float de = dn * cosf(lat * (float)M_PI / 180.0f);
+
+    int    radius_loaded = radius_cells;
+    double Nvertices     = (double)(2*radius_cells)*(double)(2*radius_cells);
+    if(max_range > 0.0f &&
+       max_range < (float)radius_cells * hypotf(de, dn))
+    {
+        float r = ceilf(max_range / de) + 1.0f;
+        if(r < 2.0f*C)              r = 2.0f*C;
+        if(r > (float)radius_cells) r = (float)radius_cells;
+        radius_loaded = (int)r;
+
+        // The disk, padded by a chunk all around
+        double Ndisk = M_PI * (max_range/de + C) * (max_range/dn + C);
+        Nvertices = (double)(2*radius_loaded)*(double)(2*radius_loaded);
+        if(Ndisk < Nvertices)
+            Nvertices = Ndisk;
+    }
+    size_t Nmosaic = (size_t)(2*radius_loaded)*(size_t)(2*radius_loaded);
+
+    size_t bytes =
+        // the decoded DEM mosaic
+        Nmosaic*sizeof(int16_t) +
+        // the vertices, their polar projections and the indices: 2 triangles
+        // per vertex
+        (size_t)(Nvertices * (double)(3*sizeof(int16_t) +
+                                      3*sizeof(float)   +
+                                      2*3*sizeof(uint32_t))) +
+        // color and depth renderbuffers
+        (size_t)width*(size_t)height*(3 + 4);
+
+    if(render_texture)
+    {
+        // OSM tiles at zoom 12 are 360/4096 degrees wide. They're taller
+        // towards the poles, so this underestimates a bit. The texture covers
+        // all of radius_cells, regardless of max_range
+        const double deg_per_tile = 360. / 4096.;
+        double Ntiles_side = 2.*(double)radius_cells/(double)cells_per_deg / deg_per_tile + 1.;
+        bytes += (size_t)(Ntiles_side*Ntiles_side) * 256*256*3;
+    }
+    return bytes;
+}
+
+// Simple non-blocking line reader on a file descriptor. I can't use stdio
+// here: I need to know whether more input is available without blocking, and
+// the stdio buffering hides that
+typedef struct
+{
+    int  fd;
+    char buf[65536];
+    int  n;
+    // Bytes at the start of buf[] that were returned in the previous call, and
+    // can be discarded
+    int  consumed;
+    bool eof;
+} linereader_t;
+
+// Returns the next line, without the trailing '\n'. If !block and no complete
+// line is available yet, returns NULL. At EOF returns NULL, and sets r->eof
+static char* read_line(linereader_t* r, bool block)
+{
+    if(r->consumed > 0)
+    {
+        memmove(r->buf, &r->buf[r->consumed], r->n - r->consumed);
+        r->n       -= r->consumed;
+        r->consumed = 0;
+    }
+
+    while(true)
+    {
+        char* newline = memchr(r->buf, '\n', r->n);
+        if(newline != NULL)
+        {
+            *newline    = '\0';
+            r->consumed = newline - r->buf + 1;
+            return r->buf;
+        }
+
+        if(r->eof)
+        {
+            if(r->n == 0)
+                return NULL;
+            // last line, with no trailing newline
+            if(r->n == (int)sizeof(r->buf))
+                r->n--;
+            r->buf[r->n] = '\0';
+            r->consumed  = r->n;
+            return r->buf;
+        }
+
+        if(r->n == (int)sizeof(r->buf))
+        {
+            MSG("Input line too long; discarding it");
+            r->n = 0;
+        }
+
+        if(!block)
+        {
+            struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+            if(poll(&pfd, 1, 0) <= 0)
+                return NULL;
+        }
+
+        ssize_t Nread = read(r->fd, &r->buf[r->n], sizeof(r->buf) - r->n);
+        if(Nread <= 0)
+            r->eof = true;
+        else
+            r->n += Nread;
+    }
+}
+
+static int compare_requests(const void* _a, const void* _b)
+{
+    const request_t* a = (const request_t*)_a;
+    const request_t* b = (const request_t*)_b;
+
+    if(a->sort_class != b->sort_class) return a->sort_class - b->sort_class;
+    if(a->sort_key   != b->sort_key)   return a->sort_key < b->sort_key ? -1 : 1;
+    if(a->seq        != b->seq)        return a->seq      < b->seq      ? -1 : 1;
+    return 0;
+}
+
+static bool save_results(const request_t* request,
+                         const char* image, const float* ranges,
+                         int width, int height)
+{
+    if(image != NULL)
+    {
+        FIBITMAP* fib = FreeImage_ConvertFromRawBits((BYTE*)image, width, height,
+                                                     3*width, 24,
+                                                     0,0,0,
+                                                     // Top row is stored first
+                                                     true);
+        bool result = FreeImage_Save(FIF_PNG, fib, request->filename_image, 0);
+        FreeImage_Unload(fib);
+        if(!result)
+        {
+            MSG("Couldn't save to '%s'", request->filename_image);
+            return false;
+        }
+    }
+
+    if(ranges != NULL)
+    {
+        FILE* fp = fopen(request->filename_ranges, "w");
+        if(fp == NULL)
+        {
+            MSG("Cannot open ranges image at '%s'", request->filename_ranges);
+            return false;
+        }
+
+        size_t N = (size_t)width*(size_t)height;
+        bool result = (N == fwrite(ranges, sizeof(float), N, fp));
+        fclose(fp);
+        if(!result)
+        {
+            MSG("Failed to write complete 'ranges' data to '%s'", request->filename_ranges);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "%s --width WIDTH_PIXELS [--height HEIGHT_PIXELS]\n"
+        "   [--radius RENDER_RADIUS_CELLS]\n"
+        "   [--region-cells REGION_CELLS]\n"
+        "   [--max-contexts N]\n"
+        "   [--max-memory-mb MB]\n"
+        "   [--dem-cache-mb MB]\n"
+        "   [--huge-pages]\n"
+        "   [--batch N]\n"
+        "   [--texture]\n"
+        "   [--allow-tile-downloads]\n"
+        "   [--znear       ZNEAR]\n"
+        "   [--zfar        ZFAR]\n"
+        "   [--znear-color ZNEARCOLOR]\n"
+        "   [--zfar-color  ZFARCOLOR]\n"
+        "   [--dirdems DIRECTORY]\n"
+        "   [--dirtiles DIRECTORY]\n"
+        "\n"
+        "Render server. Reads requests from stdin, one per line:\n"
+        "\n"
+        "  LAT LON AZ_DEG0 AZ_DEG1 IMAGE.png|- RANGES.dat|-\n"
+        "\n"
+        "Each request produces an image and/or a binary range table, exactly\n"
+        "like the 'standalone' tool does. '-' means 'don't write this output'.\n"
+        "AZ_DEG are the centers of the first and last pixels. For each request\n"
+        "we write to stdout either 'OK SEQ' or 'ERROR SEQ', where SEQ is the\n"
+        "0-based index of the request. Requests may be processed out of order.\n"
+        "A 'stats' line writes the cache statistics to stdout. Empty lines and\n"
+        "lines starting with '#' are ignored.\n"
+        "\n"
+        "Loaded contexts are cached, keyed by region. The regions are squares\n"
+        "of REGION_CELLS cells on a side (default: RENDER_RADIUS_CELLS/2). We\n"
+        "keep at most --max-contexts contexts, using at most --max-memory-mb\n"
+        "of memory (estimated), evicting the least-recently-used first.\n"
+        "\n"
+        "Separately, the decoded DEM tiles are cached, so a context loaded\n"
+        "over an area that an evicted one covered doesn't decode them again.\n"
+        "This cache uses at most --dem-cache-mb of memory (default: 256).\n"
+        "0 turns it off. With --huge-pages the DEM data of each context is put\n"
+        "on transparent huge pages, if the kernel has them enabled.\n"
+        "\n"
+        "Up to --batch requests that are available on stdin at the same time\n"
+        "are coalesced, and processed grouped by region, with the already-\n"
+        "loaded regions first.\n"
+        "\n"
+        "The other options are the same as in the 'standalone' tool. With\n"
+        "--zfar, each context loads only the terrain within ZFAR of its region.\n"
+        "The cache statistics are written to stderr on exit\n";
+
+    struct option opts[] = {
+        { "width",             required_argument, NULL, 'w' },
+        { "height",            required_argument, NULL, 'H' },
+        { "radius",            required_argument, NULL, 'R' },
+        { "region-cells",      required_argument, NULL, 'g' },
+        { "max-contexts",      required_argument, NULL, 'c' },
+        { "max-memory-mb",     required_argument, NULL, 'm' },
+        { "dem-cache-mb",      required_argument, NULL, 'D' },
+        { "huge-pages",        no_argument,       NULL, 'P' },
+        { "batch",             required_argument, NULL, 'b' },
+        { "dirdems",           required_argument, NULL, 'd' },
+        { "dirtiles",          required_argument, NULL, 't' },
+        { "texture",           no_argument,       NULL, 'T' },
+        { "allow-tile-downloads",no_argument,     NULL, 'a' },
+        { "znear",             required_argument, NULL, '1' },
+        { "zfar",              required_argument, NULL, '2' },
+        { "znear-color",       required_argument, NULL, '3' },
+        { "zfar-color",        required_argument, NULL, '4' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int         width           = 0;
+    int         height          = 0;
+    const char* dir_dems        = NULL;
+    const char* dir_tiles       = NULL;
+    bool        render_texture  = false;
+    bool        allow_downloads = false;
+    int         render_radius_cells = 1000;
+    int         region_cells    = 0;
+    int         max_contexts    = MAX_CONTEXTS_DEFAULT;
+    int         max_memory_mb   = MAX_MEMORY_MB_DEFAULT;
+    int         dem_cache_mb    = (int)(HORIZONATOR_DEM_TILE_CACHE_MAX_BYTES_DEFAULT >> 20);
+    int         max_batch       = MAX_BATCH_DEFAULT;
+    bool        huge_pages      = false;
+
+    float znear       = -1.0f;
+    float zfar        = -1.0f;
+    float znear_color = -1.0f;
+    float zfar_color  = -1.0f;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "+h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+#define PARSE_POSITIVE_INT(var, name)                                   \
+            var = atoi(optarg);                                         \
+            if(var <= 0)                                                \
+            {                                                           \
+                fprintf(stderr, "--" name " must have an integer argument > 0\n"); \
+                return 1;                                               \
+            }                                                           \
+            break
+
+#define PARSE_POSITIVE_FLOAT(var, name)                                 \
+            var = (float)atof(optarg);                                  \
+            if(var <= 0.0f)                                             \
+            {                                                           \
+                fprintf(stderr, "--" name " must have an float argument > 0\n"); \
+                return 1;                                               \
+            }                                                           \
+            break
+
+        case 'w': PARSE_POSITIVE_INT(width,               "width");
+        case 'H': PARSE_POSITIVE_INT(height,              "height");
+        case 'R': PARSE_POSITIVE_INT(render_radius_cells, "radius");
+        case 'g': PARSE_POSITIVE_INT(region_cells,        "region-cells");
+        case 'c': PARSE_POSITIVE_INT(max_contexts,        "max-contexts");
+        case 'm': PARSE_POSITIVE_INT(max_memory_mb,       "max-memory-mb");
+        case 'b': PARSE_POSITIVE_INT(max_batch,           "batch");
+
+        case 'D':
+            dem_cache_mb = atoi(optarg);
+            if(dem_cache_mb < 0)
+            {
+                fprintf(stderr, "--dem-cache-mb must have an integer argument >= 0\n");
+                return 1;
+            }
+            break;
+
+        case 'P':
+            huge_pages = true;
+            break;
+
+        case '1': PARSE_POSITIVE_FLOAT(znear,       "znear");
+        case '2': PARSE_POSITIVE_FLOAT(zfar,        "zfar");
+        case '3': PARSE_POSITIVE_FLOAT(znear_color, "znear-color");
+        case '4': PARSE_POSITIVE_FLOAT(zfar_color,  "zfar-color");
+#undef PARSE_POSITIVE_INT
+#undef PARSE_POSITIVE_FLOAT
+
+        case 'd':
+            dir_dems = optarg;
+            break;
+
+        case 't':
+            dir_tiles = optarg;
+            break;
+
+        case 'T':
+            render_texture = true;
+            break;
+
+        case 'a':
+            allow_downloads = true;
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if(argc != optind)
+    {
+        fprintf(stderr, "No non-option arguments are allowed\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if(width <= 0)
+    {
+        fprintf(stderr, "--width is required\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if(height <= 0)
+        // Same default as in the standalone tool, assuming a 90deg view
+        height = (int)roundf( (float)width * 20.0f / 90.0f );
+    if(region_cells <= 0)
+        region_cells = render_radius_cells/2;
+    if(region_cells <= 0)
+        region_cells = 1;
+
+    horizonator_dem_tile_cache_set_max_bytes((size_t)dem_cache_mb << 20);
+    horizonator_dem_set_layout(HORIZONATOR_DEM_LAYOUT_TILED, huge_pages);
+
+    // The regions are laid out in the cells of the dataset
+    const int cells_per_deg =
+        horizonator_dem_cells_per_deg(dir_dems != NULL ? dir_dems : "~/.horizonator/DEMs_SRTM3");
+    if(cells_per_deg <= 0)
+    {
+        fprintf(stderr, "Couldn't determine the resolution of the DEMs\n");
+        return 1;
+    }
+
+    // With --zfar, each context loads only the terrain that its renders can
+    // reach: zfar from anywhere in its region
+    float max_range = 0.0f;
+    if(zfar > 0.0f)
+    {
+        const float meters_per_cell =
+            6371000.0f * (float)M_PI / 180.0f / (float)cells_per_deg;
+        max_range = zfar + (float)region_cells * meters_per_cell * (float)M_SQRT1_2;
+    }
+
+    // The contexts nearest the poles are the largest: their cells are the
+    // narrowest, so more of them are needed to cover max_range. Requests are
+    // limited to +-80deg
+    size_t region_bytes(float lat)
+    {
+        return context_bytes(render_radius_cells, max_range, lat, cells_per_deg,
+                             width, height, render_texture);
+    }
+
+    const size_t max_bytes = (size_t)max_memory_mb * 1024*1024;
+    const size_t bytes_per_context_max = region_bytes(80.0f);
+    if(bytes_per_context_max > max_bytes)
+    {
+        fprintf(stderr, "A single context needs ~%zu MB, which is more than the --max-memory-mb %d\n",
+                bytes_per_context_max / (1024*1024), max_memory_mb);
+        return 1;
+    }
+
+    region_t*  regions  = calloc(max_contexts, sizeof(region_t));
+    request_t* requests = malloc(max_batch * sizeof(request_t));
+    char*      image    = malloc((size_t)width*(size_t)height*3);
+    float*     ranges   = malloc((size_t)width*(size_t)height*sizeof(float));
+    if(regions == NULL || requests == NULL || image == NULL || ranges == NULL)
+    {
+        MSG("malloc() failed");
+        return 1;
+    }
+
+    FreeImage_Initialise(true);
+
+    uint64_t lru_clock      = 0;
+    size_t   bytes_resident = 0;
+    int      Nresident      = 0;
+    long     seq_next       = 0;
+    const region_t* region_prev = NULL;
+
+    region_t* find_region(const int* region_ij)
+    {
+        for(int i=0; i<max_contexts; i++)
+            if(regions[i].resident &&
+               regions[i].region_ij[0] == region_ij[0] &&
+               regions[i].region_ij[1] == region_ij[1])
+                return &regions[i];
+        return NULL;
+    }
+
+    void evict(region_t* region)
+    {
+        horizonator_deinit(&region->ctx);
+        bytes_resident -= region->bytes;
+        Nresident--;
+        region->resident = false;
+        if(region_prev == region)
+            region_prev = NULL;
+        stats.evictions++;
+    }
+
+    region_t* get_region(const int* region_ij)
+    {
+        region_t* region = find_region(region_ij);
+        if(region != NULL)
+        {
+            stats.hits++;
+            region->last_used = ++lru_clock;
+            return region;
+        }
+        stats.misses++;
+
+        // The context is centered on the region
+        float lat = ((float)region_ij[1] + 0.5f) * (float)region_cells / (float)cells_per_deg;
+        float lon = ((float)region_ij[0] + 0.5f) * (float)region_cells / (float)cells_per_deg;
+        const size_t bytes = region_bytes(lat);
+
+        // Evict until I have room
+        while(Nresident > 0 &&
+              (Nresident >= max_contexts ||
+               bytes_resident + bytes > max_bytes))
+        {
+            region_t* lru = NULL;
+            for(int i=0; i<max_contexts; i++)
+                if(regions[i].resident &&
+                   (lru == NULL || regions[i].last_used < lru->last_used))
+                    lru = &regions[i];
+            evict(lru);
+        }
+
+        for(int i=0; i<max_contexts; i++)
+            if(!regions[i].resident)
+            {
+                region = &regions[i];
+                break;
+            }
+
+        *region = (region_t){};
+        if( !horizonator_init( &region->ctx,
+                               lat, lon,
+                               width, height,
+                               render_radius_cells,
+                               max_range,
+                               0.0f,
+                               true,
+                               render_texture,
+                               dir_dems,
+                               NULL, 0,
+                               dir_tiles,
+                               allow_downloads) )
+        {
+            MSG("horizonator_init() failed for region centered at %f,%f", lat, lon);
+            horizonator_deinit(&region->ctx);
+            return NULL;
+        }
+
+        region->region_ij[0] = region_ij[0];
+        region->region_ij[1] = region_ij[1];
+        region->last_used    = ++lru_clock;
+        region->bytes        = bytes;
+        region->resident     = true;
+        bytes_resident += region->bytes;
+        Nresident++;
+        return region;
+    }
+
+    bool process(const request_t* request)
+    {
+        region_t* region = get_region(request->region_ij);
+        if(region == NULL)
+            return false;
+        if(region == region_prev)
+            stats.reused_consecutively++;
+        region_prev = region;
+
+        horizonator_context_t* ctx = &region->ctx;
+
+        // The user gave me az_deg referring to the center of the pixels at the
+        // edge. I need to convert them to represent the edges of the viewport.
+        // That's 0.5 pixels extra on either side
+        float az_per_pixel = (request->az_deg1 - request->az_deg0) / (float)(width-1);
+
+        bool write_image  = request->filename_image [0] != '\0';
+        bool write_ranges = request->filename_ranges[0] != '\0';
+
+        return
+            horizonator_move        (ctx, request->lat, request->lon) &&
+            horizonator_pan_zoom    (ctx,
+                                     request->az_deg0 - az_per_pixel/2.f,
+                                     request->az_deg1 + az_per_pixel/2.f) &&
+            horizonator_set_zextents(ctx, znear, zfar, znear_color, zfar_color) &&
+            horizonator_render_offscreen(ctx,
+                                         write_image  ? image  : NULL,
+                                         write_ranges ? ranges : NULL,
+                                         NULL) &&
+            save_results(request,
+                         write_image  ? image  : NULL,
+                         write_ranges ? ranges : NULL,
+                         width, height);
+    }
+
+    // Parses a request line. Returns false if this line is not a valid request
+    bool parse_request(request_t* request, const char* line)
+    {
+        char filename_image [sizeof(request->filename_image)];
+        char filename_ranges[sizeof(request->filename_ranges)];
+        if(6 != sscanf(line, "%f %f %f %f %511s %511s",
+                       &request->lat, &request->lon,
+                       &request->az_deg0, &request->az_deg1,
+                       filename_image, filename_ranges))
+            return false;
+
+        strcpy(request->filename_image,  strcmp(filename_image,  "-") ? filename_image  : "");
+        strcpy(request->filename_ranges, strcmp(filename_ranges, "-") ? filename_ranges : "");
+
+        if( request->lat < -80.f  || request->lat > 80.f  ||
+            request->lon < -180.f || request->lon > 180.f ||
+            request->az_deg0 >= request->az_deg1 )
+            return false;
+
+        request->region_ij[0] = (int)floorf(request->lon * (float)cells_per_deg / (float)region_cells);
+        request->region_ij[1] = (int)floorf(request->lat * (float)cells_per_deg / (float)region_cells);
+        return true;
+    }
+
+    linereader_t* reader = calloc(1, sizeof(linereader_t));
+    if(reader == NULL)
+    {
+        MSG("malloc() failed");
+        return 1;
+    }
+    reader->fd = 0;
+
+    while(true)
+    {
+        // Read a batch: block for the first request, then take whatever else is
+        // available right now
+        int Nrequests = 0;
+        while(Nrequests < max_batch)
+        {
+            char* line = read_line(reader, Nrequests == 0);
+            if(line == NULL)
+                break;
+
+            while(*line == ' ' || *line == '\t') line++;
+            if(*line == '\0' || *line == '#')
+                continue;
+            if(0 == strncmp(line, "stats", 5))
+            {
+                print_stats(stdout, Nresident, bytes_resident);
+                continue;
+            }
+
+            request_t* request = &requests[Nrequests];
+            request->seq = seq_next++;
+            stats.requests++;
+            if(!parse_request(request, line))
+            {
+                MSG("Couldn't parse request '%s'", line);
+                printf("ERROR %ld\n", request->seq);
+                fflush(stdout);
+                stats.failures++;
+                continue;
+            }
+            Nrequests++;
+        }
+        if(Nrequests == 0 && reader->eof)
+            break;
+
+        // Reorder: resident regions first, most-recently-used first. Then the
+        // other regions, in the order they first appear in the batch. Within a
+        // region the arrival order is kept
+        for(int i=0; i<Nrequests; i++)
+        {
+            request_t* request = &requests[i];
+            const region_t* region = find_region(request->region_ij);
+            if(region != NULL)
+            {
+                request->sort_class = 0;
+                request->sort_key   = -(int64_t)region->last_used;
+            }
+            else
+            {
+                request->sort_class = 1;
+                request->sort_key   = request->seq;
+                for(int j=0; j<i; j++)
+                    if(requests[j].region_ij[0] == request->region_ij[0] &&
+                       requests[j].region_ij[1] == request->region_ij[1])
+                    {
+                        request->sort_key = requests[j].sort_key;
+                        break;
+                    }
+            }
+        }
+        qsort(requests, Nrequests, sizeof(requests[0]), compare_requests);
+
+        for(int i=0; i<Nrequests; i++)
+        {
+            if(i > 0 && requests[i].seq < requests[i-1].seq)
+                stats.reordered++;
+
+            if(process(&requests[i]))
+                printf("OK %ld\n", requests[i].seq);
+            else
+            {
+                printf("ERROR %ld\n", requests[i].seq);
+                stats.failures++;
+            }
+            fflush(stdout);
+        }
+    }
+
+    print_stats(stderr, Nresident, bytes_resident);
+
+    for(int i=0; i<max_contexts; i++)
+        if(regions[i].resident)
+            evict(&regions[i]);
+
+    FreeImage_DeInitialise();
+    free(reader);
+    free(ranges);
+    free(image);
+    free(requests);
+    free(regions);
+    return 0;
+}
@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <string.h>
 
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#endif
+
 #include <epoxy/gl.h>
 #include <epoxy/glx.h>
 #include <GL/freeglut.h>
@@ -42,6 +46,1320 @@
     } while(0)
 
 
+void horizonator_set_stage_callback(horizonator_context_t* ctx,
+                                    horizonator_stage_callback_t* callback,
+                                    void* cookie)
+{
+    ctx->stage_callback        = callback;
+    ctx->stage_callback_cookie = cookie;
+}
+
+const char* horizonator_stage_name(horizonator_stage_t stage)
+{
+    static const char* names[] =
+        {
+            [HORIZONATOR_STAGE_DEM_OPEN]         = "dem_open",
+            [HORIZONATOR_STAGE_MESH_SIMPLIFY]    = "mesh_simplify",
+            [HORIZONATOR_STAGE_VERTEX_FILL]      = "vertex_fill",
+            [HORIZONATOR_STAGE_INDEX_BUILD]      = "index_build",
+            [HORIZONATOR_STAGE_TEXTURE_LOAD]     = "texture_load",
+            [HORIZONATOR_STAGE_SHADER_COMPILE]   = "shader_compile",
+            [HORIZONATOR_STAGE_PROJECT]          = "project",
+            [HORIZONATOR_STAGE_DRAW]             = "draw",
+            [HORIZONATOR_STAGE_READPIXELS]       = "readpixels",
+            [HORIZONATOR_STAGE_FLIP]             = "flip",
+            [HORIZONATOR_STAGE_RANGE_CONVERSION] = "range_conversion",
+            [HORIZONATOR_STAGE_GEOLOCATION]      = "geolocation",
+        };
+    static_assert(sizeof(names)/sizeof(names[0]) == HORIZONATOR_STAGE_COUNT,
+                  "Every stage must have a name");
+
+    if(stage < 0 || stage >= HORIZONATOR_STAGE_COUNT)
+        return "unknown";
+    return names[stage];
+}
+
+typedef struct
+{
+    double wall0, cpu0;
+} stage_timer_t;
+
+static void stage_begin(stage_timer_t* timer)
+{
+    timer->wall0 = bench_wall_seconds();
+    timer->cpu0  = bench_cpu_seconds();
+}
+static void stage_end(horizonator_context_t* ctx,
+                      stage_timer_t* timer, horizonator_stage_t stage)
+{
+    double wall = bench_wall_seconds() - timer->wall0;
+    double cpu  = bench_cpu_seconds()  - timer->cpu0;
+
+    ctx->stats.stages[stage].wall_s += wall;
+    ctx->stats.stages[stage].cpu_s  += cpu;
+    ctx->stats.stages[stage].count++;
+
+    if(ctx->stage_callback != NULL)
+        ctx->stage_callback(stage, wall, ctx->stage_callback_cookie);
+}
+
+// Reads the results of the GL queries issued by the previous
+// horizonator_redraw() calls, oldest first. This waits for the oldest Nwait
+// sets. After those, it stops at the first set whose results aren't available
+// yet
+static void collect_queries(horizonator_context_t* ctx, int Nwait)
+{
+    for(int i=0; ctx->queries.Npending > 0; i++)
+    {
+        const int q = ctx->queries.first_pending;
+
+        if(i >= Nwait)
+        {
+            // The timer query ended first, so if primitives_generated is
+            // available, it is too
+            GLuint available;
+            glGetQueryObjectuiv(ctx->queries.primitives_generated[q],
+                                GL_QUERY_RESULT_AVAILABLE, &available);
+            assert_opengl();
+            if(!available)
+                return;
+        }
+
+        GLuint primitives_generated;
+        glGetQueryObjectuiv(ctx->queries.primitives_generated[q], GL_QUERY_RESULT,
+                            &primitives_generated);
+        assert_opengl();
+        if(ctx->queries.triangles_pending[q] > (uint64_t)primitives_generated)
+            ctx->stats.triangles_culled_seam +=
+                ctx->queries.triangles_pending[q] - (uint64_t)primitives_generated;
+
+        if(ctx->queries.have_gpu_timer)
+        {
+            GLuint64 gpu_time_ns;
+            glGetQueryObjectui64v(ctx->queries.gpu_time[q], GL_QUERY_RESULT,
+                                  &gpu_time_ns);
+            assert_opengl();
+            ctx->stats.stages[HORIZONATOR_STAGE_DRAW].gpu_s += (double)gpu_time_ns * 1e-9;
+        }
+
+        ctx->queries.first_pending = (q + 1) % HORIZONATOR_QUERY_SETS;
+        ctx->queries.Npending--;
+    }
+}
+
+
+// The occlusion culling tracks the horizon in this many azimuth bins
+#define HORIZON_BINS 1024
+
+static void free_chunks(horizonator_context_t* ctx)
+{
+    free(ctx->chunks);
+    free(ctx->chunks_by_distance0);
+    free(ctx->chunks_by_distance1);
+    free(ctx->horizon_occluders);
+    free(ctx->horizon_near);
+    free(ctx->draw_counts);
+    free(ctx->draw_offsets);
+    ctx->chunks              = NULL;
+    ctx->chunks_by_distance0 = NULL;
+    ctx->chunks_by_distance1 = NULL;
+    ctx->horizon_occluders   = NULL;
+    ctx->horizon_near        = NULL;
+    ctx->draw_counts         = NULL;
+    ctx->draw_offsets        = NULL;
+    ctx->Nchunks             = 0;
+}
+
+// Meters per cell, in each direction. This is what project.glsl uses
+static void meters_per_cell(const horizonator_context_t* ctx,
+                            float* de, float* dn)
+{
+    const float Rearth = 6371000.0f;
+
+    *dn = Rearth * (float)M_PI / 180.0f /
+        (float)(ctx->dems.cells_per_deg * ctx->near.scale);
+    *de = *dn * ctx->view.cos_viewer_lat;
+}
+
+static int floor_div(int a, int b)
+{
+    return a >= 0 ? a/b : -((-a + b-1) / b);
+}
+
+// Width (and height) of the render grid, in vertices. See
+// horizonator_context_t.near
+static int grid_width(const horizonator_context_t* ctx)
+{
+    return (horizonator_dem_mosaic_width(&ctx->dems) - 1)*ctx->near.scale + 1;
+}
+
+// Is the grid cell (i,j)-(i+1,j+1) drawn from the near field?
+static bool cell_is_near(const horizonator_context_t* ctx, int i, int j)
+{
+    return
+        ctx->near.dems.mosaic != NULL &&
+        i >= ctx->near.i0 && i < ctx->near.i1 &&
+        j >= ctx->near.j0 && j < ctx->near.j1;
+}
+
+// The near-field sample at the grid vertex (i,j). This must be in
+// [near.i0,near.i1] x [near.j0,near.j1]
+static int16_t near_at(const horizonator_context_t* ctx, int i, int j)
+{
+    return horizonator_dem_mosaic_at(&ctx->near.dems,
+                                     i - ctx->near.i0 + ctx->near.mosaic_i0,
+                                     j - ctx->near.j0 + ctx->near.mosaic_j0);
+}
+
+// The highest terrain in the grid cell (i,j)-(i+1,j+1). In the far field this
+// is the highest corner of the far cell containing it. Out-of-bounds samples
+// read as -1, like in horizonator_dem_sample()
+static float cell_zmax(const horizonator_context_t* ctx, int i, int j)
+{
+    if(cell_is_near(ctx, i, j))
+        return fmaxf(fmaxf(near_at(ctx, i,   j  ), near_at(ctx, i+1, j  )),
+                     fmaxf(near_at(ctx, i,   j+1), near_at(ctx, i+1, j+1)));
+
+    int ifar = floor_div(i, ctx->near.scale);
+    int jfar = floor_div(j, ctx->near.scale);
+    return fmaxf(fmaxf(horizonator_dem_sample(&ctx->dems, ifar,   jfar  ),
+                       horizonator_dem_sample(&ctx->dems, ifar+1, jfar  )),
+                 fmaxf(horizonator_dem_sample(&ctx->dems, ifar,   jfar+1),
+                       horizonator_dem_sample(&ctx->dems, ifar+1, jfar+1)));
+}
+
+// The far-field sample at the grid vertex (i,j). i,j must be multiples of
+// near.scale
+static int16_t far_at(const horizonator_context_t* ctx, int i, int j)
+{
+    return horizonator_dem_mosaic_at(&ctx->dems,
+                                     i / ctx->near.scale, j / ctx->near.scale);
+}
+
+// How many grid vertices there are on the boundary of the near field
+static int near_boundary_length(const horizonator_context_t* ctx)
+{
+    return 2*((ctx->near.i1 - ctx->near.i0) + (ctx->near.j1 - ctx->near.j0));
+}
+
+// The grid vertex p of the boundary of the near field. These go around
+// counterclockwise, starting at the SW corner. p wraps around
+static void near_boundary_vertex(// output
+                                 int* i, int* j,
+
+                                 // input
+                                 const horizonator_context_t* ctx, int p)
+{
+    const int Ni = ctx->near.i1 - ctx->near.i0;
+    const int Nj = ctx->near.j1 - ctx->near.j0;
+    p %= near_boundary_length(ctx);
+
+    if     (p < Ni)        { *i = ctx->near.i0 + p;             *j = ctx->near.j0;                 }
+    else if(p < Ni+Nj)     { *i = ctx->near.i1;                 *j = ctx->near.j0 + p-Ni;          }
+    else if(p < 2*Ni+Nj)   { *i = ctx->near.i1 - (p-Ni-Nj);     *j = ctx->near.j1;                 }
+    else                   { *i = ctx->near.i0;                 *j = ctx->near.j1 - (p-2*Ni-Nj);   }
+}
+
+// The bottoms of the skirts. Between the boundary vertices p and p+1, the
+// near-field terrain is a line segment, and so is the far-field terrain. Where
+// the near field is higher, the near-field skirt must reach down to the far
+// field, and vice versa; then the gap between the two is always covered.
+//
+// The bottom of the near-field skirt under vertex p is below both fields
+// there. Both fields are linear between the boundary vertices, and so is the
+// bottom, so it stays below both.
+//
+// The far-field skirt under far cell q (the boundary vertices [q*scale,
+// (q+1)*scale]) has a flat bottom, below every near-field vertex along it
+static int16_t skirt_bottom_near(const horizonator_context_t* ctx, int p)
+{
+    const int s = ctx->near.scale;
+    const int q = p / s;
+
+    int i, j, i0, j0, i1, j1;
+    near_boundary_vertex(&i,  &j,  ctx, p);
+    near_boundary_vertex(&i0, &j0, ctx, q*s);
+    near_boundary_vertex(&i1, &j1, ctx, (q+1)*s);
+
+    float t = (float)(p - q*s) / (float)s;
+    float z_far = (1.0f - t)*(float)far_at(ctx, i0, j0) + t*(float)far_at(ctx, i1, j1);
+    float z     = fminf((float)near_at(ctx, i, j), floorf(z_far));
+    return (int16_t)z;
+}
+static int16_t skirt_bottom_far(const horizonator_context_t* ctx, int q)
+{
+    const int s = ctx->near.scale;
+
+    int i0, j0, i1, j1;
+    near_boundary_vertex(&i0, &j0, ctx, q*s);
+    near_boundary_vertex(&i1, &j1, ctx, (q+1)*s);
+    int16_t z = far_at(ctx, i0, j0);
+    if(z > far_at(ctx, i1, j1)) z = far_at(ctx, i1, j1);
+
+    for(int p=q*s; p<=(q+1)*s; p++)
+    {
+        int i, j;
+        near_boundary_vertex(&i, &j, ctx, p);
+        if(z > near_at(ctx, i, j)) z = near_at(ctx, i, j);
+    }
+    return z;
+}
+
+// Places the near-field DEMs, just loaded into ctx->near.dems, into the render
+// grid. The near field is the largest block of whole far-field chunks inside
+// the near-field mosaic
+static bool near_field_init(horizonator_context_t* ctx)
+{
+    const int cpd_far  = ctx->dems.cells_per_deg;
+    const int cpd_near = ctx->near.dems.cells_per_deg;
+    if(cpd_near < cpd_far || cpd_near % cpd_far != 0)
+    {
+        MSG("The near-field DEMs have %d cells per degree. This must be a multiple of the %d cells per degree of the far-field DEMs",
+            cpd_near, cpd_far);
+        return false;
+    }
+    const int s = cpd_near / cpd_far;
+    ctx->near.scale = s;
+
+    const int C     = HORIZONATOR_CHUNK_CELLS;
+    const int Wfar  = horizonator_dem_mosaic_width(&ctx->dems);
+    const int Wnear = horizonator_dem_mosaic_width(&ctx->near.dems);
+
+    // The vertices are stored in 16 bits
+    if((Wfar-1)*s > INT16_MAX)
+    {
+        MSG("The far-field radius is too large for the resolution of the near field: the grid would have %d cells on each side. At most %d are supported",
+            (Wfar-1)*s, INT16_MAX);
+        return false;
+    }
+
+    // The far-field chunks that are full-size
+    const int Nchunks_full = (Wfar-1) / C;
+
+    int bounds[2][2];
+    int mosaic0[2];
+    for(int d=0; d<2; d++)
+    {
+        // Where the near-field mosaic starts, in the grid
+        int offset =
+            (ctx->near.dems.origin_dem_lon_lat[d]*cpd_near + ctx->near.dems.origin_dem_cellij[d]) -
+            (ctx->dems.origin_dem_lon_lat[d]*cpd_far + ctx->dems.origin_dem_cellij[d]) * s;
+
+        int c0 = -floor_div(-offset,          C*s);
+        int c1 =  floor_div(offset + Wnear-1, C*s);
+        if(c0 < 0)            c0 = 0;
+        if(c1 > Nchunks_full) c1 = Nchunks_full;
+        if(c1 <= c0)
+        {
+            MSG("The near field is too small: it must cover at least one whole chunk (%d far-field cells) in each direction",
+                C);
+            return false;
+        }
+        bounds[d][0] = c0*C*s;
+        bounds[d][1] = c1*C*s;
+        mosaic0[d]   = bounds[d][0] - offset;
+    }
+
+    ctx->near.i0        = bounds[0][0];
+    ctx->near.i1        = bounds[0][1];
+    ctx->near.j0        = bounds[1][0];
+    ctx->near.j1        = bounds[1][1];
+    ctx->near.mosaic_i0 = mosaic0[0];
+    ctx->near.mosaic_j0 = mosaic0[1];
+    return true;
+}
+
+// The position of lat,lon in the render grid: in the cells of the near field,
+// if there is one
+static void grid_position(// output
+                          float* i, float* j,
+
+                          // input
+                          const horizonator_context_t* ctx,
+                          float lat, float lon)
+{
+    *i = ((lon - ctx->dems.origin_dem_lon_lat[0]) * ctx->dems.cells_per_deg -
+          ctx->dems.origin_dem_cellij[0]) * ctx->near.scale;
+    *j = ((lat - ctx->dems.origin_dem_lon_lat[1]) * ctx->dems.cells_per_deg -
+          ctx->dems.origin_dem_cellij[1]) * ctx->near.scale;
+}
+
+// Meters per cell of a dataset with cells_per_deg cells per degree, at the
+// center of the loaded range. Like meters_per_cell(), but doesn't need the
+// viewer to be placed yet
+static void range_meters_per_cell(const horizonator_context_t* ctx,
+                                  int cells_per_deg,
+                                  float* de, float* dn)
+{
+    const float Rearth = 6371000.0f;
+
+    *dn = Rearth * (float)M_PI / 180.0f / (float)cells_per_deg;
+    *de = *dn * cosf(ctx->range.lat * (float)M_PI / 180.0f);
+}
+
+// How many cells of a dataset with cells_per_deg cells per degree must be
+// loaded in each direction to cover the loaded range, clamped to
+// [min_cells,max_cells]. The cells are narrowest to the E and W, so that's
+// what I look at
+static int range_radius_cells(const horizonator_context_t* ctx,
+                              int cells_per_deg,
+                              int min_cells, int max_cells)
+{
+    float de, dn;
+    range_meters_per_cell(ctx, cells_per_deg, &de, &dn);
+
+    // The viewer sits between cells radius_cells-1 and radius_cells
+    float r = ceilf(ctx->range.loaded / de) + 1.0f;
+    if(r < (float)min_cells) r = (float)min_cells;
+    if(r > (float)max_cells) r = (float)max_cells;
+    return (int)r;
+}
+
+// At this range, the disk covers the whole square of radius_cells_max cells
+// around the center: everything that can be loaded is loaded
+static float range_complete(const horizonator_context_t* ctx,
+                            int cells_per_deg)
+{
+    float de, dn;
+    range_meters_per_cell(ctx, cells_per_deg, &de, &dn);
+    return (float)ctx->range.radius_cells_max * hypotf(de, dn);
+}
+
+// The bounds of the rectangle [i0,i1] x [j0,j1] of the mosaic, as seen from
+// the viewer: the horizontal distances to its nearest and farthest points,
+// and its azimuth extent, in radians, with az0 <= az1 < az0 + 2pi. If the
+// viewer is inside the rectangle, it is seen all around
+static void rectangle_bounds(// output
+                             float* distance0, float* distance1,
+                             float* az0, float* az1,
+
+                             // input
+                             const horizonator_context_t* ctx,
+                             float i0, float j0, float i1, float j1)
+{
+    float de, dn;
+    meters_per_cell(ctx, &de, &dn);
+
+    // Relative to the viewer, in meters
+    float e0 = (i0 - ctx->view.viewer_cell_i) * de;
+    float e1 = (i1 - ctx->view.viewer_cell_i) * de;
+    float n0 = (j0 - ctx->view.viewer_cell_j) * dn;
+    float n1 = (j1 - ctx->view.viewer_cell_j) * dn;
+
+    // The nearest point, and the farthest corner
+    float e_near = e0 > 0.0f ? e0 : (e1 < 0.0f ? e1 : 0.0f);
+    float n_near = n0 > 0.0f ? n0 : (n1 < 0.0f ? n1 : 0.0f);
+    float e_far  = fmaxf(fabsf(e0), fabsf(e1));
+    float n_far  = fmaxf(fabsf(n0), fabsf(n1));
+    *distance0 = hypotf(e_near, n_near);
+    *distance1 = hypotf(e_far,  n_far);
+
+    if(e_near == 0.0f && n_near == 0.0f)
+    {
+        *az0 = 0.0f;
+        *az1 = 2.0f*(float)M_PI;
+        return;
+    }
+
+    // The rectangle is convex, and the viewer is outside of it, so it spans
+    // less than pi in azimuth. Its extent is the span of its corners,
+    // unwrapped around its center
+    float az_center = atan2f((e0+e1)/2.0f, (n0+n1)/2.0f);
+    *az0 =  INFINITY;
+    *az1 = -INFINITY;
+    for(int k=0; k<4; k++)
+    {
+        float az = atan2f( k&1 ? e1 : e0,
+                           k&2 ? n1 : n0 );
+        az = az_center + remainderf(az - az_center, 2.0f*(float)M_PI);
+        *az0 = fminf(*az0, az);
+        *az1 = fmaxf(*az1, az);
+    }
+}
+
+// The horizon bins touched by the azimuth range [az0,az1] are [*b0,*b1]. These
+// may extend past [0,HORIZON_BINS), and wrap around. If "inside", only the
+// bins entirely within the range are reported, and *b1 < *b0 if there are
+// none. Returns false if all the bins are touched
+static bool horizon_bins(// output
+                         int* b0, int* b1,
+
+                         // input
+                         float az0, float az1, bool inside)
+{
+    const float bins_per_rad = (float)HORIZON_BINS / (2.0f*(float)M_PI);
+
+    if(inside)
+    {
+        *b0 = (int)ceilf (az0 * bins_per_rad);
+        *b1 = (int)floorf(az1 * bins_per_rad) - 1;
+    }
+    else
+    {
+        *b0 = (int)floorf(az0 * bins_per_rad);
+        *b1 = (int)floorf(az1 * bins_per_rad);
+    }
+    return *b1 - *b0 + 1 < HORIZON_BINS;
+}
+static int horizon_bin_wrap(int b)
+{
+    b %= HORIZON_BINS;
+    return b < 0 ? b + HORIZON_BINS : b;
+}
+
+// Recomputes the azimuth and distance bounds of each chunk, as seen from the
+// viewer, and the orderings of the chunks by distance. Called whenever the
+// viewer moves
+static void update_chunk_bounds(horizonator_context_t* ctx)
+{
+    for(int c=0; c<ctx->Nchunks; c++)
+    {
+        horizonator_chunk_t* chunk = &ctx->chunks[c];
+        rectangle_bounds(&chunk->distance0, &chunk->distance1,
+                         &chunk->az0, &chunk->az1,
+                         ctx,
+                         (float)chunk->i0, (float)chunk->j0,
+                         (float)chunk->i1, (float)chunk->j1);
+
+        ctx->chunks_by_distance0[c] = c;
+        ctx->chunks_by_distance1[c] = c;
+    }
+
+    int compare_distance0(const void* a, const void* b)
+    {
+        float da = ctx->chunks[*(const int*)a].distance0;
+        float db = ctx->chunks[*(const int*)b].distance0;
+        return (da > db) - (da < db);
+    }
+    int compare_distance1(const void* a, const void* b)
+    {
+        float da = ctx->chunks[*(const int*)a].distance1;
+        float db = ctx->chunks[*(const int*)b].distance1;
+        return (da > db) - (da < db);
+    }
+    qsort(ctx->chunks_by_distance0, ctx->Nchunks, sizeof(int), compare_distance0);
+    qsort(ctx->chunks_by_distance1, ctx->Nchunks, sizeof(int), compare_distance1);
+}
+
+// Fills in ctx->horizon_near: in each bin, an upper bound on the slope of the
+// terrain at horizontal distance r0 from the viewer. This is the near edge of
+// the drawn terrain. I look at each grid cell that the circle of radius r0
+// passes through
+static void update_horizon_near(horizonator_context_t* ctx, float r0)
+{
+    const int W = grid_width(ctx);
+
+    for(int b=0; b<HORIZON_BINS; b++)
+        ctx->horizon_near[b] = -INFINITY;
+
+    float de, dn;
+    meters_per_cell(ctx, &de, &dn);
+
+    int i0 = (int)floorf(ctx->view.viewer_cell_i - r0/de) - 1;
+    int i1 = (int)ceilf (ctx->view.viewer_cell_i + r0/de) + 1;
+    int j0 = (int)floorf(ctx->view.viewer_cell_j - r0/dn) - 1;
+    int j1 = (int)ceilf (ctx->view.viewer_cell_j + r0/dn) + 1;
+    if(i0 < 0)   i0 = 0;
+    if(j0 < 0)   j0 = 0;
+    if(i1 > W-2) i1 = W-2;
+    if(j1 > W-2) j1 = W-2;
+
+    for(int j=j0; j<=j1; j++)
+        for(int i=i0; i<=i1; i++)
+        {
+            float distance0, distance1, az0, az1;
+            rectangle_bounds(&distance0, &distance1, &az0, &az1,
+                             ctx,
+                             (float)i, (float)j, (float)(i+1), (float)(j+1));
+            if(r0 < distance0 || r0 > distance1)
+                continue;
+
+            float zmax = cell_zmax(ctx, i, j);
+
+            // The simplified mesh isn't bounded by the corners of each cell,
+            // but it is bounded by its chunk
+            int ci = i / HORIZONATOR_CHUNK_CELLS;
+            int cj = j / HORIZONATOR_CHUNK_CELLS;
+            if(ctx->mesh.data != NULL &&
+               !(abs(ci - ctx->patch_ci) <= 1 && abs(cj - ctx->patch_cj) <= 1))
+                zmax = ctx->chunks[cj*ctx->Nchunks_side + ci].zmax;
+            float slope = (zmax - ctx->view.viewer_z) / r0;
+
+            int b0, b1;
+            if(!horizon_bins(&b0, &b1, az0, az1, false))
+            {
+                b0 = 0;
+                b1 = HORIZON_BINS-1;
+            }
+            for(int b=b0; b<=b1; b++)
+            {
+                float* h = &ctx->horizon_near[horizon_bin_wrap(b)];
+                if(*h < slope) *h = slope;
+            }
+        }
+}
+
+// Fills in the glMultiDrawElements() arguments with the chunks that should be
+// drawn, nearest first. Returns the number of chunks to draw. The number of
+// triangles drawn and culled is accumulated into the given counters.
+//
+// Chunks that lie outside the view (the azimuth bounds or [znear,zfar]) are
+// culled. So are the chunks that are hidden behind nearer terrain. For that I
+// maintain a conservative horizon, in azimuth bins, as I go through the
+// chunks from near to far. All the slopes are (z - viewer_z) / distance.
+//
+// - A chunk can act as an occluder in the bins it covers entirely. Every line
+//   of sight in those bins crosses the chunk, and the terrain there is at least
+//   as high as zmin. So the horizon is at least the lowest possible slope of
+//   that terrain. The occluder must be drawn completely: not clipped by
+//   [znear,zfar], and not crossing the seam behind the view, where the
+//   geometry shader throws out triangles
+//
+// - A chunk is hidden if its highest possible slope is below the horizon of
+//   the occluders in front of it, in every bin it touches. This also requires
+//   that the lines of sight to the chunk start out above the terrain at the
+//   near edge of the render, in horizon_near. Otherwise they pass under the
+//   terrain there, through the near clipping plane, where nothing is drawn
+static int cull_chunks(horizonator_context_t* ctx,
+                       uint64_t* Ntriangles_drawn,
+                       uint64_t* Ntriangles_culled_view,
+                       uint64_t* Ntriangles_culled_occlusion)
+{
+    // A bit of slack, to not lose any triangles to round-off
+    const float margin       = 1e-3f;
+    const float margin_slope = 1e-4f;
+
+    // This is what vertex.glsl does: az1 is within 2pi after az0
+    float az0   = ctx->view.az_deg0 * (float)M_PI / 180.0f;
+    float width = ctx->view.az_deg1 * (float)M_PI / 180.0f - az0;
+    width -= 2.0f*(float)M_PI * roundf( (width - (float)M_PI) / (2.0f*(float)M_PI) );
+
+    // geometry.glsl throws out triangles that cross the seam, directly behind
+    // the view center
+    float az_seam = az0 + width/2.0f + (float)M_PI;
+
+    // Terrain nearer than this isn't drawn
+    float distance_drawn = ctx->view.znear;
+    update_horizon_near(ctx, distance_drawn);
+    for(int b=0; b<HORIZON_BINS; b++)
+        ctx->horizon_occluders[b] = -INFINITY;
+
+    const float viewer_z = ctx->view.viewer_z;
+
+    int Ndraws      = 0;
+    int Noccluders  = 0;
+    for(int k=0; k<ctx->Nchunks; k++)
+    {
+        const horizonator_chunk_t* chunk = &ctx->chunks[ctx->chunks_by_distance0[k]];
+
+        // Every chunk entirely in front of this one contributes to the
+        // horizon of the occluders
+        while(Noccluders < ctx->Nchunks)
+        {
+            const horizonator_chunk_t* occluder =
+                &ctx->chunks[ctx->chunks_by_distance1[Noccluders]];
+            if(occluder->distance1 > chunk->distance0)
+                break;
+            Noccluders++;
+
+            float d_seam = az_seam - occluder->az0;
+            d_seam -= 2.0f*(float)M_PI * floorf( d_seam / (2.0f*(float)M_PI) );
+
+            int b0, b1;
+            if(occluder->distance0 < distance_drawn                     ||
+               occluder->distance1 > ctx->view.zfar                     ||
+               d_seam <= occluder->az1 - occluder->az0 + margin         ||
+               d_seam >= 2.0f*(float)M_PI - margin                      ||
+               !horizon_bins(&b0, &b1, occluder->az0, occluder->az1, true))
+                continue;
+
+            float z     = (float)occluder->zmin - viewer_z;
+            float slope = z / (z >= 0.0f ? occluder->distance1 : occluder->distance0);
+            for(int b=b0; b<=b1; b++)
+            {
+                float* h = &ctx->horizon_occluders[horizon_bin_wrap(b)];
+                if(*h < slope) *h = slope;
+            }
+        }
+
+        bool visible =
+            chunk->distance1 >= ctx->view.znear - margin &&
+            chunk->distance0 <= ctx->view.zfar  + margin;
+
+        if(visible && width < 2.0f*(float)M_PI - margin)
+        {
+            // Where the chunk starts, counting clockwise from the left edge
+            // of the view
+            float d = chunk->az0 - az0;
+            d -= 2.0f*(float)M_PI * floorf( d / (2.0f*(float)M_PI) );
+            visible =
+                d                                 <= width + margin ||
+                d + (chunk->az1 - chunk->az0)     >= 2.0f*(float)M_PI - margin;
+        }
+
+        if(!visible)
+        {
+            *Ntriangles_culled_view += chunk->Ntriangles;
+            continue;
+        }
+
+        int b0, b1;
+        if(chunk->distance0 > 0.0f &&
+           horizon_bins(&b0, &b1, chunk->az0, chunk->az1, false))
+        {
+            float zmax      = (float)chunk->zmax - viewer_z;
+            float zmin      = (float)chunk->zmin - viewer_z;
+            float slope_max = zmax / (zmax >= 0.0f ? chunk->distance0 : chunk->distance1);
+            float slope_min = zmin / (zmin >= 0.0f ? chunk->distance1 : chunk->distance0);
+
+            bool hidden = true;
+            for(int b=b0; b<=b1 && hidden; b++)
+            {
+                int bw = horizon_bin_wrap(b);
+                hidden =
+                    slope_max + margin_slope < ctx->horizon_occluders[bw] &&
+                    slope_min - margin_slope > ctx->horizon_near     [bw];
+            }
+            if(hidden)
+            {
+                *Ntriangles_culled_occlusion += chunk->Ntriangles;
+                continue;
+            }
+        }
+
+        ctx->draw_counts [Ndraws] = 3*chunk->Ntriangles;
+        ctx->draw_offsets[Ndraws] = (const void*)((size_t)chunk->index0 * sizeof(GLuint));
+        Ndraws++;
+        *Ntriangles_drawn += chunk->Ntriangles;
+    }
+    return Ndraws;
+}
+
+// Frees everything terrain_init() made, except the GL buffers
+static void terrain_deinit(horizonator_context_t* ctx)
+{
+    horizonator_dem_deinit(&ctx->dems);
+    horizonator_dem_deinit(&ctx->near.dems);
+    horizonator_mesh_deinit(&ctx->mesh);
+    free_chunks(ctx);
+    ctx->Nvertices  = 0;
+    ctx->Ntriangles = 0;
+}
+
+// Whether the context has terrain. It doesn't if extending the range failed,
+// and the old terrain couldn't be rebuilt either. Such a context can't be used
+// anymore: every call that needs the terrain fails
+static bool have_terrain(const horizonator_context_t* ctx)
+{
+    if(ctx->dems.mosaic == NULL)
+    {
+        MSG("The terrain couldn't be loaded. This context is unusable");
+        return false;
+    }
+    return true;
+}
+
+// Loads the DEMs out to ctx->range.loaded, and builds the terrain from them:
+// the vertex and index buffers, and the chunks. Called by horizonator_init(),
+// and again by horizonator_redraw() when the view reaches past the loaded
+// range. The vertex array object must be bound
+static bool terrain_init(horizonator_context_t* ctx)
+{
+    bool  result         = false;
+    bool* chunk_in_range = NULL;
+    int*  row_i0         = NULL;
+    int*  row_i1         = NULL;
+    int*  row_vertex0    = NULL;
+
+    const int C = HORIZONATOR_CHUNK_CELLS;
+
+    ctx->patch_ci = -1;
+    ctx->patch_cj = -1;
+    ctx->near     = (typeof(ctx->near)){ .scale = 1 };
+
+    stage_timer_t timer;
+
+    stage_begin(&timer);
+
+    // The DEMs are loaded only as far as the range reaches. I always load a
+    // few chunks in each direction, to keep the mesh sane
+    int radius_cells = ctx->range.radius_cells_max;
+    if(isfinite(ctx->range.loaded))
+    {
+        const int cells_per_deg = horizonator_dem_cells_per_deg(ctx->range.dir_dems);
+        if(cells_per_deg <= 0)
+        {
+            MSG("Couldn't determine the resolution of the DEMs. Giving up");
+            goto done;
+        }
+        if(ctx->range.loaded >= range_complete(ctx, cells_per_deg))
+            ctx->range.loaded = INFINITY;
+        radius_cells = range_radius_cells(ctx, cells_per_deg,
+                                          2*C, ctx->range.radius_cells_max);
+    }
+    if( !horizonator_dem_init( &ctx->dems,
+                               ctx->range.lat, ctx->range.lon,
+                               radius_cells,
+                               ctx->range.dir_dems) )
+    {
+        MSG("Couldn't init DEMs. Giving up");
+        goto done;
+    }
+
+    if(ctx->range.dir_dems_near != NULL)
+    {
+        // The near field must still cover a few far chunks
+        int near_radius_cells = ctx->range.near_radius_cells;
+        if(isfinite(ctx->range.loaded))
+        {
+            const int cells_per_deg = horizonator_dem_cells_per_deg(ctx->range.dir_dems_near);
+            if(cells_per_deg <= 0)
+            {
+                MSG("Couldn't determine the resolution of the near-field DEMs. Giving up");
+                goto done;
+            }
+            near_radius_cells =
+                range_radius_cells(ctx, cells_per_deg,
+                                   2*C * (cells_per_deg / ctx->dems.cells_per_deg),
+                                   ctx->range.near_radius_cells);
+        }
+        if( !horizonator_dem_init( &ctx->near.dems,
+                                   ctx->range.lat, ctx->range.lon,
+                                   near_radius_cells,
+                                   ctx->range.dir_dems_near) )
+        {
+            MSG("Couldn't init the near-field DEMs. Giving up");
+            goto done;
+        }
+        if(!near_field_init(ctx))
+            goto done;
+    }
+    stage_end(ctx, &timer, HORIZONATOR_STAGE_DEM_OPEN);
+
+    if(ctx->range.mesh_tolerance > 0.0f)
+    {
+        stage_begin(&timer);
+        if( !horizonator_mesh_init( &ctx->mesh, &ctx->dems,
+                                    ctx->range.mesh_tolerance,
+                                    HORIZONATOR_CHUNK_CELLS,
+                                    HORIZONATOR_MESH_CACHEDIR) )
+        {
+            MSG("Couldn't build the simplified mesh. Giving up");
+            goto done;
+        }
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_MESH_SIMPLIFY);
+    }
+
+    const int s            = ctx->near.scale;
+    const int Wfar         = horizonator_dem_mosaic_width(&ctx->dems);
+    const int Wcells       = Wfar - 1;
+    const int Nchunks_side = (Wcells + C-1) / C;
+    assert(ctx->mesh.data == NULL || ctx->mesh.Nchunks_side == Nchunks_side);
+    ctx->Nchunks_side = Nchunks_side;
+
+    chunk_in_range = malloc(Nchunks_side*Nchunks_side * sizeof(chunk_in_range[0]));
+    row_i0         = malloc(Wfar * sizeof(row_i0[0]));
+    row_i1         = malloc(Wfar * sizeof(row_i1[0]));
+    row_vertex0    = malloc(Wfar * sizeof(row_vertex0[0]));
+    if(chunk_in_range == NULL ||
+       row_i0         == NULL ||
+       row_i1         == NULL ||
+       row_vertex0    == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    // The far chunks within range of the center. Only these are built. The far
+    // chunks under the near field are kept too: the skirts use their vertices.
+    //
+    // The far vertices are stored row by row, only where the chunks in range
+    // use them: row j has the vertices [row_i0[j],row_i1[j]), starting at
+    // row_vertex0[j]. Without a range limit, this is the whole grid
+    float center_i, center_j, de, dn;
+    grid_position(&center_i, &center_j, ctx, ctx->range.lat, ctx->range.lon);
+    range_meters_per_cell(ctx, ctx->dems.cells_per_deg * s, &de, &dn);
+
+    for( int j=0; j<Wfar; j++ )
+    {
+        row_i0[j] = Wfar;
+        row_i1[j] = 0;
+    }
+    int Nchunks_far    = 0;
+    int Ntriangles_far = 0;
+    for( int cj=0; cj<Nchunks_side; cj++ )
+        for( int ci=0; ci<Nchunks_side; ci++ )
+        {
+            int i0 = ci*C;
+            int j0 = cj*C;
+            int i1 = i0 + C < Wcells ? i0 + C : Wcells;
+            int j1 = j0 + C < Wcells ? j0 + C : Wcells;
+
+            float e = fmaxf(fmaxf((float)(i0*s) - center_i, center_i - (float)(i1*s)), 0.0f) * de;
+            float n = fmaxf(fmaxf((float)(j0*s) - center_j, center_j - (float)(j1*s)), 0.0f) * dn;
+            bool under_near = cell_is_near(ctx, i0*s, j0*s);
+            bool in_range   = under_near || hypotf(e, n) <= ctx->range.loaded;
+            chunk_in_range[cj*Nchunks_side + ci] = in_range;
+            if(!in_range)
+                continue;
+
+            for( int j=j0; j<=j1; j++ )
+            {
+                if(row_i0[j] > i0)   row_i0[j] = i0;
+                if(row_i1[j] < i1+1) row_i1[j] = i1+1;
+            }
+            if(!under_near)
+            {
+                Nchunks_far++;
+                Ntriangles_far += (i1-i0)*(j1-j0) * 2;
+            }
+        }
+    int Nvertices_far = 0;
+    for( int j=0; j<Wfar; j++ )
+    {
+        row_vertex0[j] = Nvertices_far;
+        if(row_i1[j] > row_i0[j])
+            Nvertices_far += row_i1[j] - row_i0[j];
+    }
+
+    // With a near field, its vertices follow the far field, then the bottoms
+    // of the near-field skirts (one under each vertex on its boundary), then
+    // the bottoms of the far-field skirts (two under each far cell on the
+    // boundary)
+    const int Ni_near       = ctx->near.i1 - ctx->near.i0;
+    const int Nj_near       = ctx->near.j1 - ctx->near.j0;
+    const int Nboundary     = ctx->near.dems.mosaic != NULL ? near_boundary_length(ctx) : 0;
+    const int near_vertex0  = Nvertices_far;
+    const int skirt_vertex0 = near_vertex0 + (Ni_near+1)*(Nj_near+1);
+    const int skirt_far_vertex0 = skirt_vertex0 + Nboundary;
+
+    if(ctx->mesh.data == NULL)
+    {
+        // Dense triangulation
+        ctx->Nvertices  = Nvertices_far;
+        ctx->Ntriangles = Ntriangles_far;
+        ctx->Nchunks    = Nchunks_far;
+
+        if(ctx->near.dems.mosaic != NULL)
+        {
+            // Each skirt segment is a quad, drawn with both windings: 4
+            // triangles
+            ctx->Nvertices  += (Ni_near+1)*(Nj_near+1) + Nboundary + 2*Nboundary/s;
+            ctx->Ntriangles += Ni_near*Nj_near * 2 + 4*Nboundary + 4*Nboundary/s;
+            ctx->Nchunks    += (Ni_near/C)*(Nj_near/C) + Nboundary/(C*s);
+        }
+    }
+    else
+    {
+        // The simplified mesh, followed by the space for the dense patch
+        // around the viewer. See update_patch(). All the vertices of the
+        // simplified mesh are stored, but only the triangles in range
+        int Ntriangles_mesh = 0;
+        for( int c=0; c<Nchunks_side*Nchunks_side; c++ )
+            if(chunk_in_range[c])
+                Ntriangles_mesh += ctx->mesh.chunk_Ntriangles[c];
+
+        const int Wpatch = 3*HORIZONATOR_CHUNK_CELLS;
+        ctx->patch_vertex0 = ctx->mesh.Nvertices;
+        ctx->patch_index0  = Ntriangles_mesh * 3;
+        ctx->Nvertices     = ctx->mesh.Nvertices + (Wpatch+1)*(Wpatch+1);
+        ctx->Ntriangles    = Ntriangles_mesh     + Wpatch*Wpatch * 2;
+        ctx->Nchunks       = Nchunks_side*Nchunks_side;
+    }
+    const int Nvertices = ctx->Nvertices;
+
+    // vertices
+    //
+    // I fill in the VBO. Each point is a 16-bit integer tuple
+    // (ilon,ilat,height). The first 2 args are indices into the DEM mosaic
+    // (accessed with horizonator_dem_mosaic_at). The height is in meters
+    {
+        stage_begin(&timer);
+
+        static_assert(sizeof(GLuint) == sizeof(ctx->vertex_buffer),
+                      "horizonator_context_t.vertex_buffer must be a GLuint");
+        glGenBuffers(1, &ctx->vertex_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, ctx->vertex_buffer);
+
+        glEnableVertexAttribArray(0);
+
+#define VBO_USES_INTEGERS 1
+
+#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
+        // 16-bit integers. Only one of the paths below work with these
+        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, 0, NULL);
+        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+#else
+        // 32-bit floats. These take more space, but work with all the paths below
+        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+#endif
+
+        int vertex_buf_idx = 0;
+
+        if(ctx->mesh.data != NULL)
+        {
+            for( int v=0; v<ctx->mesh.Nvertices; v++ )
+            {
+                int i = ctx->mesh.vertices[2*v + 0];
+                int j = ctx->mesh.vertices[2*v + 1];
+                vertices[vertex_buf_idx++] = i;
+                vertices[vertex_buf_idx++] = j;
+                vertices[vertex_buf_idx++] = horizonator_dem_mosaic_at(&ctx->dems, i,j);
+            }
+
+            // The dense patch around the viewer. update_patch() fills it in
+            while( vertex_buf_idx < Nvertices*3 )
+                vertices[vertex_buf_idx++] = 0;
+        }
+        else
+        {
+            for( int j=0; j<Wfar; j++ )
+            {
+                for( int i=row_i0[j]; i<row_i1[j]; i++ )
+                {
+                    int32_t z = horizonator_dem_mosaic_at(&ctx->dems, i,j);
+
+                    // Several paths are available. These require corresponding
+                    // updates in the GLSL, and exist for testing
+#if 0
+                    // The CPU does all the math for the data procesing.
+#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
+#error "This path requires floating-point vertices"
+#endif
+                    const float Rearth = 6371000.0;
+                    const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
+                    float e = ((float)i - viewer_cell[0]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f * cos_viewer_lat;
+                    float n = ((float)j - viewer_cell[1]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f;
+                    float h = (float)z - viewer_z;
+
+                    float d_ne = hypotf(e,n);
+                    vertices[vertex_buf_idx++] = atan2f(e,n   ) / M_PI;
+                    vertices[vertex_buf_idx++] = atan2f(h,d_ne) / M_PI;
+                    vertices[vertex_buf_idx++] = d_ne;
+#elif 0
+                    // The CPU does some of the math for the data procesing.
+                    // Requires 32-bit floats for the vertices (selected above).
+#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
+#error "This path requires floating-point vertices"
+#endif
+                    const float Rearth = 6371000.0;
+                    const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
+                    float e = ((float)i - viewer_cell[0]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f * cos_viewer_lat;
+                    float n = ((float)j - viewer_cell[1]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f;
+                    float h = (float)z - viewer_z;
+
+                    vertices[vertex_buf_idx++] = e;
+                    vertices[vertex_buf_idx++] = n;
+                    vertices[vertex_buf_idx++] = h;
+#else
+                    // Integers into the VBO. All the work done in the GPU
+                    vertices[vertex_buf_idx++] = i * ctx->near.scale;
+                    vertices[vertex_buf_idx++] = j * ctx->near.scale;
+                    vertices[vertex_buf_idx++] = z;
+#endif
+                }
+            }
+
+            if(ctx->near.dems.mosaic != NULL)
+            {
+                for( int j=ctx->near.j0; j<=ctx->near.j1; j++ )
+                    for( int i=ctx->near.i0; i<=ctx->near.i1; i++ )
+                    {
+                        vertices[vertex_buf_idx++] = i;
+                        vertices[vertex_buf_idx++] = j;
+                        vertices[vertex_buf_idx++] = near_at(ctx, i,j);
+                    }
+
+                for( int p=0; p<Nboundary; p++ )
+                {
+                    int i, j;
+                    near_boundary_vertex(&i, &j, ctx, p);
+                    vertices[vertex_buf_idx++] = i;
+                    vertices[vertex_buf_idx++] = j;
+                    vertices[vertex_buf_idx++] = skirt_bottom_near(ctx, p);
+                }
+
+                for( int q=0; q<Nboundary/s; q++ )
+                {
+                    int16_t z = skirt_bottom_far(ctx, q);
+                    for( int p=q*s; p<=(q+1)*s; p += s )
+                    {
+                        int i, j;
+                        near_boundary_vertex(&i, &j, ctx, p);
+                        vertices[vertex_buf_idx++] = i;
+                        vertices[vertex_buf_idx++] = j;
+                        vertices[vertex_buf_idx++] = z;
+                    }
+                }
+            }
+        }
+
+        int res = glUnmapBuffer(GL_ARRAY_BUFFER);
+        assert( res == GL_TRUE );
+        assert( vertex_buf_idx == Nvertices*3 );
+
+        // The (azimuth, elevation, distance) of each vertex, as seen from the
+        // viewer. Written on the GPU by project_vertices()
+        glGenBuffers(1, &ctx->polar_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, ctx->polar_buffer);
+        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLfloat), NULL, GL_DYNAMIC_COPY);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+        glEnableVertexAttribArray(1);
+        assert_opengl();
+        ctx->polar_dirty = true;
+
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_VERTEX_FILL);
+    }
+
+    // indices
+    {
+        stage_begin(&timer);
+
+        static_assert(sizeof(GLuint) == sizeof(ctx->index_buffer),
+                      "horizonator_context_t.index_buffer must be a GLuint");
+        glGenBuffers(1, &ctx->index_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx->index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, ctx->Ntriangles*3*sizeof(GLuint), NULL, GL_STATIC_DRAW);
+
+        // The triangles are stored chunk by chunk, so that each chunk can be
+        // drawn on its own. The simplified mesh is stored in the same order.
+        // With a near field, the far chunks it covers are skipped. The near
+        // field and its skirts are stored after the far field, in chunks of
+        // their own. The far chunks out of range are skipped too. With a
+        // simplified mesh, they're kept, but empty: update_patch() and
+        // update_horizon_near() index the chunks by position
+        ctx->chunks              = malloc(ctx->Nchunks * sizeof(ctx->chunks[0]));
+        ctx->chunks_by_distance0 = malloc(ctx->Nchunks * sizeof(ctx->chunks_by_distance0[0]));
+        ctx->chunks_by_distance1 = malloc(ctx->Nchunks * sizeof(ctx->chunks_by_distance1[0]));
+        ctx->horizon_occluders   = malloc(HORIZON_BINS * sizeof(ctx->horizon_occluders[0]));
+        ctx->horizon_near        = malloc(HORIZON_BINS * sizeof(ctx->horizon_near[0]));
+        ctx->draw_counts         = malloc(ctx->Nchunks * sizeof(ctx->draw_counts[0]));
+        ctx->draw_offsets        = malloc(ctx->Nchunks * sizeof(ctx->draw_offsets[0]));
+        if(ctx->chunks              == NULL ||
+           ctx->chunks_by_distance0 == NULL ||
+           ctx->chunks_by_distance1 == NULL ||
+           ctx->horizon_occluders   == NULL ||
+           ctx->horizon_near        == NULL ||
+           ctx->draw_counts         == NULL ||
+           ctx->draw_offsets        == NULL)
+        {
+            MSG("Couldn't allocate the %d mesh chunks", ctx->Nchunks);
+            goto done;
+        }
+        static_assert(sizeof(GLsizei) == sizeof(ctx->draw_counts[0]),
+                      "horizonator_context_t.draw_counts must be GLsizei");
+
+        GLuint* indices = glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
+        int idx      = 0;
+        int idx_mesh = 0;
+
+        // The two triangles of the cell (i,j), whose SW vertex is v00, and NW
+        // vertex is v01
+        void cell_triangles(int v00, int v01)
+        {
+            indices[idx++] = v00;
+            indices[idx++] = v01 + 1;
+            indices[idx++] = v01;
+
+            indices[idx++] = v00;
+            indices[idx++] = v00 + 1;
+            indices[idx++] = v01 + 1;
+        }
+        // The far vertex (i,j), in the far cells
+        int far_vertex(int i, int j)
+        {
+            return row_vertex0[j] + i - row_i0[j];
+        }
+        // A skirt segment: a quad hanging down from top0-top1. It is seen from
+        // both sides, so it's drawn with both windings
+        void skirt_triangles(int top0, int top1, int bottom0, int bottom1)
+        {
+            indices[idx++] = top0; indices[idx++] = top1;    indices[idx++] = bottom1;
+            indices[idx++] = top0; indices[idx++] = bottom1; indices[idx++] = bottom0;
+            indices[idx++] = top0; indices[idx++] = bottom1; indices[idx++] = top1;
+            indices[idx++] = top0; indices[idx++] = bottom0; indices[idx++] = bottom1;
+        }
+
+        int c = 0;
+        for( int cj=0; cj<Nchunks_side; cj++ )
+            for( int ci=0; ci<Nchunks_side; ci++ )
+            {
+                // The far cells [i0,i1) x [j0,j1)
+                int i0 = ci*C;
+                int j0 = cj*C;
+                int i1 = i0 + C < Wcells ? i0 + C : Wcells;
+                int j1 = j0 + C < Wcells ? j0 + C : Wcells;
+                const bool in_range = chunk_in_range[cj*Nchunks_side + ci];
+                if(cell_is_near(ctx, i0*s, j0*s) ||
+                   (!in_range && ctx->mesh.data == NULL))
+                    continue;
+
+                horizonator_chunk_t* chunk = &ctx->chunks[c++];
+                chunk->i0     = i0*s;
+                chunk->j0     = j0*s;
+                chunk->i1     = i1*s;
+                chunk->j1     = j1*s;
+                chunk->index0 = idx;
+
+                // With a DEM pack, flat chunks get these from its blocks
+                horizonator_dem_bounds(&chunk->zmin, &chunk->zmax,
+                                       &ctx->dems, i0, j0, i1, j1);
+
+                if(ctx->mesh.data != NULL)
+                {
+                    int N = 3*ctx->mesh.chunk_Ntriangles[cj*Nchunks_side + ci];
+                    if(in_range)
+                    {
+                        memcpy(&indices[idx], &ctx->mesh.indices[idx_mesh],
+                               N*sizeof(indices[0]));
+                        idx += N;
+                    }
+                    idx_mesh += N;
+                }
+                else
+                    for( int j=j0; j<j1; j++ )
+                        for( int i=i0; i<i1; i++ )
+                            cell_triangles(far_vertex(i,j), far_vertex(i,j+1));
+                chunk->Ntriangles      = (idx - chunk->index0) / 3;
+                chunk->index0_mesh     = chunk->index0;
+                chunk->Ntriangles_mesh = chunk->Ntriangles;
+            }
+
+        if(ctx->near.dems.mosaic != NULL)
+        {
+            int near_vertex(int i, int j)
+            {
+                return near_vertex0 + (j - ctx->near.j0)*(Ni_near+1) + (i - ctx->near.i0);
+            }
+
+            for( int cj=0; cj<Nj_near/C; cj++ )
+                for( int ci=0; ci<Ni_near/C; ci++ )
+                {
+                    horizonator_chunk_t* chunk = &ctx->chunks[c++];
+                    chunk->i0     = ctx->near.i0 + ci*C;
+                    chunk->j0     = ctx->near.j0 + cj*C;
+                    chunk->i1     = chunk->i0 + C;
+                    chunk->j1     = chunk->j0 + C;
+                    chunk->index0 = idx;
+
+                    chunk->zmin = INT16_MAX;
+                    chunk->zmax = INT16_MIN;
+                    for( int j=chunk->j0; j<=chunk->j1; j++ )
+                        for( int i=chunk->i0; i<=chunk->i1; i++ )
+                        {
+                            int16_t z = near_at(ctx, i, j);
+                            if(chunk->zmin > z) chunk->zmin = z;
+                            if(chunk->zmax < z) chunk->zmax = z;
+                        }
+
+                    for( int j=chunk->j0; j<chunk->j1; j++ )
+                        for( int i=chunk->i0; i<chunk->i1; i++ )
+                            cell_triangles(near_vertex(i,j), near_vertex(i,j+1));
+
+                    chunk->Ntriangles      = (idx - chunk->index0) / 3;
+                    chunk->index0_mesh     = chunk->index0;
+                    chunk->Ntriangles_mesh = chunk->Ntriangles;
+                }
+
+            // The skirts, along one far chunk of the boundary at a time. The
+            // corners of the near field are at the ends of these
+            for( int p0=0; p0<Nboundary; p0 += C*s )
+            {
+                const int p1 = p0 + C*s;
+
+                int i0, j0, i1, j1;
+                near_boundary_vertex(&i0, &j0, ctx, p0);
+                near_boundary_vertex(&i1, &j1, ctx, p1);
+
+                horizonator_chunk_t* chunk = &ctx->chunks[c++];
+                chunk->i0     = i0 < i1 ? i0 : i1;
+                chunk->j0     = j0 < j1 ? j0 : j1;
+                chunk->i1     = i0 < i1 ? i1 : i0;
+                chunk->j1     = j0 < j1 ? j1 : j0;
+                chunk->index0 = idx;
+
+                // The skirts reach up to the higher of the two fields, and
+                // down to the bottoms
+                chunk->zmin = INT16_MAX;
+                chunk->zmax = INT16_MIN;
+                for( int p=p0; p<=p1; p++ )
+                {
+                    int i, j;
+                    near_boundary_vertex(&i, &j, ctx, p);
+                    int16_t ztop    = near_at(ctx, i, j);
+                    int16_t zbottom = skirt_bottom_near(ctx, p);
+                    if(p % s == 0 && ztop < far_at(ctx, i, j))
+                        ztop = far_at(ctx, i, j);
+                    if(p < p1 && p % s == 0 && zbottom > skirt_bottom_far(ctx, p/s))
+                        zbottom = skirt_bottom_far(ctx, p/s);
+                    if(chunk->zmin > zbottom) chunk->zmin = zbottom;
+                    if(chunk->zmax < ztop)    chunk->zmax = ztop;
+                }
+
+                for( int p=p0; p<p1; p++ )
+                {
+                    int i, j, inext, jnext;
+                    near_boundary_vertex(&i,     &j,     ctx, p);
+                    near_boundary_vertex(&inext, &jnext, ctx, p+1);
+                    skirt_triangles(near_vertex(i,j), near_vertex(inext,jnext),
+                                    skirt_vertex0 + p,
+                                    skirt_vertex0 + (p+1) % Nboundary);
+                }
+                for( int q=p0/s; q<p1/s; q++ )
+                {
+                    int i, j, inext, jnext;
+                    near_boundary_vertex(&i,     &j,     ctx, q*s);
+                    near_boundary_vertex(&inext, &jnext, ctx, (q+1)*s);
+                    skirt_triangles(far_vertex(i/s,j/s), far_vertex(inext/s,jnext/s),
+                                    skirt_far_vertex0 + 2*q,
+                                    skirt_far_vertex0 + 2*q + 1);
+                }
+
+                chunk->Ntriangles      = (idx - chunk->index0) / 3;
+                chunk->index0_mesh     = chunk->index0;
+                chunk->Ntriangles_mesh = chunk->Ntriangles;
+            }
+        }
+        assert(c == ctx->Nchunks);
+        int res = glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+        assert( res == GL_TRUE );
+        // With a simplified mesh, the dense patch follows. update_patch()
+        // fills it in
+        assert(idx == (ctx->mesh.data == NULL ? ctx->Ntriangles*3 : ctx->patch_index0));
+
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_INDEX_BUILD);
+    }
+
+    result = true;
+
+ done:
+    free(chunk_in_range);
+    free(row_i0);
+    free(row_i1);
+    free(row_vertex0);
+    if(!result)
+        terrain_deinit(ctx);
+    return result;
+}
+
+// The texture coordinates are computed from the position of each vertex
+// relative to the SW corner of the mosaic
+static void set_origin_uniforms(horizonator_context_t* ctx)
+{
+    glProgramUniform1f(ctx->program,
+                       glGetUniformLocation(ctx->program, "origin_cell_lon_deg"),
+                       (float)ctx->dems.origin_dem_lon_lat[0] +
+                       (float)ctx->dems.origin_dem_cellij[0] / (float)ctx->dems.cells_per_deg);
+    glProgramUniform1f(ctx->program,
+                       glGetUniformLocation(ctx->program, "origin_cell_lat_deg"),
+                       (float)ctx->dems.origin_dem_lon_lat[1] +
+                       (float)ctx->dems.origin_dem_cellij[1] / (float)ctx->dems.cells_per_deg);
+    assert_opengl();
+}
+
 // The main init routine. We support 3 modes:
 //
 // - GLUT: static window    (use_glut = true, offscreen_width <= 0)
@@ -66,20 +1384,69 @@ bool horizonator_init( // output
                        float viewer_lat, float viewer_lon,
                        int offscreen_width, int offscreen_height,
                        int render_radius_cells,
+                       float max_range,
+                       float mesh_tolerance,
 
                        bool use_glut,
                        bool render_texture,
                        const char* dir_dems,
+                       const char* dir_dems_near,
+                       int near_radius_cells,
                        const char* dir_tiles,
                        bool allow_downloads)
 {
-    bool result             = false;
-    bool dem_context_inited = false;
+    bool result = false;
 
     if(dir_dems  == NULL) dir_dems  = "~/.horizonator/DEMs_SRTM3";
     if(dir_tiles == NULL) dir_tiles = "~/.horizonator/tiles";
 
     ctx->use_glut = use_glut;
+    ctx->stats    = (horizonator_stats_t){};
+    ctx->stage_callback        = NULL;
+    ctx->stage_callback_cookie = NULL;
+    ctx->queries.first_pending = 0;
+    ctx->queries.Npending      = 0;
+    ctx->chunks              = NULL;
+    ctx->chunks_by_distance0 = NULL;
+    ctx->chunks_by_distance1 = NULL;
+    ctx->horizon_occluders   = NULL;
+    ctx->horizon_near        = NULL;
+    ctx->draw_counts         = NULL;
+    ctx->draw_offsets        = NULL;
+    ctx->Nchunks             = 0;
+    ctx->mesh                = (horizonator_mesh_t){};
+    ctx->patch_ci            = -1;
+    ctx->patch_cj            = -1;
+    ctx->near                = (typeof(ctx->near)){ .scale = 1 };
+    ctx->dems                = (horizonator_dem_context_t){};
+    ctx->offscreen           = (typeof(ctx->offscreen)){};
+    // Set by horizonator_resized() or the offscreen setup
+    ctx->viewport_width      = 0;
+    ctx->viewport_height     = 0;
+    ctx->range               = (typeof(ctx->range)){
+        .loaded            = max_range > 0.0f ? max_range : INFINITY,
+        .lat               = viewer_lat,
+        .lon               = viewer_lon,
+        .radius_cells_max  = render_radius_cells,
+        .mesh_tolerance    = mesh_tolerance,
+        .dir_dems          = strdup(dir_dems),
+        .dir_dems_near     = dir_dems_near != NULL ? strdup(dir_dems_near) : NULL,
+        .near_radius_cells = near_radius_cells };
+    if(ctx->range.dir_dems == NULL ||
+       (dir_dems_near != NULL && ctx->range.dir_dems_near == NULL))
+    {
+        MSG("strdup() failed");
+        goto done;
+    }
+
+    if(dir_dems_near != NULL && mesh_tolerance > 0.0f)
+    {
+        // The simplified mesh has no notion of the hole cut out for the near
+        // field
+        MSG("A near-field dataset can't be used with a simplified mesh");
+        goto done;
+    }
+
     if(use_glut)
     {
         bool double_buffered = offscreen_width <= 0;
@@ -128,26 +1495,25 @@ bool horizonator_init( // output
         }
     }
 
-    static_assert(sizeof(GLint) == sizeof(ctx->uniform_aspect),
-                  "horizonator_context_t.uniform_... must be a GLint");
+    static_assert(sizeof(GLuint) == sizeof(ctx->view_ubo),
+                  "horizonator_context_t.view_ubo must be a GLuint");
+    static_assert(sizeof(GLuint) == sizeof(ctx->polar_buffer),
+                  "horizonator_context_t.polar_buffer must be a GLuint");
 
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
     glClearColor(0, 0, 1, 0);
 
-    if( !horizonator_dem_init( &ctx->dems,
-                   viewer_lat, viewer_lon,
-                   render_radius_cells,
-                   dir_dems) )
-    {
-        MSG("Couldn't init DEMs. Giving up");
+    // The vertex array object holds the bindings of the vertex and index
+    // buffers. terrain_init() fills those in
+    GLuint vertexArrayID;
+    glGenVertexArrays(1, &vertexArrayID);
+    glBindVertexArray(vertexArrayID);
+
+    if(!terrain_init(ctx))
         goto done;
-    }
-    dem_context_inited = true;
 
-    // Dense triangulation. This may be adjusted below
-    int Nvertices   = (2*render_radius_cells) * (2*render_radius_cells);
-    ctx->Ntriangles = (2*render_radius_cells - 1)*(2*render_radius_cells - 1) * 2;
+    stage_timer_t timer;
 
     typedef struct
     {
@@ -166,6 +1532,8 @@ bool horizonator_init( // output
 
     if(render_texture)
     {
+        stage_begin(&timer);
+
         GLuint texID;
         glGenTextures(1, &texID);
 
@@ -310,159 +1678,61 @@ bool horizonator_init( // output
             glTexSubImage2D(GL_TEXTURE_2D, 0,
                             (osmTileX - texture_ctx->osmtile_lowestXY[0] )*OSM_TILE_WIDTH,
                             (texture_ctx->osmtile_highestXY[1] - osmTileY)*OSM_TILE_HEIGHT,
-                            OSM_TILE_WIDTH, OSM_TILE_HEIGHT,
-                            GL_BGR, GL_UNSIGNED_BYTE,
-                            (const GLvoid *)FreeImage_GetBits(fib));
-            assert_opengl();
-
-            FreeImage_Unload(fib);
-        }
-
-        // My render data is in a grid centered on viewer_lat/viewer_lon, branching
-        // render_radius_cells*DEG_PER_CELL degrees in all 4 directions
-        float lowest_E  = viewer_lon - (float)render_radius_cells/CELLS_PER_DEG;
-        float lowest_N  = viewer_lat - (float)render_radius_cells/CELLS_PER_DEG;
-        float highest_E = viewer_lon + (float)render_radius_cells/CELLS_PER_DEG;
-        float highest_N = viewer_lat + (float)render_radius_cells/CELLS_PER_DEG;
-
-        // ytile decreases with lat, so I treat it backwards
-        getOSMTileID( &texture_ctx.osmtile_lowestXY[0],
-                      &texture_ctx.osmtile_lowestXY[1],
-                      lowest_E, highest_N);
-        getOSMTileID( &texture_ctx.osmtile_highestXY[0],
-                      &texture_ctx.osmtile_highestXY[1],
-                      highest_E, lowest_N);
-
-        texture_ctx.NtilesXY[0] = texture_ctx.osmtile_highestXY[0] - texture_ctx.osmtile_lowestXY[0] + 1;
-        texture_ctx.NtilesXY[1] = texture_ctx.osmtile_highestXY[1] - texture_ctx.osmtile_lowestXY[1] + 1;
-
-        initOSMtexture(&texture_ctx);
-
-        for( int osmTileY = texture_ctx.osmtile_lowestXY[1];
-             osmTileY <= texture_ctx.osmtile_highestXY[1];
-             osmTileY++)
-            for( int osmTileX = texture_ctx.osmtile_lowestXY[0];
-                 osmTileX <= texture_ctx.osmtile_highestXY[0];
-                 osmTileX++ )
-                setOSMtextureTile( osmTileX, osmTileY, &texture_ctx );
-    }
-
-    // vertices
-    //
-    // I fill in the VBO. Each point is a 16-bit integer tuple
-    // (ilon,ilat,height). The first 2 args are indices into the virtual DEM
-    // (accessed with horizonator_dem_sample). The height is in meters
-    {
-        GLuint vertexArrayID;
-        glGenVertexArrays(1, &vertexArrayID);
-        glBindVertexArray(vertexArrayID);
-
-        GLuint vertexBufID;
-        glGenBuffers(1, &vertexBufID);
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBufID);
-
-        glEnableVertexAttribArray(0);
-
-#define VBO_USES_INTEGERS 1
-
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-        // 16-bit integers. Only one of the paths below work with these
-        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, 0, NULL);
-        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-#else
-        // 32-bit floats. These take more space, but work with all the paths below
-        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-#endif
-
-        int vertex_buf_idx = 0;
-
-        for( int j=0; j<2*render_radius_cells; j++ )
-        {
-            for( int i=0; i<2*render_radius_cells; i++ )
-            {
-                int32_t z = horizonator_dem_sample(&ctx->dems, i,j);
-
-                // Several paths are available. These require corresponding
-                // updates in the GLSL, and exist for testing
-#if 0
-                // The CPU does all the math for the data procesing.
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-#error "This path requires floating-point vertices"
-#endif
-                const float Rearth = 6371000.0;
-                const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
-                float e = ((float)i - viewer_cell[0]) / CELLS_PER_DEG * Rearth * M_PI/180.f * cos_viewer_lat;
-                float n = ((float)j - viewer_cell[1]) / CELLS_PER_DEG * Rearth * M_PI/180.f;
-                float h = (float)z - viewer_z;
-
-                float d_ne = hypotf(e,n);
-                vertices[vertex_buf_idx++] = atan2f(e,n   ) / M_PI;
-                vertices[vertex_buf_idx++] = atan2f(h,d_ne) / M_PI;
-                vertices[vertex_buf_idx++] = d_ne;
-#elif 0
-                // The CPU does some of the math for the data procesing.
-                // Requires 32-bit floats for the vertices (selected above).
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-#error "This path requires floating-point vertices"
-#endif
-                const float Rearth = 6371000.0;
-                const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
-                float e = ((float)i - viewer_cell[0]) / CELLS_PER_DEG * Rearth * M_PI/180.f * cos_viewer_lat;
-                float n = ((float)j - viewer_cell[1]) / CELLS_PER_DEG * Rearth * M_PI/180.f;
-                float h = (float)z - viewer_z;
-
-                vertices[vertex_buf_idx++] = e;
-                vertices[vertex_buf_idx++] = n;
-                vertices[vertex_buf_idx++] = h;
-#else
-                // Integers into the VBO. All the work done in the GPU
-                vertices[vertex_buf_idx++] = i;
-                vertices[vertex_buf_idx++] = j;
-                vertices[vertex_buf_idx++] = z;
-#endif
-            }
+                            OSM_TILE_WIDTH, OSM_TILE_HEIGHT,
+                            GL_BGR, GL_UNSIGNED_BYTE,
+                            (const GLvoid *)FreeImage_GetBits(fib));
+            assert_opengl();
+
+            FreeImage_Unload(fib);
         }
 
-        int res = glUnmapBuffer(GL_ARRAY_BUFFER);
-        assert( res == GL_TRUE );
-        assert( vertex_buf_idx == Nvertices*3 );
-    }
+        // My render data is in a grid centered on viewer_lat/viewer_lon, branching
+        // render_radius_cells*DEG_PER_CELL degrees in all 4 directions
+        float lowest_E  = viewer_lon - (float)render_radius_cells/ctx->dems.cells_per_deg;
+        float lowest_N  = viewer_lat - (float)render_radius_cells/ctx->dems.cells_per_deg;
+        float highest_E = viewer_lon + (float)render_radius_cells/ctx->dems.cells_per_deg;
+        float highest_N = viewer_lat + (float)render_radius_cells/ctx->dems.cells_per_deg;
 
-    // indices
-    {
-        GLuint indexBufID;
-        glGenBuffers(1, &indexBufID);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufID);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, ctx->Ntriangles*3*sizeof(GLuint), NULL, GL_STATIC_DRAW);
+        // ytile decreases with lat, so I treat it backwards
+        getOSMTileID( &texture_ctx.osmtile_lowestXY[0],
+                      &texture_ctx.osmtile_lowestXY[1],
+                      lowest_E, highest_N);
+        getOSMTileID( &texture_ctx.osmtile_highestXY[0],
+                      &texture_ctx.osmtile_highestXY[1],
+                      highest_E, lowest_N);
 
-        GLuint* indices = glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-        int idx = 0;
-        for( int j=0; j<(2*render_radius_cells-1); j++ )
-        {
-            for( int i=0; i<(2*render_radius_cells-1); i++ )
-            {
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 0);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 1);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 0);
+        texture_ctx.NtilesXY[0] = texture_ctx.osmtile_highestXY[0] - texture_ctx.osmtile_lowestXY[0] + 1;
+        texture_ctx.NtilesXY[1] = texture_ctx.osmtile_highestXY[1] - texture_ctx.osmtile_lowestXY[1] + 1;
 
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 0);
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 1);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 1);
-            }
-        }
-        int res = glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
-        assert( res == GL_TRUE );
-        assert(idx == ctx->Ntriangles*3);
+        initOSMtexture(&texture_ctx);
+
+        for( int osmTileY = texture_ctx.osmtile_lowestXY[1];
+             osmTileY <= texture_ctx.osmtile_highestXY[1];
+             osmTileY++)
+            for( int osmTileX = texture_ctx.osmtile_lowestXY[0];
+                 osmTileX <= texture_ctx.osmtile_highestXY[0];
+                 osmTileX++ )
+                setOSMtextureTile( osmTileX, osmTileY, &texture_ctx );
+
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_TEXTURE_LOAD);
     }
 
     // shaders
     {
-        // The shader transforms the VBO vertices into the view coord system. Each VBO
-        // point is a 16-bit integer tuple (ilon,ilat,height). The first 2 args are
-        // indices into the DEM. The height is in meters
+        stage_begin(&timer);
+
+        // project.glsl transforms the VBO vertices into the view coord system:
+        // (azimuth, elevation, distance). Each VBO point is a 16-bit integer
+        // tuple (ilon,ilat,height). The first 2 args are indices into the DEM.
+        // The height is in meters. vertex.glsl then maps these to the screen
+        const GLchar* projectShaderSource =
+#include "project.glsl.h"
+            ;
+
+        const GLchar* projectFragmentShaderSource =
+#include "project_fragment.glsl.h"
+            ;
+
         const GLchar* vertexShaderSource =
 #include "vertex.glsl.h"
             ;
@@ -479,9 +1749,11 @@ bool horizonator_init( // output
         int len;
         ctx->program = glCreateProgram();
         assert_opengl();
+        ctx->program_project = glCreateProgram();
+        assert_opengl();
 
 
-#define install_shader(type,TYPE)                                       \
+#define install_shader(program,type,TYPE)                               \
         GLuint type ## Shader = glCreateShader(GL_ ## TYPE ## _SHADER); \
         assert_opengl();                                                \
                                                                         \
@@ -494,14 +1766,28 @@ bool horizonator_init( // output
         if( strlen(msg) )                                               \
             printf(#type " shader info: %s\n", msg);                    \
                                                                         \
-        glAttachShader(ctx->program, type ##Shader);                         \
+        glAttachShader(program, type ##Shader);                         \
         assert_opengl();
 
 
 
-        install_shader(vertex,   VERTEX);
-        install_shader(fragment, FRAGMENT);
-        install_shader(geometry, GEOMETRY);
+        install_shader(ctx->program, vertex,   VERTEX);
+        install_shader(ctx->program, fragment, FRAGMENT);
+        install_shader(ctx->program, geometry, GEOMETRY);
+
+        // The projection program runs with GL_RASTERIZER_DISCARD, and its
+        // output is captured. Its fragment stage never runs, but it must exist:
+        // see project_fragment.glsl
+        install_shader(ctx->program_project, project,         VERTEX);
+        install_shader(ctx->program_project, projectFragment, FRAGMENT);
+        glTransformFeedbackVaryings(ctx->program_project,
+                                    1, (const GLchar*[]){"polar"},
+                                    GL_INTERLEAVED_ATTRIBS);
+        assert_opengl();
+        glLinkProgram(ctx->program_project); assert_opengl();
+        glGetProgramInfoLog( ctx->program_project, sizeof(msg), &len, msg );
+        if( strlen(msg) )
+            printf("projection program info after glLinkProgram(): %s\n", msg);
 
         glLinkProgram(ctx->program); assert_opengl();
         glGetProgramInfoLog( ctx->program, sizeof(msg), &len, msg );
@@ -513,6 +1799,8 @@ bool horizonator_init( // output
         if( strlen(msg) )
             printf("program info after glUseProgram: %s\n", msg);
 
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_SHADER_COMPILE);
+
 
 #define make_and_set_uniform(gltype, name, expr) do {                   \
             GLint uniform_ ## name = glGetUniformLocation(ctx->program, #name); \
@@ -521,43 +1809,61 @@ bool horizonator_init( // output
             assert_opengl();                                            \
         } while(0)
 
-        make_and_set_uniform(f, DEG_PER_CELL,   1.0f/ (float)CELLS_PER_DEG );
+        // The vertices are in the cells of the near field
+        const float deg_per_cell =
+            1.0f / (float)(ctx->dems.cells_per_deg * ctx->near.scale);
+        glProgramUniform1f(ctx->program_project,
+                           glGetUniformLocation(ctx->program_project, "DEG_PER_CELL"),
+                           deg_per_cell );
+        assert_opengl();
+        make_and_set_uniform(f, DEG_PER_CELL,   deg_per_cell );
 
-        make_and_set_uniform(f, origin_cell_lon_deg,
-                     (float)ctx->dems.origin_dem_lon_lat[0] +
-                     (float)ctx->dems.origin_dem_cellij[0] / (float)CELLS_PER_DEG);
-        make_and_set_uniform(f, origin_cell_lat_deg,
-                     (float)ctx->dems.origin_dem_lon_lat[1] +
-                     (float)ctx->dems.origin_dem_cellij[1] / (float)CELLS_PER_DEG);
+        set_origin_uniforms(ctx);
         make_and_set_uniform(i, NtilesX,         texture_ctx.NtilesXY[0]);
         make_and_set_uniform(i, NtilesY,         texture_ctx.NtilesXY[1]);
         make_and_set_uniform(i, osmtile_lowestX, texture_ctx.osmtile_lowestXY[0]);
         make_and_set_uniform(i, osmtile_lowestY, texture_ctx.osmtile_lowestXY[1]);
+        make_and_set_uniform(i, dense_mesh,      ctx->mesh.data == NULL);
+
+        // The view parameters may be modified at runtime. They live in a
+        // uniform buffer, bound to binding point 0 of the view_t block. The
+        // initial values are set below, and uploaded before the first draw
+        glGenBuffers(1, &ctx->view_ubo);
+        assert_opengl();
+        glBindBuffer(GL_UNIFORM_BUFFER, ctx->view_ubo);
+        assert_opengl();
+        // std140 rounds the size of the block up to a multiple of a vec4
+        glBufferData(GL_UNIFORM_BUFFER,
+                     (sizeof(ctx->view) + 15) / 16 * 16,
+                     NULL, GL_DYNAMIC_DRAW);
+        assert_opengl();
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, ctx->view_ubo);
+        assert_opengl();
 
-        // These may be modified at runtime, so I make, but don't set
-        ctx->uniform_aspect           = glGetUniformLocation(ctx->program, "aspect");           assert_opengl();
-        ctx->uniform_az_deg0          = glGetUniformLocation(ctx->program, "az_deg0");          assert_opengl();
-        ctx->uniform_az_deg1          = glGetUniformLocation(ctx->program, "az_deg1");          assert_opengl();
-        ctx->uniform_viewer_cell_i    = glGetUniformLocation(ctx->program, "viewer_cell_i");    assert_opengl();
-        ctx->uniform_viewer_cell_j    = glGetUniformLocation(ctx->program, "viewer_cell_j");    assert_opengl();
-        ctx->uniform_viewer_z         = glGetUniformLocation(ctx->program, "viewer_z");         assert_opengl();
-        ctx->uniform_viewer_lat       = glGetUniformLocation(ctx->program, "viewer_lat");       assert_opengl();
-        ctx->uniform_cos_viewer_lat   = glGetUniformLocation(ctx->program, "cos_viewer_lat");   assert_opengl();
-        ctx->uniform_texturemap_lon0  = glGetUniformLocation(ctx->program, "texturemap_lon0");  assert_opengl();
-        ctx->uniform_texturemap_lon1  = glGetUniformLocation(ctx->program, "texturemap_lon1");  assert_opengl();
-        ctx->uniform_texturemap_dlat0 = glGetUniformLocation(ctx->program, "texturemap_dlat0"); assert_opengl();
-        ctx->uniform_texturemap_dlat1 = glGetUniformLocation(ctx->program, "texturemap_dlat1"); assert_opengl();
-        ctx->uniform_texturemap_dlat2 = glGetUniformLocation(ctx->program, "texturemap_dlat2"); assert_opengl();
-        ctx->uniform_znear            = glGetUniformLocation(ctx->program, "znear");            assert_opengl();
-        ctx->uniform_zfar             = glGetUniformLocation(ctx->program, "zfar");             assert_opengl();
-        ctx->uniform_znear_color      = glGetUniformLocation(ctx->program, "znear_color");      assert_opengl();
-        ctx->uniform_zfar_color       = glGetUniformLocation(ctx->program, "zfar_color");       assert_opengl();
+        ctx->view       = (typeof(ctx->view)){};
+        ctx->view_dirty = true;
 #undef make_and_set_uniform
 
+        // The queries used for the runtime stats. Timer queries are core
+        // only in GL 3.3, so I check for them explicitly
+        static_assert(sizeof(GLuint) == sizeof(ctx->queries.gpu_time[0]),
+                      "horizonator_context_t.queries.... must be a GLuint");
+        glGenQueries(HORIZONATOR_QUERY_SETS, ctx->queries.primitives_generated);
+        assert_opengl();
+        ctx->queries.have_gpu_timer =
+            epoxy_gl_version() >= 33 ||
+            epoxy_has_gl_extension("GL_ARB_timer_query");
+        if(ctx->queries.have_gpu_timer)
+        {
+            glGenQueries(HORIZONATOR_QUERY_SETS, ctx->queries.gpu_time);
+            assert_opengl();
+        }
+
         // And I set the other uniforms
         horizonator_move(ctx, viewer_lat, viewer_lon);
         horizonator_set_zextents(ctx,
-                                 ZNEAR_DEFAULT, ZFAR_DEFAULT,
+                                 ZNEAR_DEFAULT,
+                                 max_range > 0.0f ? max_range : ZFAR_DEFAULT,
                                  ZNEAR_DEFAULT, ZFAR_DEFAULT);
     }
 
@@ -594,14 +1900,25 @@ bool horizonator_init( // output
         assert_opengl();
 
         glViewport(0, 0, offscreen_width, offscreen_height);
-        glUniform1f(ctx->uniform_aspect,
-                    (float)offscreen_width / (float)offscreen_height);
+        ctx->viewport_width  = offscreen_width;
+        ctx->viewport_height = offscreen_height;
+        ctx->view.aspect     = (float)offscreen_width / (float)offscreen_height;
+        ctx->view.viewport_width  = (float)offscreen_width;
+        ctx->view.viewport_height = (float)offscreen_height;
+        ctx->view_dirty      = true;
 
         ctx->offscreen.inited = true;
         ctx->offscreen.width  = offscreen_width;
         ctx->offscreen.height = offscreen_height;
 
-        atexit(glutExit);
+        // Long-running processes may create many offscreen contexts. I only
+        // want to clean up GLUT once
+        static bool atexit_registered = false;
+        if(!atexit_registered)
+        {
+            atexit(glutExit);
+            atexit_registered = true;
+        }
     }
 
 
@@ -612,8 +1929,14 @@ bool horizonator_init( // output
     result = true;
 
  done:
-    if(dem_context_inited && !result)
-        horizonator_dem_deinit(&ctx->dems);
+    if(!result)
+    {
+        terrain_deinit(ctx);
+        free(ctx->range.dir_dems);
+        free(ctx->range.dir_dems_near);
+        ctx->range.dir_dems      = NULL;
+        ctx->range.dir_dems_near = NULL;
+    }
 
     return result;
 }
@@ -625,6 +1948,18 @@ void horizonator_deinit( horizonator_context_t* ctx )
         glutDestroyWindow(ctx->glut_window);
         ctx->glut_window = 0;
     }
+
+    // The mosaic is this context's own copy, freed here. The decoded tiles it
+    // was copied from stay in the process-wide tile cache, which is bounded
+    // by size. Long-running processes that create and destroy contexts rely
+    // on this to not leak them
+    terrain_deinit(ctx);
+    free(ctx->range.dir_dems);
+    free(ctx->range.dir_dems_near);
+    free(ctx->offscreen.cellid);
+    ctx->range.dir_dems      = NULL;
+    ctx->range.dir_dems_near = NULL;
+    ctx->offscreen.cellid    = NULL;
 }
 
 bool horizonator_move(horizonator_context_t* ctx,
@@ -637,6 +1972,9 @@ bool horizonator_move(horizonator_context_t* ctx,
         glutSetWindow(ctx->glut_window);
     }
 
+    if(!have_terrain(ctx))
+        return false;
+
     void texture_coeffs(// output
                         float* lon0,
                         float* lon1,
@@ -695,52 +2033,38 @@ bool horizonator_move(horizonator_context_t* ctx,
     texture_coeffs(&lon0,&lon1,&dlat0,&dlat1,&dlat2,
                    viewer_lat);
 
-    float viewer_cell_i =
-        (viewer_lon - ctx->dems.origin_dem_lon_lat[0]) * CELLS_PER_DEG -
-        ctx->dems.origin_dem_cellij[0];
-    float viewer_cell_j =
-        (viewer_lat - ctx->dems.origin_dem_lon_lat[1]) * CELLS_PER_DEG -
-        ctx->dems.origin_dem_cellij[1];
+    float viewer_cell_i, viewer_cell_j;
+    grid_position(&viewer_cell_i, &viewer_cell_j, ctx, viewer_lat, viewer_lon);
 
 
     // The viewer elevation. I nudge it up a tiny bit to not see fewer bumps
     // immediately around me
     int i0 = (int)floorf(viewer_cell_i);
     int j0 = (int)floorf(viewer_cell_j);
-    float viewer_z =
-        fmaxf( fmaxf(horizonator_dem_sample( &ctx->dems, i0,   j0),
-                     horizonator_dem_sample( &ctx->dems, i0+1, j0)),
-               fmaxf(horizonator_dem_sample( &ctx->dems, i0,   j0+1 ),
-                     horizonator_dem_sample( &ctx->dems, i0+1, j0+1 )) ) + 1.0;
-
-    glUniform1f(ctx->uniform_viewer_cell_i,    viewer_cell_i);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_cell_j,    viewer_cell_j);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_z,         viewer_z);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_lat,             viewer_lat * M_PI / 180.0f );
-    assert_opengl();
-    glUniform1f(ctx->uniform_cos_viewer_lat,   cosf( viewer_lat * M_PI / 180.0f ));
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_lon0,  lon0);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_lon1,  lon1);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat0, dlat0);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat1, dlat1);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat2, dlat2);
-    assert_opengl();
+    float viewer_z = cell_zmax(ctx, i0, j0) + 1.0;
+
+    ctx->view.viewer_cell_i    = viewer_cell_i;
+    ctx->view.viewer_cell_j    = viewer_cell_j;
+    ctx->view.viewer_z         = viewer_z;
+    ctx->view.viewer_lat       = viewer_lat * M_PI / 180.0f;
+    ctx->view.cos_viewer_lat   = cosf( viewer_lat * M_PI / 180.0f );
+    ctx->view.texturemap_lon0  = lon0;
+    ctx->view.texturemap_lon1  = lon1;
+    ctx->view.texturemap_dlat0 = dlat0;
+    ctx->view.texturemap_dlat1 = dlat1;
+    ctx->view.texturemap_dlat2 = dlat2;
+    ctx->view_dirty            = true;
 
     ctx->viewer_lat = viewer_lat;
     ctx->viewer_lon = viewer_lon;
 
+    ctx->polar_dirty = true;
+    update_chunk_bounds(ctx);
+
     return true;
 }
 
-bool horizonator_pan_zoom(const horizonator_context_t* ctx,
+bool horizonator_pan_zoom(horizonator_context_t* ctx,
                       // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
                       // edges lie at the edges of the image. So for an image that's
                       // W pixels wide, az0 is at x = -0.5 and az1 is at W-0.5. The
@@ -755,12 +2079,13 @@ bool horizonator_pan_zoom(const horizonator_context_t* ctx,
         glutSetWindow(ctx->glut_window);
     }
 
-    glUniform1f( ctx->uniform_az_deg0, az_deg0); assert_opengl();
-    glUniform1f( ctx->uniform_az_deg1, az_deg1); assert_opengl();
+    ctx->view.az_deg0 = az_deg0;
+    ctx->view.az_deg1 = az_deg1;
+    ctx->view_dirty   = true;
     return true;
 }
 
-bool horizonator_resized(const horizonator_context_t* ctx, int width, int height)
+bool horizonator_resized(horizonator_context_t* ctx, int width, int height)
 {
     if(ctx->use_glut)
     {
@@ -776,14 +2101,21 @@ bool horizonator_resized(const horizonator_context_t* ctx, int width, int height
     }
 
     glViewport(0, 0, width, height);
-    glUniform1f(ctx->uniform_aspect, (float)width / (float)height);
+    ctx->viewport_width  = width;
+    ctx->viewport_height = height;
+    ctx->view.aspect     = (float)width / (float)height;
+    ctx->view.viewport_width  = (float)width;
+    ctx->view.viewport_height = (float)height;
+    ctx->view_dirty      = true;
     return true;
 }
 
 // set the position of the clipping planes. The horizontal distance from the
 // viewer is compared against these positions. Only points in [znear,zfar] are
 // rendered. The render is color-coded by this distance, using znear_color and
-// zfar_color as the bounds for the color-coding.
+// zfar_color as the bounds for the color-coding. If the terrain was loaded
+// with a limited range, and zfar now reaches past it, more is loaded by the
+// next horizonator_redraw().
 //
 // Any value <0 is untouched by this call
 bool horizonator_set_zextents(horizonator_context_t* ctx,
@@ -797,18 +2129,212 @@ bool horizonator_set_zextents(horizonator_context_t* ctx,
         glutSetWindow(ctx->glut_window);
     }
 
-    if(znear > 0.0f)
-       glUniform1f( ctx->uniform_znear,       znear);       assert_opengl();
-    if(zfar > 0.0f)
-       glUniform1f( ctx->uniform_zfar,        zfar);        assert_opengl();
-    if(znear_color > 0.0f)
-       glUniform1f( ctx->uniform_znear_color, znear_color); assert_opengl();
-    if(zfar_color > 0.0f)
-       glUniform1f( ctx->uniform_zfar_color,  zfar_color);  assert_opengl();
+    if(znear       > 0.0f) ctx->view.znear       = znear;
+    if(zfar        > 0.0f) ctx->view.zfar        = zfar;
+    if(znear_color > 0.0f) ctx->view.znear_color = znear_color;
+    if(zfar_color  > 0.0f) ctx->view.zfar_color  = zfar_color;
+    ctx->view_dirty = true;
     return true;
 }
 
-bool horizonator_redraw(const horizonator_context_t* ctx)
+// With a simplified mesh, the chunks around the viewer are drawn from a dense
+// grid. This moves that patch to follow the viewer, if needed: the chunks of the
+// old patch go back to the simplified mesh, and the vertices and triangles of
+// the new patch are written into the space reserved for them at the end of the
+// vertex and index buffers
+static void update_patch(horizonator_context_t* ctx)
+{
+    if(ctx->mesh.data == NULL)
+        return;
+
+    const int C = HORIZONATOR_CHUNK_CELLS;
+    const int N = ctx->Nchunks_side;
+
+    // The patch is centered on the chunk containing the viewer, but stays
+    // inside the mosaic, if it can
+    int ci = (int)floorf(ctx->view.viewer_cell_i) / C;
+    int cj = (int)floorf(ctx->view.viewer_cell_j) / C;
+    if(ci > N-2) ci = N-2;
+    if(ci < 1)   ci = 1;
+    if(cj > N-2) cj = N-2;
+    if(cj < 1)   cj = 1;
+    if(ci == ctx->patch_ci && cj == ctx->patch_cj)
+        return;
+
+    if(ctx->patch_ci >= 0)
+        for(int j = ctx->patch_cj-1; j <= ctx->patch_cj+1; j++)
+            for(int i = ctx->patch_ci-1; i <= ctx->patch_ci+1; i++)
+            {
+                if(i < 0 || i >= N || j < 0 || j >= N)
+                    continue;
+                horizonator_chunk_t* chunk = &ctx->chunks[j*N + i];
+                chunk->index0     = chunk->index0_mesh;
+                chunk->Ntriangles = chunk->Ntriangles_mesh;
+            }
+
+    int ci0 = ci-1 < 0 ? 0 : ci-1;
+    int cj0 = cj-1 < 0 ? 0 : cj-1;
+    int ci1 = ci+1 < N ? ci+1 : N-1;
+    int cj1 = cj+1 < N ? cj+1 : N-1;
+    const int i0 = ctx->chunks[cj0*N + ci0].i0;
+    const int j0 = ctx->chunks[cj0*N + ci0].j0;
+    const int i1 = ctx->chunks[cj1*N + ci1].i1;
+    const int j1 = ctx->chunks[cj1*N + ci1].j1;
+
+    // The patch vertices are a (3C+1) x (3C+1) grid, starting at (i0,j0)
+    const int Wpatch = 3*C + 1;
+
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->vertex_buffer);
+    GLshort* vertices =
+        glMapBufferRange(GL_ARRAY_BUFFER,
+                         (GLintptr)ctx->patch_vertex0*3*sizeof(GLshort),
+                         Wpatch*Wpatch*3*sizeof(GLshort),
+                         GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    assert_opengl();
+    for(int j=j0; j<=j1; j++)
+        for(int i=i0; i<=i1; i++)
+        {
+            GLshort* v = &vertices[3*((j-j0)*Wpatch + (i-i0))];
+            v[0] = i;
+            v[1] = j;
+            v[2] = horizonator_dem_mosaic_at(&ctx->dems, i,j);
+        }
+    int res = glUnmapBuffer(GL_ARRAY_BUFFER);
+    assert( res == GL_TRUE );
+
+    // The element array binding is part of the VAO, so the index buffer is
+    // still bound
+    GLuint* indices =
+        glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER,
+                         (GLintptr)ctx->patch_index0*sizeof(GLuint),
+                         2*(3*C)*(3*C)*3*sizeof(GLuint),
+                         GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    assert_opengl();
+    int idx = 0;
+    for(int cj=cj0; cj<=cj1; cj++)
+        for(int ci=ci0; ci<=ci1; ci++)
+        {
+            horizonator_chunk_t* chunk = &ctx->chunks[cj*N + ci];
+            chunk->index0 = ctx->patch_index0 + idx;
+
+            for( int j=chunk->j0; j<chunk->j1; j++ )
+                for( int i=chunk->i0; i<chunk->i1; i++ )
+                {
+                    int v00 = ctx->patch_vertex0 + (j-j0)*Wpatch + (i-i0);
+                    indices[idx++] = v00;
+                    indices[idx++] = v00 + Wpatch + 1;
+                    indices[idx++] = v00 + Wpatch;
+
+                    indices[idx++] = v00;
+                    indices[idx++] = v00 + 1;
+                    indices[idx++] = v00 + Wpatch + 1;
+                }
+            chunk->Ntriangles = (ctx->patch_index0 + idx - chunk->index0) / 3;
+        }
+    res = glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+    assert( res == GL_TRUE );
+
+    ctx->patch_ci = ci;
+    ctx->patch_cj = cj;
+}
+
+// Computes the (azimuth, elevation, distance) of every vertex, as seen from the
+// viewer, into polar_buffer. This is the expensive part of the vertex work, and
+// it only changes when the viewer moves. The view UBO must be current
+static void project_vertices(horizonator_context_t* ctx)
+{
+    stage_timer_t timer;
+    stage_begin(&timer);
+
+    glUseProgram(ctx->program_project);
+
+    // polar_buffer is written here, so it can't be a vertex input at the same
+    // time
+    glDisableVertexAttribArray(1);
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, ctx->polar_buffer);
+
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, ctx->Nvertices);
+    glEndTransformFeedback();
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    glEnableVertexAttribArray(1);
+
+    glUseProgram(ctx->program);
+    assert_opengl();
+
+    ctx->polar_dirty = false;
+
+    // When benchmarking I wait for the GPU, like in horizonator_redraw()
+    if(ctx->stage_callback != NULL)
+        glFinish();
+    stage_end(ctx, &timer, HORIZONATOR_STAGE_PROJECT);
+}
+
+// If the view now reaches past the loaded range (zfar, plus the distance the
+// viewer has moved off-center), the terrain is rebuilt with a larger range.
+// It grows by at least half each time, so that a slowly-increasing zfar
+// doesn't rebuild it at every step
+static bool ensure_range(horizonator_context_t* ctx)
+{
+    if(!isfinite(ctx->range.loaded))
+        return true;
+
+    const float Rearth = 6371000.0f;
+    float dn = (ctx->viewer_lat - ctx->range.lat) * Rearth * (float)M_PI / 180.0f;
+    float de = (ctx->viewer_lon - ctx->range.lon) * Rearth * (float)M_PI / 180.0f *
+        cosf(ctx->range.lat * (float)M_PI / 180.0f);
+    float needed = ctx->view.zfar + hypotf(de, dn);
+    if(needed <= ctx->range.loaded)
+        return true;
+
+    // terrain_init() makes new GL buffers, so the old ones are deleted here.
+    // terrain_deinit() can't do this: horizonator_deinit() calls it after the
+    // GL context (and the buffers with it) is gone
+    void terrain_reset(void)
+    {
+        terrain_deinit(ctx);
+        glDeleteBuffers(3, (const GLuint[]){ctx->vertex_buffer,
+                                            ctx->polar_buffer,
+                                            ctx->index_buffer});
+        ctx->vertex_buffer = ctx->polar_buffer = ctx->index_buffer = 0;
+    }
+
+    const float loaded_old = ctx->range.loaded;
+
+    terrain_reset();
+    ctx->range.loaded = fmaxf(needed, 1.5f*loaded_old);
+    if(!terrain_init(ctx))
+    {
+        MSG("Couldn't extend the terrain to a range of %.0fm. Going back to %.0fm",
+            ctx->range.loaded, loaded_old);
+
+        // terrain_init() cleans up after itself, except for the GL buffers
+        terrain_reset();
+        ctx->range.loaded = loaded_old;
+        if(!terrain_init(ctx))
+        {
+            // Nothing is loaded now. have_terrain() rejects this context from
+            // here on
+            MSG("Couldn't rebuild the terrain either");
+            terrain_reset();
+        }
+        else
+        {
+            set_origin_uniforms(ctx);
+            horizonator_move(ctx, ctx->viewer_lat, ctx->viewer_lon);
+        }
+        return false;
+    }
+    set_origin_uniforms(ctx);
+
+    // The grid moved: the viewer must be placed in it again
+    return horizonator_move(ctx, ctx->viewer_lat, ctx->viewer_lon);
+}
+
+bool horizonator_redraw(horizonator_context_t* ctx)
 {
     if(ctx->use_glut)
     {
@@ -817,26 +2343,169 @@ bool horizonator_redraw(const horizonator_context_t* ctx)
         glutSetWindow(ctx->glut_window);
     }
 
+    if(!have_terrain(ctx))
+        return false;
+
+    // Whatever the earlier draws' queries have by now. If every set of queries
+    // is still in flight, I wait for the oldest one: I need it for this draw
+    collect_queries(ctx, ctx->queries.Npending == HORIZONATOR_QUERY_SETS ? 1 : 0);
+
+    if(!ensure_range(ctx))
+        return false;
+
+    if(ctx->view_dirty)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, ctx->view_ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ctx->view), &ctx->view);
+        assert_opengl();
+        ctx->view_dirty = false;
+    }
+
+    if(ctx->polar_dirty)
+    {
+        update_patch(ctx);
+        project_vertices(ctx);
+    }
+
+    stage_timer_t timer;
+    stage_begin(&timer);
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDrawElements(GL_TRIANGLES, ctx->Ntriangles*3, GL_UNSIGNED_INT, NULL);
+    if(ctx->offscreen.render_cellid)
+    {
+        // glClear() is undefined for integer buffers, so the cell-ID buffer is
+        // cleared separately. cell (-1,-1) means "no terrain here"
+        glClearBufferiv(GL_COLOR, 1, (const GLint[]){-1, -1, 0, 0});
+    }
+
+    const int q = (ctx->queries.first_pending + ctx->queries.Npending) % HORIZONATOR_QUERY_SETS;
+    glBeginQuery(GL_PRIMITIVES_GENERATED, ctx->queries.primitives_generated[q]);
+    if(ctx->queries.have_gpu_timer)
+        glBeginQuery(GL_TIME_ELAPSED, ctx->queries.gpu_time[q]);
+
+    // Only the chunks of the mesh that intersect the view, and aren't hidden
+    // behind nearer terrain, are drawn, so the vertex work is proportional to
+    // the field of view. They're drawn nearest-first, so the depth test
+    // rejects most hidden fragments early
+    uint64_t Ntriangles_drawn = 0;
+    int Ndraws = cull_chunks(ctx,
+                             &Ntriangles_drawn,
+                             &ctx->stats.triangles_culled_view,
+                             &ctx->stats.triangles_culled_occlusion);
+    glMultiDrawElements(GL_TRIANGLES,
+                        ctx->draw_counts, GL_UNSIGNED_INT,
+                        ctx->draw_offsets, Ndraws);
+
+    if(ctx->queries.have_gpu_timer)
+        glEndQuery(GL_TIME_ELAPSED);
+    glEndQuery(GL_PRIMITIVES_GENERATED);
+    ctx->queries.triangles_pending[q] = Ntriangles_drawn;
+    ctx->queries.Npending++;
+    ctx->stats.triangles_submitted += Ntriangles_drawn;
+
+    // When benchmarking I wait for the GPU. Otherwise the draw time would be
+    // charged to whatever synchronizes next
+    if(ctx->stage_callback != NULL)
+        glFinish();
+    stage_end(ctx, &timer, HORIZONATOR_STAGE_DRAW);
+    return true;
+}
+
+// Adds the integer cell-ID color attachment to the offscreen framebuffer. Done
+// lazily, the first time geolocation is requested: most users never ask for
+// it, and it is 16 bytes per pixel
+static bool init_cellid_buffer(horizonator_context_t* ctx)
+{
+    static_assert(sizeof(GLuint) == sizeof(ctx->offscreen.cellidBufID),
+                  "horizonator_context_t.offscreen.... must be a GLuint");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->offscreen.frameBufID);
+    assert_opengl();
+
+    glGenRenderbuffers(1, &ctx->offscreen.cellidBufID);
+    assert_opengl();
+    glBindRenderbuffer(GL_RENDERBUFFER, ctx->offscreen.cellidBufID);
+    assert_opengl();
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32I,
+                          ctx->offscreen.width, ctx->offscreen.height);
+    assert_opengl();
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                              GL_RENDERBUFFER, ctx->offscreen.cellidBufID);
+    assert_opengl();
+
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        MSG("Couldn't add the cell-ID attachment to the offscreen framebuffer");
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                                  GL_RENDERBUFFER, 0);
+        glDeleteRenderbuffers(1, &ctx->offscreen.cellidBufID);
+        ctx->offscreen.cellidBufID = 0;
+        return false;
+    }
     return true;
 }
 
-// Renders a given scene to an RGB image and/or a range image.
-// horizonator_init() must have been called first with use_glut=true and
-// offscreen_width,height > 0. Then the viewer and camera must have been
-// configured with horizonator_move() and horizonator_pan_zoom()
+// Converts the cell-ID buffer (bottom row first, as read from GL) to the
+// geolocation map (top row first). Each pixel has the cell, the packed 16-bit
+// offsets inside it, and the bits of the float elevation, all at the point
+// where the line of sight meets the drawn triangle (see fragment.glsl)
+static void cellid_to_geolocation(const horizonator_context_t* ctx,
+                                  horizonator_geolocation_t* geolocation,
+                                  const GLint* cellid)
+{
+    const int width  = ctx->offscreen.width;
+    const int height = ctx->offscreen.height;
+
+    const float lon0 =
+        (float)ctx->dems.origin_dem_lon_lat[0] +
+        (float)ctx->dems.origin_dem_cellij[0] / (float)ctx->dems.cells_per_deg;
+    const float lat0 =
+        (float)ctx->dems.origin_dem_lon_lat[1] +
+        (float)ctx->dems.origin_dem_cellij[1] / (float)ctx->dems.cells_per_deg;
+    // The cell ids are in the grid of the render
+    const float cells_per_deg = (float)(ctx->dems.cells_per_deg * ctx->near.scale);
+
+    for(int y=0; y<height; y++)
+    {
+        const GLint*               c = &cellid[(size_t)(height-1 - y)*(size_t)width*4];
+        horizonator_geolocation_t* g = &geolocation[(size_t)y*(size_t)width];
+
+        for(int x=0; x<width; x++, c += 4, g++)
+        {
+            int i = c[0];
+            int j = c[1];
+            if(i < 0)
+            {
+                g->lat = g->lon = g->elevation = NAN;
+                continue;
+            }
+
+            float fi = (float)( (uint32_t)c[2]        & 0xFFFF) / 65535.f;
+            float fj = (float)(((uint32_t)c[2] >> 16) & 0xFFFF) / 65535.f;
+
+            memcpy(&g->elevation, &c[3], sizeof(float));
+            g->lon = lon0 + ((float)i + fi) / cells_per_deg;
+            g->lat = lat0 + ((float)j + fj) / cells_per_deg;
+        }
+    }
+}
+
+// Renders a given scene to an RGB image and/or a range image and/or a
+// geolocation map. horizonator_init() must have been called first with
+// use_glut=true and offscreen_width,height > 0. Then the viewer and camera must
+// have been configured with horizonator_move() and horizonator_pan_zoom()
 //
 // Returns true on success. The image and ranges buffers must be large-enough to
 // contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively. The
 // images are returned using the usual convention: the top row is stored first.
 // This is opposite of the OpenGL convention: bottom row is first. Invisible
 // points have ranges <0
-bool horizonator_render_offscreen(const horizonator_context_t* ctx,
+bool horizonator_render_offscreen(horizonator_context_t* ctx,
 
                                   // output
-                                  // either may be NULL
-                                  char* image, float* ranges)
+                                  // any may be NULL
+                                  char* image, float* ranges,
+                                  horizonator_geolocation_t* geolocation)
 {
     if(ctx->use_glut)
     {
@@ -854,13 +2523,33 @@ bool horizonator_render_offscreen(const horizonator_context_t* ctx,
     int width  = ctx->offscreen.width;
     int height = ctx->offscreen.height;
 
-    horizonator_redraw(ctx);
+    if(geolocation != NULL)
+    {
+        if(ctx->offscreen.cellidBufID == 0 && !init_cellid_buffer(ctx))
+            return false;
+        glDrawBuffers(2, (const GLenum[]){GL_COLOR_ATTACHMENT0,
+                                          GL_COLOR_ATTACHMENT1});
+    }
+    else
+        glDrawBuffers(1, (const GLenum[]){GL_COLOR_ATTACHMENT0});
+
+    ctx->offscreen.render_cellid = geolocation != NULL;
+    bool result = horizonator_redraw(ctx);
+    ctx->offscreen.render_cellid = false;
+    if(!result)
+        return false;
+
+    stage_timer_t timer;
 
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
     if(image != NULL)
     {
+        stage_begin(&timer);
         glReadPixels(0,0, width, height,
                      GL_BGR, GL_UNSIGNED_BYTE, image);
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_READPIXELS);
+        ctx->stats.bytes_read_back += (uint64_t)width*(uint64_t)height*3;
+
+        stage_begin(&timer);
 
         // Flip the image around to compensate for OpenGL giving me upside-down
         // images
@@ -880,30 +2569,29 @@ bool horizonator_render_offscreen(const horizonator_context_t* ctx,
                 swap((x + y             *width)*3 + 2,
                      (x + (height-1 - y)*width)*3 + 2);
             }
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_FLIP);
     }
     if(ranges != NULL)
     {
+        stage_begin(&timer);
         glReadPixels(0,0, width, height,
                      GL_DEPTH_COMPONENT, GL_FLOAT, ranges);
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_READPIXELS);
+        ctx->stats.bytes_read_back += (uint64_t)width*(uint64_t)height*sizeof(float);
 
-        float az_deg0, az_deg1;
-        glGetUniformfv(ctx->program, ctx->uniform_az_deg0, &az_deg0);
-        assert_opengl();
-        glGetUniformfv(ctx->program, ctx->uniform_az_deg1, &az_deg1);
-        assert_opengl();
+        stage_begin(&timer);
 
-        float znear, zfar;
-        glGetUniformfv(ctx->program, ctx->uniform_znear, &znear);
-        assert_opengl();
-        glGetUniformfv(ctx->program, ctx->uniform_zfar, &zfar);
-        assert_opengl();
+        const float az_deg0 = ctx->view.az_deg0;
+        const float az_deg1 = ctx->view.az_deg1;
+        const float znear   = ctx->view.znear;
+        const float zfar    = ctx->view.zfar;
 
 
         // I just read the depth buffer. depth is in [0,1] and it describes
         // gl_Position.z/gl_Position.w in the vertex shader, except THAT
         // quantity is in [-1,1]. I convert each "depth" value to a "range"
 
-        // In vertex.glsl we have:
+        // In project.glsl and vertex.glsl we have:
         //
         // az = 0:     North
         // az = 90deg: East
@@ -969,6 +2657,35 @@ bool horizonator_render_offscreen(const horizonator_context_t* ctx,
             for(int x=0; x<width; x++)
                 ranges[y*width + x] = range(x, y, tanel);
         }
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_RANGE_CONVERSION);
+    }
+    if(geolocation != NULL)
+    {
+        static_assert(sizeof(GLint) == sizeof(ctx->offscreen.cellid[0]),
+                      "GLint size mismatch");
+
+        // The offscreen size is fixed, so this buffer is allocated once
+        if(ctx->offscreen.cellid == NULL)
+        {
+            ctx->offscreen.cellid = malloc((size_t)width*(size_t)height*4*sizeof(GLint));
+            if(ctx->offscreen.cellid == NULL)
+            {
+                MSG("malloc() failed");
+                return false;
+            }
+        }
+
+        stage_begin(&timer);
+        glReadBuffer(GL_COLOR_ATTACHMENT1);
+        glReadPixels(0,0, width, height,
+                     GL_RGBA_INTEGER, GL_INT, ctx->offscreen.cellid);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_READPIXELS);
+        ctx->stats.bytes_read_back += (uint64_t)width*(uint64_t)height*4*sizeof(GLint);
+
+        stage_begin(&timer);
+        cellid_to_geolocation(ctx, geolocation, ctx->offscreen.cellid);
+        stage_end(ctx, &timer, HORIZONATOR_STAGE_GEOLOCATION);
     }
 
     return true;
@@ -984,6 +2701,7 @@ bool horizonator_allinone_glut_loop( bool render_texture,
                                      // square.
                                      float az_deg0, float az_deg1,
                                      int render_radius_cells,
+                                     float mesh_tolerance,
 
                                      // rendering and color-coding boundaries. Set to <=0 for
                                      // defaults
@@ -991,6 +2709,8 @@ bool horizonator_allinone_glut_loop( bool render_texture,
                                      float znear_color, float zfar_color,
 
                                      const char* dir_dems,
+                                     const char* dir_dems_near,
+                                     int near_radius_cells,
                                      const char* dir_tiles,
                                      bool allow_downloads)
 {
@@ -1000,9 +2720,13 @@ bool horizonator_allinone_glut_loop( bool render_texture,
                            viewer_lat, viewer_lon,
                            -1, -1,
                            render_radius_cells,
+                           // Only the terrain within zfar is ever drawn
+                           zfar,
+                           mesh_tolerance,
                            true,
                            render_texture,
                            dir_dems,
+                           dir_dems_near, near_radius_cells,
                            dir_tiles,
                            allow_downloads) )
         return false;
@@ -1071,8 +2795,135 @@ bool horizonator_allinone_glut_loop( bool render_texture,
     return true;
 }
 
+// The window of the depth buffer read back by horizonator_pick_many(), and its
+// per-column and per-row tables
+typedef struct
+{
+    int x0, x1, y0, y1, w, h;
+
+    // depth[] is w*h, bottom row first. sin_az[], cos_az[] have one entry per
+    // column, and range_scale[] one per row, top row first
+    const float* depth;
+    const float* sin_az;
+    const float* cos_az;
+    const float* range_scale;
+
+    float znear, zfar;
+    float viewer_lat, viewer_lon;
+    float lat_per_n,  lon_per_e;
+} pick_window_t;
+
+// I have some p = (e,n,z)
+//   e = length_en sin(az)
+//   n = length_en cos(az)
+//   z = length_en tan(el)
+//
+// The trig was done per column and per row, so each pixel costs a lookup and a
+// few multiplies. This does pixels k0..N-1, one at a time
+static void pick_pixels_scalar(// output
+                               float* lat, float* lon, float* range,
+
+                               // input
+                               const pick_window_t* p,
+                               const int* x, const int* y,
+                               int k0, int N)
+{
+    for(int i=k0; i<N; i++)
+    {
+        bool inside =
+            x[i] >= p->x0 && x[i] <= p->x1 &&
+            y[i] >= p->y0 && y[i] <= p->y1;
+        int ix = inside ? x[i] - p->x0 : 0;
+        int iy = inside ? y[i] - p->y0 : 0;
+
+        // depth is in [0,1] and it describes gl_Position.z/gl_Position.w in the
+        // vertex shader, except THAT quantity is in [-1,1]. Row 0 of depth[] is
+        // the bottom row (y1)
+        float d         = p->depth[(size_t)(p->h-1 - iy)*(size_t)p->w + ix];
+        bool  hit       = inside && d < 1.0f;
+        float length_en = d * (p->zfar-p->znear) + p->znear;
+
+        lon[i] = hit ? p->viewer_lon + length_en * p->sin_az[ix] * p->lon_per_e : NAN;
+        lat[i] = hit ? p->viewer_lat + length_en * p->cos_az[ix] * p->lat_per_n : NAN;
+        if(range != NULL)
+            range[i] = hit ? length_en * p->range_scale[iy] : -1.0f;
+    }
+}
+
+#if defined __x86_64__ || defined __i386__
+// Like pick_pixels_scalar(), but 8 pixels at a time, gathering from the tables,
+// for as long as there are 8 left. Returns how many pixels were done. Gives
+// the same results as pick_pixels_scalar()
+__attribute__((target("avx2")))
+static int pick_pixels_avx2(// output
+                            float* lat, float* lon, float* range,
+
+                            // input
+                            const pick_window_t* p,
+                            const int* x, const int* y,
+                            int N)
+{
+    const __m256i x0         = _mm256_set1_epi32(p->x0);
+    const __m256i y0         = _mm256_set1_epi32(p->y0);
+    const __m256i x0m1       = _mm256_set1_epi32(p->x0 - 1);
+    const __m256i y0m1       = _mm256_set1_epi32(p->y0 - 1);
+    const __m256i x1p1       = _mm256_set1_epi32(p->x1 + 1);
+    const __m256i y1p1       = _mm256_set1_epi32(p->y1 + 1);
+    const __m256i w          = _mm256_set1_epi32(p->w);
+    const __m256i hm1        = _mm256_set1_epi32(p->h - 1);
+    const __m256  one        = _mm256_set1_ps(1.0f);
+    const __m256  nan        = _mm256_set1_ps(NAN);
+    const __m256  minus1     = _mm256_set1_ps(-1.0f);
+    const __m256  depth_span = _mm256_set1_ps(p->zfar - p->znear);
+    const __m256  znear      = _mm256_set1_ps(p->znear);
+    const __m256  viewer_lat = _mm256_set1_ps(p->viewer_lat);
+    const __m256  viewer_lon = _mm256_set1_ps(p->viewer_lon);
+    const __m256  lat_per_n  = _mm256_set1_ps(p->lat_per_n);
+    const __m256  lon_per_e  = _mm256_set1_ps(p->lon_per_e);
+
+    int k = 0;
+    for(; k+8 <= N; k += 8)
+    {
+        __m256i xk = _mm256_loadu_si256((const __m256i*)&x[k]);
+        __m256i yk = _mm256_loadu_si256((const __m256i*)&y[k]);
+
+        __m256i inside =
+            _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(xk,   x0m1),
+                                              _mm256_cmpgt_epi32(x1p1, xk)),
+                             _mm256_and_si256(_mm256_cmpgt_epi32(yk,   y0m1),
+                                              _mm256_cmpgt_epi32(y1p1, yk)));
+        __m256i ix = _mm256_and_si256(inside, _mm256_sub_epi32(xk, x0));
+        __m256i iy = _mm256_and_si256(inside, _mm256_sub_epi32(yk, y0));
+
+        __m256i idepth = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(hm1, iy), w),
+                                          ix);
+        __m256 d         = _mm256_i32gather_ps(p->depth, idepth, 4);
+        __m256 hit       = _mm256_and_ps(_mm256_castsi256_ps(inside),
+                                         _mm256_cmp_ps(d, one, _CMP_LT_OQ));
+        __m256 length_en = _mm256_add_ps(_mm256_mul_ps(d, depth_span), znear);
+
+        __m256 sin_az = _mm256_i32gather_ps(p->sin_az, ix, 4);
+        __m256 cos_az = _mm256_i32gather_ps(p->cos_az, ix, 4);
+        __m256 lonk   = _mm256_add_ps(viewer_lon,
+                                      _mm256_mul_ps(_mm256_mul_ps(length_en, sin_az), lon_per_e));
+        __m256 latk   = _mm256_add_ps(viewer_lat,
+                                      _mm256_mul_ps(_mm256_mul_ps(length_en, cos_az), lat_per_n));
+        _mm256_storeu_ps(&lon[k], _mm256_blendv_ps(nan, lonk, hit));
+        _mm256_storeu_ps(&lat[k], _mm256_blendv_ps(nan, latk, hit));
+
+        if(range != NULL)
+        {
+            __m256 scale = _mm256_i32gather_ps(p->range_scale, iy, 4);
+            _mm256_storeu_ps(&range[k],
+                             _mm256_blendv_ps(minus1, _mm256_mul_ps(length_en, scale), hit));
+        }
+    }
+    return k;
+}
+#endif
+
 // returns true if an intersection is found
-bool horizonator_pick(const horizonator_context_t* ctx,
+bool horizonator_pick(horizonator_context_t* ctx,
 
                       // output
                       float* lat, float* lon,
@@ -1080,6 +2931,26 @@ bool horizonator_pick(const horizonator_context_t* ctx,
                       // input
                       // pixel coordinates in the render
                       int x, int y )
+{
+    // A 1-pixel batch reads back exactly one pixel, so this costs the same as
+    // a dedicated implementation
+    float range;
+    if(!horizonator_pick_many(ctx, lat, lon, &range, &x, &y, 1))
+        return false;
+    return range >= 0.0f;
+}
+
+bool horizonator_pick_many(horizonator_context_t* ctx,
+
+                           // output
+                           // Each is an array of N values. range may be NULL
+                           float* lat, float* lon, float* range,
+
+                           // input
+                           // pixel coordinates in the render. Each is an array
+                           // of N values
+                           const int* x, const int* y,
+                           int N)
 {
     if(ctx->use_glut)
     {
@@ -1088,6 +2959,12 @@ bool horizonator_pick(const horizonator_context_t* ctx,
         glutSetWindow(ctx->glut_window);
     }
 
+    if(!have_terrain(ctx))
+        return false;
+
+    if(N <= 0)
+        return true;
+
     // az = 0:     North
     // az = 90deg: East
     // xy coords are (e,n)
@@ -1107,61 +2984,127 @@ bool horizonator_pick(const horizonator_context_t* ctx,
       depth = ((length(en) - znear) / (zfar - znear))
     */
 
-    union
+    const int   width          = ctx->viewport_width;
+    const int   height         = ctx->viewport_height;
+    if(width <= 0 || height <= 0)
     {
-        GLint viewport[4];
-        struct
-        {
-            GLint x0,y0,width,height;
-        };
-    } u;
-    glGetIntegerv(GL_VIEWPORT, u.viewport);
+        MSG("The viewport size isn't known yet: nothing was rendered");
+        return false;
+    }
+    const float znear          = ctx->view.znear;
+    const float zfar           = ctx->view.zfar;
+    const float az_deg0        = ctx->view.az_deg0;
+    const float az_deg1        = ctx->view.az_deg1;
+    const float cos_viewer_lat = ctx->view.cos_viewer_lat;
+    const float aspect         = (float)width / (float)height;
 
-    float znear, zfar;
-    glGetUniformfv(ctx->program, ctx->uniform_znear, &znear);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_zfar, &zfar);
-    assert_opengl();
+    const float Rearth = 6371000.0;
 
-    float depth;
-    glReadPixels(x, u.height-1 - y,
-                 1,1,
-                 GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
-    if(depth >= 1.0f)
-        return false;
+    // I read back only the bounding box of the requested pixels, in one
+    // glReadPixels() call. Pixels outside the viewport are never hits
+    int x0 = width, x1 = -1, y0 = height, y1 = -1;
+    for(int i=0; i<N; i++)
+    {
+        if(x[i] < 0 || x[i] >= width || y[i] < 0 || y[i] >= height)
+            continue;
+        if(x[i] < x0) x0 = x[i];
+        if(x[i] > x1) x1 = x[i];
+        if(y[i] < y0) y0 = y[i];
+        if(y[i] > y1) y1 = y[i];
+    }
+    if(x1 < 0)
+    {
+        for(int i=0; i<N; i++)
+        {
+            lat[i] = lon[i] = NAN;
+            if(range != NULL) range[i] = -1.0f;
+        }
+        return true;
+    }
 
-    // depth is in [0,1] and it describes gl_Position.z/gl_Position.w in the
-    // vertex shader, except THAT quantity is in [-1,1]
-    float length_en = depth * (zfar-znear) + znear;
+    const int w = x1 - x0 + 1;
+    const int h = y1 - y0 + 1;
 
-    float az_deg0, az_deg1, cos_viewer_lat;
-    glGetUniformfv(ctx->program, ctx->uniform_az_deg0,        &az_deg0);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_az_deg1,        &az_deg1);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_cos_viewer_lat, &cos_viewer_lat);
-    assert_opengl();
+    // The depth buffer, and the per-column and per-row factors of the inverse
+    // projection. The azimuth depends only on x and the elevation only on y,
+    // so all the trig is done once per column and per row, not per pixel
+    float* buf = malloc( ((size_t)w*(size_t)h + 2*w + h) * sizeof(float) );
+    if(buf == NULL)
+    {
+        MSG("malloc() failed");
+        return false;
+    }
+    float* depth       = buf;
+    float* sin_az      = &depth [(size_t)w*(size_t)h];
+    float* cos_az      = &sin_az[w];
+    float* range_scale = &cos_az[w];
 
-    const float Rearth = 6371000.0;
+    // The image is stored bottom-row-first in GL
+    glReadPixels(x0, height-1 - y1,
+                 w, h,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, depth);
+    ctx->stats.bytes_read_back += (uint64_t)w*(uint64_t)h*sizeof(float);
 
     // The viewport is "width" pixels wide. The center of the first pixel is at
     // x=0.5. The center of the last pixel is at x=width-0.5
-    float az_ndc = ((float)x + 0.5f) / (float)u.width * 2.f - 1.f;
-    float az     = (az_ndc * (az_deg1-az_deg0) / 2.f + (az_deg1+az_deg0)/2.f) * M_PI/180.0f;
-
-    // Could be useful, but I don't need these
-    // float el_ndc = ((float)y + 0.5f) / (float)u.height * 2.f - 1.f;
-    // float aspect = (float)u.width / (float)u.height;
-    // float el     = el_ndc * (az_deg1-az_deg0) / 2.f / aspect * M_PI/180.0f;
-
-    // I have some p = (e,n,z)
-    //   e = length_en sin(az)
-    //   n = length_en cos(az)
-    //   z = length_en tan(el)
-    float e = length_en * sinf(az);
-    float n = length_en * cosf(az);
-
-    *lon = ctx->viewer_lon + e / Rearth / M_PI * 180. / cos_viewer_lat;
-    *lat = ctx->viewer_lat + n / Rearth / M_PI * 180.;
+    for(int i=0; i<w; i++)
+    {
+        float az_ndc = ((float)(x0+i) + 0.5f) / (float)width * 2.f - 1.f;
+        float az     = (az_ndc * (az_deg1-az_deg0) / 2.f + (az_deg1+az_deg0)/2.f) * M_PI/180.0f;
+        sin_az[i] = sinf(az);
+        cos_az[i] = cosf(az);
+    }
+    for(int j=0; j<h; j++)
+    {
+        // y is the row from the top. GL counts from the bottom
+        float el_ndc = ((float)(height-1 - (y0+j)) + 0.5f) / (float)height * 2.f - 1.f;
+        float el     = el_ndc * (az_deg1-az_deg0) / 2.f / aspect * M_PI/180.0f;
+        range_scale[j] = 1.0f / cosf(el);
+    }
+
+    const pick_window_t window =
+        { .x0          = x0, .x1 = x1, .y0 = y0, .y1 = y1, .w = w, .h = h,
+          .depth       = depth,
+          .sin_az      = sin_az,
+          .cos_az      = cos_az,
+          .range_scale = range_scale,
+          .znear       = znear,
+          .zfar        = zfar,
+          .viewer_lat  = ctx->viewer_lat,
+          .viewer_lon  = ctx->viewer_lon,
+          .lat_per_n   = 180.f / (float)M_PI / Rearth,
+          .lon_per_e   = 180.f / (float)M_PI / Rearth / cos_viewer_lat };
+
+    int k = 0;
+#if defined __x86_64__ || defined __i386__
+    if(__builtin_cpu_supports("avx2"))
+        k = pick_pixels_avx2(lat, lon, range, &window, x, y, N);
+#endif
+    pick_pixels_scalar(lat, lon, range, &window, x, y, k, N);
+
+    free(buf);
+    return true;
+}
+
+bool horizonator_get_stats(horizonator_context_t* ctx,
+                           // output
+                           horizonator_stats_t* stats)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    collect_queries(ctx, HORIZONATOR_QUERY_SETS);
+    *stats = ctx->stats;
     return true;
 }
+
+void horizonator_reset_stats(horizonator_context_t* ctx)
+{
+    // Any still-pending queries describe the last draw before the reset. They
+    // will be counted in the new stats. The discrepancy is small
+    ctx->stats = (horizonator_stats_t){};
+}
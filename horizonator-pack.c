@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "dem.h"
+#include "dempack.h"
+#include "util.h"
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "%s [--dirdems DIRECTORY]\n"
+        "   [--block-cells N]\n"
+        "   [--compress]\n"
+        "   LAT0 LON0 LAT1 LON1 OUT\n"
+        "\n"
+        "Packs the SRTM DEMs of a region into one DEM pack file OUT. The\n"
+        "region spans latitudes LAT0..LAT1 and longitudes LON0..LON1, in whole\n"
+        "degrees. The pack can be given to the other tools in place of the DEM\n"
+        "directory (--dirdems); they then read just the parts of it that they\n"
+        "need. The pack has the full-resolution DEM, split into square\n"
+        "blocks, the lowest and highest elevation in each block, and max\n"
+        "levels: coarser grids of the highest elevation under each node.\n"
+        "\n"
+        "The DEMs are in the directory given by --dirdems, or in\n"
+        "~/.horizonator/DEMs_SRTM3/ if omitted. Missing DEMs are assumed to be\n"
+        "in the sea.\n"
+        "\n"
+        "The blocks have --block-cells samples on each side. If omitted, we use\n"
+        "64.\n"
+        "\n"
+        "With --compress, the blocks are compressed losslessly. They are then\n"
+        "decompressed as they are read. We report the size of the pack, relative\n"
+        "to an uncompressed one, and how quickly the blocks decompress, to\n"
+        "weigh the I/O saved against the CPU time spent.\n";
+
+    struct option opts[] = {
+        { "dirdems",           required_argument, NULL, 'd' },
+        { "block-cells",       required_argument, NULL, 'b' },
+        { "compress",          no_argument,       NULL, 'c' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    const char* dir_dems    = "~/.horizonator/DEMs_SRTM3";
+    int         block_cells = HORIZONATOR_DEM_PACK_BLOCK_CELLS;
+    bool        compress    = false;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "+h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'd':
+            dir_dems = optarg;
+            break;
+
+        case 'b':
+            block_cells = atoi(optarg);
+            if(block_cells <= 0)
+            {
+                fprintf(stderr, "--block-cells must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'c':
+            compress = true;
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    int Nargs_remaining = argc-optind;
+    if( Nargs_remaining != 5 )
+    {
+        fprintf(stderr, "Need exactly 5 non-option arguments. Got %d\n\n",Nargs_remaining);
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    int lat0 = atoi(argv[optind+0]);
+    int lon0 = atoi(argv[optind+1]);
+    int lat1 = atoi(argv[optind+2]);
+    int lon1 = atoi(argv[optind+3]);
+    const char* filename = argv[optind+4];
+
+    if( lat1 <= lat0 || lon1 <= lon0 )
+    {
+        fprintf(stderr, "MUST have LAT0 < LAT1 and LON0 < LON1\n");
+        return 1;
+    }
+
+    // Each DEM is read exactly once, so caching the decoded tiles would only
+    // hold on to memory
+    horizonator_dem_tile_cache_set_max_bytes(0);
+
+    if( !horizonator_dem_pack_write(filename,
+                                    lat0, lon0,
+                                    lat1 - lat0, lon1 - lon0,
+                                    block_cells,
+                                    compress,
+                                    dir_dems) )
+    {
+        fprintf(stderr, "Couldn't write the DEM pack '%s'\n", filename);
+        return 1;
+    }
+
+    if(!compress)
+        return 0;
+
+    // Decompress every block once, to report the trade-off
+    horizonator_dem_pack_t pack;
+    if(!horizonator_dem_pack_open(&pack, filename))
+    {
+        fprintf(stderr, "Couldn't open the DEM pack '%s' I just wrote\n", filename);
+        return 1;
+    }
+
+    const uint64_t Nblocks           = (uint64_t)pack.Nblocks_i * (uint64_t)pack.Nblocks_j;
+    const uint64_t Nbytes_raw        = Nblocks * block_cells*block_cells*sizeof(int16_t);
+    const uint64_t Nbytes_compressed = pack.block_offsets[Nblocks] - pack.block_offsets[0];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(int bj=0; bj<pack.Nblocks_j; bj++)
+        for(int bi=0; bi<pack.Nblocks_i; bi++)
+            if(NULL == horizonator_dem_pack_block(&pack, bi, bj))
+            {
+                fprintf(stderr, "Couldn't decompress the DEM pack '%s' I just wrote\n", filename);
+                horizonator_dem_pack_close(&pack);
+                return 1;
+            }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    horizonator_dem_pack_close(&pack);
+
+    double dt = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec)*1e-9;
+    printf("Blocks: %.1f MB uncompressed, %.1f MB compressed: ratio %.2f\n",
+           (double)Nbytes_raw/1e6, (double)Nbytes_compressed/1e6,
+           (double)Nbytes_raw / (double)Nbytes_compressed);
+    printf("Decompressed in %.3f s: %.0f MB/s of output\n",
+           dt, (double)Nbytes_raw/1e6 / dt);
+    return 0;
+}
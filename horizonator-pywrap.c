@@ -5,8 +5,14 @@
 #include <structmember.h>
 #include <numpy/arrayobject.h>
 #include <signal.h>
+#include <assert.h>
 
 #include "horizonator.h"
+#include "viewshed.h"
+#include "horizons.h"
+#include "los.h"
+#include "raycast.h"
+#include "profile.h"
 #include "util.h"
 
 
@@ -59,6 +65,10 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     const char* dir_dems  = NULL;
     const char* dir_tiles = NULL;
     unsigned int render_radius_cells = 1000; // default
+    float mesh_tolerance = 0.0f;
+    float max_range      = 0.0f;
+    const char* dir_dems_near = NULL;
+    unsigned int near_radius_cells = 1000; // default
     double znear       = -1.0;
     double zfar        = -1.0;
     double znear_color = -1.0;
@@ -70,6 +80,9 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
         "render_texture",
         "dir_dems", "dir_tiles", "allow_downloads",
         "radius",
+        "mesh_tolerance",
+        "dir_dems_near", "radius_near",
+        "max_range",
         NULL};
 
     if(self->ctx.offscreen.inited)
@@ -79,17 +92,24 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     }
 
     if( !PyArg_ParseTupleAndKeywords(args, kwargs,
-                                     "ddII|psspI", keywords,
+                                     "ddII|psspIfzIf", keywords,
                                      &lat, &lon, &width, &height,
                                      &render_texture, &dir_dems, &dir_tiles,
                                      &allow_downloads,
-                                     &render_radius_cells))
+                                     &render_radius_cells,
+                                     &mesh_tolerance,
+                                     &dir_dems_near, &near_radius_cells,
+                                     &max_range))
         goto done;
 
     if(! horizonator_init( &self->ctx,
                            lat, lon, width, height,
                            render_radius_cells,
-                           true, render_texture, dir_dems, dir_tiles,
+                           max_range,
+                           mesh_tolerance,
+                           true, render_texture, dir_dems,
+                           dir_dems_near, near_radius_cells,
+                           dir_tiles,
                            allow_downloads ) )
         goto done;
 
@@ -138,10 +158,13 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     PyObject* result = NULL;
     PyObject* image  = NULL;
     PyObject* ranges = NULL;
+    PyObject* geolocation = NULL;
+    PyObject* geolocation_dtype_spec = NULL;
 
     double lat = -1000., lon = -1000.;
     double az_deg0, az_deg1;
     int return_image = true, return_range = true;
+    int return_geolocation = false;
     int az_extents_use_pixel_centers = false;
     double znear       = -1.;
     double zfar        = -1.;
@@ -155,19 +178,21 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
         "az_extents_use_pixel_centers",
         "znear", "zfar",
         "znear_color", "zfar_color",
+        "return_geolocation",
         NULL};
 
     if( !PyArg_ParseTupleAndKeywords(args, kwargs,
-                                     "dd|ddpppdddd", keywords,
+                                     "dd|ddpppddddp", keywords,
                                      &az_deg0, &az_deg1,
                                      &lat, &lon,
                                      &return_image, &return_range,
                                      &az_extents_use_pixel_centers,
                                      &znear, &zfar,
-                                     &znear_color, &zfar_color) )
+                                     &znear_color, &zfar_color,
+                                     &return_geolocation) )
         goto done;
 
-    if(!return_image && !return_range)
+    if(!return_image && !return_range && !return_geolocation)
     {
         result = PyTuple_New(0);
         goto done;
@@ -220,46 +245,829 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
                 NPY_FLOAT32);
         if(ranges == NULL) goto done;
     }
+    if(return_geolocation)
+    {
+        // Matches horizonator_geolocation_t
+        static_assert(sizeof(horizonator_geolocation_t) == 3*sizeof(float),
+                      "horizonator_geolocation_t must be 3 packed floats");
+        geolocation_dtype_spec = Py_BuildValue("[(ss)(ss)(ss)]",
+                                               "lat",       "f4",
+                                               "lon",       "f4",
+                                               "elevation", "f4");
+        if(geolocation_dtype_spec == NULL) goto done;
+
+        PyArray_Descr* dtype = NULL;
+        if(!PyArray_DescrConverter(geolocation_dtype_spec, &dtype))
+            goto done;
+
+        // This steals the reference to dtype
+        geolocation =
+            PyArray_NewFromDescr(&PyArray_Type, dtype,
+                                 2, ((npy_intp[]){self->ctx.offscreen.height,
+                                                  self->ctx.offscreen.width}),
+                                 NULL, NULL, 0, NULL);
+        if(geolocation == NULL) goto done;
+    }
 
     if( !horizonator_render_offscreen( &self->ctx,
                                        image  == NULL ? NULL :
                                          (char *)PyArray_DATA((PyArrayObject*)image),
                                        ranges == NULL ? NULL :
-                                         (float*)PyArray_DATA((PyArrayObject*)ranges) ))
+                                         (float*)PyArray_DATA((PyArrayObject*)ranges),
+                                       geolocation == NULL ? NULL :
+                                         (horizonator_geolocation_t*)PyArray_DATA((PyArrayObject*)geolocation) ))
     {
         BARF("horizonator_render_offscreen() failed");
         goto done;
     }
 
-    if(      return_image && !return_range) result = image;
-    else if(!return_image &&  return_range) result = ranges;
+    // I return each requested array. If exactly one was requested, I return
+    // it directly; otherwise I return a tuple, in the order (image, range,
+    // geolocation)
+    PyObject* outputs[3];
+    int       Noutputs = 0;
+    if(image       != NULL) outputs[Noutputs++] = image;
+    if(ranges      != NULL) outputs[Noutputs++] = ranges;
+    if(geolocation != NULL) outputs[Noutputs++] = geolocation;
+
+    if(Noutputs == 1)
+        result = outputs[0];
     else
     {
-        result = PyTuple_Pack(2, image, ranges);
+        result = PyTuple_New(Noutputs);
         if(result == NULL) goto done;
-        Py_DECREF(image);
-        Py_DECREF(ranges);
+        // PyTuple_SET_ITEM() steals the references
+        for(int i=0; i<Noutputs; i++)
+            PyTuple_SET_ITEM(result, i, outputs[i]);
     }
 
  done:
+    Py_XDECREF(geolocation_dtype_spec);
     if(result == NULL)
     {
         Py_XDECREF(image);
         Py_XDECREF(ranges);
+        Py_XDECREF(geolocation);
     }
     return result;
 }
 
+static PyObject*
+pick(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject*      result = NULL;
+    PyArrayObject* x      = NULL;
+    PyArrayObject* y      = NULL;
+    PyObject*      lat    = NULL;
+    PyObject*      lon    = NULL;
+    PyObject*      range  = NULL;
+
+    PyObject* x_py;
+    PyObject* y_py;
+
+    char* keywords[] = {"x", "y",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OO", keywords,
+                                     &x_py, &y_py) )
+        goto done;
+
+    x = (PyArrayObject*)PyArray_FROMANY(x_py, NPY_INT, 0, 0,
+                                        NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_FORCECAST);
+    if(x == NULL) goto done;
+    y = (PyArrayObject*)PyArray_FROMANY(y_py, NPY_INT, 0, 0,
+                                        NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_FORCECAST);
+    if(y == NULL) goto done;
+
+    if( !PyArray_SAMESHAPE(x, y) )
+    {
+        BARF("x and y must have the same shape");
+        goto done;
+    }
+
+    int       ndim = PyArray_NDIM(x);
+    npy_intp* dims = PyArray_DIMS(x);
+
+    lat   = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+    if(lat   == NULL) goto done;
+    lon   = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+    if(lon   == NULL) goto done;
+    range = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+    if(range == NULL) goto done;
+
+    npy_intp N = PyArray_SIZE(x);
+    if(N > INT_MAX)
+    {
+        BARF("Too many pixels requested: %ld", (long)N);
+        goto done;
+    }
+
+    if( !horizonator_pick_many( &self->ctx,
+                                (float*)PyArray_DATA((PyArrayObject*)lat),
+                                (float*)PyArray_DATA((PyArrayObject*)lon),
+                                (float*)PyArray_DATA((PyArrayObject*)range),
+                                (const int*)PyArray_DATA(x),
+                                (const int*)PyArray_DATA(y),
+                                (int)N ))
+    {
+        BARF("horizonator_pick_many() failed");
+        goto done;
+    }
+
+    result = PyTuple_Pack(3, lat, lon, range);
+
+ done:
+    Py_XDECREF(x);
+    Py_XDECREF(y);
+    Py_XDECREF(lat);
+    Py_XDECREF(lon);
+    Py_XDECREF(range);
+    return result;
+}
+
+static PyObject*
+viewshed(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result    = NULL;
+    PyObject* visible   = NULL;
+    PyObject* clearance = NULL;
+
+    double lat = -1000., lon = -1000.;
+    double observer_height  = 2.;
+    double target_height    = 0.;
+    double refraction_coeff = 0.13;
+
+    char* keywords[] = {"lat", "lon",
+                        "observer_height", "target_height",
+                        "refraction_coeff",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "|ddddd", keywords,
+                                     &lat, &lon,
+                                     &observer_height, &target_height,
+                                     &refraction_coeff) )
+        goto done;
+
+    if(lat <= -1000.)
+    {
+        lat = self->ctx.viewer_lat;
+        lon = self->ctx.viewer_lon;
+    }
+
+    const int W = horizonator_dem_mosaic_width(&self->ctx.dems);
+
+    visible   = PyArray_SimpleNew(2, ((npy_intp[]){W, W}), NPY_BOOL);
+    if(visible   == NULL) goto done;
+    clearance = PyArray_SimpleNew(2, ((npy_intp[]){W, W}), NPY_FLOAT32);
+    if(clearance == NULL) goto done;
+
+    if( !horizonator_viewshed( (uint8_t*)PyArray_DATA((PyArrayObject*)visible),
+                               (float*)  PyArray_DATA((PyArrayObject*)clearance),
+                               &self->ctx.dems,
+                               lat, lon,
+                               observer_height, target_height,
+                               refraction_coeff ))
+    {
+        BARF("horizonator_viewshed() failed");
+        goto done;
+    }
+
+    result = PyTuple_Pack(2, visible, clearance);
+
+ done:
+    Py_XDECREF(visible);
+    Py_XDECREF(clearance);
+    return result;
+}
+
+static PyObject*
+viewshed_cumulative(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject*      result = NULL;
+    PyArrayObject* lat    = NULL;
+    PyArrayObject* lon    = NULL;
+    PyObject*      counts = NULL;
+
+    PyObject* lat_py;
+    PyObject* lon_py;
+    double observer_height  = 2.;
+    double target_height    = 0.;
+    double refraction_coeff = 0.13;
+    int    Nthreads         = 0;
+
+    char* keywords[] = {"lat", "lon",
+                        "observer_height", "target_height",
+                        "refraction_coeff",
+                        "Nthreads",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OO|dddi", keywords,
+                                     &lat_py, &lon_py,
+                                     &observer_height, &target_height,
+                                     &refraction_coeff,
+                                     &Nthreads) )
+        goto done;
+
+    lat = (PyArrayObject*)PyArray_FROMANY(lat_py, NPY_FLOAT32, 0, 0,
+                                          NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_FORCECAST);
+    if(lat == NULL) goto done;
+    lon = (PyArrayObject*)PyArray_FROMANY(lon_py, NPY_FLOAT32, 0, 0,
+                                          NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_FORCECAST);
+    if(lon == NULL) goto done;
+
+    if( !PyArray_SAMESHAPE(lat, lon) )
+    {
+        BARF("lat and lon must have the same shape");
+        goto done;
+    }
+
+    npy_intp N = PyArray_SIZE(lat);
+    if(N > INT_MAX/8)
+    {
+        BARF("Too many observers: %ld", (long)N);
+        goto done;
+    }
+
+    const int W = horizonator_dem_mosaic_width(&self->ctx.dems);
+
+    counts = PyArray_SimpleNew(2, ((npy_intp[]){W, W}), NPY_UINT32);
+    if(counts == NULL) goto done;
+
+    double observers_per_second;
+    if( !horizonator_viewshed_cumulative( (uint32_t*)PyArray_DATA((PyArrayObject*)counts),
+                                          &observers_per_second,
+                                          &self->ctx.dems,
+                                          (const float*)PyArray_DATA(lat),
+                                          (const float*)PyArray_DATA(lon),
+                                          (int)N,
+                                          observer_height, target_height,
+                                          refraction_coeff,
+                                          Nthreads ))
+    {
+        BARF("horizonator_viewshed_cumulative() failed");
+        goto done;
+    }
+
+    result = Py_BuildValue("(Od)", counts, observers_per_second);
+
+ done:
+    Py_XDECREF(lat);
+    Py_XDECREF(lon);
+    Py_XDECREF(counts);
+    return result;
+}
+
+static PyObject*
+horizons(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result        = NULL;
+    PyObject* numpy         = NULL;
+    PyObject* memmap        = NULL;
+    PyObject* memmap_args   = NULL;
+    PyObject* memmap_kwargs = NULL;
+
+    int         K;
+    const char* filename = NULL;
+    int         Nthreads = 0;
+
+    char* keywords[] = {"K",
+                        "filename",
+                        "Nthreads",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "i|zi", keywords,
+                                     &K, &filename, &Nthreads) )
+        goto done;
+
+    if(K <= 0)
+    {
+        BARF("Need K > 0. Got K = %d", K);
+        goto done;
+    }
+
+    const int W = horizonator_dem_mosaic_width(&self->ctx.dems);
+
+    if(filename == NULL)
+    {
+        result = PyArray_SimpleNew(3, ((npy_intp[]){K, W, W}), NPY_FLOAT32);
+        if(result == NULL) goto done;
+
+        if( !horizonator_horizons( (float*)PyArray_DATA((PyArrayObject*)result),
+                                   &self->ctx.dems, K, Nthreads ))
+        {
+            BARF("horizonator_horizons() failed");
+            Py_DECREF(result);
+            result = NULL;
+            goto done;
+        }
+    }
+    else
+    {
+        if( !horizonator_horizons_file( filename,
+                                        &self->ctx.dems, K, Nthreads ))
+        {
+            BARF("horizonator_horizons_file() failed");
+            goto done;
+        }
+
+        // I return a numpy.memmap of the file I just wrote
+        numpy = PyImport_ImportModule("numpy");
+        if(numpy == NULL) goto done;
+        memmap = PyObject_GetAttrString(numpy, "memmap");
+        if(memmap == NULL) goto done;
+        memmap_args = Py_BuildValue("(s)", filename);
+        if(memmap_args == NULL) goto done;
+        memmap_kwargs = Py_BuildValue("{sssss(iii)}",
+                                      "dtype", "float32",
+                                      "mode",  "r+",
+                                      "shape", K, W, W);
+        if(memmap_kwargs == NULL) goto done;
+        result = PyObject_Call(memmap, memmap_args, memmap_kwargs);
+    }
+
+ done:
+    Py_XDECREF(numpy);
+    Py_XDECREF(memmap);
+    Py_XDECREF(memmap_args);
+    Py_XDECREF(memmap_kwargs);
+    return result;
+}
+
+// Broadcasts the N given array-likes against each other, and copies each into
+// a new dense float32 array of the broadcasted shape. On success, the new
+// arrays are returned in inputs[], and the broadcasted shape in ndim,dims.
+// On failure, the python exception is set, and any of inputs[] may have been
+// created: the caller releases them
+static bool broadcast_float32(// output
+                              PyObject** inputs,
+                              int*       ndim,
+                              npy_intp*  dims,
+
+                              // input
+                              PyObject** inputs_py,
+                              int        N)
+{
+    PyObject* broadcast = PyArray_MultiIterFromObjects(inputs_py, N, 0);
+    if(broadcast == NULL)
+        return false;
+
+    *ndim = PyArray_MultiIter_NDIM((PyArrayMultiIterObject*)broadcast);
+    for(int i=0; i<*ndim; i++)
+        dims[i] = PyArray_MultiIter_DIMS((PyArrayMultiIterObject*)broadcast)[i];
+    Py_DECREF(broadcast);
+
+    for(int i=0; i<N; i++)
+    {
+        inputs[i] = PyArray_SimpleNew(*ndim, dims, NPY_FLOAT32);
+        if(inputs[i] == NULL)
+            return false;
+
+        PyObject* x = PyArray_FROMANY(inputs_py[i], NPY_FLOAT32, 0, 0,
+                                      NPY_ARRAY_ALIGNED | NPY_ARRAY_FORCECAST);
+        if(x == NULL)
+            return false;
+        int res = PyArray_CopyInto((PyArrayObject*)inputs[i], (PyArrayObject*)x);
+        Py_DECREF(x);
+        if(res != 0)
+            return false;
+    }
+    return true;
+}
+
+static PyObject*
+los(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result    = NULL;
+    PyObject* inputs [6] = {};
+    PyObject* outputs[4] = {};
+
+    PyObject* inputs_py[6];
+    double refraction_coeff = 0.13;
+    int    Nthreads         = 0;
+
+    char* keywords[] = {"lat0", "lon0", "height0",
+                        "lat1", "lon1", "height1",
+                        "refraction_coeff",
+                        "Nthreads",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OOOOOO|di", keywords,
+                                     &inputs_py[0], &inputs_py[1], &inputs_py[2],
+                                     &inputs_py[3], &inputs_py[4], &inputs_py[5],
+                                     &refraction_coeff,
+                                     &Nthreads) )
+        goto done;
+
+    // The inputs broadcast against each other. So the heights can be
+    // scalars, for instance
+    int      ndim;
+    npy_intp dims[NPY_MAXDIMS];
+    if(!broadcast_float32(inputs, &ndim, dims,
+                          inputs_py, 6))
+        goto done;
+
+    outputs[0] = PyArray_SimpleNew(ndim, dims, NPY_BOOL);
+    if(outputs[0] == NULL) goto done;
+    for(int i=1; i<4; i++)
+    {
+        outputs[i] = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+        if(outputs[i] == NULL) goto done;
+    }
+
+    npy_intp N = PyArray_SIZE((PyArrayObject*)outputs[0]);
+    if(N > INT_MAX)
+    {
+        BARF("Too many paths: %ld", (long)N);
+        goto done;
+    }
+
+#define DATA(x) PyArray_DATA((PyArrayObject*)(x))
+    if( !horizonator_los_batch( (uint8_t*)DATA(outputs[0]),
+                                (float*)  DATA(outputs[1]),
+                                (float*)  DATA(outputs[2]),
+                                (float*)  DATA(outputs[3]),
+                                &self->ctx.dems,
+                                (const float*)DATA(inputs[0]),
+                                (const float*)DATA(inputs[1]),
+                                (const float*)DATA(inputs[2]),
+                                (const float*)DATA(inputs[3]),
+                                (const float*)DATA(inputs[4]),
+                                (const float*)DATA(inputs[5]),
+                                (int)N,
+                                refraction_coeff,
+                                Nthreads ))
+    {
+        BARF("horizonator_los_batch() failed");
+        goto done;
+    }
+#undef DATA
+
+    result = PyTuple_Pack(4, outputs[0], outputs[1], outputs[2], outputs[3]);
+
+ done:
+    for(int i=0; i<6; i++) Py_XDECREF(inputs[i]);
+    for(int i=0; i<4; i++) Py_XDECREF(outputs[i]);
+    return result;
+}
+
+static PyObject*
+raycast(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result     = NULL;
+    PyObject* inputs [5] = {};
+    PyObject* outputs[3] = {};
+
+    PyObject* inputs_py[5];
+    double refraction_coeff = 0.13;
+    int    Nthreads         = 0;
+
+    char* keywords[] = {"lat0", "lon0", "height0",
+                        "azimuth", "elevation",
+                        "refraction_coeff",
+                        "Nthreads",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OOOOO|di", keywords,
+                                     &inputs_py[0], &inputs_py[1], &inputs_py[2],
+                                     &inputs_py[3], &inputs_py[4],
+                                     &refraction_coeff,
+                                     &Nthreads) )
+        goto done;
+
+    int      ndim;
+    npy_intp dims[NPY_MAXDIMS];
+    if(!broadcast_float32(inputs, &ndim, dims,
+                          inputs_py, 5))
+        goto done;
+
+    for(int i=0; i<3; i++)
+    {
+        outputs[i] = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+        if(outputs[i] == NULL) goto done;
+    }
+
+    npy_intp N = PyArray_SIZE((PyArrayObject*)outputs[0]);
+    if(N > INT_MAX)
+    {
+        BARF("Too many rays: %ld", (long)N);
+        goto done;
+    }
+
+    // The pyramid is built (or read from the cache) on first use
+    if( !horizonator_dem_pyramid_init(&self->ctx.dems,
+                                      HORIZONATOR_DEM_PYRAMID_CACHEDIR) )
+    {
+        BARF("horizonator_dem_pyramid_init() failed");
+        goto done;
+    }
+
+#define DATA(x) PyArray_DATA((PyArrayObject*)(x))
+    if( !horizonator_raycast( (float*)DATA(outputs[0]),
+                              (float*)DATA(outputs[1]),
+                              (float*)DATA(outputs[2]),
+                              &self->ctx.dems,
+                              (const float*)DATA(inputs[0]),
+                              (const float*)DATA(inputs[1]),
+                              (const float*)DATA(inputs[2]),
+                              (const float*)DATA(inputs[3]),
+                              (const float*)DATA(inputs[4]),
+                              (int)N,
+                              refraction_coeff,
+                              Nthreads ))
+    {
+        BARF("horizonator_raycast() failed");
+        goto done;
+    }
+#undef DATA
+
+    result = PyTuple_Pack(3, outputs[0], outputs[1], outputs[2]);
+
+ done:
+    for(int i=0; i<5; i++) Py_XDECREF(inputs[i]);
+    for(int i=0; i<3; i++) Py_XDECREF(outputs[i]);
+    return result;
+}
+
+static PyObject*
+elevation(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result    = NULL;
+    PyObject* inputs[2] = {};
+
+    PyObject* inputs_py[2];
+
+    char* keywords[] = {"lat", "lon",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OO", keywords,
+                                     &inputs_py[0], &inputs_py[1]) )
+        goto done;
+
+    int      ndim;
+    npy_intp dims[NPY_MAXDIMS];
+    if(!broadcast_float32(inputs, &ndim, dims,
+                          inputs_py, 2))
+        goto done;
+
+    npy_intp N = PyArray_SIZE((PyArrayObject*)inputs[0]);
+    if(N > INT_MAX)
+    {
+        BARF("Too many points: %ld", (long)N);
+        goto done;
+    }
+
+    result = PyArray_SimpleNew(ndim, dims, NPY_FLOAT32);
+    if(result == NULL) goto done;
+
+#define DATA(x) PyArray_DATA((PyArrayObject*)(x))
+    horizonator_dem_interp_many( (float*)DATA(result),
+                                 &self->ctx.dems,
+                                 (const float*)DATA(inputs[0]),
+                                 (const float*)DATA(inputs[1]),
+                                 (int)N );
+#undef DATA
+
+ done:
+    for(int i=0; i<2; i++) Py_XDECREF(inputs[i]);
+    return result;
+}
+
+static PyObject*
+profile(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result     = NULL;
+    PyObject* lat        = NULL;
+    PyObject* lon        = NULL;
+    PyObject* outputs[6] = {};
+
+    PyObject* lat_py;
+    PyObject* lon_py;
+    double spacing          = 0.0;
+    double observer_height  = 2.0;
+    double target_height    = 0.0;
+    double refraction_coeff = 0.13;
+
+    char* keywords[] = {"lat", "lon",
+                        "spacing",
+                        "observer_height",
+                        "target_height",
+                        "refraction_coeff",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "OO|dddd", keywords,
+                                     &lat_py, &lon_py,
+                                     &spacing,
+                                     &observer_height,
+                                     &target_height,
+                                     &refraction_coeff) )
+        goto done;
+
+    lat = PyArray_FROMANY(lat_py, NPY_FLOAT32, 1, 1,
+                          NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    if(lat == NULL) goto done;
+    lon = PyArray_FROMANY(lon_py, NPY_FLOAT32, 1, 1,
+                          NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    if(lon == NULL) goto done;
+
+    npy_intp Nvertices = PyArray_DIM((PyArrayObject*)lat, 0);
+    if(Nvertices != PyArray_DIM((PyArrayObject*)lon, 0))
+    {
+        BARF("lat and lon must have the same length. Got %ld and %ld",
+             (long)Nvertices, (long)PyArray_DIM((PyArrayObject*)lon, 0));
+        goto done;
+    }
+    if(Nvertices < 1 || Nvertices > INT_MAX)
+    {
+        BARF("The path must have between 1 and INT_MAX vertices. Got %ld",
+             (long)Nvertices);
+        goto done;
+    }
+
+#define DATA(x) PyArray_DATA((PyArrayObject*)(x))
+    int N = horizonator_profile_Nsamples(&self->ctx.dems,
+                                         (const float*)DATA(lat),
+                                         (const float*)DATA(lon),
+                                         (int)Nvertices,
+                                         spacing);
+    if(N < 0)
+    {
+        BARF("horizonator_profile_Nsamples() failed");
+        goto done;
+    }
+
+    npy_intp dims[] = {N};
+    for(int i=0; i<6; i++)
+    {
+        outputs[i] = PyArray_SimpleNew(1, dims,
+                                       i == 2 ? NPY_BOOL : NPY_FLOAT32);
+        if(outputs[i] == NULL) goto done;
+    }
+
+    if( !horizonator_profile( (float*)  DATA(outputs[0]),
+                              (float*)  DATA(outputs[4]),
+                              (float*)  DATA(outputs[5]),
+                              (float*)  DATA(outputs[1]),
+                              (uint8_t*)DATA(outputs[2]),
+                              (float*)  DATA(outputs[3]),
+                              &self->ctx.dems,
+                              (const float*)DATA(lat),
+                              (const float*)DATA(lon),
+                              (int)Nvertices,
+                              spacing,
+                              observer_height,
+                              target_height,
+                              refraction_coeff ))
+    {
+        BARF("horizonator_profile() failed");
+        goto done;
+    }
+#undef DATA
+
+    result = PyTuple_Pack(6,
+                          outputs[0], outputs[1], outputs[2],
+                          outputs[3], outputs[4], outputs[5]);
+
+ done:
+    Py_XDECREF(lat);
+    Py_XDECREF(lon);
+    for(int i=0; i<6; i++) Py_XDECREF(outputs[i]);
+    return result;
+}
+
+static PyObject*
+stats(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result       = NULL;
+    PyObject* stages       = NULL;
+    PyObject* stage        = NULL;
+    PyObject* dem_cache    = NULL;
+
+    int reset = false;
+
+    char* keywords[] = {"reset",
+                        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "|p", keywords,
+                                     &reset) )
+        goto done;
+
+    horizonator_stats_t s;
+    if( !horizonator_get_stats(&self->ctx, &s) )
+    {
+        BARF("horizonator_get_stats() failed");
+        goto done;
+    }
+    if(reset)
+        horizonator_reset_stats(&self->ctx);
+
+    stages = PyDict_New();
+    if(stages == NULL) goto done;
+    for(int i=0; i<HORIZONATOR_STAGE_COUNT; i++)
+    {
+        stage = Py_BuildValue("{sdsdsdsK}",
+                              "wall_s", s.stages[i].wall_s,
+                              "cpu_s",  s.stages[i].cpu_s,
+                              "gpu_s",  s.stages[i].gpu_s,
+                              "count",  (unsigned long long)s.stages[i].count);
+        if(stage == NULL) goto done;
+        if(0 != PyDict_SetItemString(stages, horizonator_stage_name(i), stage))
+            goto done;
+        Py_DECREF(stage);
+        stage = NULL;
+    }
+
+    horizonator_dem_tile_cache_stats_t c;
+    horizonator_dem_tile_cache_get_stats(&c);
+    dem_cache = Py_BuildValue("{sKsKsKsKsisnsn}",
+                              "hits",      (unsigned long long)c.hits,
+                              "misses",    (unsigned long long)c.misses,
+                              "evictions", (unsigned long long)c.evictions,
+                              "stale",     (unsigned long long)c.stale,
+                              "tiles",     c.Ntiles,
+                              "bytes",     (Py_ssize_t)c.bytes,
+                              "max_bytes", (Py_ssize_t)c.max_bytes);
+    if(dem_cache == NULL) goto done;
+
+    result = Py_BuildValue("{sOsOsKsKsKsKsK}",
+                           "stages",                     stages,
+                           "dem_tile_cache",             dem_cache,
+                           "triangles_submitted",        (unsigned long long)s.triangles_submitted,
+                           "triangles_culled_view",      (unsigned long long)s.triangles_culled_view,
+                           "triangles_culled_occlusion", (unsigned long long)s.triangles_culled_occlusion,
+                           "triangles_culled_seam",      (unsigned long long)s.triangles_culled_seam,
+                           "bytes_read_back",            (unsigned long long)s.bytes_read_back);
+
+ done:
+    Py_XDECREF(stage);
+    Py_XDECREF(stages);
+    Py_XDECREF(dem_cache);
+    return result;
+}
+
 static const char py_horizonator_docstring[] =
 #include "horizonator.docstring.h"
     ;
 static const char render_docstring[] =
 #include "render.docstring.h"
     ;
+static const char pick_docstring[] =
+#include "pick.docstring.h"
+    ;
+static const char stats_docstring[] =
+#include "stats.docstring.h"
+    ;
+static const char viewshed_docstring[] =
+#include "viewshed.docstring.h"
+    ;
+static const char viewshed_cumulative_docstring[] =
+#include "viewshed_cumulative.docstring.h"
+    ;
+static const char horizons_docstring[] =
+#include "horizons.docstring.h"
+    ;
+static const char los_docstring[] =
+#include "los.docstring.h"
+    ;
+static const char raycast_docstring[] =
+#include "raycast.docstring.h"
+    ;
+static const char elevation_docstring[] =
+#include "elevation.docstring.h"
+    ;
+static const char profile_docstring[] =
+#include "profile.docstring.h"
+    ;
 
 static PyMethodDef py_horizonator_methods[] =
     {
-        PYMETHODDEF_ENTRY(, render, METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, render,              METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, pick,                METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, stats,               METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, viewshed,            METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, viewshed_cumulative, METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, horizons,            METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, los,                 METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, raycast,             METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, elevation,           METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, profile,             METH_VARARGS | METH_KEYWORDS),
         {}
     };
 
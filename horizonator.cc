@@ -149,9 +149,14 @@ public:
                                   g_view.lat, g_view.lon,
                                   -1, -1,
                                   RENDER_RADIUS_CELLS_DEFAULT,
+                                  // Only the terrain within zfar is ever drawn
+                                  zfar,
+                                  0.0f,
                                   false,
                                   render_texture,
-                                  NULL,NULL,
+                                  NULL,
+                                  NULL, 0,
+                                  NULL,
                                   true))
             {
                 MSG("horizonator_init() failed. Giving up");
@@ -4,37 +4,231 @@
 #include <stdint.h>
 
 #include "dem.h"
+#include "mesh.h"
+
+// The stages of horizonator_init() and horizonator_render_offscreen(). Used
+// for the timing reports
+typedef enum
+{
+    // horizonator_init()
+    HORIZONATOR_STAGE_DEM_OPEN,
+    HORIZONATOR_STAGE_MESH_SIMPLIFY,
+    HORIZONATOR_STAGE_VERTEX_FILL,
+    HORIZONATOR_STAGE_INDEX_BUILD,
+    HORIZONATOR_STAGE_TEXTURE_LOAD,
+    HORIZONATOR_STAGE_SHADER_COMPILE,
+
+    // horizonator_redraw(), horizonator_render_offscreen()
+    HORIZONATOR_STAGE_PROJECT,
+    HORIZONATOR_STAGE_DRAW,
+    HORIZONATOR_STAGE_READPIXELS,
+    HORIZONATOR_STAGE_FLIP,
+    HORIZONATOR_STAGE_RANGE_CONVERSION,
+    HORIZONATOR_STAGE_GEOLOCATION,
+
+    HORIZONATOR_STAGE_COUNT
+} horizonator_stage_t;
+
+// Runtime statistics, accumulated in the context. Retrieved with
+// horizonator_get_stats()
+typedef struct
+{
+    // Indexed by horizonator_stage_t. The wall-clock and CPU (this thread)
+    // times are available for all stages. The GPU time is measured with GL
+    // timer queries, and only for the draw stage
+    struct
+    {
+        double   wall_s, cpu_s, gpu_s;
+        uint64_t count;
+    } stages[HORIZONATOR_STAGE_COUNT];
+
+    // Triangles sent to the GPU in all the horizonator_redraw() calls
+    uint64_t triangles_submitted;
+    // Triangles not sent to the GPU, because their chunk of the mesh lies
+    // outside the azimuth bounds of the view, or outside [znear,zfar]
+    uint64_t triangles_culled_view;
+    // Triangles not sent to the GPU, because their chunk of the mesh is hidden
+    // behind nearer terrain
+    uint64_t triangles_culled_occlusion;
+    // Triangles thrown out by the azimuth-seam test in the geometry shader
+    uint64_t triangles_culled_seam;
+    // Bytes read back from the GPU by horizonator_render_offscreen() and
+    // horizonator_pick()
+    uint64_t bytes_read_back;
+} horizonator_stats_t;
+
+// Called at the end of each stage. See horizonator_set_stage_callback()
+typedef void (horizonator_stage_callback_t)(horizonator_stage_t stage,
+                                            double seconds,
+                                            void* cookie);
+
+// The terrain point seen at one pixel of an offscreen render. Filled in by
+// horizonator_render_offscreen(). lat,lon are in degrees, elevation in meters.
+// Pixels that don't see any terrain have all three set to NAN
+typedef struct
+{
+    float lat, lon, elevation;
+} horizonator_geolocation_t;
+
+// The mesh is split into square chunks of HORIZONATOR_CHUNK_CELLS x
+// HORIZONATOR_CHUNK_CELLS cells. The triangles of each chunk are contiguous in
+// the index buffer, so each chunk can be drawn (or not) on its own
+#define HORIZONATOR_CHUNK_CELLS 32
+
+// How many draws' worth of GL queries can be in flight at once. See
+// horizonator_context_t.queries
+#define HORIZONATOR_QUERY_SETS 3
+
+typedef struct
+{
+    // The cells in this chunk are [i0,i1) x [j0,j1). These use the vertices
+    // [i0,i1] x [j0,j1]
+    int i0, j0, i1, j1;
+
+    // The triangles of this chunk are at [index0, index0 + 3*Ntriangles) in
+    // the index buffer
+    int index0, Ntriangles;
+
+    // With a simplified mesh, the triangles of the simplified mesh. The
+    // chunks near the viewer are drawn from the dense patch instead, and
+    // index0, Ntriangles point there
+    int index0_mesh, Ntriangles_mesh;
+
+    // The lowest and highest terrain in this chunk, in meters
+    int16_t zmin, zmax;
+
+    // The bounds of this chunk, as seen from the viewer. Recomputed by
+    // horizonator_move(). The azimuths are in radians, clockwise from North,
+    // with az0 <= az1 < az0 + 2pi. The distances are horizontal, in meters
+    float az0, az1;
+    float distance0, distance1;
+} horizonator_chunk_t;
 
 typedef struct
 {
-    int Ntriangles;
+    int Nvertices, Ntriangles;
     bool render_texture, use_glut;
 
+    // The simplified mesh, if one was requested. mesh.data is NULL otherwise,
+    // and we draw the dense grid
+    horizonator_mesh_t mesh;
+
+    // With a simplified mesh, the 3x3 chunks around the one containing the
+    // viewer are drawn from a dense grid, with vertices at patch_vertex0 in the
+    // vertex buffer, and triangles at patch_index0 in the index buffer. The
+    // simplified mesh has large triangles, and the ones that surround the
+    // viewer can't be drawn (see geometry.glsl). patch_ci,patch_cj is the
+    // chunk at the center of the patch: -1 until the patch is built
+    int patch_vertex0, patch_index0;
+    int patch_ci, patch_cj;
+
+    horizonator_chunk_t* chunks;
+    int                  Nchunks, Nchunks_side;
+    // The chunk indices, sorted by increasing distance0 and distance1.
+    // Recomputed by horizonator_move()
+    int*                 chunks_by_distance0;
+    int*                 chunks_by_distance1;
+    // Scratch space for the occlusion culling in horizonator_redraw(): the
+    // conservative horizon of the terrain drawn so far, and of the terrain at
+    // the near edge of the render, in azimuth bins
+    float*               horizon_occluders;
+    float*               horizon_near;
+    // The arguments to glMultiDrawElements(), rebuilt by every
+    // horizonator_redraw(): one entry per drawn chunk. These are GLsizei and
+    // const GLvoid*, but I don't want to #include <GL.h>
+    int32_t*     draw_counts;
+    const void** draw_offsets;
+
     // meaningful only if use_glut. 0 means "invalid" or "closed"
     int glut_window;
 
-    // These should be GLint, but I don't want to #include <GL.h>.
+    // CPU-side copy of the view parameters. This is the std140 layout of the
+    // "view_t" uniform block in vertex.glsl, and it is uploaded to the uniform
+    // buffer view_ubo before the next draw after any of these change. Nothing
+    // is ever read back from GL: render and pick use these values directly
+    struct
+    {
+        float aspect;
+        float az_deg0, az_deg1;
+        float viewer_cell_i, viewer_cell_j;
+        float viewer_z;
+        // in radians
+        float viewer_lat;
+        float cos_viewer_lat;
+        float texturemap_lon0,  texturemap_lon1;
+        float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+        float znear, zfar;
+        float znear_color, zfar_color;
+        // The glViewport() size, for the fragment shader to find the line of
+        // sight through each pixel
+        float viewport_width, viewport_height;
+    } view;
+    bool view_dirty;
+
+    // These should be GLuint, but I don't want to #include <GL.h>.
     // I will static_assert() this in the .c to make sure they are compatible
-    int32_t uniform_aspect, uniform_az_deg0, uniform_az_deg1;
-    int32_t uniform_viewer_cell_i;
-    int32_t uniform_viewer_cell_j;
-    int32_t uniform_viewer_z;
-    int32_t uniform_viewer_lat;
-    int32_t uniform_cos_viewer_lat;
-    int32_t uniform_texturemap_lon0;
-    int32_t uniform_texturemap_lon1;
-    int32_t uniform_texturemap_dlat0;
-    int32_t uniform_texturemap_dlat1;
-    int32_t uniform_texturemap_dlat2;
-    int32_t uniform_znear, uniform_zfar;
-    int32_t uniform_znear_color, uniform_zfar_color;
+    uint32_t view_ubo;
+
+    // The current glViewport() size
+    int viewport_width, viewport_height;
 
     uint32_t program;
 
+    // The program (project.glsl) that computes the position of each vertex,
+    // as seen from the viewer, and the buffer it writes those into, with
+    // transform feedback. These depend only on the viewer position, so the
+    // projection runs in the first horizonator_redraw() after each
+    // horizonator_move(). The renders in between, which just pan and zoom,
+    // reuse it. These should be GLuint
+    uint32_t program_project;
+    uint32_t polar_buffer;
+    bool     polar_dirty;
+
+    // The vertex and index buffers of the mesh. These should be GLuint
+    uint32_t vertex_buffer, index_buffer;
+
     float viewer_lat, viewer_lon;
 
     horizonator_dem_context_t dems;
 
+    // The high-resolution DEMs drawn near the viewer, if any. near.dems.mosaic
+    // is NULL if there are none, and everything is drawn from the DEMs above.
+    //
+    // All the cell coordinates of the render (the vertices, the chunks,
+    // view.viewer_cell_i,j) are in the cells of the near field: the far cell
+    // (i,j) is at (i*scale, j*scale). Without a near field, scale = 1. The near
+    // field covers the vertices [i0,i1] x [j0,j1]. This is a whole number of
+    // far chunks. The far cells in it aren't drawn, and the two meshes are
+    // joined by skirts: vertical walls hanging down from both sides of the
+    // boundary, so no cracks show between them
+    struct
+    {
+        horizonator_dem_context_t dems;
+        int scale;
+        int i0, j0, i1, j1;
+        // The vertex (i0,j0) is the sample (mosaic_i0,mosaic_j0) of dems
+        int mosaic_i0, mosaic_j0;
+    } near;
+
+    // The terrain is loaded and meshed only within range.loaded meters of
+    // range.lat,range.lon, the position given to horizonator_init(): the DEMs
+    // are loaded only as far as that disk reaches, and the far-field chunks
+    // outside it aren't built. range.loaded is INFINITY if everything within
+    // radius_cells_max is loaded. When the view reaches further (zfar, plus
+    // the distance the viewer has moved off-center), the next
+    // horizonator_redraw() rebuilds the terrain with a larger range. The rest
+    // are the horizonator_init() arguments needed for that
+    struct
+    {
+        float loaded;
+        float lat, lon;
+        int   radius_cells_max;
+        float mesh_tolerance;
+        char* dir_dems;
+        char* dir_dems_near;
+        int   near_radius_cells;
+    } range;
+
     struct
     {
         bool inited;
@@ -43,12 +237,59 @@ typedef struct
         uint32_t frameBufID;
         uint32_t renderBufID;
         uint32_t depthBufID;
+        // The integer (GL_RGBA32I) attachment storing the DEM cell seen at
+        // each pixel. Created the first time geolocation is requested; 0 until
+        // then
+        uint32_t cellidBufID;
+        // Set while drawing a render that writes to cellidBufID
+        bool     render_cellid;
+        // Where cellidBufID is read back to: 4 ints per pixel. Allocated the
+        // first time geolocation is requested, and reused by the renders after
+        // that. Freed in horizonator_deinit()
+        int32_t* cellid;
 
         int width, height;
     } offscreen;
+
+    horizonator_stats_t stats;
+
+    // Set by horizonator_set_stage_callback()
+    horizonator_stage_callback_t* stage_callback;
+    void*                         stage_callback_cookie;
+
+    // The GL queries used to fill in the stats. These should be GLuint, but I
+    // don't want to #include <GL.h>. Each draw uses the next of
+    // HORIZONATOR_QUERY_SETS sets of queries, in a ring. A set's results are
+    // read only once the GPU has them, so the pipeline isn't stalled. Only if
+    // all the sets are still in flight does a draw wait for the oldest one
+    struct
+    {
+        uint32_t gpu_time            [HORIZONATOR_QUERY_SETS];
+        uint32_t primitives_generated[HORIZONATOR_QUERY_SETS];
+        uint64_t triangles_pending   [HORIZONATOR_QUERY_SETS];
+        bool     have_gpu_timer;
+        // The sets in flight are first_pending, first_pending+1, ... (mod
+        // HORIZONATOR_QUERY_SETS): Npending of them, oldest first
+        int      first_pending, Npending;
+    } queries;
 } horizonator_context_t;
 
 
+// Returns a short, constant name of the stage, such as "vertex_fill"
+const char* horizonator_stage_name(horizonator_stage_t stage);
+
+// If a callback is given, it is called at the end of each stage of this
+// context, with the wall-clock time that stage took. Stages may be reported
+// more than once per call (horizonator_render_offscreen() reads the image and
+// the depth separately, for instance). Pass NULL to turn this off.
+// horizonator_init() turns it off; its own stages are in the stats.
+//
+// While a callback is set, horizonator_redraw() on this context waits for the
+// GPU to finish, to report the real draw time. This is meant for benchmarking
+void horizonator_set_stage_callback(horizonator_context_t* ctx,
+                                    horizonator_stage_callback_t* callback,
+                                    void* cookie);
+
 __attribute__((unused))
 static bool horizonator_context_isvalid(const horizonator_context_t* ctx)
 {
@@ -79,19 +320,49 @@ bool horizonator_init( // output
                        float viewer_lat, float viewer_lon,
                        int offscreen_width, int offscreen_height,
                        int render_radius_cells,
+                       // If > 0, only the terrain within this horizontal
+                       // distance of the viewer, in meters, is loaded and
+                       // meshed: a disk, instead of the whole square of
+                       // render_radius_cells. zfar starts out at this range.
+                       // If a later horizonator_set_zextents() or
+                       // horizonator_move() makes the view reach further, the
+                       // terrain is reloaded out to the new range (but never
+                       // past render_radius_cells) by the next redraw. If that
+                       // fails, the redraw returns false, and the old terrain is
+                       // rebuilt. If even that fails, the context has no
+                       // terrain, and everything but horizonator_deinit() fails
+                       // from then on. If <= 0, everything within
+                       // render_radius_cells is loaded
+                       float max_range,
+                       // If > 0, the terrain is drawn from a mesh simplified
+                       // to within this vertical error, in meters, instead
+                       // of the dense grid. See horizonator_mesh_init(). The
+                       // mesh is cached in HORIZONATOR_MESH_CACHEDIR. The
+                       // loaded mosaic can be at most
+                       // HORIZONATOR_MESH_MAX_WIDTH cells wide
+                       float mesh_tolerance,
 
                        bool use_glut,
                        bool render_texture,
                        const char* dir_dems,
+                       // If not NULL, the terrain within near_radius_cells of
+                       // the viewer is drawn from the DEMs in dir_dems_near
+                       // instead. These have a higher resolution: an integer
+                       // multiple of the resolution of dir_dems.
+                       // near_radius_cells is in the cells of dir_dems_near,
+                       // and is rounded down to whole chunks of the far field.
+                       // Can't be used with mesh_tolerance > 0
+                       const char* dir_dems_near,
+                       int near_radius_cells,
                        const char* dir_tiles,
                        bool allow_downloads);
 
 void horizonator_deinit( horizonator_context_t* ctx );
 
-bool horizonator_resized(const horizonator_context_t* ctx, int width, int height);
+bool horizonator_resized(horizonator_context_t* ctx, int width, int height);
 
 // Must be called at least once before horizonator_redraw()
-bool horizonator_pan_zoom(const horizonator_context_t* ctx,
+bool horizonator_pan_zoom(horizonator_context_t* ctx,
                       // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
                       // edges lie at the edges of the image. So for an image that's
                       // W pixels wide, az0 is at x = -0.5 and az1 is at W-0.5. The
@@ -108,17 +379,19 @@ bool horizonator_move(horizonator_context_t* ctx,
 // set the position of the clipping planes. The horizontal distance from the
 // viewer is compared against these positions. Only points in [znear,zfar] are
 // rendered. The render is color-coded by this distance, using znear_color and
-// zfar_color as the bounds for the color-coding
+// zfar_color as the bounds for the color-coding. If the terrain was loaded
+// with a limited range (see horizonator_init()), and zfar now reaches past it,
+// more is loaded by the next redraw
 //
 // Any value <0 is untouched by this call
 bool horizonator_set_zextents(horizonator_context_t* ctx,
                               float znear,       float zfar,
                               float znear_color, float zfar_color);
 
-bool horizonator_redraw(const horizonator_context_t* ctx);
+bool horizonator_redraw(horizonator_context_t* ctx);
 
 // returns true if an intersection is found
-bool horizonator_pick(const horizonator_context_t* ctx,
+bool horizonator_pick(horizonator_context_t* ctx,
 
                       // output
                       float* lat, float* lon,
@@ -127,22 +400,64 @@ bool horizonator_pick(const horizonator_context_t* ctx,
                       // pixel coordinates in the render
                       int x, int y );
 
+// Batched horizonator_pick(). Each of the N pixels is converted to the lat,lon
+// of the terrain seen there, and its range (the distance from the viewer, as
+// returned by horizonator_render_offscreen()). The depth is read back from GL
+// once, for all the pixels. Pixels that don't see any terrain get lat = lon =
+// NAN and range = -1.
+//
+// Returns true on success
+bool horizonator_pick_many(horizonator_context_t* ctx,
+
+                           // output
+                           // Each is an array of N values. range may be NULL
+                           float* lat, float* lon, float* range,
+
+                           // input
+                           // pixel coordinates in the render. Each is an array
+                           // of N values
+                           const int* x, const int* y,
+                           int N);
 
-// Renders a given scene to an RGB image and/or a range image.
-// horizonator_init() must have been called first with use_glut=true and
-// offscreen_width,height > 0. Then the viewer and camera must have been
-// configured with horizonator_move() and horizonator_pan_zoom()
+
+// Renders a given scene to an RGB image and/or a range image and/or a
+// geolocation map. horizonator_init() must have been called first with
+// use_glut=true and offscreen_width,height > 0. Then the viewer and camera must
+// have been configured with horizonator_move() and horizonator_pan_zoom()
 //
 // Returns true on success. The image and ranges buffers must be large-enough to
 // contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively. The
 // images are returned using the usual convention: the top row is stored first.
 // This is opposite of the OpenGL convention: bottom row is first. Invisible
 // points have ranges <0
-bool horizonator_render_offscreen(const horizonator_context_t* ctx,
+//
+// The geolocation map has one horizonator_geolocation_t per pixel. This comes
+// from an extra integer render target that records the DEM cell and the
+// position inside it for each pixel, so no depth inversion is involved. The
+// extra render target is only drawn into if geolocation is requested.
+//
+// The geolocation is the point where the line of sight through the center of
+// the pixel meets the triangle drawn there: the lat,lon and the elevation all
+// come from that intersection, in the same tangent plane the renderer uses. The
+// offsets inside the cell are stored with 16 bits, so the lat,lon are
+// quantized to 1/65536 of a cell. With mesh_tolerance > 0 the drawn surface may
+// be up to mesh_tolerance above or below the DEM, and the reported point is on
+// the drawn surface, not on the DEM
+bool horizonator_render_offscreen(horizonator_context_t* ctx,
 
                                   // output
-                                  // either may be NULL
-                                  char* image, float* ranges);
+                                  // any may be NULL
+                                  char* image, float* ranges,
+                                  horizonator_geolocation_t* geolocation);
+
+// Retrieves the runtime statistics accumulated since horizonator_init() or the
+// last horizonator_reset_stats(). The GPU results of the last draw are
+// collected here, so this may wait for the GPU to finish
+bool horizonator_get_stats(horizonator_context_t* ctx,
+                           // output
+                           horizonator_stats_t* stats);
+
+void horizonator_reset_stats(horizonator_context_t* ctx);
 
 /////////////// The horizonator_allinone_...() functions are to be used
 /////////////// standalone. No other init functions should be called
@@ -157,6 +472,8 @@ bool horizonator_allinone_glut_loop( bool render_texture,
                                      // square.
                                      float az_deg0, float az_deg1,
                                      int render_radius_cells,
+                                     // See horizonator_init()
+                                     float mesh_tolerance,
 
                                      // rendering and color-coding boundaries. Set to <=0 for
                                      // defaults
@@ -164,5 +481,8 @@ bool horizonator_allinone_glut_loop( bool render_texture,
                                      float znear_color, float zfar_color,
 
                                      const char* dir_dems,
+                                     // See horizonator_init()
+                                     const char* dir_dems_near,
+                                     int near_radius_cells,
                                      const char* dir_tiles,
                                      bool allow_downloads);
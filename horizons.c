@@ -0,0 +1,281 @@
+#include <tgmath.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "horizons.h"
+#include "util.h"
+
+// Each task is a block of this many lines of one direction
+#define LINES_PER_TASK 64
+
+// The geometry of the lines in one direction. Let A be the mosaic axis (i or
+// j) closest to the direction (the major axis), and M the other one. I flip
+// both axes as needed, to get coordinates a,m that increase when moving in
+// the direction. Every step along a line increments a, and m increases by
+// "slope" <= 1 on average. The line with intercept c contains the cells
+//
+//   m = c + offset[a]    where offset[a] = round(a*slope)
+//
+// Every cell thus lies on exactly one line: c = m - offset[a]
+typedef struct
+{
+    bool major_i;
+    bool flip_a, flip_m;
+
+    // The lines have intercepts c in [c0, c0+Nlines)
+    int  c0, Nlines;
+    int* offset;
+
+    // Horizontal distance along the direction, in meters, per cell, in i and
+    // j
+    float x_per_i, x_per_j;
+} direction_t;
+
+typedef struct
+{
+    const horizonator_dem_context_t* dems;
+    float*       horizons;
+    direction_t* directions;
+    int          K;
+    int          Ntasks_per_direction;
+
+    int          next_task;
+} horizons_shared_t;
+
+static void* horizons_worker(void* cookie)
+{
+    horizons_shared_t* s = (horizons_shared_t*)cookie;
+
+    const int    W  = horizonator_dem_mosaic_width(s->dems);
+    const size_t WW = (size_t)W*(size_t)W;
+
+    // The convex hull of the terrain ahead: the horizontal position along the
+    // line, and the elevation of each point
+    float* hull_x = malloc(2*(size_t)W*sizeof(float));
+    if(hull_x == NULL)
+    {
+        MSG("malloc() failed");
+        return (void*)1;
+    }
+    float* hull_z = &hull_x[W];
+
+    while(true)
+    {
+        int task = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED);
+        if(task >= s->K * s->Ntasks_per_direction)
+            break;
+
+        const int          k = task / s->Ntasks_per_direction;
+        const direction_t* d = &s->directions[k];
+        float* out = &s->horizons[(size_t)k*WW];
+
+        int c_begin = d->c0 + (task % s->Ntasks_per_direction) * LINES_PER_TASK;
+        int c_end   = c_begin + LINES_PER_TASK;
+        if(c_end > d->c0 + d->Nlines)
+            c_end = d->c0 + d->Nlines;
+
+        for(int c = c_begin; c < c_end; c++)
+        {
+            int Nhull = 0;
+
+            // I walk each line backwards: from the far end (in the look
+            // direction) towards the viewer, so the points ahead of each cell
+            // have been seen already
+            for(int a = W-1; a >= 0; a--)
+            {
+                int m = c + d->offset[a];
+                if(m >= W) continue;
+                if(m <  0) break;
+
+                int A = d->flip_a ? W-1 - a : a;
+                int M = d->flip_m ? W-1 - m : m;
+                int i = d->major_i ? A : M;
+                int j = d->major_i ? M : A;
+
+                float x = (float)i * d->x_per_i + (float)j * d->x_per_j;
+                float z = (float)horizonator_dem_mosaic_at(s->dems, i, j);
+
+                // Any hull point under the line from this cell to the point
+                // after it is hidden from here, and from every cell behind
+                // this one. I throw those out
+                while(Nhull >= 2 &&
+                      (hull_z[Nhull-2] - z) * (hull_x[Nhull-1] - x) >=
+                      (hull_z[Nhull-1] - z) * (hull_x[Nhull-2] - x))
+                    Nhull--;
+
+                out[(size_t)j*(size_t)W + (size_t)i] =
+                    Nhull == 0 ?
+                    NAN :
+                    atanf( (hull_z[Nhull-1] - z) / (hull_x[Nhull-1] - x) );
+
+                hull_x[Nhull] = x;
+                hull_z[Nhull] = z;
+                Nhull++;
+            }
+        }
+    }
+
+    free(hull_x);
+    return NULL;
+}
+
+bool horizonator_horizons( // output
+                           float* horizons,
+
+                           // input
+                           const horizonator_dem_context_t* dems,
+                           int K,
+                           int Nthreads)
+{
+    const float Rearth = 6371000.0;
+    const int   W      = horizonator_dem_mosaic_width(dems);
+
+    if(K <= 0)
+    {
+        MSG("Need K > 0 directions. Got K = %d", K);
+        return false;
+    }
+
+    bool result = false;
+
+    // The cell size. I use the latitude at the center of the mosaic
+    float lat0, lon0, lat1, lon1;
+    horizonator_dem_bounds_latlon_deg(dems, &lat0, &lon0, &lat1, &lon1);
+    const float dn = Rearth * (float)M_PI / 180.0f / (float)dems->cells_per_deg;
+    const float de = dn * cosf((lat0 + lat1) / 2.0f * (float)M_PI / 180.0f);
+
+    direction_t* directions = calloc(K, sizeof(directions[0]));
+    int*         offsets    = malloc((size_t)K*(size_t)W*sizeof(int));
+    pthread_t*   threads    = NULL;
+    bool*        started    = NULL;
+    if(directions == NULL || offsets == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    for(int k=0; k<K; k++)
+    {
+        direction_t* d = &directions[k];
+
+        float az = 2.0f * (float)M_PI * (float)k / (float)K;
+        float e  = sinf(az);
+        float n  = cosf(az);
+
+        // The direction, in cells
+        float di = e / de;
+        float dj = n / dn;
+
+        d->major_i = fabsf(di) >= fabsf(dj);
+        float da   = d->major_i ? di : dj;
+        float dm   = d->major_i ? dj : di;
+        d->flip_a  = da < 0.0f;
+        d->flip_m  = dm < 0.0f;
+
+        float slope = fabsf(dm / da);
+        d->offset = &offsets[(size_t)k*(size_t)W];
+        for(int a=0; a<W; a++)
+            d->offset[a] = (int)roundf((float)a * slope);
+
+        d->c0     = -d->offset[W-1];
+        d->Nlines = W + d->offset[W-1];
+
+        d->x_per_i = de * e;
+        d->x_per_j = dn * n;
+    }
+
+    horizons_shared_t shared =
+        { .dems                 = dems,
+          .horizons             = horizons,
+          .directions           = directions,
+          .K                    = K,
+          // The most lines any direction can have
+          .Ntasks_per_direction = (2*W + LINES_PER_TASK-1) / LINES_PER_TASK };
+
+    if(Nthreads <= 0)
+    {
+        long Ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Nthreads = Ncpus > 0 ? (int)Ncpus : 1;
+    }
+    threads = calloc(Nthreads, sizeof(threads[0]));
+    started = calloc(Nthreads, sizeof(started[0]));
+    if(threads == NULL || started == NULL)
+    {
+        MSG("calloc() failed");
+        goto done;
+    }
+
+    // This thread is one of the workers. If any other worker can't be
+    // started, the others simply do its share
+    for(int i=1; i<Nthreads; i++)
+        if(0 == pthread_create(&threads[i], NULL, horizons_worker, &shared))
+            started[i] = true;
+
+    result = horizons_worker(&shared) == NULL;
+    for(int i=1; i<Nthreads; i++)
+    {
+        if(!started[i])
+            continue;
+        void* worker_result;
+        pthread_join(threads[i], &worker_result);
+        if(worker_result != NULL)
+            result = false;
+    }
+
+ done:
+    free(directions);
+    free(offsets);
+    free(threads);
+    free(started);
+    return result;
+}
+
+bool horizonator_horizons_file( const char* filename,
+
+                                // input
+                                const horizonator_dem_context_t* dems,
+                                int K,
+                                int Nthreads)
+{
+    const int    W    = horizonator_dem_mosaic_width(dems);
+    const size_t size = (size_t)K*(size_t)W*(size_t)W*sizeof(float);
+
+    if(K <= 0)
+    {
+        MSG("Need K > 0 directions. Got K = %d", K);
+        return false;
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s' for writing", filename);
+        return false;
+    }
+    if(0 != ftruncate(fd, (off_t)size))
+    {
+        MSG("Couldn't resize '%s' to %zu bytes", filename, size);
+        close(fd);
+        return false;
+    }
+
+    float* horizons = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(horizons == MAP_FAILED)
+    {
+        MSG("Couldn't mmap '%s'", filename);
+        return false;
+    }
+
+    bool result = horizonator_horizons(horizons, dems, K, Nthreads);
+
+    munmap(horizons, size);
+    return result;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Computes the horizon elevation angle in K azimuth directions for every cell
+// of the DEM mosaic. This is the input to solar-access and sky-view-factor
+// computations.
+//
+// Direction k is at azimuth 360deg * k / K: k = 0 looks North, and the azimuth
+// increases clockwise (towards the East). For each cell we report the highest
+// elevation angle of the terrain ahead of it in that direction, within the
+// mosaic, in radians. Cells that have nothing ahead of them (at the edge of
+// the mosaic) get NAN.
+//
+// Each direction is computed in one sweep over the mosaic. The mosaic is split
+// into digital lines parallel to that direction: every cell lies on exactly
+// one line, and each line is walked towards the viewer, maintaining the convex
+// hull of the terrain ahead on a stack. This is linear-time in the number of
+// cells, per direction. The work is spread over Nthreads threads (one per CPU
+// if Nthreads <= 0), in blocks of lines of any direction.
+//
+// The curvature of the Earth is ignored, like in the renderer.
+//
+// The output is a float array of shape (K, 2*radius_cells, 2*radius_cells),
+// with each slice indexed like the mosaic, but always row-major, SW corner
+// first.
+//
+// Returns true on success
+bool horizonator_horizons( // output
+                           float* horizons,
+
+                           // input
+                           const horizonator_dem_context_t* dems,
+                           int K,
+                           int Nthreads);
+
+// Same as horizonator_horizons(), but writes the output to a new file, through
+// a memory map. The output is usually far larger than the mosaic (K times
+// larger, with 32-bit floats), so this is how large regions should be done.
+// The file contains the raw float array, in the native byte order, with no
+// header. It is overwritten if it exists
+bool horizonator_horizons_file( const char* filename,
+
+                                // input
+                                const horizonator_dem_context_t* dems,
+                                int K,
+                                int Nthreads);
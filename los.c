@@ -0,0 +1,538 @@
+#include <tgmath.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "los.h"
+#include "util.h"
+
+// The rays are processed this many at a time
+#define LANES 8
+
+// Each task is this many groups of LANES rays
+#define GROUPS_PER_TASK 16
+
+typedef struct
+{
+    int Nsteps;
+    int i;
+} ray_order_t;
+
+typedef struct
+{
+    uint8_t* visible;
+    float*   min_clearance;
+    float*   min_clearance_lat;
+    float*   min_clearance_lon;
+
+    const horizonator_dem_context_t* dems;
+    const float *lat0, *lon0, *height0;
+    const float *lat1, *lon1, *height1;
+
+    // The origin DEM, and the cell in it at the SW corner of the mosaic
+    float lon_origin, lat_origin;
+    float i_origin,   j_origin;
+    // Meters per cell, East and North
+    float de, dn;
+    // The curvature bulge of a path of length D at t is t*(1-t)*D^2*curvature
+    float curvature;
+
+    // The terrain under the two ends of each ray. Indexed like the inputs
+    const float* z0;
+    const float* z1;
+
+    // The rays, sorted by the number of steps they take
+    const ray_order_t* order;
+    int                N;
+
+    int next_task;
+} los_shared_t;
+
+// The state of one ray, as it walks from one row or column crossing to the
+// next. The ray is at (x0 + t*di, y0 + t*dj), in the cells of the mosaic. The
+// next column it crosses is xnext, and the next row is ynext. These step by
+// sx,sy = +-1
+typedef struct
+{
+    float x0, y0, di, dj;
+    float xnext, ynext, sx, sy;
+    // The line of sight is at los0 + t*dlos, and the terrain bulges up by
+    // t*(1-t)*bulge
+    float los0, dlos, bulge;
+    // The lowest clearance so far, and where it is
+    float best, best_t;
+    // The ray has walked [0,t_last]. It's done when t_last = 1
+    float t_last;
+} los_ray_t;
+
+static float cell_i(const los_shared_t* s, float lon)
+{
+    return (lon - s->lon_origin) * s->dems->cells_per_deg - s->i_origin;
+}
+static float cell_j(const los_shared_t* s, float lat)
+{
+    return (lat - s->lat_origin) * s->dems->cells_per_deg - s->j_origin;
+}
+
+// Sets up a ray. A ray that doesn't exist (at the end of the batch) or has an
+// endpoint outside the mosaic sits still at cell (0,0), and is already done
+static void ray_init(los_ray_t* ray,
+                     const los_shared_t* s, const ray_order_t* order)
+{
+    *ray = (los_ray_t){ .sx = 1.0f, .sy = 1.0f,
+                        .best = NAN, .t_last = 1.0f };
+    if(order == NULL || order->Nsteps < 0)
+        return;
+
+    const int r = order->i;
+    ray->x0 = cell_i(s, s->lon0[r]);
+    ray->y0 = cell_j(s, s->lat0[r]);
+    ray->di = cell_i(s, s->lon1[r]) - ray->x0;
+    ray->dj = cell_j(s, s->lat1[r]) - ray->y0;
+
+    // The first column and row past the start, and which way we're going
+    ray->sx    = ray->di > 0.0f ? 1.0f : -1.0f;
+    ray->sy    = ray->dj > 0.0f ? 1.0f : -1.0f;
+    ray->xnext = ray->di > 0.0f ? floorf(ray->x0) + 1.0f : ceilf(ray->x0) - 1.0f;
+    ray->ynext = ray->dj > 0.0f ? floorf(ray->y0) + 1.0f : ceilf(ray->y0) - 1.0f;
+
+    // The line of sight runs from the terrain+height at one end to the
+    // terrain+height at the other
+    float D2 = ray->di*ray->di*s->de*s->de + ray->dj*ray->dj*s->dn*s->dn;
+    ray->bulge = D2 * s->curvature;
+    ray->los0  = s->z0[r] + s->height0[r];
+    ray->dlos  = s->z1[r] + s->height1[r] - ray->los0;
+
+    // The clearance at the start is the observer's height
+    ray->best   = s->height0[r];
+    ray->best_t = 0.0f;
+    ray->t_last = 0.0f;
+}
+
+static void ray_finish(const los_shared_t* s, const ray_order_t* order,
+                       const los_ray_t* ray)
+{
+    const int  r     = order->i;
+    const bool valid = order->Nsteps >= 0;
+
+    if(s->visible != NULL)
+        s->visible[r] = valid && ray->best >= 0.0f;
+    if(s->min_clearance != NULL)
+        s->min_clearance[r] = valid ? ray->best : NAN;
+    if(s->min_clearance_lat != NULL)
+        s->min_clearance_lat[r] = valid ? s->lat0[r] + ray->best_t*(s->lat1[r] - s->lat0[r]) : NAN;
+    if(s->min_clearance_lon != NULL)
+        s->min_clearance_lon[r] = valid ? s->lon0[r] + ray->best_t*(s->lon1[r] - s->lon0[r]) : NAN;
+}
+
+// Walks one ray, from one column or row crossing to the next. Between
+// crossings the ray is inside one cell, where the terrain is bilinear. So
+// along the ray, the clearance (the line of sight, minus the terrain, minus
+// the curvature bulge) is a quadratic in t. Its minimum over the segment is
+// at one of its ends, or at the vertex of the parabola, if that's inside.
+// Checking those points at each crossing finds the exact minimum clearance
+// over the whole ray. The ray is sampled at the crossings, not at cell
+// centers, so nothing between the samples is missed
+static void ray_walk_scalar(los_ray_t* ray, const los_shared_t* s)
+{
+    const int W = horizonator_dem_mosaic_width(s->dems);
+
+    while(ray->t_last < 1.0f)
+    {
+        float tx = ray->di != 0.0f ? (ray->xnext - ray->x0) / ray->di : INFINITY;
+        float ty = ray->dj != 0.0f ? (ray->ynext - ray->y0) / ray->dj : INFINITY;
+        float t  = fminf(fminf(tx, ty), 1.0f);
+
+        // The cell of this segment, from its midpoint
+        float tm = 0.5f * (ray->t_last + t);
+        int   i  = (int)(ray->x0 + tm*ray->di);
+        int   j  = (int)(ray->y0 + tm*ray->dj);
+        i = i < 0 ? 0 : i > W-2 ? W-2 : i;
+        j = j < 0 ? 0 : j > W-2 ? W-2 : j;
+
+        float z00 = horizonator_dem_mosaic_at(s->dems, i,   j  );
+        float z10 = horizonator_dem_mosaic_at(s->dems, i+1, j  );
+        float z01 = horizonator_dem_mosaic_at(s->dems, i,   j+1);
+        float z11 = horizonator_dem_mosaic_at(s->dems, i+1, j+1);
+
+        float ax = ray->x0 - (float)i;
+        float ay = ray->y0 - (float)j;
+
+        float clearance(float t)
+        {
+            float fx = ax + t*ray->di;
+            float fy = ay + t*ray->dj;
+            float z0 = z00 + fx*(z10 - z00);
+            float z1 = z01 + fx*(z11 - z01);
+            float z  = z0  + fy*(z1  - z0 );
+            return ray->los0 + t*ray->dlos - z - t*(1.0f-t)*ray->bulge;
+        }
+        void check(float c, float t)
+        {
+            if(c < ray->best)
+            {
+                ray->best   = c;
+                ray->best_t = t;
+            }
+        }
+
+        // The clearance is c2*t^2 + c1*t + c0. Its vertex is a minimum if
+        // c2 > 0
+        float zxy = z00 - z10 - z01 + z11;
+        float c2  = ray->bulge - zxy*ray->di*ray->dj;
+        float c1  = ray->dlos - ray->bulge -
+            ((z10 - z00)*ray->di + (z01 - z00)*ray->dj + zxy*(ax*ray->dj + ay*ray->di));
+        float tv  = -c1 / (2.0f*c2);
+        if(c2 > 0.0f && tv > ray->t_last && tv < t)
+            check(clearance(tv), tv);
+        check(clearance(t), t);
+
+        // Crossing a row and a column at the same time is one step
+        if(tx == t) ray->xnext += ray->sx;
+        if(ty == t) ray->ynext += ray->sy;
+        ray->t_last = t;
+    }
+}
+
+#if defined __x86_64__ || defined __i386__
+// The clearance at t in the cell with the given corners, in ray_walk_avx2()
+__attribute__((target("avx2"), always_inline))
+static inline __m256 clearance_avx2(__m256 t,
+                                    __m256 ax, __m256 ay, __m256 di, __m256 dj,
+                                    __m256 z00, __m256 z10, __m256 z01, __m256 z11,
+                                    __m256 los0, __m256 dlos, __m256 bulge)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    __m256 fx = _mm256_add_ps(ax, _mm256_mul_ps(t, di));
+    __m256 fy = _mm256_add_ps(ay, _mm256_mul_ps(t, dj));
+    __m256 z0 = _mm256_add_ps(z00, _mm256_mul_ps(fx, _mm256_sub_ps(z10, z00)));
+    __m256 z1 = _mm256_add_ps(z01, _mm256_mul_ps(fx, _mm256_sub_ps(z11, z01)));
+    __m256 z  = _mm256_add_ps(z0,  _mm256_mul_ps(fy, _mm256_sub_ps(z1,  z0 )));
+    return _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(los0, _mm256_mul_ps(t, dlos)),
+                                       z),
+                         _mm256_mul_ps(_mm256_mul_ps(t, _mm256_sub_ps(one, t)),
+                                       bulge));
+}
+
+// ray_walk_scalar() for a group of LANES rays, in lockstep, with AVX2. The
+// terrain under all the lanes is gathered from the mosaic in the step loop
+// itself. The lanes that are done keep stepping in place, with their results
+// masked out. Gives the same results as ray_walk_scalar()
+__attribute__((target("avx2")))
+static void ray_walk_avx2(los_ray_t* rays, const los_shared_t* s)
+{
+    const int W = horizonator_dem_mosaic_width(s->dems);
+
+    // Structure-of-arrays copies of the ray state
+    float x0[LANES], y0[LANES], di[LANES], dj[LANES];
+    float xnext[LANES], ynext[LANES], sx[LANES], sy[LANES];
+    float los0[LANES], dlos[LANES], bulge[LANES];
+    float best[LANES], best_t[LANES], t_last[LANES];
+    for(int l=0; l<LANES; l++)
+    {
+        x0    [l] = rays[l].x0;    y0   [l] = rays[l].y0;
+        di    [l] = rays[l].di;    dj   [l] = rays[l].dj;
+        xnext [l] = rays[l].xnext; ynext[l] = rays[l].ynext;
+        sx    [l] = rays[l].sx;    sy   [l] = rays[l].sy;
+        los0  [l] = rays[l].los0;
+        dlos  [l] = rays[l].dlos;
+        bulge [l] = rays[l].bulge;
+        best  [l] = rays[l].best;
+        best_t[l] = rays[l].best_t;
+        t_last[l] = rays[l].t_last;
+    }
+
+    const __m256  zero   = _mm256_setzero_ps();
+    const __m256  one    = _mm256_set1_ps(1.0f);
+    const __m256  two    = _mm256_set1_ps(2.0f);
+    const __m256  half   = _mm256_set1_ps(0.5f);
+    const __m256  inf    = _mm256_set1_ps(INFINITY);
+    const __m256i ij_min = _mm256_setzero_si256();
+    const __m256i ij_max = _mm256_set1_epi32(W-2);
+
+    const __m256 x0v    = _mm256_loadu_ps(x0);
+    const __m256 y0v    = _mm256_loadu_ps(y0);
+    const __m256 div    = _mm256_loadu_ps(di);
+    const __m256 djv    = _mm256_loadu_ps(dj);
+    const __m256 sxv    = _mm256_loadu_ps(sx);
+    const __m256 syv    = _mm256_loadu_ps(sy);
+    const __m256 los0v  = _mm256_loadu_ps(los0);
+    const __m256 dlosv  = _mm256_loadu_ps(dlos);
+    const __m256 bulgev = _mm256_loadu_ps(bulge);
+    const __m256 di0    = _mm256_cmp_ps(div, zero, _CMP_EQ_OQ);
+    const __m256 dj0    = _mm256_cmp_ps(djv, zero, _CMP_EQ_OQ);
+
+    __m256 xnextv  = _mm256_loadu_ps(xnext);
+    __m256 ynextv  = _mm256_loadu_ps(ynext);
+    __m256 bestv   = _mm256_loadu_ps(best);
+    __m256 best_tv = _mm256_loadu_ps(best_t);
+    __m256 t_lastv = _mm256_loadu_ps(t_last);
+
+    while(true)
+    {
+        __m256 active = _mm256_cmp_ps(t_lastv, one, _CMP_LT_OQ);
+        if(_mm256_movemask_ps(active) == 0)
+            break;
+
+        __m256 tx = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(xnextv, x0v), div), inf, di0);
+        __m256 ty = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(ynextv, y0v), djv), inf, dj0);
+        __m256 t  = _mm256_min_ps(_mm256_min_ps(tx, ty), one);
+
+        // The cell of this segment, from its midpoint
+        __m256  tm = _mm256_mul_ps(half, _mm256_add_ps(t_lastv, t));
+        __m256i i  = _mm256_cvttps_epi32(_mm256_add_ps(x0v, _mm256_mul_ps(tm, div)));
+        __m256i j  = _mm256_cvttps_epi32(_mm256_add_ps(y0v, _mm256_mul_ps(tm, djv)));
+        i = _mm256_min_epi32(_mm256_max_epi32(i, ij_min), ij_max);
+        j = _mm256_min_epi32(_mm256_max_epi32(j, ij_min), ij_max);
+
+        __m256 z00, z10, z01, z11;
+        horizonator_dem_cell_corners_avx2(&z00, &z10, &z01, &z11, s->dems, i, j);
+
+        __m256 ax = _mm256_sub_ps(x0v, _mm256_cvtepi32_ps(i));
+        __m256 ay = _mm256_sub_ps(y0v, _mm256_cvtepi32_ps(j));
+
+        __m256 zxy = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(z00, z10), z01), z11);
+        __m256 c2  = _mm256_sub_ps(bulgev, _mm256_mul_ps(_mm256_mul_ps(zxy, div), djv));
+        __m256 c1  =
+            _mm256_sub_ps(_mm256_sub_ps(dlosv, bulgev),
+                          _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(z10, z00), div),
+                                                      _mm256_mul_ps(_mm256_sub_ps(z01, z00), djv)),
+                                        _mm256_mul_ps(zxy,
+                                                      _mm256_add_ps(_mm256_mul_ps(ax, djv),
+                                                                    _mm256_mul_ps(ay, div)))));
+        __m256 tv  = _mm256_div_ps(_mm256_sub_ps(zero, c1), _mm256_mul_ps(two, c2));
+        __m256 has_vertex =
+            _mm256_and_ps(_mm256_and_ps(active,
+                                        _mm256_cmp_ps(c2, zero, _CMP_GT_OQ)),
+                          _mm256_and_ps(_mm256_cmp_ps(tv, t_lastv, _CMP_GT_OQ),
+                                        _mm256_cmp_ps(tv, t,       _CMP_LT_OQ)));
+        for(int k=0; k<2; k++)
+        {
+            __m256 tk   = k == 0 ? tv         : t;
+            __m256 mask = k == 0 ? has_vertex : active;
+            __m256 c    = clearance_avx2(tk, ax, ay, div, djv,
+                                         z00, z10, z01, z11,
+                                         los0v, dlosv, bulgev);
+
+            __m256 better = _mm256_and_ps(mask, _mm256_cmp_ps(c, bestv, _CMP_LT_OQ));
+            bestv   = _mm256_blendv_ps(bestv,   c,  better);
+            best_tv = _mm256_blendv_ps(best_tv, tk, better);
+        }
+
+        // Crossing a row and a column at the same time is one step. The lanes
+        // that are done stay where they are
+        xnextv  = _mm256_add_ps(xnextv,
+                                _mm256_and_ps(_mm256_and_ps(active, _mm256_cmp_ps(tx, t, _CMP_EQ_OQ)), sxv));
+        ynextv  = _mm256_add_ps(ynextv,
+                                _mm256_and_ps(_mm256_and_ps(active, _mm256_cmp_ps(ty, t, _CMP_EQ_OQ)), syv));
+        t_lastv = _mm256_blendv_ps(t_lastv, t, active);
+    }
+
+    _mm256_storeu_ps(best,   bestv);
+    _mm256_storeu_ps(best_t, best_tv);
+    for(int l=0; l<LANES; l++)
+    {
+        rays[l].best   = best  [l];
+        rays[l].best_t = best_t[l];
+        rays[l].t_last = 1.0f;
+    }
+}
+#endif
+
+// Processes one group of up to LANES rays: in lockstep with AVX2, if the CPU
+// has it, or one at a time otherwise
+static void los_group(const los_shared_t* s, const ray_order_t* order, int Nlanes,
+                      bool use_avx2)
+{
+    los_ray_t rays[LANES];
+    for(int l=0; l<LANES; l++)
+        ray_init(&rays[l], s, l < Nlanes ? &order[l] : NULL);
+
+#if defined __x86_64__ || defined __i386__
+    if(use_avx2)
+        ray_walk_avx2(rays, s);
+    else
+#endif
+        for(int l=0; l<Nlanes; l++)
+            ray_walk_scalar(&rays[l], s);
+
+    for(int l=0; l<Nlanes; l++)
+        ray_finish(s, &order[l], &rays[l]);
+}
+
+static void* los_worker(void* cookie)
+{
+    los_shared_t* s = (los_shared_t*)cookie;
+
+    const int Ngroups = (s->N + LANES-1) / LANES;
+    const int Ntasks  = (Ngroups + GROUPS_PER_TASK-1) / GROUPS_PER_TASK;
+
+    bool use_avx2 = false;
+#if defined __x86_64__ || defined __i386__
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    while(true)
+    {
+        int task = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED);
+        if(task >= Ntasks)
+            break;
+
+        for(int g = task*GROUPS_PER_TASK;
+            g < (task+1)*GROUPS_PER_TASK && g < Ngroups;
+            g++)
+        {
+            int r0     = g*LANES;
+            int Nlanes = s->N - r0 < LANES ? s->N - r0 : LANES;
+            los_group(s, &s->order[r0], Nlanes, use_avx2);
+        }
+    }
+    return NULL;
+}
+
+static int compare_Nsteps(const void* _a, const void* _b)
+{
+    const ray_order_t* a = (const ray_order_t*)_a;
+    const ray_order_t* b = (const ray_order_t*)_b;
+    return (a->Nsteps > b->Nsteps) - (a->Nsteps < b->Nsteps);
+}
+
+bool horizonator_los_batch( // output
+                            uint8_t* visible,
+                            float*   min_clearance,
+                            float*   min_clearance_lat,
+                            float*   min_clearance_lon,
+
+                            // input
+                            const horizonator_dem_context_t* dems,
+                            const float* lat0, const float* lon0, const float* height0,
+                            const float* lat1, const float* lon1, const float* height1,
+                            int N,
+                            float refraction_coeff,
+                            int Nthreads)
+{
+    const float Rearth = 6371000.0;
+    const int   W      = horizonator_dem_mosaic_width(dems);
+
+    if(N <= 0)
+        return true;
+    if(W < 2)
+    {
+        MSG("The DEM mosaic is too small");
+        return false;
+    }
+
+    bool result = false;
+
+    float lat_min, lon_min, lat_max, lon_max;
+    horizonator_dem_bounds_latlon_deg(dems, &lat_min, &lon_min, &lat_max, &lon_max);
+    const float dn = Rearth * (float)M_PI / 180.0f / (float)dems->cells_per_deg;
+
+    los_shared_t shared =
+        { .visible           = visible,
+          .min_clearance     = min_clearance,
+          .min_clearance_lat = min_clearance_lat,
+          .min_clearance_lon = min_clearance_lon,
+          .dems              = dems,
+          .lat0              = lat0,
+          .lon0              = lon0,
+          .height0           = height0,
+          .lat1              = lat1,
+          .lon1              = lon1,
+          .height1           = height1,
+          .lon_origin        = (float)dems->origin_dem_lon_lat[0],
+          .lat_origin        = (float)dems->origin_dem_lon_lat[1],
+          .i_origin          = (float)dems->origin_dem_cellij[0],
+          .j_origin          = (float)dems->origin_dem_cellij[1],
+          .de                = dn * cosf((lat_min + lat_max) / 2.0f * (float)M_PI / 180.0f),
+          .dn                = dn,
+          .curvature         = (1.0f - refraction_coeff) / (2.0f * Rearth),
+          .N                 = N };
+
+    pthread_t*   threads = NULL;
+    bool*        started = NULL;
+    ray_order_t* order   = malloc((size_t)N * sizeof(order[0]));
+    // The cells of the two ends of each ray, and the terrain there
+    float*       buffer  = malloc(6*(size_t)N * sizeof(float));
+    if(order == NULL || buffer == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+    float* x0 = &buffer[0*N];
+    float* y0 = &buffer[1*N];
+    float* x1 = &buffer[2*N];
+    float* y1 = &buffer[3*N];
+    float* z0 = &buffer[4*N];
+    float* z1 = &buffer[5*N];
+
+    // Each ray takes one step per column or row it crosses, and one more to
+    // reach its end. Rays with an endpoint outside the mosaic get Nsteps = -1
+    for(int r=0; r<N; r++)
+    {
+        x0[r] = cell_i(&shared, lon0[r]);
+        y0[r] = cell_j(&shared, lat0[r]);
+        x1[r] = cell_i(&shared, lon1[r]);
+        y1[r] = cell_j(&shared, lat1[r]);
+
+        order[r].i = r;
+        if( !(x0[r] >= 0.0f && x0[r] <= (float)(W-1) &&
+              y0[r] >= 0.0f && y0[r] <= (float)(W-1) &&
+              x1[r] >= 0.0f && x1[r] <= (float)(W-1) &&
+              y1[r] >= 0.0f && y1[r] <= (float)(W-1)) )
+        {
+            order[r].Nsteps = -1;
+            continue;
+        }
+
+        order[r].Nsteps =
+            (int)(fabsf(floorf(x1[r]) - floorf(x0[r])) +
+                  fabsf(floorf(y1[r]) - floorf(y0[r]))) + 1;
+    }
+
+    // The terrain at the ends of all the rays, in one call. The rays outside
+    // the mosaic get NAN here, and aren't walked
+    horizonator_dem_interp_cells_many(z0, dems, x0, y0, N);
+    horizonator_dem_interp_cells_many(z1, dems, x1, y1, N);
+    shared.z0 = z0;
+    shared.z1 = z1;
+
+    // Rays of similar lengths end up in the same group, so few lanes sit idle
+    qsort(order, N, sizeof(order[0]), compare_Nsteps);
+    shared.order = order;
+
+    if(Nthreads <= 0)
+    {
+        long Ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Nthreads = Ncpus > 0 ? (int)Ncpus : 1;
+    }
+    threads = calloc(Nthreads, sizeof(threads[0]));
+    started = calloc(Nthreads, sizeof(started[0]));
+    if(threads == NULL || started == NULL)
+    {
+        MSG("calloc() failed");
+        goto done;
+    }
+
+    // This thread is one of the workers. If any other worker can't be
+    // started, the others simply do its share
+    for(int i=1; i<Nthreads; i++)
+        if(0 == pthread_create(&threads[i], NULL, los_worker, &shared))
+            started[i] = true;
+    los_worker(&shared);
+    for(int i=1; i<Nthreads; i++)
+        if(started[i])
+            pthread_join(threads[i], NULL);
+
+    result = true;
+
+ done:
+    free(order);
+    free(buffer);
+    free(threads);
+    free(started);
+    return result;
+}
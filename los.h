@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Batched point-to-point line-of-sight queries over the DEM mosaic. For each
+// of the N (observer, target) pairs we walk the straight line between them
+// from one mosaic column or row crossing to the next, and compare the line of
+// sight against the terrain, interpolated bilinearly.
+//
+// The clearance at each point is the height of the line of sight above the
+// terrain, in meters. We report the smallest clearance along the path
+// (including the endpoints), and where it occurs. The path is unobstructed if
+// this minimum clearance is >= 0. Inside each cell the clearance is a
+// quadratic along the path, so its minimum there is at a crossing or at the
+// vertex of that parabola: we check both, and the minimum is exact, not
+// sampled.
+//
+// Earth curvature is taken into account, with the given refraction
+// coefficient, as in horizonator_viewshed(): the terrain in the middle of a
+// path of length D bulges up by D^2/8 * (1-refraction_coeff)/Rearth.
+//
+// The rays are processed in groups of 8, in lockstep: at each step, the
+// corners of the cells under the whole group are read with AVX2 gathers, if
+// the CPU has them. The pairs are sorted by the number of crossings first, so
+// that the rays in each group take a similar number of steps. The groups are
+// spread over Nthreads threads (one per CPU if Nthreads <= 0).
+//
+// Pairs with an endpoint outside the mosaic are reported as not visible, with
+// a NAN clearance and location.
+//
+// Returns true on success
+bool horizonator_los_batch( // output
+                            // Each is an array of N values. Any may be NULL
+                            uint8_t* visible,
+                            float*   min_clearance,
+                            float*   min_clearance_lat,
+                            float*   min_clearance_lon,
+
+                            // input
+                            const horizonator_dem_context_t* dems,
+                            // Each is an array of N values. The heights are
+                            // in meters above the ground
+                            const float* lat0, const float* lon0, const float* height0,
+                            const float* lat1, const float* lon1, const float* height1,
+                            int N,
+                            float refraction_coeff,
+                            int Nthreads);
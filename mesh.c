@@ -0,0 +1,466 @@
+#include <tgmath.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mesh.h"
+#include "util.h"
+
+// The header of the mesh cache files. The mesh arrays follow it, in the order
+// of horizonator_mesh_t, in the native byte order
+typedef struct
+{
+    char     magic[8];
+    int32_t  origin_dem_lon_lat[2];
+    int32_t  origin_dem_cellij [2];
+    int32_t  W;
+    int32_t  chunk_cells;
+    int32_t  Nchunks_side;
+    float    tolerance;
+    int32_t  Nvertices;
+    int32_t  Ntriangles;
+} mesh_file_header_t;
+
+#define MESH_FILE_MAGIC "hzmsh02"
+
+static size_t mesh_Nbytes(const horizonator_mesh_t* mesh)
+{
+    return
+        (size_t)mesh->Ntriangles * 3 * sizeof(uint32_t) +
+        (size_t)mesh->Nchunks_side * (size_t)mesh->Nchunks_side * sizeof(uint32_t) +
+        (size_t)mesh->Nvertices  * 2 * sizeof(uint16_t);
+}
+
+// Allocates the arrays for the counts in *mesh
+static bool mesh_alloc(horizonator_mesh_t* mesh)
+{
+    mesh->data = malloc(mesh_Nbytes(mesh));
+    if(mesh->data == NULL)
+    {
+        MSG("Couldn't allocate the %zu-byte mesh", mesh_Nbytes(mesh));
+        return false;
+    }
+    mesh->indices          = (uint32_t*)mesh->data;
+    mesh->chunk_Ntriangles = &mesh->indices[(size_t)mesh->Ntriangles * 3];
+    mesh->vertices         = (uint16_t*)&mesh->chunk_Ntriangles[(size_t)mesh->Nchunks_side *
+                                                                 (size_t)mesh->Nchunks_side];
+    return true;
+}
+
+// The RTIN lives on a (T+1) x (T+1) grid, with T a power of 2. This covers the
+// mosaic, and anything past it is out of bounds. Triangle k is identified by
+// walking down the binary tree of splits, as in the "Martini" implementation of
+// RTIN. (ax,ay),(bx,by) are the ends of the hypotenuse, and (cx,cy) is the
+// right-angle corner
+static void rtin_triangle(// output
+                          int* ax, int* ay, int* bx, int* by, int* cx, int* cy,
+
+                          // input
+                          int64_t k, int T)
+{
+    uint64_t id = (uint64_t)k + 2;
+
+    *ax = *ay = *bx = *by = *cx = *cy = 0;
+    if(id & 1) { *bx = *by = *cx = T; }
+    else       { *ax = *ay = *cy = T; }
+
+    while((id >>= 1) > 1)
+    {
+        int mx = (*ax + *bx) >> 1;
+        int my = (*ay + *by) >> 1;
+        if(id & 1)
+        {
+            *bx = *ax; *by = *ay;
+            *ax = *cx; *ay = *cy;
+        }
+        else
+        {
+            *ax = *bx; *ay = *by;
+            *bx = *cx; *by = *cy;
+        }
+        *cx = mx; *cy = my;
+    }
+}
+
+// Builds the mesh from scratch
+static bool mesh_build(horizonator_mesh_t* mesh,
+                       const horizonator_dem_context_t* dems,
+                       float tolerance)
+{
+    const int W = horizonator_dem_mosaic_width(dems);
+    const int C = mesh->chunk_cells;
+
+    int T = 1;
+    while(T < W-1)
+        T *= 2;
+    const int G = T+1;
+
+    bool result = false;
+
+    // The error of each triangle, stored at the midpoint of its hypotenuse. The
+    // two triangles that share a hypotenuse share this entry, and each entry
+    // includes the errors of the children, so the splits are consistent, and
+    // the mesh has no cracks. A triangle must be split if it's too big for a
+    // chunk, or if it extends past the mosaic: those errors are infinite
+    float*    errors    = calloc((size_t)G*(size_t)G, sizeof(float));
+    // Where each mosaic vertex ended up in mesh->vertices, or -1
+    int32_t*  vertex_id = malloc((size_t)W*(size_t)W*sizeof(int32_t));
+    // The triangles, in the order they're found, and the chunk of each
+    uint32_t* triangles = NULL;
+    int32_t*  chunks    = NULL;
+    int       Ntriangles_alloc = 0;
+    // The chunk offsets, for the sort
+    uint32_t* chunk_next = NULL;
+
+    if(errors == NULL || vertex_id == NULL)
+    {
+        MSG("Couldn't allocate the mesh-simplification buffers");
+        goto done;
+    }
+
+    int16_t z(int x, int y)
+    {
+        return horizonator_dem_mosaic_at(dems, x, y);
+    }
+
+    // The largest vertical distance between the flat triangle and the DEM, at
+    // the mosaic vertices it covers. This is exact, unlike the usual RTIN
+    // error estimate, which only looks at the midpoint of the hypotenuse. The
+    // barycentric weights are integers, so the inside test is exact too
+    float triangle_error(int ax, int ay, int bx, int by, int cx, int cy)
+    {
+        int xmin = ax < bx ? (ax < cx ? ax : cx) : (bx < cx ? bx : cx);
+        int xmax = ax > bx ? (ax > cx ? ax : cx) : (bx > cx ? bx : cx);
+        int ymin = ay < by ? (ay < cy ? ay : cy) : (by < cy ? by : cy);
+        int ymax = ay > by ? (ay > cy ? ay : cy) : (by > cy ? by : cy);
+
+        int   den = (by-cy)*(ax-cx) + (cx-bx)*(ay-cy);
+        float za  = (float)z(ax,ay);
+        float zb  = (float)z(bx,by);
+        float zc  = (float)z(cx,cy);
+
+        float error = 0.0f;
+        for(int y=ymin; y<=ymax; y++)
+            for(int x=xmin; x<=xmax; x++)
+            {
+                int wa = (by-cy)*(x-cx) + (cx-bx)*(y-cy);
+                int wb = (cy-ay)*(x-cx) + (ax-cx)*(y-cy);
+                int wc = den - wa - wb;
+                if( den > 0 ? (wa < 0 || wb < 0 || wc < 0) :
+                              (wa > 0 || wb > 0 || wc > 0) )
+                    continue;
+
+                float zi = ((float)wa*za + (float)wb*zb + (float)wc*zc) / (float)den;
+                float e  = fabsf(zi - (float)z(x,y));
+                if(error < e) error = e;
+            }
+        return error;
+    }
+
+    const int64_t Ntriangles_all = (int64_t)T*(int64_t)T*2 - 2;
+    const int64_t Nparents       = Ntriangles_all - (int64_t)T*(int64_t)T;
+    for(int64_t k=Ntriangles_all-1; k>=0; k--)
+    {
+        int ax,ay,bx,by,cx,cy;
+        rtin_triangle(&ax,&ay,&bx,&by,&cx,&cy, k, T);
+
+        int mx = (ax + bx) >> 1;
+        int my = (ay + by) >> 1;
+        float* e = &errors[(size_t)my*(size_t)G + (size_t)mx];
+
+        int xmin = ax < bx ? (ax < cx ? ax : cx) : (bx < cx ? bx : cx);
+        int xmax = ax > bx ? (ax > cx ? ax : cx) : (bx > cx ? bx : cx);
+        int ymin = ay < by ? (ay < cy ? ay : cy) : (by < cy ? by : cy);
+        int ymax = ay > by ? (ay > cy ? ay : cy) : (by > cy ? by : cy);
+
+        float error;
+        if(xmax > W-1 || ymax > W-1 ||
+           xmax - xmin > C || ymax - ymin > C)
+            error = INFINITY;
+        else
+            error = triangle_error(ax,ay, bx,by, cx,cy);
+        if(*e < error) *e = error;
+
+        if(k < Nparents)
+        {
+            float el = errors[(size_t)((ay + cy) >> 1)*(size_t)G + (size_t)((ax + cx) >> 1)];
+            float er = errors[(size_t)((by + cy) >> 1)*(size_t)G + (size_t)((bx + cx) >> 1)];
+            if(*e < el) *e = el;
+            if(*e < er) *e = er;
+        }
+    }
+
+    for(size_t k=0; k<(size_t)W*(size_t)W; k++)
+        vertex_id[k] = -1;
+
+    int Nvertices  = 0;
+    int Ntriangles = 0;
+    bool ok        = true;
+
+    int add_vertex(int x, int y)
+    {
+        int32_t* id = &vertex_id[(size_t)y*(size_t)W + (size_t)x];
+        if(*id < 0)
+            *id = Nvertices++;
+        return *id;
+    }
+
+    void emit(int ax, int ay, int bx, int by, int cx, int cy)
+    {
+        // Anything past the mosaic is thrown out. Those triangles were split
+        // all the way down, so what's left covers the mosaic exactly
+        if(ax > W-1 || bx > W-1 || cx > W-1 ||
+           ay > W-1 || by > W-1 || cy > W-1)
+            return;
+
+        if(Ntriangles == Ntriangles_alloc)
+        {
+            Ntriangles_alloc = Ntriangles_alloc ? 2*Ntriangles_alloc : 65536;
+            uint32_t* t = realloc(triangles, (size_t)Ntriangles_alloc*3*sizeof(triangles[0]));
+            if(t != NULL) triangles = t;
+            int32_t*  c = realloc(chunks,    (size_t)Ntriangles_alloc*  sizeof(chunks[0]));
+            if(c != NULL) chunks = c;
+            if(t == NULL || c == NULL)
+            {
+                ok = false;
+                return;
+            }
+        }
+
+        // The renderer culls back faces, so the triangles are
+        // counter-clockwise when looking down
+        if( (bx-ax)*(cy-ay) - (by-ay)*(cx-ax) < 0 )
+        {
+            int tx = bx, ty = by;
+            bx = cx; by = cy;
+            cx = tx; cy = ty;
+        }
+
+        int xmin = ax < bx ? (ax < cx ? ax : cx) : (bx < cx ? bx : cx);
+        int ymin = ay < by ? (ay < cy ? ay : cy) : (by < cy ? by : cy);
+
+        triangles[3*(size_t)Ntriangles + 0] = add_vertex(ax,ay);
+        triangles[3*(size_t)Ntriangles + 1] = add_vertex(bx,by);
+        triangles[3*(size_t)Ntriangles + 2] = add_vertex(cx,cy);
+        chunks   [  (size_t)Ntriangles    ] =
+            (ymin / C) * mesh->Nchunks_side + (xmin / C);
+        Ntriangles++;
+    }
+
+    void process(int ax, int ay, int bx, int by, int cx, int cy)
+    {
+        if(!ok)
+            return;
+
+        int mx = (ax + bx) >> 1;
+        int my = (ay + by) >> 1;
+        if( abs(ax - cx) + abs(ay - cy) > 1 &&
+            errors[(size_t)my*(size_t)G + (size_t)mx] > tolerance )
+        {
+            process(cx, cy, ax, ay, mx, my);
+            process(bx, by, cx, cy, mx, my);
+        }
+        else
+            emit(ax, ay, bx, by, cx, cy);
+    }
+
+    process(0, 0, T, T, T, 0);
+    process(T, T, 0, 0, 0, T);
+    if(!ok)
+    {
+        MSG("Couldn't allocate the simplified mesh");
+        goto done;
+    }
+
+    mesh->Nvertices  = Nvertices;
+    mesh->Ntriangles = Ntriangles;
+    if(!mesh_alloc(mesh))
+        goto done;
+
+    for(int y=0; y<W; y++)
+        for(int x=0; x<W; x++)
+        {
+            int32_t id = vertex_id[(size_t)y*(size_t)W + (size_t)x];
+            if(id >= 0)
+            {
+                mesh->vertices[2*(size_t)id + 0] = (uint16_t)x;
+                mesh->vertices[2*(size_t)id + 1] = (uint16_t)y;
+            }
+        }
+
+    // Sort the triangles by chunk
+    const int Nchunks = mesh->Nchunks_side*mesh->Nchunks_side;
+    chunk_next = calloc(Nchunks, sizeof(chunk_next[0]));
+    if(chunk_next == NULL)
+    {
+        MSG("Couldn't allocate the mesh-simplification buffers");
+        goto done;
+    }
+    memset(mesh->chunk_Ntriangles, 0, Nchunks*sizeof(mesh->chunk_Ntriangles[0]));
+    for(int t=0; t<Ntriangles; t++)
+        mesh->chunk_Ntriangles[chunks[t]]++;
+    for(int c=1; c<Nchunks; c++)
+        chunk_next[c] = chunk_next[c-1] + mesh->chunk_Ntriangles[c-1];
+    for(int t=0; t<Ntriangles; t++)
+    {
+        uint32_t s = chunk_next[chunks[t]]++;
+        memcpy(&mesh->indices[3*(size_t)s], &triangles[3*(size_t)t], 3*sizeof(uint32_t));
+    }
+
+    result = true;
+
+ done:
+    if(!result)
+    {
+        free(mesh->data);
+        mesh->data = NULL;
+    }
+    free(errors);
+    free(vertex_id);
+    free(triangles);
+    free(chunks);
+    free(chunk_next);
+    return result;
+}
+
+static void mesh_header(// output
+                        mesh_file_header_t* header,
+
+                        // input
+                        const horizonator_mesh_t* mesh,
+                        const horizonator_dem_context_t* dems,
+                        float tolerance)
+{
+    *header = (mesh_file_header_t)
+        { .magic              = MESH_FILE_MAGIC,
+          .origin_dem_lon_lat = {dems->origin_dem_lon_lat[0], dems->origin_dem_lon_lat[1]},
+          .origin_dem_cellij  = {dems->origin_dem_cellij [0], dems->origin_dem_cellij [1]},
+          .W                  = horizonator_dem_mosaic_width(dems),
+          .chunk_cells        = mesh->chunk_cells,
+          .Nchunks_side       = mesh->Nchunks_side,
+          .tolerance          = tolerance,
+          .Nvertices          = mesh->Nvertices,
+          .Ntriangles         = mesh->Ntriangles };
+}
+
+// Reads the mesh from the cache file, if it exists and matches this mosaic.
+// The header has everything except the counts, which come from the file
+static bool mesh_read_cache(horizonator_mesh_t* mesh,
+                            mesh_file_header_t* header,
+                            const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    bool result = false;
+
+    mesh_file_header_t header_file;
+    if(sizeof(header_file) != read(fd, &header_file, sizeof(header_file)))
+        goto done;
+    header->Nvertices  = header_file.Nvertices;
+    header->Ntriangles = header_file.Ntriangles;
+    if(0 != memcmp(&header_file, header, sizeof(header_file)) ||
+       header_file.Nvertices < 0 || header_file.Ntriangles < 0)
+        goto done;
+
+    mesh->Nvertices  = header_file.Nvertices;
+    mesh->Ntriangles = header_file.Ntriangles;
+
+    const size_t Nbytes = mesh_Nbytes(mesh);
+    struct stat sb;
+    if(0 != fstat(fd, &sb) ||
+       sb.st_size != (off_t)(sizeof(header_file) + Nbytes))
+        goto done;
+
+    if(!mesh_alloc(mesh))
+        goto done;
+    for(size_t Nread = 0; Nread < Nbytes; )
+    {
+        ssize_t n = read(fd, &((char*)mesh->data)[Nread], Nbytes - Nread);
+        if(n <= 0)
+        {
+            free(mesh->data);
+            mesh->data = NULL;
+            goto done;
+        }
+        Nread += n;
+    }
+    result = true;
+
+ done:
+    close(fd);
+    return result;
+}
+
+bool horizonator_mesh_init( // output
+                            horizonator_mesh_t* mesh,
+
+                            // input
+                            const horizonator_dem_context_t* dems,
+                            float tolerance,
+                            int chunk_cells,
+                            const char* cachedir )
+{
+    *mesh = (horizonator_mesh_t){};
+
+    const int W = horizonator_dem_mosaic_width(dems);
+    if(W < 2)
+    {
+        MSG("The DEM mosaic is too small to build a mesh");
+        return false;
+    }
+    _Static_assert(HORIZONATOR_MESH_MAX_WIDTH <= 65536,
+                   "The mesh vertices are stored in 16 bits");
+    if(W > HORIZONATOR_MESH_MAX_WIDTH)
+    {
+        MSG("The DEM mosaic is too large to build a mesh: it is %d cells wide, but at most %d are supported",
+            W, HORIZONATOR_MESH_MAX_WIDTH);
+        return false;
+    }
+    if(chunk_cells <= 0 || (chunk_cells & (chunk_cells-1)) != 0)
+    {
+        MSG("The mesh chunk size must be a power of 2. Got %d", chunk_cells);
+        return false;
+    }
+
+    mesh->chunk_cells  = chunk_cells;
+    mesh->Nchunks_side = (W-1 + chunk_cells-1) / chunk_cells;
+
+    if(cachedir == NULL)
+        return mesh_build(mesh, dems, tolerance);
+
+    char kind[64];
+    char filename[1024];
+    if( snprintf(kind, sizeof(kind), "mesh_%gm_%d", tolerance, chunk_cells) >= (int)sizeof(kind) ||
+        !horizonator_dem_cache_filename(filename, sizeof(filename), dems, cachedir, kind) )
+    {
+        MSG("Warning: couldn't construct the mesh cache filename. Not caching");
+        return mesh_build(mesh, dems, tolerance);
+    }
+
+    mesh_file_header_t header;
+    mesh_header(&header, mesh, dems, tolerance);
+
+    if( mesh_read_cache(mesh, &header, filename) )
+        return true;
+
+    if( !mesh_build(mesh, dems, tolerance) )
+        return false;
+
+    mesh_header(&header, mesh, dems, tolerance);
+    if( !horizonator_dem_cache_write(filename, cachedir,
+                                     &header, sizeof(header),
+                                     mesh->data, mesh_Nbytes(mesh)) )
+        MSG("Warning: couldn't write the mesh cache file '%s'", filename);
+    return true;
+}
+
+void horizonator_mesh_deinit( horizonator_mesh_t* mesh )
+{
+    free(mesh->data);
+    *mesh = (horizonator_mesh_t){};
+}
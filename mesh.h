@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Where the simplified meshes are cached by default
+#define HORIZONATOR_MESH_CACHEDIR "~/.horizonator/meshes"
+
+// The widest mosaic a mesh can be built from. The simplification keeps an error
+// for each node of a power-of-2 grid covering the mosaic, and a vertex index
+// for each mosaic sample: at this width, 4 bytes each, that's ~540MB, in
+// addition to the triangles found. A render radius of half this, 4096 cells,
+// is ~340km with 3sec DEMs
+#define HORIZONATOR_MESH_MAX_WIDTH 8192
+
+// A triangulation of the DEM mosaic, simplified to within a vertical error
+// tolerance. This is a right-triangulated irregular network (RTIN): the
+// mosaic is split into two right triangles, and each triangle is split in half
+// across its hypotenuse, recursively, until the terrain under it is within the
+// tolerance of the flat triangle. At the finest level each triangle is half of
+// a mosaic cell. The splits are propagated so that the mesh has no cracks.
+//
+// Every triangle lies within one square chunk of chunk_cells x chunk_cells
+// cells, so the chunks can be drawn and culled independently. The chunks are
+// laid out as in horizonator_init(): Nchunks_side per side, row-major, starting
+// at the SW corner of the mosaic
+typedef struct
+{
+    // One allocation holding the arrays below. NULL if there's no mesh
+    void* data;
+
+    // 3 vertex indices per triangle, counter-clockwise when looking down.
+    // Sorted by chunk: the triangles of chunk 0 first, then chunk 1, and so on
+    uint32_t* indices;
+    // How many triangles each chunk has
+    uint32_t* chunk_Ntriangles;
+    // The mosaic coordinates (i,j) of each vertex
+    uint16_t* vertices;
+
+    int Nvertices, Ntriangles;
+    int chunk_cells, Nchunks_side;
+} horizonator_mesh_t;
+
+// Builds the simplified mesh of the mosaic. The tolerance is the largest
+// allowed vertical error, in meters. chunk_cells must be a power of 2.
+//
+// If cachedir is not NULL, the mesh is cached in a file in that directory
+// (HORIZONATOR_MESH_CACHEDIR is a good choice), like the pyramid in
+// horizonator_dem_pyramid_init(). A mesh of the same region and tolerance,
+// cached earlier, is read instead of being rebuilt
+bool horizonator_mesh_init( // output
+                            horizonator_mesh_t* mesh,
+
+                            // input
+                            const horizonator_dem_context_t* dems,
+                            float tolerance,
+                            int chunk_cells,
+                            const char* cachedir );
+
+void horizonator_mesh_deinit( horizonator_mesh_t* mesh );
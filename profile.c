@@ -0,0 +1,243 @@
+#include <tgmath.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "profile.h"
+#include "los.h"
+#include "util.h"
+
+// Walks the path, and writes each sample into the given arrays. Any of these
+// may be NULL: to just count the samples, for instance. Returns the number of
+// samples
+static int profile_points(// output
+                          float* distance,
+                          float* sample_lat,
+                          float* sample_lon,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          const float* lat, const float* lon,
+                          int Nvertices,
+                          float spacing)
+{
+    const double Rearth = 6371000.0;
+    // Meters per degree of latitude
+    const double dn = Rearth * M_PI / 180.0;
+
+    const double lon_origin = (double)dems->origin_dem_lon_lat[0];
+    const double lat_origin = (double)dems->origin_dem_lon_lat[1];
+    const double i_origin   = (double)dems->origin_dem_cellij[0];
+    const double j_origin   = (double)dems->origin_dem_cellij[1];
+
+    int    N      = 0;
+    double s_last = -1.0;
+
+    void emit(int v, double t, double s)
+    {
+        if(distance   != NULL) distance  [N] = (float)s;
+        if(sample_lat != NULL) sample_lat[N] = (float)((double)lat[v] + t*(double)(lat[v+1] - lat[v]));
+        if(sample_lon != NULL) sample_lon[N] = (float)((double)lon[v] + t*(double)(lon[v+1] - lon[v]));
+        s_last = s;
+        N++;
+    }
+
+    // The distance at the start of the current segment
+    double D = 0.0;
+    // For fixed spacing: the index of the next sample
+    int    k = 0;
+
+    for(int v=0; v<Nvertices-1; v++)
+    {
+        double dlat = (double)(lat[v+1] - lat[v]);
+        double dlon = (double)(lon[v+1] - lon[v]);
+        double de   = dn * cos( (double)(lat[v] + lat[v+1]) / 2.0 * M_PI/180.0 );
+        double L    = hypot(dlon*de, dlat*dn);
+        if(L == 0.0)
+            continue;
+
+        if(spacing > 0.0f)
+        {
+            for(double s = (double)k*(double)spacing;
+                s <= D + L;
+                s = (double)(++k)*(double)spacing)
+                emit(v, (s - D) / L, s);
+        }
+        else
+        {
+            // The path crosses column x (or row y) at the integer values of
+            // the mosaic coordinates
+            double x0 = ((double)lon[v  ] - lon_origin) * dems->cells_per_deg - i_origin;
+            double x1 = ((double)lon[v+1] - lon_origin) * dems->cells_per_deg - i_origin;
+            double y0 = ((double)lat[v  ] - lat_origin) * dems->cells_per_deg - j_origin;
+            double y1 = ((double)lat[v+1] - lat_origin) * dems->cells_per_deg - j_origin;
+
+            // The first integer past the start, and which way we're going
+            double xi = x1 > x0 ? floor(x0) + 1.0 : ceil(x0) - 1.0;
+            double yi = y1 > y0 ? floor(y0) + 1.0 : ceil(y0) - 1.0;
+            double sx = x1 > x0 ? 1.0 : -1.0;
+            double sy = y1 > y0 ? 1.0 : -1.0;
+            int    kx = 0, ky = 0;
+
+            // Between crossings we're inside one cell, and the bilinear
+            // terrain is quadratic in t. If it has an extremum strictly
+            // inside (ta,tb), I sample there too
+            void emit_extremum(double ta, double tb)
+            {
+                const double tm = (ta + tb) / 2.0;
+                const double xm = x0 + tm*(x1 - x0);
+                const double ym = y0 + tm*(y1 - y0);
+                const int    W  = horizonator_dem_mosaic_width(dems);
+                if( !(xm >= 0.0 && xm < (double)(W-1) &&
+                      ym >= 0.0 && ym < (double)(W-1)) )
+                    return;
+
+                const int    i   = (int)xm;
+                const int    j   = (int)ym;
+                const double z00 = horizonator_dem_mosaic_at(dems, i,   j  );
+                const double z10 = horizonator_dem_mosaic_at(dems, i+1, j  );
+                const double z01 = horizonator_dem_mosaic_at(dems, i,   j+1);
+                const double z11 = horizonator_dem_mosaic_at(dems, i+1, j+1);
+
+                // z(t) = z00 + (z10-z00) fx + (z01-z00) fy + c fx fy, with
+                // fx = ax + dx t and fy = ay + dy t
+                const double c  = z00 - z10 - z01 + z11;
+                const double dx = x1 - x0, dy = y1 - y0;
+                const double ax = x0 - (double)i, ay = y0 - (double)j;
+                const double a2 = c*dx*dy;
+                if(a2 == 0.0)
+                    return;
+                const double a1 = (z10-z00)*dx + (z01-z00)*dy + c*(ax*dy + ay*dx);
+                const double t  = -a1 / (2.0*a2);
+                if(t > ta && t < tb)
+                    emit(v, t, D + t*L);
+            }
+
+            emit(v, 0.0, D);
+            double t_last = 0.0;
+            while(true)
+            {
+                double tx = x1 != x0 ? (xi + sx*(double)kx - x0) / (x1 - x0) : INFINITY;
+                double ty = y1 != y0 ? (yi + sy*(double)ky - y0) / (y1 - y0) : INFINITY;
+                double t  = fmin(tx, ty);
+                if(t >= 1.0)
+                    break;
+
+                // Crossing a row and a column at the same time is one sample
+                emit_extremum(t_last, t);
+                emit(v, t, D + t*L);
+                t_last = t;
+                if(tx == t) kx++;
+                if(ty == t) ky++;
+            }
+            emit_extremum(t_last, 1.0);
+        }
+
+        D += L;
+    }
+
+    // The end of the path. emit() interpolates from vertex v to v+1, so I
+    // report the last vertex as t=1 of the last segment
+    if(Nvertices == 1)
+    {
+        if(distance   != NULL) distance  [N] = 0.0f;
+        if(sample_lat != NULL) sample_lat[N] = lat[0];
+        if(sample_lon != NULL) sample_lon[N] = lon[0];
+        N++;
+    }
+    else if(N == 0 || s_last < D)
+        emit(Nvertices-2, 1.0, D);
+
+    return N;
+}
+
+int horizonator_profile_Nsamples( const horizonator_dem_context_t* dems,
+                                  const float* lat, const float* lon,
+                                  int Nvertices,
+                                  float spacing )
+{
+    if(Nvertices < 1)
+    {
+        MSG("The path needs at least one vertex");
+        return -1;
+    }
+    // A NaN vertex would make the native-resolution walk never end
+    for(int v=0; v<Nvertices; v++)
+        if( !isfinite(lat[v]) || !isfinite(lon[v]) )
+        {
+            MSG("Path vertex %d is not finite", v);
+            return -1;
+        }
+    return profile_points(NULL, NULL, NULL,
+                          dems, lat, lon, Nvertices, spacing);
+}
+
+bool horizonator_profile( // output
+                          float*   distance,
+                          float*   sample_lat,
+                          float*   sample_lon,
+                          float*   elevation,
+                          uint8_t* visible,
+                          float*   clearance,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          const float* lat, const float* lon,
+                          int Nvertices,
+                          float spacing,
+                          float observer_height,
+                          float target_height,
+                          float refraction_coeff)
+{
+    int N = horizonator_profile_Nsamples(dems, lat, lon, Nvertices, spacing);
+    if(N < 0)
+        return false;
+
+    bool result = false;
+
+    // I need the sample coordinates for the elevation and the line of sight,
+    // even if the caller doesn't want them. And the line-of-sight queries
+    // need the start point and the heights for each sample
+    float* buffer     = malloc(6*(size_t)N*sizeof(float));
+    if(buffer == NULL)
+    {
+        MSG("malloc() failed");
+        return false;
+    }
+    float* lat_sample = sample_lat != NULL ? sample_lat : &buffer[0*N];
+    float* lon_sample = sample_lon != NULL ? sample_lon : &buffer[1*N];
+    float* lat_start  = &buffer[2*N];
+    float* lon_start  = &buffer[3*N];
+    float* h_start    = &buffer[4*N];
+    float* h_sample   = &buffer[5*N];
+
+    profile_points(distance, lat_sample, lon_sample,
+                   dems, lat, lon, Nvertices, spacing);
+
+    if(elevation != NULL)
+        horizonator_dem_interp_many(elevation, dems, lat_sample, lon_sample, N);
+
+    if(visible != NULL || clearance != NULL)
+    {
+        for(int i=0; i<N; i++)
+        {
+            lat_start[i] = lat[0];
+            lon_start[i] = lon[0];
+            h_start  [i] = observer_height;
+            h_sample [i] = target_height;
+        }
+
+        if( !horizonator_los_batch(visible, clearance, NULL, NULL,
+                                   dems,
+                                   lat_start,  lon_start,  h_start,
+                                   lat_sample, lon_sample, h_sample,
+                                   N, refraction_coeff, 0) )
+            goto done;
+    }
+
+    result = true;
+
+ done:
+    free(buffer);
+    return result;
+}
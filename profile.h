@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Terrain profile along a polyline, such as a GPX track. The polyline is
+// given by its Nvertices vertices, in degrees, and is sampled either
+//
+// - at a fixed spacing: every "spacing" meters of distance along the path, and
+//   at its end
+//
+// - at the DEM's native resolution, if spacing <= 0: at every vertex,
+//   everywhere the path crosses a mosaic row or column, and at the highest or
+//   lowest point inside each cell. Inside a cell the bilinearly-interpolated
+//   terrain is quadratic along the path, so linear interpolation between these
+//   points follows each rise and dip of the profile, if not its exact shape
+//
+// Distances along the path are horizontal, in meters, with each segment
+// treated as a straight line on the local tangent plane.
+//
+// For each sample we report
+//
+// - the distance along the path from its start
+// - the lat/lon of the sample
+// - the terrain elevation, interpolated bilinearly, as in
+//   horizonator_dem_interp_many()
+// - whether the sample is visible from the start of the path, and the
+//   clearance of that line of sight, in meters, as in horizonator_los_batch().
+//   The observer stands observer_height above the start of the path, and
+//   looks at a point target_height above each sample. This is the straight
+//   line of sight, not the path
+//
+// Samples outside the mosaic get NAN elevation, and are not visible. All the
+// vertices must be finite.
+//
+// The number of samples is given by horizonator_profile_Nsamples(), and the
+// output arrays must have room for that many.
+//
+// Returns true on success
+bool horizonator_profile( // output
+                          // Each is an array of
+                          // horizonator_profile_Nsamples() values. Any may be
+                          // NULL
+                          float*   distance,
+                          float*   sample_lat,
+                          float*   sample_lon,
+                          float*   elevation,
+                          uint8_t* visible,
+                          float*   clearance,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          const float* lat, const float* lon,
+                          int Nvertices,
+                          float spacing,
+                          float observer_height,
+                          float target_height,
+                          float refraction_coeff);
+
+// Returns how many samples horizonator_profile() will produce for this
+// polyline, or -1 on error
+int horizonator_profile_Nsamples( const horizonator_dem_context_t* dems,
+                                  const float* lat, const float* lon,
+                                  int Nvertices,
+                                  float spacing );
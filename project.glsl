@@ -0,0 +1,96 @@
+/* -*- c -*- */
+
+#version 420
+
+layout (location = 0) in vec3 vertex;
+
+// The view parameters. These change at runtime, and live in a uniform buffer
+// that the CPU code uploads. The layout must match horizonator_context_t.view
+layout(std140, binding = 0) uniform view_t
+{
+    float aspect;
+    float az_deg0, az_deg1;
+    float viewer_cell_i, viewer_cell_j;
+    float viewer_z;
+    float viewer_lat;
+    float cos_viewer_lat;
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    float znear, zfar;
+    float znear_color, zfar_color;
+    float viewport_width, viewport_height;
+};
+
+// Set once, in horizonator_init()
+uniform float DEG_PER_CELL;
+
+// The position of this vertex, as seen from the viewer: (azimuth, elevation,
+// horizontal distance). The angles are in radians, the distance in meters. The
+// azimuth is clockwise from North, in [-pi,pi]. This is captured with
+// transform feedback whenever the viewer moves, and vertex.glsl uses it for
+// all the renders from that spot
+out vec3 polar;
+
+const float Rearth = 6371000.0;
+const float pi     = 3.14159265358979;
+
+void main(void)
+{
+    /*
+      I do this in the tangent plane, ignoring the spherical (and even
+      ellipsoidal) nature of the Earth. It is close-enough. Python script to
+      confirm:
+
+        import numpy as np
+
+        d = 20000.
+
+        th = d/Rearth
+        s  = np.sin(th)
+        c  = np.cos(th)
+
+        x_plane  = np.array((d,Rearth))
+        x_sphere = np.array((s,c))*Rearth
+
+        print(x_plane - x_sphere)
+
+      says: [ 0.03284909 31.39222034]. So at 20km out, this planar assumption
+      produces 30m of error, primarily in the vertical direction. This
+      admittedly is 1.5mrad. Which is marginally too much. But 20km is quite a
+      lot. At 10km the error is 7.8m, which is 0.78mrad. I should do something
+      better, but in the near-term this is more than good-enough.
+     */
+
+    // Several different paths exist for the data processing, with different
+    // amounts of the math done in the CPU or GPU. The corresponding path must
+    // be selected in the CPU code in horizonator_init()
+    if(false)
+    {
+        // The CPU computed az/pi, el/pi, distance
+        polar = vec3(vertex.x * pi, vertex.y * pi, vertex.z);
+    }
+    else if(false)
+    {
+        // The CPU computed (e,n,height) relative to the viewer
+        float distance_ne = length(vertex.xy);
+        polar = vec3(atan(vertex.x, vertex.y),
+                     atan(vertex.z, distance_ne),
+                     distance_ne);
+    }
+    else
+    {
+        float i = vertex.x;
+        float j = vertex.y;
+
+        vec2 en =
+            vec2( (i - viewer_cell_i) * DEG_PER_CELL * Rearth * pi/180. * cos_viewer_lat,
+                  (j - viewer_cell_j) * DEG_PER_CELL * Rearth * pi/180. );
+
+        // az = 0:     North
+        // az = 90deg: East
+        float distance_ne = length(en);
+        polar = vec3(atan(en.x, en.y),
+                     atan(vertex.z - viewer_z, distance_ne),
+                     distance_ne);
+    }
+}
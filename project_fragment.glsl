@@ -0,0 +1,13 @@
+/* -*- c -*- */
+
+#version 420
+
+// The fragment stage of the projection program. That program runs with
+// GL_RASTERIZER_DISCARD, so this never runs. But a draw into a framebuffer with
+// an integer color attachment (the cell-ID buffer of
+// horizonator_render_offscreen()) must have a fragment shader, even if nothing
+// is rasterized: without one, the projection fails with GL_INVALID_OPERATION
+// once geolocation has been requested
+void main(void)
+{
+}
@@ -0,0 +1,353 @@
+#include <tgmath.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "raycast.h"
+#include "util.h"
+
+// Each task is this many rays
+#define RAYS_PER_TASK 256
+
+// When a ray crosses into a new node, I look up the node at this distance (in
+// meters) past the boundary, to pick the node the ray is entering, rather than
+// the one it is leaving
+#define S_EPS 1e-4
+
+typedef struct
+{
+    float* lat;
+    float* lon;
+    float* range;
+
+    const horizonator_dem_context_t* dems;
+    const float *lat0, *lon0, *height0;
+    const float *azimuth, *elevation;
+    int N;
+
+    // The origin DEM, and the cell in it at the SW corner of the mosaic
+    double lon_origin, lat_origin;
+    double i_origin,   j_origin;
+    // Meters per cell, North
+    double dn;
+    // The Earth curves down by s^2 * curvature at a distance s
+    double curvature;
+
+    int next_task;
+} raycast_shared_t;
+
+// One ray. x,y are in mosaic cells, z in meters. At the horizontal distance s
+// (in meters) from the start, the ray is at
+//
+//   x = x0 + s*dx
+//   y = y0 + s*dy
+//   z = z0 + s*slope - s^2*curvature
+typedef struct
+{
+    double x0, y0, z0;
+    double dx, dy;
+    double slope, curvature;
+} ray_t;
+
+static double ray_z(const ray_t* r, double s)
+{
+    return r->z0 + s*(r->slope - s*r->curvature);
+}
+
+// The lowest point of the ray in [s0,s1]. Usually the curvature is positive,
+// the ray is concave, and the lowest point is at one of the ends. With
+// refraction_coeff > 1 the ray is convex, and the lowest point may be inside
+// the interval
+static double ray_zmin(const ray_t* r, double s0, double s1)
+{
+    double z = fmin(ray_z(r, s0), ray_z(r, s1));
+    if(r->curvature < 0.0)
+    {
+        double s = r->slope / (2.0*r->curvature);
+        if(s > s0 && s < s1)
+            z = fmin(z, ray_z(r, s));
+    }
+    return z;
+}
+
+// The terrain in cell (i,j), at (u,v) from its SW corner. The cell is split
+// into two triangles along the SW-NE diagonal, like in the renderer:
+// (i,j),(i+1,j),(i+1,j+1) to the SE of the diagonal (u >= v) and
+// (i,j),(i+1,j+1),(i,j+1) to the NW
+static double cell_z(const horizonator_dem_context_t* dems,
+                     int i, int j, bool se, double u, double v)
+{
+    double z00 = horizonator_dem_mosaic_at(dems, i,   j  );
+    double z11 = horizonator_dem_mosaic_at(dems, i+1, j+1);
+    if(se)
+    {
+        double z10 = horizonator_dem_mosaic_at(dems, i+1, j);
+        return z00 + u*(z10-z00) + v*(z11-z10);
+    }
+    double z01 = horizonator_dem_mosaic_at(dems, i, j+1);
+    return z00 + v*(z01-z00) + u*(z11-z01);
+}
+
+static double terrain_z(const horizonator_dem_context_t* dems,
+                        double x, double y)
+{
+    const int W = horizonator_dem_mosaic_width(dems);
+
+    int i = (int)x;
+    int j = (int)y;
+    i = i < 0 ? 0 : (i > W-2 ? W-2 : i);
+    j = j < 0 ? 0 : (j > W-2 ? W-2 : j);
+    double u = x - (double)i;
+    double v = y - (double)j;
+    return cell_z(dems, i, j, u >= v, u, v);
+}
+
+// Returns the distance to the first hit of the ray with the terrain in cell
+// (i,j), within [s0,s1], or -1 if there isn't one. Over one cell the ray is
+// straight to within a fraction of a millimeter, so I intersect the line
+// through its ends with each of the two triangles it passes over
+static double hit_cell(const horizonator_dem_context_t* dems,
+                       const ray_t* r,
+                       int i, int j,
+                       double s0, double s1)
+{
+    // The ray crosses the diagonal where u-v = 0
+    double d0 = (r->x0 + s0*r->dx - (double)i) - (r->y0 + s0*r->dy - (double)j);
+    double dd = r->dx - r->dy;
+
+    double s[3] = {s0, s1, s1};
+    int    Nsegments = 1;
+    if(dd != 0.0)
+    {
+        double s_diagonal = s0 - d0/dd;
+        if(s_diagonal > s0 && s_diagonal < s1)
+        {
+            s[1]      = s_diagonal;
+            Nsegments = 2;
+        }
+    }
+
+    for(int k=0; k<Nsegments; k++)
+    {
+        double a = s[k];
+        double b = s[k+1];
+
+        double sm = (a+b) / 2.0;
+        bool   se =
+            r->x0 + sm*r->dx - (double)i >=
+            r->y0 + sm*r->dy - (double)j;
+
+        // The height of the ray above the terrain at each end of the segment
+        double fa = ray_z(r, a) - cell_z(dems, i, j, se,
+                                         r->x0 + a*r->dx - (double)i,
+                                         r->y0 + a*r->dy - (double)j);
+        double fb = ray_z(r, b) - cell_z(dems, i, j, se,
+                                         r->x0 + b*r->dx - (double)i,
+                                         r->y0 + b*r->dy - (double)j);
+        // A ray that starts right on the ground, and heads up, doesn't hit it
+        if(fa < 0.0)
+            return a;
+        if(fb < 0.0 || (fb == 0.0 && fa > 0.0))
+            return a + (b-a) * fa/(fa-fb);
+    }
+    return -1.0;
+}
+
+// Returns the distance to the first hit of the ray with the terrain, or -1 if
+// it leaves the mosaic without hitting anything. I walk the pyramid from the
+// top. A node is skipped if the lowest point of the ray over it is above its
+// highest point, and I then look at the next node along the ray one level up.
+// Otherwise I descend into the node. At level 0 each node is one cell, and I
+// intersect the ray with its triangles
+static double raycast_one(const horizonator_dem_context_t* dems, const ray_t* r)
+{
+    const horizonator_dem_pyramid_t* p = &dems->pyramid;
+    const int    W      = horizonator_dem_mosaic_width(dems);
+    const double xy_max = (double)(W-1);
+
+    int    L = p->Nlevels-1;
+    double s = 0.0;
+
+    while(true)
+    {
+        double x = r->x0 + (s + S_EPS)*r->dx;
+        double y = r->y0 + (s + S_EPS)*r->dy;
+        if( !(x >= 0.0 && x <= xy_max &&
+              y >= 0.0 && y <= xy_max) )
+            return -1.0;
+
+        // The cell, and the node at this level that contains it
+        int i  = (int)x < W-2 ? (int)x : W-2;
+        int j  = (int)y < W-2 ? (int)y : W-2;
+        int ni = i >> L;
+        int nj = j >> L;
+
+        double x_lo = (double)(ni << L);
+        double y_lo = (double)(nj << L);
+        double x_hi = fmin((double)((ni+1) << L), xy_max);
+        double y_hi = fmin((double)((nj+1) << L), xy_max);
+
+        double s_exit = INFINITY;
+        if     (r->dx > 0.0) s_exit = fmin(s_exit, (x_hi - r->x0) / r->dx);
+        else if(r->dx < 0.0) s_exit = fmin(s_exit, (x_lo - r->x0) / r->dx);
+        if     (r->dy > 0.0) s_exit = fmin(s_exit, (y_hi - r->y0) / r->dy);
+        else if(r->dy < 0.0) s_exit = fmin(s_exit, (y_lo - r->y0) / r->dy);
+
+        double zmax = (double)p->levels[L][(size_t)nj*(size_t)p->widths[L] + (size_t)ni];
+        if(ray_zmin(r, s, s_exit) > zmax)
+        {
+            s = s_exit;
+            if(L < p->Nlevels-1)
+                L++;
+            continue;
+        }
+
+        if(L > 0)
+        {
+            L--;
+            continue;
+        }
+
+        double s_hit = hit_cell(dems, r, i, j, s, s_exit);
+        if(s_hit >= 0.0)
+            return s_hit;
+
+        s = s_exit;
+        if(L < p->Nlevels-1)
+            L++;
+    }
+}
+
+static void* raycast_worker(void* cookie)
+{
+    raycast_shared_t* s = (raycast_shared_t*)cookie;
+
+    const int W      = horizonator_dem_mosaic_width(s->dems);
+    const int Ntasks = (s->N + RAYS_PER_TASK-1) / RAYS_PER_TASK;
+
+    while(true)
+    {
+        int task = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED);
+        if(task >= Ntasks)
+            break;
+
+        for(int k = task*RAYS_PER_TASK;
+            k < (task+1)*RAYS_PER_TASK && k < s->N;
+            k++)
+        {
+            double x0 = ((double)s->lon0[k] - s->lon_origin) * s->dems->cells_per_deg - s->i_origin;
+            double y0 = ((double)s->lat0[k] - s->lat_origin) * s->dems->cells_per_deg - s->j_origin;
+
+            double s_hit = -1.0;
+            ray_t  r     = {};
+            if( x0 >= 0.0 && x0 <= (double)(W-1) &&
+                y0 >= 0.0 && y0 <= (double)(W-1) )
+            {
+                double de = s->dn * cos((double)s->lat0[k] * M_PI/180.0);
+                double az = (double)s->azimuth  [k] * M_PI/180.0;
+                double el = (double)s->elevation[k] * M_PI/180.0;
+
+                r = (ray_t){ .x0        = x0,
+                             .y0        = y0,
+                             .z0        = terrain_z(s->dems, x0, y0) + (double)s->height0[k],
+                             .dx        = sin(az) / de,
+                             .dy        = cos(az) / s->dn,
+                             .slope     = tan(el),
+                             .curvature = s->curvature };
+                s_hit = raycast_one(s->dems, &r);
+            }
+
+            bool hit = s_hit >= 0.0;
+            if(s->lat != NULL)
+                s->lat[k] = hit ?
+                    (float)(s->lat_origin + (s->j_origin + r.y0 + s_hit*r.dy) / s->dems->cells_per_deg) :
+                    NAN;
+            if(s->lon != NULL)
+                s->lon[k] = hit ?
+                    (float)(s->lon_origin + (s->i_origin + r.x0 + s_hit*r.dx) / s->dems->cells_per_deg) :
+                    NAN;
+            if(s->range != NULL)
+                s->range[k] = hit ? (float)s_hit : NAN;
+        }
+    }
+    return NULL;
+}
+
+bool horizonator_raycast( // output
+                          float* lat,
+                          float* lon,
+                          float* range,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          const float* lat0, const float* lon0, const float* height0,
+                          const float* azimuth, const float* elevation,
+                          int N,
+                          float refraction_coeff,
+                          int Nthreads)
+{
+    const double Rearth = 6371000.0;
+
+    if(N <= 0)
+        return true;
+    if(dems->pyramid.data == NULL)
+    {
+        MSG("The DEM pyramid hasn't been built. Call horizonator_dem_pyramid_init() first");
+        return false;
+    }
+
+    bool result = false;
+
+    raycast_shared_t shared =
+        { .lat        = lat,
+          .lon        = lon,
+          .range      = range,
+          .dems       = dems,
+          .lat0       = lat0,
+          .lon0       = lon0,
+          .height0    = height0,
+          .azimuth    = azimuth,
+          .elevation  = elevation,
+          .N          = N,
+          .lon_origin = (double)dems->origin_dem_lon_lat[0],
+          .lat_origin = (double)dems->origin_dem_lon_lat[1],
+          .i_origin   = (double)dems->origin_dem_cellij[0],
+          .j_origin   = (double)dems->origin_dem_cellij[1],
+          .dn         = Rearth * M_PI / 180.0 / (double)dems->cells_per_deg,
+          .curvature  = (1.0 - (double)refraction_coeff) / (2.0 * Rearth) };
+
+    pthread_t* threads = NULL;
+    bool*      started = NULL;
+
+    if(Nthreads <= 0)
+    {
+        long Ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Nthreads = Ncpus > 0 ? (int)Ncpus : 1;
+    }
+    threads = calloc(Nthreads, sizeof(threads[0]));
+    started = calloc(Nthreads, sizeof(started[0]));
+    if(threads == NULL || started == NULL)
+    {
+        MSG("calloc() failed");
+        goto done;
+    }
+
+    // This thread is one of the workers. If any other worker can't be
+    // started, the others simply do its share
+    for(int i=1; i<Nthreads; i++)
+        if(0 == pthread_create(&threads[i], NULL, raycast_worker, &shared))
+            started[i] = true;
+    raycast_worker(&shared);
+    for(int i=1; i<Nthreads; i++)
+        if(started[i])
+            pthread_join(threads[i], NULL);
+
+    result = true;
+
+ done:
+    free(threads);
+    free(started);
+    return result;
+}
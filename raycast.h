@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Finds where each of N rays first hits the terrain of the DEM mosaic. Each ray
+// starts at the given lat/lon, at the given height above the ground, and
+// heads out at the given azimuth (degrees clockwise from North) and elevation
+// (degrees above the horizontal).
+//
+// The terrain is the same triangulated surface the renderer draws: each cell
+// is split into two triangles along its SW-NE diagonal. The curvature of the
+// Earth is taken into account, with the given refraction coefficient, as in
+// horizonator_viewshed().
+//
+// The rays are traced through the max-elevation pyramid of the mosaic, which
+// must have been built with horizonator_dem_pyramid_init() first. A ray skips
+// any pyramid node whose highest point is below the ray over the whole node,
+// and only descends into the nodes it could hit. So long rays over empty space
+// (over low terrain, or pointing up) cost O(log(range)) steps, instead of one
+// step per cell. The rays are spread over Nthreads threads (one per CPU if
+// Nthreads <= 0).
+//
+// For each ray we report the lat/lon of the hit, and its range: the horizontal
+// distance from the start of the ray, in meters. Rays that leave the mosaic
+// without hitting anything (and rays that start outside it) get NAN in all 3
+// outputs.
+//
+// Returns true on success
+bool horizonator_raycast( // output
+                          // Each is an array of N values. Any may be NULL
+                          float* lat,
+                          float* lon,
+                          float* range,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          // Each is an array of N values. The heights are in
+                          // meters above the ground. The angles are in degrees
+                          const float* lat0, const float* lon0, const float* height0,
+                          const float* azimuth, const float* elevation,
+                          int N,
+                          float refraction_coeff,
+                          int Nthreads);
@@ -12,6 +12,7 @@ Source0:        https://www.github.com/dkogan/horizonator/archive/%{version}.tar
 BuildRequires:  libepoxy-devel
 BuildRequires:  freeglut-devel
 BuildRequires:  freeimage-devel
+BuildRequires:  zlib-devel
 BuildRequires:  tinyxml-devel
 BuildRequires:  libpng-devel
 BuildRequires:  libcurl-devel
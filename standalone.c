@@ -15,6 +15,7 @@ int main(int argc, char* argv[])
         "%s [--width WIDTH_PIXELS] [--height HEIGHT_PIXELS]\n"
         "   [--image OUT.png] [--ranges RANGES.DAT]\n"
         "   [--radius RENDER_RADIUS_CELLS]\n"
+        "   [--mesh-tolerance METERS]\n"
         "   [--texture]\n"
         "   [--allow-tile-downloads]\n"
         "   [--znear       ZNEAR]\n"
@@ -22,6 +23,7 @@ int main(int argc, char* argv[])
         "   [--znear-color ZNEARCOLOR]\n"
         "   [--zfar-color  ZFARCOLOR]\n"
         "   [--dirdems DIRECTORY]\n"
+        "   [--dirdems-near DIRECTORY [--radius-near NEAR_RADIUS_CELLS]]\n"
         "   [--dirtiles DIRECTORY]\n"
         "   LAT LON AZ_DEG0 AZ_DEG1\n"
         "\n"
@@ -34,6 +36,11 @@ int main(int argc, char* argv[])
         "I load RENDER_RADIUS_CELLS of the DEM in each direction off the center\n"
         "point. If --radius is omitted, a reasonable default is chosen\n"
         "\n"
+        "If --mesh-tolerance is given, the terrain is drawn from a mesh simplified\n"
+        "to within this many meters of vertical error, instead of the full DEM\n"
+        "grid. This is much faster for large --radius. The mesh is cached in\n"
+        "~/.horizonator/meshes\n"
+        "\n"
         "When plotting to a window, AZ_DEG are the azimuth bounds of the\n"
         "VIEWPORT. When rendering to an image, AZ_DEG are the\n"
         "centers of the first and last pixels. This is slightly smaller\n"
@@ -44,13 +51,25 @@ int main(int argc, char* argv[])
         "not be rendered. The color-coding extents are given by --zmin-color and\n"
         "--zmax-color. Anything at or closer than --zmin-color will be rendered\n"
         "as black, and anything at or further than --zmax-color will be rendered\n"
-        "as red. All 4 of these have reasonable defaults, and may be omitted\n"
+        "as red. All 4 of these have reasonable defaults, and may be omitted.\n"
+        "If --zfar is given, only the terrain within that distance of the viewer\n"
+        "is loaded and meshed, instead of the whole RENDER_RADIUS_CELLS square\n"
         "\n"
         "By default we colorcode the renders by range. If --texture, we\n"
         "use a set of image tiles to texture the render instead\n"
         "\n"
         "The DEMs are in the directory given by --dirdems, or in\n"
-        "~/.horizonator/DEMs_SRTM3/ if omitted.\n"
+        "~/.horizonator/DEMs_SRTM3/ if omitted. --dirdems may also be a DEM\n"
+        "pack file, made by horizonator-pack, or a GeoTIFF in lat/lon coordinates.\n"
+        "The resolution of the DEMs (3sec or 1sec SRTM, or others) comes from the\n"
+        "files. --radius is in the cells of that resolution\n"
+        "\n"
+        "If --dirdems-near is given, the terrain within NEAR_RADIUS_CELLS of the\n"
+        "viewer is drawn from the DEMs there instead: a higher-resolution dataset,\n"
+        "such as 1sec SRTM. Its resolution must be a multiple of the resolution\n"
+        "of --dirdems. NEAR_RADIUS_CELLS is in the cells of that resolution. It\n"
+        "is rounded down to whole chunks of the far field. Can't be used with\n"
+        "--mesh-tolerance\n"
         "\n"
         "The tiles are in the directory given by --dirtiles, or in\n"
         "~/.horizonator/tiles if omitted.\n";
@@ -60,8 +79,11 @@ int main(int argc, char* argv[])
         { "height",            required_argument, NULL, 'H' },
         { "image",             required_argument, NULL, 'i' },
         { "radius",            required_argument, NULL, 'R' },
+        { "mesh-tolerance",    required_argument, NULL, 'm' },
         { "ranges",            required_argument, NULL, 'r' },
         { "dirdems",           required_argument, NULL, 'd' },
+        { "dirdems-near",      required_argument, NULL, 'D' },
+        { "radius-near",       required_argument, NULL, 'N' },
         { "dirtiles",          required_argument, NULL, 't' },
         { "texture",           no_argument,       NULL, 'T' },
         { "allow-tile-downloads",no_argument,     NULL, 'a' },
@@ -78,10 +100,13 @@ int main(int argc, char* argv[])
     const char* filename_image  = NULL;
     const char* filename_ranges = NULL;
     const char* dir_dems        = NULL;
+    const char* dir_dems_near   = NULL;
     const char* dir_tiles       = NULL;
     bool        render_texture  = false;
     bool        allow_downloads = false;
     int         render_radius_cells = 1000;
+    float       mesh_tolerance  = 0.0f;
+    int         near_radius_cells = 1000;
 
     float znear       = -1.0f;
     float zfar        = -1.0f;
@@ -129,6 +154,24 @@ int main(int argc, char* argv[])
             }
             break;
 
+        case 'N':
+            near_radius_cells = atoi(optarg);
+            if(near_radius_cells <= 0)
+            {
+                fprintf(stderr, "--radius-near must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'm':
+            mesh_tolerance = (float)atof(optarg);
+            if(mesh_tolerance <= 0.0f)
+            {
+                fprintf(stderr, "--mesh-tolerance must have an float argument > 0\n");
+                return 1;
+            }
+            break;
+
         case '1':
             znear = (float)atof(optarg);
             if(znear <= 0.0f)
@@ -174,6 +217,10 @@ int main(int argc, char* argv[])
             dir_dems = optarg;
             break;
 
+        case 'D':
+            dir_dems_near = optarg;
+            break;
+
         case 't':
             dir_tiles = optarg;
             break;
@@ -260,8 +307,11 @@ int main(int argc, char* argv[])
         horizonator_allinone_glut_loop(render_texture,
                                        lat, lon, az_deg0, az_deg1,
                                        render_radius_cells,
+                                       mesh_tolerance,
                                        znear,zfar,znear_color,zfar_color,
-                                       dir_dems, dir_tiles,
+                                       dir_dems,
+                                       dir_dems_near, near_radius_cells,
+                                       dir_tiles,
                                        allow_downloads);
         return 0;
     }
@@ -310,9 +360,13 @@ int main(int argc, char* argv[])
                            lat, lon,
                            width, height,
                            render_radius_cells,
+                           // Only the terrain within zfar is ever drawn
+                           zfar,
+                           mesh_tolerance,
                            true,
                            render_texture,
                            dir_dems,
+                           dir_dems_near, near_radius_cells,
                            dir_tiles,
                            allow_downloads) )
     {
@@ -330,7 +384,7 @@ int main(int argc, char* argv[])
         return false;
     }
 
-    if(!horizonator_render_offscreen(&ctx, image, ranges))
+    if(!horizonator_render_offscreen(&ctx, image, ranges, NULL))
     {
         fprintf(stderr, "render failed\n");
         return 1;
@@ -0,0 +1,410 @@
+#include <tgmath.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "viewshed.h"
+#include "bench.h"
+#include "util.h"
+
+// The sweep is done separately in each octant around the observer. In each
+// octant, u is the distance from the observer along the major axis (u >= 1),
+// and v is the distance along the minor axis (0 <= v <= u). Ring u depends
+// only on ring u-1 of the same octant, so the octants are independent, and
+// each only needs 2 rings of scratch space.
+//
+// Cells on the octant boundaries (the axes and the diagonals) are swept by 2
+// octants, which compute identical results. Only one of them writes the
+// output: the axes (v == 0) are written by the octants with a positive minor
+// direction, and the diagonals (v == u) by the octants with a major x axis
+typedef struct
+{
+    const horizonator_dem_context_t* dems;
+    uint8_t*  visible;
+    float*    clearance;
+    // For cumulative viewsheds: incremented for each visible cell
+    uint32_t* counts;
+
+    // The observer cell, and the elevation of the observer
+    int   oi, oj;
+    float z_observer;
+    float target_height;
+
+    // Cell size, in meters, East and North
+    float de, dn;
+    // The curvature drop is d^2 * curvature
+    float curvature;
+
+    bool major_x;
+    // Directions of the major and minor axes: +1 or -1
+    int  sm, sn;
+
+    bool ok;
+} octant_t;
+
+static void octant_init(// output
+                        octant_t* o,
+
+                        // input
+                        int k, // which octant: 0..7
+                        const horizonator_dem_context_t* dems,
+                        int oi, int oj,
+                        float viewer_lat,
+                        float observer_height,
+                        float target_height,
+                        float refraction_coeff)
+{
+    const float Rearth = 6371000.0;
+    const float dn = Rearth * (float)M_PI / 180.0f / (float)dems->cells_per_deg;
+
+    *o = (octant_t)
+        { .dems          = dems,
+          .oi            = oi,
+          .oj            = oj,
+          .z_observer    = (float)horizonator_dem_mosaic_at(dems, oi, oj) + observer_height,
+          .target_height = target_height,
+          .de            = dn * cosf(viewer_lat * (float)M_PI / 180.0f),
+          .dn            = dn,
+          .curvature     = (1.0f - refraction_coeff) / (2.0f * Rearth),
+          .major_x       = (k & 1) != 0,
+          .sm            = (k & 2) ? 1 : -1,
+          .sn            = (k & 4) ? 1 : -1 };
+}
+
+// The observer sits at the nearest DEM sample. Returns false if it is outside
+// the mosaic
+static bool observer_cell(// output
+                          int* oi, int* oj,
+
+                          // input
+                          const horizonator_dem_context_t* dems,
+                          float viewer_lat, float viewer_lon)
+{
+    const int W = horizonator_dem_mosaic_width(dems);
+
+    float viewer_cell_i =
+        (viewer_lon - dems->origin_dem_lon_lat[0]) * dems->cells_per_deg -
+        dems->origin_dem_cellij[0];
+    float viewer_cell_j =
+        (viewer_lat - dems->origin_dem_lon_lat[1]) * dems->cells_per_deg -
+        dems->origin_dem_cellij[1];
+    *oi = (int)roundf(viewer_cell_i);
+    *oj = (int)roundf(viewer_cell_j);
+    return *oi >= 0 && *oi < W && *oj >= 0 && *oj < W;
+}
+
+// Sweeps one octant. scratch must have room for 2*(W+1) floats, where W is the
+// mosaic width
+static void sweep_octant(const octant_t* o, float* scratch)
+{
+    const int W = horizonator_dem_mosaic_width(o->dems);
+
+    const int o_major = o->major_x ? o->oi : o->oj;
+    const int o_minor = o->major_x ? o->oj : o->oi;
+    const int umax    = o->sm > 0 ? W-1 - o_major : o_major;
+    const int vmax    = o->sn > 0 ? W-1 - o_minor : o_minor;
+
+    const float d_major = o->major_x ? o->de : o->dn;
+    const float d_minor = o->major_x ? o->dn : o->de;
+
+    // The horizon (the highest tangent of the elevation angle) seen along
+    // each line of sight, up to and including each cell of the previous and
+    // current rings
+    float* prev = scratch;
+    float* cur  = &scratch[W+1];
+
+    // ring 0 is the observer: nothing is in the way
+    prev[0] = -INFINITY;
+
+    for(int u=1; u<=umax; u++)
+    {
+        const int vlast = u < vmax ? u : vmax;
+        for(int v=0; v<=vlast; v++)
+        {
+            // The line of sight to this cell crosses the previous ring at
+            // minor coordinate vp. I interpolate the horizon there
+            float vp = (float)v * (float)(u-1) / (float)u;
+            int   v0 = (int)vp;
+            float f  = vp - (float)v0;
+            float horizon =
+                f == 0.0f ?
+                prev[v0] :
+                prev[v0]*(1.0f - f) + prev[v0+1]*f;
+
+            int i, j;
+            if(o->major_x) { i = o->oi + o->sm*u; j = o->oj + o->sn*v; }
+            else           { i = o->oi + o->sn*v; j = o->oj + o->sm*u; }
+
+            float d    = hypotf((float)u*d_major, (float)v*d_minor);
+            float z    = (float)horizonator_dem_mosaic_at(o->dems, i, j) -
+                         d*d*o->curvature - o->z_observer;
+            float tan_terrain = z / d;
+            float tan_target  = (z + o->target_height) / d;
+
+            cur[v] = tan_terrain > horizon ? tan_terrain : horizon;
+
+            bool owned =
+                (v != 0 || o->sn > 0) &&
+                (v != u || o->major_x);
+            if(owned)
+            {
+                size_t p = (size_t)j*(size_t)W + (size_t)i;
+                if(o->visible != NULL)
+                    o->visible[p] = tan_target >= horizon;
+                if(o->clearance != NULL)
+                    o->clearance[p] = atanf(tan_target) - atanf(horizon);
+                if(o->counts != NULL)
+                    o->counts[p] += tan_target >= horizon;
+            }
+        }
+
+        float* t = prev;
+        prev = cur;
+        cur  = t;
+    }
+}
+
+static void* sweep_octant_thread(void* cookie)
+{
+    octant_t* o = (octant_t*)cookie;
+
+    const int W = horizonator_dem_mosaic_width(o->dems);
+    float* scratch = malloc(2*(size_t)(W+1)*sizeof(float));
+    if(scratch == NULL)
+    {
+        MSG("malloc() failed");
+        o->ok = false;
+        return NULL;
+    }
+    sweep_octant(o, scratch);
+    free(scratch);
+    o->ok = true;
+    return NULL;
+}
+
+bool horizonator_viewshed( // output
+                           // Either may be NULL
+                           uint8_t* visible,
+                           float*   clearance,
+
+                           // input
+                           const horizonator_dem_context_t* dems,
+                           float viewer_lat, float viewer_lon,
+                           float observer_height,
+                           float target_height,
+                           float refraction_coeff)
+{
+    const int W = horizonator_dem_mosaic_width(dems);
+
+    int oi, oj;
+    if(!observer_cell(&oi, &oj, dems, viewer_lat, viewer_lon))
+    {
+        MSG("The viewer at lat,lon = %f,%f is outside the loaded DEMs",
+            viewer_lat, viewer_lon);
+        return false;
+    }
+
+    octant_t  octants[8];
+    pthread_t threads[8];
+    bool      thread_started[8] = {};
+
+    for(int k=0; k<8; k++)
+    {
+        octant_init(&octants[k], k, dems, oi, oj,
+                    viewer_lat, observer_height, target_height, refraction_coeff);
+        octants[k].visible   = visible;
+        octants[k].clearance = clearance;
+
+        // If I can't start a thread, I do that octant here, serially
+        if(0 == pthread_create(&threads[k], NULL, sweep_octant_thread, &octants[k]))
+            thread_started[k] = true;
+        else
+            sweep_octant_thread(&octants[k]);
+    }
+
+    bool result = true;
+    for(int k=0; k<8; k++)
+    {
+        if(thread_started[k])
+            pthread_join(threads[k], NULL);
+        if(!octants[k].ok)
+            result = false;
+    }
+
+    size_t p = (size_t)oj*(size_t)W + (size_t)oi;
+    if(visible   != NULL) visible  [p] = 1;
+    if(clearance != NULL) clearance[p] = (float)M_PI / 2.0f;
+
+    return result;
+}
+
+// The state shared by the workers of horizonator_viewshed_cumulative(). Each
+// task is one octant of one observer. The workers take tasks in order, by
+// atomically incrementing next_task, so a worker that gets quick tasks (short
+// octants near the mosaic edge) simply takes more of them
+typedef struct
+{
+    const horizonator_dem_context_t* dems;
+    const float* lat;
+    const float* lon;
+    int   Nobservers;
+    float observer_height, target_height, refraction_coeff;
+
+    int next_task;
+} cumulative_shared_t;
+
+// Each worker accumulates into its own counts, so there's no contention
+// between the workers. Worker 0 accumulates directly into the output
+typedef struct
+{
+    cumulative_shared_t* shared;
+    uint32_t*            counts;
+    float*               scratch;
+} cumulative_worker_t;
+
+static void* cumulative_worker(void* cookie)
+{
+    cumulative_worker_t* w = (cumulative_worker_t*)cookie;
+    cumulative_shared_t* s = w->shared;
+
+    const int W = horizonator_dem_mosaic_width(s->dems);
+
+    while(true)
+    {
+        int task = __atomic_fetch_add(&s->next_task, 1, __ATOMIC_RELAXED);
+        if(task >= s->Nobservers*8)
+            break;
+
+        int iobserver = task / 8;
+        int k         = task % 8;
+
+        // Validated in horizonator_viewshed_cumulative()
+        int oi, oj;
+        observer_cell(&oi, &oj, s->dems, s->lat[iobserver], s->lon[iobserver]);
+
+        octant_t o;
+        octant_init(&o, k, s->dems, oi, oj,
+                    s->lat[iobserver],
+                    s->observer_height, s->target_height, s->refraction_coeff);
+        o.counts = w->counts;
+        sweep_octant(&o, w->scratch);
+
+        // The observer sees its own cell. I count it once
+        if(k == 0)
+            w->counts[(size_t)oj*(size_t)W + (size_t)oi]++;
+    }
+    return NULL;
+}
+
+bool horizonator_viewshed_cumulative( // output
+                                      uint32_t* counts,
+                                      double*   observers_per_second,
+
+                                      // input
+                                      const horizonator_dem_context_t* dems,
+                                      const float* lat, const float* lon,
+                                      int Nobservers,
+                                      float observer_height,
+                                      float target_height,
+                                      float refraction_coeff,
+                                      int Nthreads)
+{
+    const int    W  = horizonator_dem_mosaic_width(dems);
+    const size_t WW = (size_t)W*(size_t)W;
+
+    bool result = false;
+
+    for(int i=0; i<Nobservers; i++)
+    {
+        int oi, oj;
+        if(!observer_cell(&oi, &oj, dems, lat[i], lon[i]))
+        {
+            MSG("Observer %d at lat,lon = %f,%f is outside the loaded DEMs",
+                i, lat[i], lon[i]);
+            return false;
+        }
+    }
+
+    if(Nthreads <= 0)
+    {
+        long Ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Nthreads = Ncpus > 0 ? (int)Ncpus : 1;
+    }
+    // There's no point in having more workers than tasks
+    if(Nthreads > Nobservers*8)
+        Nthreads = Nobservers*8 > 0 ? Nobservers*8 : 1;
+
+    double t0 = bench_wall_seconds();
+
+    cumulative_shared_t shared =
+        { .dems             = dems,
+          .lat              = lat,
+          .lon              = lon,
+          .Nobservers       = Nobservers,
+          .observer_height  = observer_height,
+          .target_height    = target_height,
+          .refraction_coeff = refraction_coeff };
+
+    cumulative_worker_t* workers        = calloc(Nthreads, sizeof(workers[0]));
+    pthread_t*           threads        = calloc(Nthreads, sizeof(threads[0]));
+    bool*                thread_started = calloc(Nthreads, sizeof(thread_started[0]));
+    if(workers == NULL || threads == NULL || thread_started == NULL)
+    {
+        MSG("calloc() failed");
+        goto done;
+    }
+
+    memset(counts, 0, WW*sizeof(counts[0]));
+
+    // All the buffers are allocated here, once. Nothing is allocated per
+    // observer
+    for(int i=0; i<Nthreads; i++)
+    {
+        workers[i].shared  = &shared;
+        workers[i].counts  = (i == 0) ? counts : calloc(WW, sizeof(uint32_t));
+        workers[i].scratch = malloc(2*(size_t)(W+1)*sizeof(float));
+        if(workers[i].counts == NULL || workers[i].scratch == NULL)
+        {
+            MSG("Couldn't allocate the buffers for worker %d", i);
+            goto done;
+        }
+    }
+
+    // Worker 0 is this thread. If any other worker can't be started, the
+    // others simply do its share
+    for(int i=1; i<Nthreads; i++)
+        if(0 == pthread_create(&threads[i], NULL, cumulative_worker, &workers[i]))
+            thread_started[i] = true;
+    cumulative_worker(&workers[0]);
+
+    for(int i=1; i<Nthreads; i++)
+    {
+        if(!thread_started[i])
+            continue;
+        pthread_join(threads[i], NULL);
+
+        for(size_t p=0; p<WW; p++)
+            counts[p] += workers[i].counts[p];
+    }
+
+    if(observers_per_second != NULL)
+        *observers_per_second = (double)Nobservers / (bench_wall_seconds() - t0);
+
+    result = true;
+
+ done:
+    if(workers != NULL)
+        for(int i=0; i<Nthreads; i++)
+        {
+            if(i != 0)
+                free(workers[i].counts);
+            free(workers[i].scratch);
+        }
+    free(workers);
+    free(threads);
+    free(thread_started);
+    return result;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dem.h"
+
+// Computes which cells of the DEM mosaic are visible from an observer. This is
+// an XDraw-style sweep: we walk outwards from the observer one ring of cells
+// at a time, and the horizon seen by each cell is interpolated from the two
+// cells in the previous ring that straddle the line of sight. This is O(N) in
+// the number of cells, and approximate in the same way XDraw is. The 8
+// octants around the observer are independent, and are swept in parallel.
+//
+// The outputs are (2*radius_cells) x (2*radius_cells) arrays, indexed like
+// the mosaic (see horizonator_dem_context_t), but always row-major, SW corner
+// first.
+//
+// - visible[] is 1 for cells that the observer can see, 0 otherwise
+//
+// - clearance[] is the angular clearance, in radians: the elevation angle of
+//   the target (the terrain + target_height) above the highest horizon between
+//   it and the observer. Visible cells have clearance >= 0. The observer's own
+//   cell is visible, with clearance pi/2
+//
+// Earth curvature is taken into account, with the given refraction
+// coefficient: light bends to follow the Earth, which looks like a larger
+// Earth radius, Rearth/(1-refraction_coeff). 0.13 is commonly used for visible
+// light, and 0.25 for radio. refraction_coeff = 1 ignores the curvature
+// entirely, like the renderer does
+//
+// Returns true on success
+bool horizonator_viewshed( // output
+                           // Either may be NULL
+                           uint8_t* visible,
+                           float*   clearance,
+
+                           // input
+                           const horizonator_dem_context_t* dems,
+                           float viewer_lat, float viewer_lon,
+                           // Height of the observer above the terrain, in
+                           // meters
+                           float observer_height,
+                           // Height of the targets above the terrain, in
+                           // meters. We report whether a point this high
+                           // above each cell is visible
+                           float target_height,
+                           float refraction_coeff);
+
+// Cumulative viewshed: for each cell of the mosaic, counts how many of the
+// given observers can see it. This is equivalent to calling
+// horizonator_viewshed() for each observer, and adding up the visible[]
+// arrays, but much faster: all the buffers are allocated once, and the work is
+// spread over a pool of threads, one octant of one observer at a time.
+//
+// counts[] is a (2*radius_cells) x (2*radius_cells) array, like the outputs of
+// horizonator_viewshed(): always row-major, SW corner first, whatever the
+// layout of the mosaic. It is overwritten. Each thread accumulates into its own
+// copy of it, so each thread beyond the first needs 4*(2*radius_cells)^2 bytes
+// of memory.
+//
+// If observers_per_second is not NULL, the throughput is reported there.
+//
+// All the observers must lie inside the mosaic. observer_height,
+// target_height, refraction_coeff are as in horizonator_viewshed(), and apply
+// to all the observers. Nthreads <= 0 means "one thread per CPU".
+//
+// Returns true on success
+bool horizonator_viewshed_cumulative( // output
+                                      uint32_t* counts,
+                                      double*   observers_per_second,
+
+                                      // input
+                                      const horizonator_dem_context_t* dems,
+                                      // Arrays of Nobservers coordinates
+                                      const float* lat, const float* lon,
+                                      int Nobservers,
+                                      float observer_height,
+                                      float target_height,
+                                      float refraction_coeff,
+                                      int Nthreads);